@@ -1,6 +1,9 @@
 // sharemarket.cpp
 // Object-oriented Stock Market Simulation (fixed for portability with MinGW/Dev-C++)
-// Compile with: g++ -std=c++11 sharemarket.cpp -o sharemarket
+// Compile with: g++ -std=c++11 -pthread sharemarket.cpp -o sharemarket
+// (-std=c++17 or later formats table numbers with std::to_chars;
+//  -DSHAREMARKET_ALLOC_PROFILE counts allocations per operation, see menu option 25;
+//  -DSHAREMARKET_PRICE_MODELS=JumpDiffusionPriceModels or StressPriceModels swaps the tick models)
 
 #include <iostream>
 #include <string>
@@ -15,25 +18,189 @@
 #include <algorithm>
 #include <chrono>
 #include <cstring>
+#include <cerrno>
+#include <cmath>
 #include <limits>  // Added for numeric_limits
+#include <unordered_map>
+#include <deque>
+#include <queue>
+#include <list>
+#include <stdexcept>
+#include <cstdint>
+#include <cstddef>
+#ifdef _WIN32
+#include <io.h>
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <memory>
+#include <condition_variable>
+#include <functional>
+#include <cstdio>
+#include <new>
+#if __cplusplus >= 201703L
+#include <charconv>
+#endif
+#if defined(__AVX__) || (defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)))
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 
-// --------------------------- Utility functions ---------------------------
-string now_str() {
-    // Portable way to format current time as YYYY-MM-DD HH:MM:SS
-    auto t = chrono::system_clock::now();
-    time_t tt = chrono::system_clock::to_time_t(t);
-    tm* lt = localtime(&tt); // note: localtime is fine for single-threaded console apps
-    char buf[64];
-    if (lt) {
-        strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", lt);
-        return string(buf);
-    } else {
-        return string("unknown-time");
+// --------------------------- Allocation profiling ---------------------------
+// Build with -DSHAREMARKET_ALLOC_PROFILE to count every global operator new.
+// An AllocScope charges the allocations its thread makes while it is alive
+// (nested scopes included) to one operation, so the report reads as
+// "allocations per buy", "per log append", and so on. Without the flag
+// AllocScope is empty and operator new is the library's own.
+enum class AllocTag : unsigned char {
+    Buy, Sell, Deposit, Withdraw, LogAppend, ListInstrument, Tick, LoadMarket, LoadInvestor, SaveMarket, SaveInvestor,
+    Count
+};
+
+inline const char* allocTagName(AllocTag t) {
+    static const char* names[] = {"buy", "sell", "deposit", "withdraw", "log append", "list instrument",
+                                  "market tick", "load market", "load investor", "save market", "save investor"};
+    return t < AllocTag::Count ? names[(int)t] : "?";
+}
+
+struct AllocCounts {
+    uint64_t allocs;
+    uint64_t bytes;
+    uint64_t frees;
+};
+
+namespace allocprof {
+#ifdef SHAREMARKET_ALLOC_PROFILE
+const bool enabled = true;
+#else
+const bool enabled = false;
+#endif
+// Process-wide totals, and the calling thread's running count for scopes
+atomic<uint64_t> totalAllocs(0), totalBytes(0), totalFrees(0);
+thread_local uint64_t threadAllocs = 0, threadBytes = 0;
+
+struct TagTotals {
+    atomic<uint64_t> ops, allocs, bytes;
+};
+TagTotals tags[(int)AllocTag::Count]; // static storage: starts zeroed
+} // namespace allocprof
+
+// Allocations made by the whole process so far (all zero without the build flag)
+inline AllocCounts allocationsSoFar() {
+    AllocCounts c = {allocprof::totalAllocs.load(memory_order_relaxed), allocprof::totalBytes.load(memory_order_relaxed),
+                     allocprof::totalFrees.load(memory_order_relaxed)};
+    return c;
+}
+
+class AllocScope {
+#ifdef SHAREMARKET_ALLOC_PROFILE
+private:
+    AllocTag tag;
+    uint64_t allocs0, bytes0;
+public:
+    explicit AllocScope(AllocTag t) : tag(t), allocs0(allocprof::threadAllocs), bytes0(allocprof::threadBytes) {}
+    ~AllocScope() {
+        allocprof::TagTotals& s = allocprof::tags[(int)tag];
+        s.ops.fetch_add(1, memory_order_relaxed);
+        s.allocs.fetch_add(allocprof::threadAllocs - allocs0, memory_order_relaxed);
+        s.bytes.fetch_add(allocprof::threadBytes - bytes0, memory_order_relaxed);
+    }
+#else
+public:
+    explicit AllocScope(AllocTag) {}
+#endif
+    AllocScope(const AllocScope&) = delete;
+    AllocScope& operator=(const AllocScope&) = delete;
+};
+
+// Per-operation table of everything charged to an AllocScope so far
+void printAllocReport(ostream& os = cout) {
+    if (!allocprof::enabled) {
+        os << "Allocation profiling is off; rebuild with -DSHAREMARKET_ALLOC_PROFILE.\n";
+        return;
+    }
+    ios::fmtflags flags = os.flags();
+    streamsize prec = os.precision();
+    os << "\n---- Allocations by operation ----\n";
+    os << left << setw(18) << "Operation" << right << setw(12) << "ops" << setw(14) << "allocs" << setw(16) << "bytes"
+       << setw(12) << "allocs/op" << setw(12) << "bytes/op" << "\n";
+    os << string(84, '-') << "\n";
+    os << fixed << setprecision(1);
+    for (int t = 0; t < (int)AllocTag::Count; ++t) {
+        const allocprof::TagTotals& s = allocprof::tags[t];
+        uint64_t ops = s.ops.load(memory_order_relaxed);
+        if (!ops) continue;
+        uint64_t allocs = s.allocs.load(memory_order_relaxed), bytes = s.bytes.load(memory_order_relaxed);
+        os << left << setw(18) << allocTagName((AllocTag)t) << right << setw(12) << ops << setw(14) << allocs
+           << setw(16) << bytes << setw(12) << (double)allocs / ops << setw(12) << (double)bytes / ops << "\n";
     }
+    AllocCounts all = allocationsSoFar();
+    os << "process total: " << all.allocs << " allocations, " << all.bytes << " bytes, " << all.frees << " frees\n";
+    os.flags(flags);
+    os.precision(prec);
+}
+
+#ifdef SHAREMARKET_ALLOC_PROFILE
+// Kept out of line so the compiler never sees new and free() meet at a call site
+#ifdef __GNUC__
+#define SHAREMARKET_NOINLINE __attribute__((noinline))
+#else
+#define SHAREMARKET_NOINLINE
+#endif
+SHAREMARKET_NOINLINE void* countedMalloc(size_t n) {
+    ++allocprof::threadAllocs;
+    allocprof::threadBytes += n;
+    allocprof::totalAllocs.fetch_add(1, memory_order_relaxed);
+    allocprof::totalBytes.fetch_add(n, memory_order_relaxed);
+    return malloc(n ? n : 1);
+}
+SHAREMARKET_NOINLINE void countedFree(void* p) {
+    if (!p) return;
+    allocprof::totalFrees.fetch_add(1, memory_order_relaxed);
+    free(p);
+}
+void* operator new(size_t n) {
+    void* p = countedMalloc(n);
+    if (!p) throw bad_alloc();
+    return p;
 }
+void* operator new[](size_t n) { return operator new(n); }
+void* operator new(size_t n, const nothrow_t&) noexcept { return countedMalloc(n); }
+void* operator new[](size_t n, const nothrow_t&) noexcept { return countedMalloc(n); }
+void operator delete(void* p) noexcept { countedFree(p); }
+void operator delete[](void* p) noexcept { countedFree(p); }
+void operator delete(void* p, const nothrow_t&) noexcept { countedFree(p); }
+void operator delete[](void* p, const nothrow_t&) noexcept { countedFree(p); }
+#ifdef __cpp_sized_deallocation
+void operator delete(void* p, size_t) noexcept { countedFree(p); }
+void operator delete[](void* p, size_t) noexcept { countedFree(p); }
+#endif
+#endif
 
+// --------------------------- Utility functions ---------------------------
 double clamp_double(double v, double lo, double hi) {
     if (v < lo) return lo;
     if (v > hi) return hi;
@@ -47,657 +214,12328 @@ double rand_double(double a, double b) {
     return dist(rng);
 }
 
-// --------------------------- Base: Investment ---------------------------
-class Investment {
-protected:
-    string name;
-    string symbol;
+// Elapsed wall time (and, when profiling, process allocations) since construction
+class Stopwatch {
+private:
+    chrono::steady_clock::time_point start;
+    uint64_t allocs0;
 public:
-    Investment() {}
-    Investment(const string& n, const string& s) : name(n), symbol(s) {}
-    virtual ~Investment() {}
-    string getName() const { return name; }
-    string getSymbol() const { return symbol; }
-
-    virtual void displayDetails() const = 0;
-    virtual double currentPrice() const = 0;
-    virtual string typeName() const = 0;
+    Stopwatch() : start(chrono::steady_clock::now()), allocs0(allocationsSoFar().allocs) {}
+    double seconds() const {
+        return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+    uint64_t allocs() const { return allocationsSoFar().allocs - allocs0; }
 };
 
-// --------------------------- Stock ---------------------------
-class Stock : public Investment {
+// --------------------------- Clock ---------------------------
+// Event time is an int64 count of nanoseconds since the Unix epoch. Stamps are
+// read from the monotonic clock (steady_clock, i.e. CLOCK_MONOTONIC: a vDSO
+// read, no syscall) and shifted by the wall time sampled once at startup, so
+// they never go backwards and cost nothing to format. The transaction log,
+// the tick history and the load generator's latency figures all stamp through
+// clockNow(); text is made only for display and for text files.
+typedef int64_t Timestamp;
+const Timestamp kNsPerSecond = 1000000000;
+
+class EventClock {
 private:
-    double price;    // current market price per share
-    int available;   // number of shares available in market
+    chrono::steady_clock::time_point monoBase;
+    Timestamp wallBase;
+    EventClock()
+        : monoBase(chrono::steady_clock::now()),
+          wallBase(chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count()) {}
 public:
-    Stock() : price(0.0), available(0) {}
-    Stock(const string& n, const string& s, double p, int avail)
-        : Investment(n, s), price(p), available(avail) {}
-
-    void displayDetails() const override {
-        cout << left << setw(6) << symbol << " | "
-             << setw(20) << name << " | "
-             << "Price: " << setw(9) << fixed << setprecision(2) << price
-             << " | Available: " << available;
+    static const EventClock& instance() {
+        static EventClock clock;
+        return clock;
+    }
+    Timestamp now() const {
+        return wallBase + chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - monoBase).count();
     }
+};
 
-    double currentPrice() const override { return price; }
-    string typeName() const override { return "Stock"; }
+inline Timestamp clockNow() { return EventClock::instance().now(); }
 
-    void setPrice(double p) { price = p; }
-    void changeAvailable(int delta) { available += delta; if (available < 0) available = 0; }
-    int getAvailable() const { return available; }
-};
+// Days from 1970-01-01 to a proleptic Gregorian date
+inline int64_t daysFromCivil(int64_t y, unsigned m, unsigned d) {
+    y -= m <= 2;
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    unsigned yoe = (unsigned)(y - era * 400);
+    unsigned doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (int64_t)doe - 719468;
+}
 
-// --------------------------- MutualFund ---------------------------
-class MutualFund : public Investment {
+// Local-time text for timestamps: "YYYY-MM-DD HH:MM:SS", optionally followed by
+// ".nnnnnnnnn". format() keeps the last second it rendered and parse() the UTC
+// offset of the last hour it saw, so neither goes to the time-zone database on
+// every call. Not thread-safe; timeText() hands each thread its own.
+class TimeText {
 private:
-    double nav;    // net asset value per unit
-    double totalUnits; // units available in "market"
-public:
-    MutualFund() : nav(0.0), totalUnits(0.0) {}
-    MutualFund(const string& n, const string& s, double nav_, double units)
-        : Investment(n, s), nav(nav_), totalUnits(units) {}
+    int64_t cachedSec;
+    char cachedText[19];
+    int64_t offsetHour; // civil hour the cached offset belongs to
+    int64_t offset;     // epoch seconds minus civil seconds in that hour
 
-    void displayDetails() const override {
-        cout << left << setw(6) << symbol << " | "
-             << setw(20) << name << " | "
-             << "NAV: " << setw(9) << fixed << setprecision(2) << nav
-             << " | UnitsAvail: " << setw(8) << fixed << setprecision(2) << totalUnits;
+    static void put(char* p, int v, int width) {
+        for (int i = width - 1; i >= 0; --i, v /= 10) p[i] = char('0' + v % 10);
+    }
+    static bool digits(const char* s, size_t n, int& v) {
+        v = 0;
+        for (size_t i = 0; i < n; ++i) {
+            if (s[i] < '0' || s[i] > '9') return false;
+            v = v * 10 + (s[i] - '0');
+        }
+        return true;
     }
+public:
+    static const size_t kSecondsLen = 19; // without the fraction
+    static const size_t kMaxLen = 29;     // with it
 
-    double currentPrice() const override { return nav; }
-    string typeName() const override { return "MutualFund"; }
+    TimeText() : cachedSec(numeric_limits<int64_t>::min()), offsetHour(numeric_limits<int64_t>::min()), offset(0) {}
 
-    void setNAV(double n) { nav = n; }
-    void changeUnits(double d) { totalUnits += d; if (totalUnits < 0) totalUnits = 0; }
-    double getUnits() const { return totalUnits; }
-};
+    // Writes the text to out (kMaxLen bytes of room) and returns its length
+    size_t format(Timestamp t, char* out, bool nanos = false) {
+        int64_t sec = t / kNsPerSecond, ns = t % kNsPerSecond;
+        if (ns < 0) {
+            --sec;
+            ns += kNsPerSecond;
+        }
+        if (sec != cachedSec) {
+            time_t tt = (time_t)sec;
+            tm lt;
+#ifdef _WIN32
+            bool ok = localtime_s(&lt, &tt) == 0;
+#else
+            bool ok = localtime_r(&tt, &lt) != nullptr;
+#endif
+            if (!ok) memset(&lt, 0, sizeof(lt));
+            put(cachedText, lt.tm_year + 1900, 4);
+            cachedText[4] = '-';
+            put(cachedText + 5, lt.tm_mon + 1, 2);
+            cachedText[7] = '-';
+            put(cachedText + 8, lt.tm_mday, 2);
+            cachedText[10] = ' ';
+            put(cachedText + 11, lt.tm_hour, 2);
+            cachedText[13] = ':';
+            put(cachedText + 14, lt.tm_min, 2);
+            cachedText[16] = ':';
+            put(cachedText + 17, lt.tm_sec, 2);
+            cachedSec = sec;
+        }
+        memcpy(out, cachedText, kSecondsLen);
+        if (!nanos) return kSecondsLen;
+        out[kSecondsLen] = '.';
+        put(out + kSecondsLen + 1, (int)ns, 9);
+        return kMaxLen;
+    }
 
-// --------------------------- Holding ---------------------------
-// Represents investor's holding (for a stock or mutual fund)
-struct Holding {
-    string symbol;
-    string name;
-    string type; // "Stock" or "MutualFund"
-    double quantity; // for stocks use int-like quantity, but stored as double to unify mutual funds
-    double avgPrice; // average buy price per unit
-    Holding() : quantity(0.0), avgPrice(0.0) {}
-    Holding(const string& sym, const string& nm, const string& tp, double qty, double avg)
-        : symbol(sym), name(nm), type(tp), quantity(qty), avgPrice(avg) {}
+    // Reads "YYYY-MM-DD", "YYYY-MM-DD HH:MM", "YYYY-MM-DD HH:MM:SS" or that with
+    // a decimal fraction of a second. unit gets the span the text covers (a day,
+    // a minute, a second or the fraction's last digit).
+    bool parse(const char* s, size_t n, Timestamp& t, Timestamp* unit = nullptr) {
+        while (n && (s[n - 1] == ' ' || s[n - 1] == '\r')) --n;
+        while (n && *s == ' ') { ++s; --n; }
+        int y, mo, d, h = 0, mi = 0, se = 0;
+        if (n < 10 || s[4] != '-' || s[7] != '-' || !digits(s, 4, y) || !digits(s + 5, 2, mo) || !digits(s + 8, 2, d) ||
+            mo < 1 || mo > 12 || d < 1 || d > 31)
+            return false;
+        Timestamp span = 86400 * kNsPerSecond, frac = 0;
+        if (n > 10) {
+            if (n < 16 || s[10] != ' ' || s[13] != ':' || !digits(s + 11, 2, h) || !digits(s + 14, 2, mi)) return false;
+            span = 60 * kNsPerSecond;
+        }
+        if (n > 16) {
+            if (n < 19 || s[16] != ':' || !digits(s + 17, 2, se)) return false;
+            span = kNsPerSecond;
+        }
+        if (n > 19) {
+            if (s[19] != '.' || n == 20 || n > kMaxLen) return false;
+            for (size_t i = 20; i < n; ++i) {
+                if (s[i] < '0' || s[i] > '9') return false;
+                frac = frac * 10 + (s[i] - '0');
+                span /= 10;
+            }
+            frac *= span;
+        }
+        int64_t civil = daysFromCivil(y, (unsigned)mo, (unsigned)d) * 86400 + h * 3600 + mi * 60 + se;
+        if (civil / 3600 != offsetHour) {
+            offsetHour = civil / 3600;
+            tm lt;
+            memset(&lt, 0, sizeof(lt));
+            lt.tm_year = y - 1900;
+            lt.tm_mon = mo - 1;
+            lt.tm_mday = d;
+            lt.tm_hour = h;
+            lt.tm_isdst = -1;
+            time_t tt = mktime(&lt);
+            offset = tt == (time_t)-1 ? 0 : (int64_t)tt - (civil - mi * 60 - se);
+        }
+        t = (civil + offset) * kNsPerSecond + frac;
+        if (unit) *unit = span;
+        return true;
+    }
 };
 
-// --------------------------- TransactionLog ---------------------------
-class TransactionLog {
-private:
-    struct Entry {
-        string time;
-        string action; // BUY / SELL / DEPOSIT / WITHDRAW
-        string symbol;
-        string name;
-        string type;
-        double qty;
-        double price;
-        double balanceAfter;
-    };
-    vector<Entry> entries;
-public:
-    void add(const string& action, const string& symbol, const string& name,
-             const string& type, double qty, double price, double balanceAfter) {
-        Entry e;
-        e.time = now_str();
-        e.action = action;
-        e.symbol = symbol;
-        e.name = name;
-        e.type = type;
-        e.qty = qty;
-        e.price = price;
-        e.balanceAfter = balanceAfter;
-        entries.push_back(e);
+inline TimeText& timeText() {
+    static thread_local TimeText text;
+    return text;
+}
+
+// Display form, to the second
+inline string formatTime(Timestamp t) {
+    char buf[TimeText::kMaxLen];
+    return string(buf, timeText().format(t, buf));
+}
+
+// Text as typed by a user. With endOfUnit the result is the last nanosecond the
+// text covers, so "2024-05-01" as an inclusive upper bound takes in the whole day.
+inline bool parseTime(const string& s, Timestamp& t, bool endOfUnit = false) {
+    Timestamp unit;
+    if (!timeText().parse(s.data(), s.size(), t, &unit)) return false;
+    if (endOfUnit) t += unit - 1;
+    return true;
+}
+
+// --------------------------- Worker threads ---------------------------
+// Threads for a parallel step: `requested`, or one per hardware thread when 0
+inline unsigned workerThreads(unsigned requested) {
+    return requested ? requested : max(1u, thread::hardware_concurrency());
+}
+
+// Calls fn(i) for i in [0, n), claimed in order by up to `threads` threads
+// (the caller's among them); returns when every call has finished
+template <typename Fn>
+void parallelFor(unsigned threads, unsigned n, Fn fn) {
+    unsigned nt = min(threads, n);
+    if (nt <= 1) {
+        for (unsigned i = 0; i < n; ++i) fn(i);
+        return;
     }
-    void showAll() const {
-        if (entries.empty()) {
-            cout << "No transactions yet.\n";
-            return;
-        }
-        cout << left << setw(20) << "Time" << setw(8) << "Act" << setw(8) << "Type"
-             << setw(8) << "Symbol" << setw(20) << "Name" << setw(10) << "Qty"
-             << setw(12) << "Price" << setw(12) << "BalAfter" << "\n";
-        cout << string(100, '-') << "\n";
-        for (const auto& e : entries) {
-            cout << setw(20) << e.time << setw(8) << e.action << setw(8) << e.type
-                 << setw(8) << e.symbol << setw(20) << e.name
-                 << setw(10) << fixed << setprecision(2) << e.qty
-                 << setw(12) << fixed << setprecision(2) << e.price
-                 << setw(12) << fixed << setprecision(2) << e.balanceAfter << "\n";
+    atomic<unsigned> next(0);
+    auto worker = [&] {
+        for (unsigned i; (i = next.fetch_add(1)) < n;) fn(i);
+    };
+    vector<thread> pool;
+    for (unsigned t = 1; t < nt; ++t) pool.push_back(thread(worker));
+    worker();
+    for (auto& th : pool) th.join();
+}
+
+// Fixed set of worker threads, each with its own task deque. A worker runs its
+// own newest task first and, when it runs dry, steals the oldest task of another.
+class WorkStealingPool {
+public:
+    typedef function<void(unsigned)> Task; // called with the index of the worker running it
+
+    explicit WorkStealingPool(unsigned threads = 0) : queued(0), pending(0), stolen(0), stopping(false) {
+        threads = workerThreads(threads);
+        for (unsigned i = 0; i < threads; ++i) queues.push_back(unique_ptr<Queue>(new Queue()));
+        for (unsigned i = 0; i < threads; ++i) workers.push_back(thread(&WorkStealingPool::run, this, i));
+    }
+    ~WorkStealingPool() {
+        {
+            lock_guard<mutex> lk(idleMtx);
+            stopping = true;
         }
+        wake.notify_all();
+        for (thread& t : workers) t.join();
     }
-    // Save transaction log to file
-    bool saveToFile(const string& fname) const {
-        ofstream ofs(fname);
-        if (!ofs) return false;
-        for (const auto& e : entries) {
-            ofs << e.time << '|' << e.action << '|' << e.type << '|' << e.symbol << '|'
-                << e.name << '|' << e.qty << '|' << e.price << '|' << e.balanceAfter << '\n';
+
+    unsigned size() const { return (unsigned)queues.size(); }
+    uint64_t steals() const { return stolen.load(); }
+
+    // Queue a task on worker hint % size()
+    void submit(Task task, size_t hint) {
+        pending.fetch_add(1);
+        Queue& q = *queues[hint % queues.size()];
+        {
+            lock_guard<mutex> lk(q.m);
+            q.tasks.push_back(move(task));
         }
-        ofs.close();
+        queued.fetch_add(1);
+        {
+            lock_guard<mutex> lk(idleMtx); // a worker checking queued under idleMtx cannot miss this
+        }
+        wake.notify_one();
+    }
+
+    // Block until every submitted task has finished
+    void wait() {
+        unique_lock<mutex> lk(idleMtx);
+        idle.wait(lk, [this] { return pending.load() == 0; });
+    }
+
+private:
+    struct Queue {
+        mutex m;
+        deque<Task> tasks;
+    };
+    vector<unique_ptr<Queue> > queues;
+    vector<thread> workers;
+    mutex idleMtx;
+    condition_variable wake, idle;
+    atomic<size_t> queued;   // tasks sitting in some deque
+    atomic<size_t> pending;  // submitted and not finished
+    atomic<uint64_t> stolen;
+    bool stopping;
+
+    bool popLocal(unsigned self, Task& task) {
+        Queue& q = *queues[self];
+        lock_guard<mutex> lk(q.m);
+        if (q.tasks.empty()) return false;
+        task = move(q.tasks.back());
+        q.tasks.pop_back();
+        queued.fetch_sub(1);
         return true;
     }
-    // Load from file (appends)
-    bool loadFromFile(const string& fname) {
-        ifstream ifs(fname);
-        if (!ifs) return false;
-        string line;
-        while (getline(ifs, line)) {
-            if (line.empty()) continue;
-            stringstream ss(line);
-            Entry e;
-            getline(ss, e.time, '|');
-            getline(ss, e.action, '|');
-            getline(ss, e.type, '|');
-            getline(ss, e.symbol, '|');
-            getline(ss, e.name, '|');
-            string tmp;
-            getline(ss, tmp, '|'); 
-            try {
-                e.qty = tmp.empty() ? 0.0 : stod(tmp);
-            } catch (const exception& e) {
-                cout << "Error parsing quantity in transaction log.\n";
-                return false;
-            }
-            getline(ss, tmp, '|'); 
-            try {
-                e.price = tmp.empty() ? 0.0 : stod(tmp);
-            } catch (const exception& e) {
-                cout << "Error parsing price in transaction log.\n";
-                return false;
-            }
-            getline(ss, tmp, '\n'); 
-            try {
-                e.balanceAfter = tmp.empty() ? 0.0 : stod(tmp);
-            } catch (const exception& e) {
-                cout << "Error parsing balance in transaction log.\n";
-                return false;
+    bool steal(unsigned self, Task& task) {
+        for (size_t k = 1; k < queues.size(); ++k) {
+            Queue& q = *queues[(self + k) % queues.size()];
+            lock_guard<mutex> lk(q.m);
+            if (q.tasks.empty()) continue;
+            task = move(q.tasks.front());
+            q.tasks.pop_front();
+            queued.fetch_sub(1);
+            stolen.fetch_add(1);
+            return true;
+        }
+        return false;
+    }
+    void run(unsigned self) {
+        for (;;) {
+            Task task;
+            if (popLocal(self, task) || steal(self, task)) {
+                task(self);
+                if (pending.fetch_sub(1) == 1) {
+                    lock_guard<mutex> lk(idleMtx);
+                    idle.notify_all();
+                }
+                continue;
             }
-            entries.push_back(e);
+            unique_lock<mutex> lk(idleMtx);
+            wake.wait(lk, [this] { return stopping || queued.load() > 0; });
+            if (stopping && queued.load() == 0) return;
         }
-        ifs.close();
-        return true;
     }
 };
 
-// --------------------------- Market ---------------------------
-class Market {
-private:
-    map<string, Stock> stocks;           // keyed by symbol
-    map<string, MutualFund> funds;       // keyed by symbol
-    double volatility; // a small factor to control price randomness
+// --------------------------- Table output ---------------------------
+// Buffered writer for the text tables (market, portfolio, transactions).
+// Cells are formatted straight into one reusable buffer that goes to the
+// stream in a single write when it fills or on flush(). A cell gives the same
+// bytes as `left << setw(width)` and, for numbers, `fixed << setprecision(2)`.
+class TableWriter {
 public:
-    Market() : volatility(0.02) {} // default volatility 2%
+    explicit TableWriter(ostream& o, size_t capacity = 1 << 16) : os(o), buf(max(capacity, kMaxNumber)), len(0) {}
+    ~TableWriter() { flush(); }
 
-    // Add sample data
-    void addStock(const Stock& s) { stocks[s.getSymbol()] = s; }
-    void addFund(const MutualFund& f) { funds[f.getSymbol()] = f; }
+    TableWriter& cell(const char* s, size_t n, size_t width) {
+        size_t w = max(n, width);
+        char* p = reserve(w);
+        memcpy(p, s, n);
+        memset(p + n, ' ', w - n);
+        len += w;
+        return *this;
+    }
+    TableWriter& cell(const string& s, size_t width = 0) { return cell(s.data(), s.size(), width); }
+    TableWriter& cell(const char* s, size_t width = 0) { return cell(s, strlen(s), width); }
 
-    // find pointers to investments (non-const)
-    Investment* findInvestment(const string& symbol) {
-        auto itS = stocks.find(symbol);
-        if (itS != stocks.end()) return &itS->second;
-        auto itF = funds.find(symbol);
-        if (itF != funds.end()) return &itF->second;
-        return nullptr;
+    // Fixed-point with two decimals
+    TableWriter& money(double v, size_t width = 0) {
+        char* p = reserve(kMaxNumber + width);
+        size_t n = formatFixed2(p, v);
+        if (n < width) {
+            memset(p + n, ' ', width - n);
+            n = width;
+        }
+        len += n;
+        return *this;
     }
-    Stock* findStock(const string& symbol) {
-        auto it = stocks.find(symbol);
-        if (it != stocks.end()) return &it->second;
-        return nullptr;
+    TableWriter& integer(long long v, size_t width = 0) {
+        char tmp[24];
+        char* e = tmp + sizeof(tmp);
+        char* b = e;
+        unsigned long long u = v < 0 ? 0ULL - (unsigned long long)v : (unsigned long long)v;
+        do {
+            *--b = char('0' + u % 10);
+            u /= 10;
+        } while (u);
+        if (v < 0) *--b = '-';
+        return cell(b, (size_t)(e - b), width);
     }
-    MutualFund* findFund(const string& symbol) {
-        auto it = funds.find(symbol);
-        if (it != funds.end()) return &it->second;
-        return nullptr;
+    TableWriter& repeat(char c, size_t n) {
+        memset(reserve(n), c, n);
+        len += n;
+        return *this;
+    }
+    TableWriter& put(char c) {
+        *reserve(1) = c;
+        ++len;
+        return *this;
     }
 
-    // const overloads so const Market can be queried
-    const Investment* findInvestment(const string& symbol) const {
-        auto itS = stocks.find(symbol);
-        if (itS != stocks.end()) return &itS->second;
-        auto itF = funds.find(symbol);
-        if (itF != funds.end()) return &itF->second;
-        return nullptr;
+    void flush() {
+        if (len) os.write(buf.data(), (streamsize)len);
+        len = 0;
     }
-    const Stock* findStock(const string& symbol) const {
-        auto it = stocks.find(symbol);
-        if (it != stocks.end()) return &it->second;
-        return nullptr;
+
+private:
+    static const size_t kMaxNumber = 352; // "%.2f" of DBL_MAX is 312 characters
+    ostream& os;
+    vector<char> buf;
+    size_t len;
+
+    char* reserve(size_t n) {
+        if (len + n > buf.size()) {
+            flush();
+            if (n > buf.size()) buf.resize(n);
+        }
+        return buf.data() + len;
     }
-    const MutualFund* findFund(const string& symbol) const {
-        auto it = funds.find(symbol);
-        if (it != funds.end()) return &it->second;
-        return nullptr;
+    static size_t formatFixed2(char* out, double v) {
+#ifdef __cpp_lib_to_chars
+        to_chars_result r = to_chars(out, out + kMaxNumber, v, chars_format::fixed, 2);
+        if (r.ec == errc()) return (size_t)(r.ptr - out);
+#else
+        // v * 100 is exact in a 64-bit-mantissa long double, so rounding it here
+        // (ties to even) gives the same digits printf does
+        if (numeric_limits<long double>::digits >= 64 && fabs(v) < 1e15) {
+            bool neg = signbit(v);
+            long double x = (long double)v * 100;
+            if (neg) x = -x;
+            unsigned long long c = (unsigned long long)x;
+            long double frac = x - (long double)c;
+            if (frac > 0.5L || (frac == 0.5L && (c & 1))) ++c;
+            char tmp[24];
+            char* e = tmp + sizeof(tmp);
+            char* b = e;
+            *--b = char('0' + c % 10);
+            *--b = char('0' + c / 10 % 10);
+            *--b = '.';
+            c /= 100;
+            do {
+                *--b = char('0' + c % 10);
+                c /= 10;
+            } while (c);
+            if (neg) *--b = '-';
+            memcpy(out, b, (size_t)(e - b));
+            return (size_t)(e - b);
+        }
+#endif
+        return (size_t)snprintf(out, kMaxNumber, "%.2f", v);
     }
+};
+const size_t TableWriter::kMaxNumber;
 
-    void showMarket() const {
-        cout << "\n---- AVAILABLE STOCKS ----\n";
-        cout << left << setw(6) << "Sym" << " | " << setw(20) << "Name" << " | " << "Price | Available\n";
-        cout << string(60, '-') << "\n";
-        for (const auto& p : stocks) {
-            p.second.displayDetails();
-            cout << "\n";
+// The iostream table code left these flags set on cout, and later messages
+// (e.g. "Bought 2.00 shares") still print through them.
+inline void keepTableFormat(ostream& os, bool numbers) {
+    os << left;
+    if (numbers) os << fixed << setprecision(2);
+}
+
+// --------------------------- Memory resources ---------------------------
+// The tree is C++11, so these stand in for the parts of std::pmr it needs: a
+// MemoryResource interface, a monotonic arena for scratch that dies together,
+// a size-class pool for small long-lived nodes, and an allocator that lets a
+// container draw from any of them.
+class MemoryResource {
+public:
+    virtual ~MemoryResource() {}
+    void* allocate(size_t bytes, size_t align = alignof(max_align_t)) { return doAllocate(bytes, align); }
+    void deallocate(void* p, size_t bytes, size_t align = alignof(max_align_t)) { doDeallocate(p, bytes, align); }
+protected:
+    virtual void* doAllocate(size_t bytes, size_t align) = 0;
+    virtual void doDeallocate(void* p, size_t bytes, size_t align) = 0;
+};
+
+// Global operator new/delete (alignment up to max_align_t)
+class HeapResource : public MemoryResource {
+protected:
+    void* doAllocate(size_t bytes, size_t) { return ::operator new(bytes); }
+    void doDeallocate(void* p, size_t, size_t) { ::operator delete(p); }
+};
+inline MemoryResource* heapResource() {
+    static HeapResource r;
+    return &r;
+}
+
+// Bump allocation from growing chunks; deallocate is a no-op and everything goes
+// at once in release(), which keeps the largest chunk so a workload that repeats
+// (one screen, one batch) stops asking upstream for memory after the first pass.
+class MonotonicArena : public MemoryResource {
+private:
+    struct Chunk {
+        Chunk* next;
+        size_t size; // bytes including this header
+    };
+    MemoryResource* upstream;
+    Chunk* chunks; // newest (largest) first
+    char* cur;
+    char* end;
+    size_t nextSize;
+
+    MonotonicArena(const MonotonicArena&);
+    MonotonicArena& operator=(const MonotonicArena&);
+
+    void freeChunks(Chunk* c) {
+        while (c) {
+            Chunk* next = c->next;
+            upstream->deallocate(c, c->size);
+            c = next;
         }
-        cout << "\n---- AVAILABLE MUTUAL FUNDS ----\n";
-        for (const auto& p : funds) {
-            p.second.displayDetails();
-            cout << "\n";
+    }
+protected:
+    void* doAllocate(size_t bytes, size_t align) {
+        uintptr_t p = ((uintptr_t)cur + align - 1) & ~(uintptr_t)(align - 1);
+        if (!cur || p + bytes > (uintptr_t)end) {
+            size_t need = sizeof(Chunk) + bytes + align;
+            while (nextSize < need) nextSize *= 2;
+            Chunk* c = static_cast<Chunk*>(upstream->allocate(nextSize));
+            c->next = chunks;
+            c->size = nextSize;
+            chunks = c;
+            cur = reinterpret_cast<char*>(c + 1);
+            end = reinterpret_cast<char*>(c) + nextSize;
+            nextSize *= 2;
+            p = ((uintptr_t)cur + align - 1) & ~(uintptr_t)(align - 1);
         }
+        cur = reinterpret_cast<char*>(p + bytes);
+        return reinterpret_cast<void*>(p);
     }
+    void doDeallocate(void*, size_t, size_t) {}
+public:
+    explicit MonotonicArena(size_t initial = 4096, MemoryResource* up = heapResource())
+        : upstream(up), chunks(nullptr), cur(nullptr), end(nullptr), nextSize(max(initial, (size_t)64)) {}
+    ~MonotonicArena() { freeChunks(chunks); }
 
-    // Simulate market movement using a random walk (affects stock price and NAV)
-    void simulatePriceMovement() {
-        for (auto& p : stocks) {
-            Stock& s = p.second;
-            double oldp = s.currentPrice();
-            double pct = rand_double(-volatility, volatility);
-            double newp = oldp * (1.0 + pct);
-            newp = clamp_double(newp, 0.01, oldp * 10.0 + 10.0);
-            s.setPrice(newp);
-        }
-        for (auto& p : funds) {
-            MutualFund& f = p.second;
-            double oldp = f.currentPrice();
-            double pct = rand_double(-volatility*0.8, volatility*0.8);
-            double newp = oldp * (1.0 + pct);
-            newp = clamp_double(newp, 0.01, oldp * 5.0 + 10.0);
-            f.setNAV(newp);
-        }
-        // occasionally vary volatility a bit
-        volatility = clamp_double(volatility + rand_double(-0.002, 0.002), 0.003, 0.08);
+    void release() {
+        if (!chunks) return;
+        freeChunks(chunks->next);
+        chunks->next = nullptr;
+        cur = reinterpret_cast<char*>(chunks + 1);
+        end = reinterpret_cast<char*>(chunks) + chunks->size;
     }
+};
 
-    // Save market snapshot to file
-    bool saveSnapshot(const string& fname) const {
-        ofstream ofs(fname);
-        if (!ofs) {
-            cout << "Error: Could not open file " << fname << " for writing.\n";
-            return false;
-        }
-        // Stocks
-        for (const auto& p : stocks) {
-            const Stock& s = p.second;
-            ofs << "STOCK|" << s.getSymbol() << '|' << s.getName() << '|' << s.currentPrice() << '|' << s.getAvailable() << '\n';
+// Free lists for power-of-two size classes (16 to 512 bytes) carved out of
+// 64 KB blocks; anything larger or more aligned goes upstream. Freed nodes are
+// kept for reuse and the blocks only go back when the pool is destroyed.
+// Thread-safe.
+class PoolResource : public MemoryResource {
+private:
+    static const int kClasses = 6;
+    static const size_t kMinNode = 16;
+    static const size_t kBlock = 64 * 1024;
+    struct FreeNode {
+        FreeNode* next;
+    };
+    MemoryResource* upstream;
+    mutex m;
+    FreeNode* freeList[kClasses];
+    vector<void*> blocks;
+
+    PoolResource(const PoolResource&);
+    PoolResource& operator=(const PoolResource&);
+
+    static int classOf(size_t bytes) {
+        int c = 0;
+        for (size_t s = kMinNode; s < bytes; s <<= 1) ++c;
+        return c;
+    }
+protected:
+    void* doAllocate(size_t bytes, size_t align) {
+        int c = classOf(bytes);
+        if (c >= kClasses || align > kMinNode) return upstream->allocate(bytes, align);
+        lock_guard<mutex> lk(m);
+        if (!freeList[c]) { // carve a fresh block into nodes of this class
+            size_t node = kMinNode << c;
+            char* b = static_cast<char*>(upstream->allocate(kBlock));
+            blocks.push_back(b);
+            for (size_t off = kBlock; off >= node; off -= node) {
+                FreeNode* f = reinterpret_cast<FreeNode*>(b + off - node);
+                f->next = freeList[c];
+                freeList[c] = f;
+            }
         }
-        // Funds
-        for (const auto& p : funds) {
-            const MutualFund& f = p.second;
-            ofs << "FUND|" << f.getSymbol() << '|' << f.getName() << '|' << f.currentPrice() << '|' << f.getUnits() << '\n';
+        FreeNode* f = freeList[c];
+        freeList[c] = f->next;
+        return f;
+    }
+    void doDeallocate(void* p, size_t bytes, size_t align) {
+        int c = classOf(bytes);
+        if (c >= kClasses || align > kMinNode) {
+            upstream->deallocate(p, bytes, align);
+            return;
         }
-        ofs.close();
-        return true;
+        lock_guard<mutex> lk(m);
+        FreeNode* f = static_cast<FreeNode*>(p);
+        f->next = freeList[c];
+        freeList[c] = f;
     }
-
-    // Load market snapshot (clears existing)
-    bool loadSnapshot(const string& fname) {
+public:
+    explicit PoolResource(MemoryResource* up = heapResource()) : upstream(up) {
+        for (int c = 0; c < kClasses; ++c) freeList[c] = nullptr;
+    }
+    ~PoolResource() {
+        for (void* b : blocks) upstream->deallocate(b, kBlock);
+    }
+};
+
+// Off reproduces plain new/delete everywhere the engine pools memory (for benchmarks)
+bool memoryPoolsEnabled = true;
+
+// Shared pool for small long-lived nodes (lot rings and the like). Never
+// destroyed: nodes may still be handed back while the process exits.
+inline MemoryResource* nodeResource() {
+    static PoolResource* pool = new PoolResource();
+    return memoryPoolsEnabled ? pool : heapResource();
+}
+
+// Allocator drawing from a MemoryResource, in the manner of pmr::polymorphic_allocator
+template <typename T>
+class PolyAllocator {
+public:
+    typedef T value_type;
+    MemoryResource* res;
+
+    PolyAllocator(MemoryResource* r = heapResource()) : res(r) {}
+    template <typename U>
+    PolyAllocator(const PolyAllocator<U>& o) : res(o.res) {}
+    T* allocate(size_t n) { return static_cast<T*>(res->allocate(n * sizeof(T), alignof(T))); }
+    void deallocate(T* p, size_t n) { res->deallocate(p, n * sizeof(T), alignof(T)); }
+};
+template <typename T, typename U>
+bool operator==(const PolyAllocator<T>& a, const PolyAllocator<U>& b) { return a.res == b.res; }
+template <typename T, typename U>
+bool operator!=(const PolyAllocator<T>& a, const PolyAllocator<U>& b) { return a.res != b.res; }
+
+// --------------------------- Epoch-based reclamation ---------------------------
+// Readers pin the global epoch while they look at a published version; writers
+// retire the version they replaced, and it is freed once every pinned reader
+// has moved at least two epochs past the one it was retired in.
+// A reader that finds all kMaxSlots slots taken is counted as an overflow pin
+// instead, which holds the epoch where it is until the last one leaves.
+class EpochManager {
+public:
+    static const int kMaxSlots = 64;
+    static const int kOverflowPin = -2; // pinDetached() result when no slot was free
+
+    static EpochManager& instance() {
+        static EpochManager mgr;
+        return mgr;
+    }
+
+    void enter() {
+        ThreadSlot& ts = threadSlot();
+        if (ts.depth++ > 0) return; // nested pin: already protected
+        if (ts.index < 0) ts.index = acquireSlot();
+        if (ts.index == kOverflowPin) pinOverflow();
+        else slots[ts.index].epoch.store(globalEpoch.load());
+    }
+
+    void leave() {
+        ThreadSlot& ts = threadSlot();
+        if (--ts.depth > 0) return;
+        if (ts.index == kOverflowPin) {
+            overflowPins.fetch_sub(1);
+            ts.index = -1; // try for a real slot next time
+        } else {
+            slots[ts.index].epoch.store(0);
+        }
+    }
+
+    template <typename T>
+    void retire(const T* p) { retire(p, &destroy<T>); }
+    // deleter runs once no reader can still see p
+    void retire(const void* p, void (*deleter)(void*)) {
+        if (!p) return;
+        lock_guard<mutex> lk(retireMutex);
+        retired.push_back(Retired{const_cast<void*>(p), deleter, globalEpoch.load()});
+        if (retired.size() >= 32) collectLocked();
+    }
+
+    // A pin that is not tied to the calling thread: it may be handed to another
+    // thread and released there (used to keep a captured checkpoint alive).
+    int pinDetached() {
+        int i = acquireSlot();
+        if (i == kOverflowPin) pinOverflow();
+        else slots[i].epoch.store(globalEpoch.load());
+        return i;
+    }
+    void unpinDetached(int i) {
+        if (i == kOverflowPin) {
+            overflowPins.fetch_sub(1);
+            return;
+        }
+        slots[i].epoch.store(0);
+        slots[i].used.store(false);
+    }
+
+    // Advance the epoch and free whatever is no longer reachable, as far as the pins allow.
+    void collect() {
+        lock_guard<mutex> lk(retireMutex);
+        collectLocked();
+    }
+
+    ~EpochManager() {
+        for (auto& r : retired) r.deleter(r.ptr);
+    }
+
+private:
+    struct alignas(64) Slot {
+        atomic<uint64_t> epoch; // 0 = not pinned
+        atomic<bool> used;
+        Slot() : epoch(0), used(false) {}
+    };
+    struct Retired {
+        void* ptr;
+        void (*deleter)(void*);
+        uint64_t epoch;
+    };
+    // Per-thread slot ownership, released when the thread exits.
+    struct ThreadSlot {
+        int index; // -1 = none yet, kOverflowPin = pinned without one
+        int depth;
+        ThreadSlot() : index(-1), depth(0) {}
+        ~ThreadSlot() { if (index >= 0) EpochManager::instance().slots[index].used.store(false); }
+    };
+
+    // Retired versions past this many mean a reader has stayed pinned for a
+    // long time; each warning doubles it
+    static const size_t kRetiredWarning = 4096;
+
+    Slot slots[kMaxSlots];
+    atomic<uint64_t> globalEpoch;
+    atomic<int> overflowPins;
+    atomic<bool> overflowReported;
+    mutex retireMutex;
+    vector<Retired> retired;
+    size_t warnAt;
+
+    EpochManager() : globalEpoch(1), overflowPins(0), overflowReported(false), warnAt(kRetiredWarning) {}
+
+    template <typename T>
+    static void destroy(void* p) { delete static_cast<T*>(p); }
+
+    static ThreadSlot& threadSlot() {
+        static thread_local ThreadSlot ts;
+        return ts;
+    }
+
+    // A free slot, or kOverflowPin when more than kMaxSlots threads hold one
+    int acquireSlot() {
+        for (int i = 0; i < kMaxSlots; ++i) {
+            bool expected = false;
+            if (!slots[i].used.load() && slots[i].used.compare_exchange_strong(expected, true)) return i;
+        }
+        if (!overflowReported.exchange(true))
+            cerr << "warning: more than " << kMaxSlots << " threads reading published versions at once; "
+                 << "the extra readers hold reclamation back while they are pinned\n";
+        return kOverflowPin;
+    }
+    void pinOverflow() { overflowPins.fetch_add(1); }
+
+    bool tryAdvance() {
+        if (overflowPins.load() != 0) return false;
+        uint64_t g = globalEpoch.load();
+        for (int i = 0; i < kMaxSlots; ++i) {
+            uint64_t e = slots[i].epoch.load();
+            if (e != 0 && e != g) return false;
+        }
+        return globalEpoch.compare_exchange_strong(g, g + 1);
+    }
+
+    // Advance and free until a pin stops the epoch or nothing is left; a
+    // version retired just now needs two advances
+    void collectLocked() {
+        for (;;) {
+            bool advanced = tryAdvance();
+            uint64_t g = globalEpoch.load();
+            size_t keep = 0;
+            for (size_t i = 0; i < retired.size(); ++i) {
+                if (retired[i].epoch + 2 <= g) retired[i].deleter(retired[i].ptr);
+                else retired[keep++] = retired[i];
+            }
+            retired.resize(keep);
+            if (!advanced || retired.empty()) break;
+        }
+        if (retired.size() >= warnAt) {
+            cerr << "warning: " << retired.size() << " retired versions are waiting for pinned readers (oldest pin at epoch "
+                 << oldestPin() << ", now " << globalEpoch.load() << ", " << overflowPins.load() << " without a slot)\n";
+            warnAt *= 2;
+        } else if (retired.size() < kRetiredWarning / 2) {
+            warnAt = kRetiredWarning;
+        }
+    }
+
+    uint64_t oldestPin() const {
+        uint64_t oldest = globalEpoch.load();
+        for (int i = 0; i < kMaxSlots; ++i) {
+            uint64_t e = slots[i].epoch.load();
+            if (e != 0 && e < oldest) oldest = e;
+        }
+        return oldest;
+    }
+};
+
+// RAII pin: everything read through a Versioned<T> stays alive for its scope.
+class EpochGuard {
+public:
+    EpochGuard() { EpochManager::instance().enter(); }
+    ~EpochGuard() { EpochManager::instance().leave(); }
+private:
+    EpochGuard(const EpochGuard&);
+    EpochGuard& operator=(const EpochGuard&);
+};
+
+// Movable owner of a detached pin
+class EpochPin {
+private:
+    static const int kNone = -1;
+    int slot;
+    EpochPin(const EpochPin&);
+    EpochPin& operator=(const EpochPin&);
+public:
+    EpochPin() : slot(EpochManager::instance().pinDetached()) {}
+    EpochPin(EpochPin&& o) : slot(o.slot) { o.slot = kNone; }
+    ~EpochPin() { release(); }
+    void release() {
+        if (slot != kNone) EpochManager::instance().unpinDetached(slot);
+        slot = kNone;
+    }
+};
+
+// Reclaimed versions of T waiting to be refilled. A writer that publishes after
+// every trade takes its next draft from here, containers and all, instead of
+// allocating one. The cap covers a full reclamation batch (versions come back
+// 32 or so at a time) without holding on to more than that.
+template <typename T>
+class VersionBin {
+private:
+    static const size_t kSpares = 64;
+    mutex m;
+    vector<T*> spare;
+    VersionBin() { spare.reserve(kSpares); }
+public:
+    // Never destroyed: the epoch manager hands versions back while the process exits
+    static VersionBin& instance() {
+        static VersionBin* bin = new VersionBin();
+        return *bin;
+    }
+    T* take() {
+        if (memoryPoolsEnabled) {
+            lock_guard<mutex> lk(m);
+            if (!spare.empty()) {
+                T* p = spare.back();
+                spare.pop_back();
+                return p;
+            }
+        }
+        return new T();
+    }
+    static void give(void* p) {
+        VersionBin& b = instance();
+        if (memoryPoolsEnabled) {
+            lock_guard<mutex> lk(b.m);
+            if (b.spare.size() < kSpares) {
+                b.spare.push_back(static_cast<T*>(p));
+                return;
+            }
+        }
+        delete static_cast<T*>(p);
+    }
+};
+
+// Single-writer copy-on-write cell. Writers build a fresh T and publish it with
+// one atomic swap; readers call get() under an EpochGuard and never block.
+template <typename T>
+class Versioned {
+private:
+    atomic<const T*> cur;
+public:
+    Versioned() : cur(new T()) {}
+    Versioned(const Versioned& o) : cur(nullptr) {
+        EpochGuard g;
+        cur.store(new T(*o.get()));
+    }
+    Versioned& operator=(const Versioned& o) {
+        if (this != &o) {
+            EpochGuard g;
+            publish(new T(*o.get()));
+        }
+        return *this;
+    }
+    ~Versioned() { EpochManager::instance().retire(cur.load(), &VersionBin<T>::give); }
+
+    const T* get() const { return cur.load(memory_order_acquire); }
+    // Storage for the next version: possibly a reclaimed one, so the writer
+    // must set every field before publishing it
+    T* draft() { return VersionBin<T>::instance().take(); }
+    void publish(T* next) {
+        const T* old = cur.exchange(next, memory_order_acq_rel);
+        EpochManager::instance().retire(old, &VersionBin<T>::give);
+    }
+};
+
+// --------------------------- Instrument kinds ---------------------------
+// Tag stored in holdings, log entries and the catalog instead of a type string.
+enum class InstrumentKind : unsigned char { None, Stock, MutualFund, Bond };
+
+inline const char* kindName(InstrumentKind k) {
+    switch (k) {
+        case InstrumentKind::Stock: return "Stock";
+        case InstrumentKind::MutualFund: return "MutualFund";
+        case InstrumentKind::Bond: return "Bond";
+        default: return "-";
+    }
+}
+
+// Inverse of kindName(); anything unrecognised maps to None
+inline InstrumentKind parseKind(const string& s) {
+    if (s == "Stock") return InstrumentKind::Stock;
+    if (s == "MutualFund") return InstrumentKind::MutualFund;
+    if (s == "Bond") return InstrumentKind::Bond;
+    return InstrumentKind::None;
+}
+
+// --------------------------- Interned strings ---------------------------
+// Append-only array whose elements never move. One writer appends (under the
+// owner's lock); any thread may read indices below size() without locking.
+template <typename T>
+class StableVector {
+private:
+    static const size_t kChunkBits = 10;
+    static const size_t kChunkSize = size_t(1) << kChunkBits;
+    static const size_t kMaxChunks = 16384; // 16M elements
+    atomic<T*> chunks[kMaxChunks];
+    atomic<size_t> count;
+    StableVector(const StableVector&);
+    StableVector& operator=(const StableVector&);
+public:
+    StableVector() : count(0) {
+        for (size_t i = 0; i < kMaxChunks; ++i) chunks[i].store(nullptr, memory_order_relaxed);
+    }
+    ~StableVector() {
+        for (size_t i = 0; i < kMaxChunks; ++i) delete[] chunks[i].load();
+    }
+    size_t size() const { return count.load(memory_order_acquire); }
+    const T& operator[](size_t i) const { return chunks[i >> kChunkBits].load(memory_order_acquire)[i & (kChunkSize - 1)]; }
+    T& operator[](size_t i) { return chunks[i >> kChunkBits].load(memory_order_acquire)[i & (kChunkSize - 1)]; }
+    // Returns the new element's index; the element is visible to readers on return.
+    size_t push_back(const T& v) {
+        size_t i = count.load(memory_order_relaxed);
+        if (i >= kChunkSize * kMaxChunks) throw length_error("StableVector full");
+        size_t c = i >> kChunkBits;
+        if (!chunks[c].load(memory_order_relaxed)) chunks[c].store(new T[kChunkSize], memory_order_release);
+        chunks[c].load(memory_order_relaxed)[i & (kChunkSize - 1)] = v;
+        count.store(i + 1, memory_order_release);
+        return i;
+    }
+};
+
+// Growable array stored in pages that never move. snapshot() shares the pages,
+// so a reader on another thread can walk the first size() elements while the
+// owner keeps appending behind them. Page k holds kFirst << k elements, so a
+// short log costs one small page rather than a full fixed-size one.
+template <typename T>
+class PagedVector {
+private:
+    static const size_t kFirst = 8;
+    vector<shared_ptr<T> > pages;
+    size_t count;
+
+    static T& at(const vector<shared_ptr<T> >& pages, size_t i) {
+        size_t q = i / kFirst + 1, page = 0;
+#ifdef __GNUC__
+        page = 63 - __builtin_clzll((unsigned long long)q);
+#else
+        while (q >>= 1) ++page;
+#endif
+        return pages[page].get()[i - kFirst * ((size_t(1) << page) - 1)];
+    }
+public:
+    class Snapshot {
+    private:
+        vector<shared_ptr<T> > pages;
+        size_t count;
+    public:
+        Snapshot() : count(0) {}
+        Snapshot(const vector<shared_ptr<T> >& p, size_t n) : pages(p), count(n) {}
+        size_t size() const { return count; }
+        const T& operator[](size_t i) const { return at(pages, i); }
+    };
+
+    PagedVector() : count(0) {}
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const T& operator[](size_t i) const { return at(pages, i); }
+    const T& back() const { return at(pages, count - 1); }
+    void push_back(const T& v) { slotForPush() = v; ++count; }
+    void push_back(T&& v) { slotForPush() = move(v); ++count; }
+    void clear() { pages.clear(); count = 0; }
+    Snapshot snapshot() const { return Snapshot(pages, count); }
+
+private:
+    T& slotForPush() {
+        if (count == kFirst * ((size_t(1) << pages.size()) - 1)) {
+            size_t n = kFirst << pages.size();
+            pages.push_back(shared_ptr<T>(new T[n], default_delete<T[]>()));
+        }
+        return at(pages, count);
+    }
+};
+
+// Every distinct symbol and name is stored once; everything else refers to it by id.
+class StringPool {
+private:
+    mutable mutex mtx;
+    unordered_map<string, uint32_t> index;
+    StableVector<string> strings;
+public:
+    uint32_t intern(const string& s) {
+        lock_guard<mutex> lk(mtx);
+        auto it = index.find(s);
+        if (it != index.end()) return it->second;
+        uint32_t id = (uint32_t)strings.push_back(s);
+        index.emplace(s, id);
+        return id;
+    }
+    const string& str(uint32_t id) const { return strings[id]; }
+    size_t size() const { return strings.size(); }
+};
+
+inline StringPool& stringPool() {
+    static StringPool pool;
+    return pool;
+}
+
+// --------------------------- Instrument table ---------------------------
+// Process-wide dense ids for every symbol ever listed. Ids outlive any one
+// Market, so holdings stay valid across market resets and snapshot loads.
+typedef uint32_t InstrumentId;
+const InstrumentId kNoInstrument = 0xffffffffu;
+
+class InstrumentTable {
+private:
+    struct Info {
+        uint32_t symbolRef;
+        uint32_t nameRef;
+        InstrumentKind kind;
+        Info() : symbolRef(0), nameRef(0), kind(InstrumentKind::None) {}
+    };
+    mutable mutex mtx;
+    unordered_map<string, InstrumentId> bySymbol;
+    StableVector<Info> info;
+public:
+    // Registers the symbol on first use; the first name and kind seen stick.
+    InstrumentId intern(const string& symbol, const string& name, InstrumentKind kind) {
+        lock_guard<mutex> lk(mtx);
+        auto it = bySymbol.find(symbol);
+        if (it != bySymbol.end()) return it->second;
+        Info in;
+        in.symbolRef = stringPool().intern(symbol);
+        in.nameRef = stringPool().intern(name);
+        in.kind = kind;
+        InstrumentId id = (InstrumentId)info.push_back(in);
+        bySymbol.emplace(symbol, id);
+        return id;
+    }
+    InstrumentId find(const string& symbol) const {
+        lock_guard<mutex> lk(mtx);
+        auto it = bySymbol.find(symbol);
+        return it == bySymbol.end() ? kNoInstrument : it->second;
+    }
+    const string& symbol(InstrumentId id) const { return stringPool().str(info[id].symbolRef); }
+    const string& name(InstrumentId id) const { return stringPool().str(info[id].nameRef); }
+    InstrumentKind kind(InstrumentId id) const { return info[id].kind; }
+    size_t size() const { return info.size(); }
+};
+
+inline InstrumentTable& instruments() {
+    static InstrumentTable table;
+    return table;
+}
+
+// A split or cash dividend on one instrument. For a split, value is the ratio
+// of new units to old (2 for a 2-for-1); for a dividend, the cash per unit.
+enum class CorporateActionKind : unsigned char { Split, Dividend };
+
+inline const char* corporateActionName(CorporateActionKind k) {
+    return k == CorporateActionKind::Split ? "SPLIT" : "DIVIDEND";
+}
+inline bool parseCorporateAction(const string& s, CorporateActionKind& k) {
+    if (s == "SPLIT") k = CorporateActionKind::Split;
+    else if (s == "DIVIDEND") k = CorporateActionKind::Dividend;
+    else return false;
+    return true;
+}
+
+struct CorporateAction {
+    InstrumentId instrument;
+    CorporateActionKind kind;
+    double value;
+};
+
+// --------------------------- Base: Investment ---------------------------
+class Investment {
+protected:
+    string name;
+    string symbol;
+    InstrumentId id;
+public:
+    Investment() : id(kNoInstrument) {}
+    Investment(const string& n, const string& s, InstrumentKind k)
+        : name(n), symbol(s), id(instruments().intern(s, n, k)) {}
+    virtual ~Investment() {}
+    string getName() const { return name; }
+    string getSymbol() const { return symbol; }
+    InstrumentId getId() const { return id; }
+
+    virtual void displayDetails() const = 0;
+    virtual double currentPrice() const = 0;
+    virtual string typeName() const = 0;
+};
+
+// --------------------------- Stock ---------------------------
+class Stock final : public Investment {
+private:
+    double price;    // current market price per share
+    int available;   // number of shares available in market
+public:
+    Stock() : price(0.0), available(0) {}
+    Stock(const string& n, const string& s, double p, int avail)
+        : Investment(n, s, InstrumentKind::Stock), price(p), available(avail) {}
+
+    void displayDetails() const override {
+        cout << left << setw(6) << symbol << " | "
+             << setw(20) << name << " | "
+             << "Price: " << setw(9) << fixed << setprecision(2) << price
+             << " | Available: " << available;
+    }
+
+    double currentPrice() const override { return price; }
+    string typeName() const override { return "Stock"; }
+    static const InstrumentKind kind = InstrumentKind::Stock;
+    void setPrice(double p) { price = p; }
+    void changeAvailable(int delta) { available += delta; if (available < 0) available = 0; }
+    void setAvailable(int n) { available = n; }
+    int getAvailable() const { return available; }
+};
+const InstrumentKind Stock::kind;
+
+// --------------------------- MutualFund ---------------------------
+class MutualFund final : public Investment {
+private:
+    double nav;    // net asset value per unit
+    double totalUnits; // units available in "market"
+public:
+    MutualFund() : nav(0.0), totalUnits(0.0) {}
+    MutualFund(const string& n, const string& s, double nav_, double units)
+        : Investment(n, s, InstrumentKind::MutualFund), nav(nav_), totalUnits(units) {}
+
+    void displayDetails() const override {
+        cout << left << setw(6) << symbol << " | "
+             << setw(20) << name << " | "
+             << "NAV: " << setw(9) << fixed << setprecision(2) << nav
+             << " | UnitsAvail: " << setw(8) << fixed << setprecision(2) << totalUnits;
+    }
+
+    double currentPrice() const override { return nav; }
+    string typeName() const override { return "MutualFund"; }
+    static const InstrumentKind kind = InstrumentKind::MutualFund;
+
+    void setNAV(double n) { nav = n; }
+    void changeUnits(double d) { totalUnits += d; if (totalUnits < 0) totalUnits = 0; }
+    void setUnits(double u) { totalUnits = u; }
+    double getUnits() const { return totalUnits; }
+};
+const InstrumentKind MutualFund::kind;
+
+// --------------------------- Bond ---------------------------
+// Fixed coupon bond. Times are in years from the market's valuation date;
+// coupons fall every 1/frequency years counting back from maturity.
+struct BondTerms {
+    double coupon;   // annual rate on face value, 0.0718 = 7.18%
+    int frequency;   // coupons a year; 0 for a zero-coupon bond
+    double maturity; // years until the face value is repaid
+    double face;     // repaid at maturity; quotes are per bond of this face
+    BondTerms() : coupon(0.0), frequency(2), maturity(0.0), face(100.0) {}
+    BondTerms(double c, int f, double m, double fv = 100.0) : coupon(c), frequency(f), maturity(m), face(fv) {}
+
+    // Remaining cash flows, earliest first
+    void cashflows(vector<double>& times, vector<double>& amounts) const {
+        times.clear();
+        amounts.clear();
+        if (maturity <= 0.0) return;
+        if (frequency <= 0) {
+            times.push_back(maturity);
+            amounts.push_back(face);
+            return;
+        }
+        double period = 1.0 / frequency;
+        size_t n = (size_t)ceil(maturity * frequency - 1e-9);
+        for (size_t k = n; k-- > 0;) {
+            times.push_back(maturity - k * period);
+            amounts.push_back(face * coupon * period + (k == 0 ? face : 0.0));
+        }
+    }
+    // Interest earned since the last coupon, included in a dirty price
+    double accrued() const {
+        if (frequency <= 0 || maturity <= 0.0) return 0.0;
+        double period = 1.0 / frequency;
+        double next = maturity - period * floor(maturity * frequency - 1e-9);
+        return face * coupon * period * (1.0 - next / period);
+    }
+};
+
+// Bonds trade in whole units at the dirty price (clean price plus accrued).
+// Their quotes come from the yield curve (BondPricer), not the tick models.
+class Bond final : public Investment {
+private:
+    BondTerms terms;
+    double price;   // dirty price per bond
+    int available;  // bonds left in the market
+public:
+    Bond() : price(0.0), available(0) {}
+    Bond(const string& n, const string& s, const BondTerms& t, double p, int avail)
+        : Investment(n, s, InstrumentKind::Bond), terms(t), price(p), available(avail) {}
+
+    void displayDetails() const override {
+        cout << left << setw(6) << symbol << " | "
+             << setw(20) << name << " | "
+             << "Price: " << setw(9) << fixed << setprecision(2) << price
+             << " | Available: " << available;
+    }
+
+    double currentPrice() const override { return price; }
+    string typeName() const override { return "Bond"; }
+    static const InstrumentKind kind = InstrumentKind::Bond;
+    const BondTerms& getTerms() const { return terms; }
+    void setPrice(double p) { price = p; }
+    void changeAvailable(int delta) { available += delta; if (available < 0) available = 0; }
+    void setAvailable(int n) { available = n; }
+    int getAvailable() const { return available; }
+};
+const InstrumentKind Bond::kind;
+
+// --------------------------- Holding ---------------------------
+// Vector with room for N elements inline; spills to the heap beyond that.
+// Only for trivially copyable T.
+template <typename T, size_t N>
+class SmallVector {
+private:
+    T* ptr;
+    uint32_t len;
+    uint32_t cap;
+    T inlineBuf[N];
+
+    bool isInline() const { return ptr == inlineBuf; }
+    void grow(size_t want) {
+        size_t ncap = cap * 2;
+        if (ncap < want) ncap = want;
+        T* p = static_cast<T*>(::operator new(ncap * sizeof(T)));
+        if (len) memcpy(p, ptr, len * sizeof(T));
+        if (!isInline()) ::operator delete(ptr);
+        ptr = p;
+        cap = (uint32_t)ncap;
+    }
+public:
+    SmallVector() : ptr(inlineBuf), len(0), cap(N) {}
+    SmallVector(const SmallVector& o) : ptr(inlineBuf), len(0), cap(N) { *this = o; }
+    SmallVector& operator=(const SmallVector& o) {
+        if (this == &o) return *this;
+        if (o.len > cap) grow(o.len);
+        if (o.len) memcpy(ptr, o.ptr, o.len * sizeof(T));
+        len = o.len;
+        return *this;
+    }
+    ~SmallVector() { if (!isInline()) ::operator delete(ptr); }
+
+    size_t size() const { return len; }
+    bool empty() const { return len == 0; }
+    T* begin() { return ptr; }
+    T* end() { return ptr + len; }
+    const T* begin() const { return ptr; }
+    const T* end() const { return ptr + len; }
+    T& operator[](size_t i) { return ptr[i]; }
+    const T& operator[](size_t i) const { return ptr[i]; }
+    void clear() { len = 0; }
+    void reserve(size_t n) { if (n > cap) grow(n); }
+    T* insert(T* pos, const T& v) {
+        size_t at = pos - ptr;
+        if (len == cap) grow(len + 1);
+        memmove(ptr + at + 1, ptr + at, (len - at) * sizeof(T));
+        ptr[at] = v;
+        ++len;
+        return ptr + at;
+    }
+    void erase(T* pos) {
+        size_t at = pos - ptr;
+        memmove(ptr + at, ptr + at + 1, (len - at - 1) * sizeof(T));
+        --len;
+    }
+    // Heap bytes owned beyond sizeof(*this)
+    size_t heapBytes() const { return isInline() ? 0 : cap * sizeof(T); }
+};
+
+// Represents investor's holding (for a stock or mutual fund). Symbol, name and
+// kind live once in the instrument table.
+struct Holding {
+    InstrumentId id;
+    double quantity; // for stocks use int-like quantity, but stored as double to unify mutual funds
+    double avgPrice; // average buy price per unit
+};
+
+// An investor's holdings, sorted by instrument id. The first few live inline.
+class Portfolio {
+private:
+    SmallVector<Holding, 4> rows;
+
+    Holding* lowerBound(InstrumentId id) {
+        return lower_bound(rows.begin(), rows.end(), id,
+                           [](const Holding& h, InstrumentId k) { return h.id < k; });
+    }
+public:
+    Holding* find(InstrumentId id) {
+        Holding* it = lowerBound(id);
+        return (it != rows.end() && it->id == id) ? it : nullptr;
+    }
+    const Holding* find(InstrumentId id) const { return const_cast<Portfolio*>(this)->find(id); }
+    // Existing holding for id, or a new zero one inserted in order
+    Holding& upsert(InstrumentId id) {
+        Holding* it = lowerBound(id);
+        if (it != rows.end() && it->id == id) return *it;
+        Holding h = {id, 0.0, 0.0};
+        return *rows.insert(it, h);
+    }
+    void erase(Holding* h) { rows.erase(h); }
+    void clear() { rows.clear(); }
+    size_t size() const { return rows.size(); }
+    bool empty() const { return rows.empty(); }
+    const Holding* begin() const { return rows.begin(); }
+    const Holding* end() const { return rows.end(); }
+    size_t heapBytes() const { return rows.heapBytes(); }
+
+    // Holdings in symbol order, for reports and save files
+    vector<const Holding*> bySymbol() const {
+        vector<const Holding*> out;
+        out.reserve(rows.size());
+        for (const Holding& h : rows) out.push_back(&h);
+        sort(out.begin(), out.end(), [](const Holding* a, const Holding* b) {
+            return instruments().symbol(a->id) < instruments().symbol(b->id);
+        });
+        return out;
+    }
+};
+
+// --------------------------- Tax lots ---------------------------
+// Which open lots a sale closes first. A sale can also name one lot explicitly
+// (specific-lot identification), which overrides the method for that sale.
+enum class LotMethod : unsigned char { FIFO, LIFO };
+
+inline const char* lotMethodName(LotMethod m) { return m == LotMethod::FIFO ? "FIFO" : "LIFO"; }
+
+const uint32_t kAnyLot = 0xffffffffu;
+
+struct Lot {
+    double qty;
+    double price;  // cost per unit
+    uint32_t id;   // unique within the LotBook, in buy order
+};
+
+// Open lots of one holding in buy order, in a power-of-two ring buffer so both
+// FIFO (front) and LIFO (back) relief are O(1). Buffers come from the shared
+// node pool, so closing out a position and reopening it does not hit the heap.
+class LotRing {
+private:
+    Lot* buf;
+    uint32_t head;
+    uint32_t len;
+    uint32_t cap;
+    MemoryResource* res; // what buf came from
+
+    Lot& slot(uint32_t i) const { return buf[(head + i) & (cap - 1)]; }
+    Lot* allocate(uint32_t n) { return static_cast<Lot*>(res->allocate(n * sizeof(Lot), alignof(Lot))); }
+    void release() {
+        if (buf) res->deallocate(buf, cap * sizeof(Lot), alignof(Lot));
+        buf = nullptr;
+    }
+    void grow() {
+        uint32_t ncap = cap ? cap * 2 : 2;
+        Lot* nb = allocate(ncap);
+        for (uint32_t i = 0; i < len; ++i) nb[i] = slot(i);
+        release();
+        buf = nb;
+        head = 0;
+        cap = ncap;
+    }
+public:
+    LotRing() : buf(nullptr), head(0), len(0), cap(0), res(nodeResource()) {}
+    LotRing(const LotRing& o) : buf(nullptr), head(0), len(0), cap(0), res(nodeResource()) { *this = o; }
+    LotRing& operator=(const LotRing& o) {
+        if (this == &o) return *this;
+        release();
+        buf = o.cap ? allocate(o.cap) : nullptr;
+        cap = o.cap;
+        head = 0;
+        len = o.len;
+        for (uint32_t i = 0; i < len; ++i) buf[i] = o.slot(i);
+        return *this;
+    }
+    LotRing(LotRing&& o) : buf(o.buf), head(o.head), len(o.len), cap(o.cap), res(o.res) {
+        o.buf = nullptr;
+        o.len = o.cap = o.head = 0;
+    }
+    LotRing& operator=(LotRing&& o) {
+        if (this != &o) {
+            release();
+            buf = o.buf; head = o.head; len = o.len; cap = o.cap; res = o.res;
+            o.buf = nullptr; o.len = o.cap = o.head = 0;
+        }
+        return *this;
+    }
+    ~LotRing() { release(); }
+
+    uint32_t size() const { return len; }
+    bool empty() const { return len == 0; }
+    Lot& operator[](uint32_t i) { return slot(i); }
+    const Lot& operator[](uint32_t i) const { return slot(i); }
+    void push_back(const Lot& l) {
+        if (len == cap) grow();
+        slot(len++) = l;
+    }
+    void pop_front() { head = (head + 1) & (cap - 1); --len; }
+    void pop_back() { --len; }
+    void erase(uint32_t i) {
+        for (uint32_t k = i; k + 1 < len; ++k) slot(k) = slot(k + 1);
+        --len;
+    }
+    // Logical index of lot id, or len when not open
+    uint32_t indexOf(uint32_t id) const {
+        for (uint32_t i = 0; i < len; ++i) if (slot(i).id == id) return i;
+        return len;
+    }
+};
+
+// All open lots of one account plus its running realized P/L.
+class LotBook {
+private:
+    vector<pair<InstrumentId, LotRing> > books; // sorted by instrument id
+    double realized;
+    uint32_t nextLotId;
+
+    vector<pair<InstrumentId, LotRing> >::iterator findBook(InstrumentId id) {
+        return lower_bound(books.begin(), books.end(), id,
+                           [](const pair<InstrumentId, LotRing>& b, InstrumentId k) { return b.first < k; });
+    }
+public:
+    LotMethod method;
+
+    LotBook() : realized(0.0), nextLotId(1), method(LotMethod::FIFO) {}
+
+    void clear() { books.clear(); realized = 0.0; nextLotId = 1; }
+    double realizedPL() const { return realized; }
+    uint32_t nextId() const { return nextLotId; }
+
+    // Checkpoint restore: lots arrive in buy order with their original ids
+    void restore(InstrumentId id, const Lot& l) {
+        auto it = findBook(id);
+        if (it == books.end() || it->first != id) it = books.insert(it, make_pair(id, LotRing()));
+        it->second.push_back(l);
+    }
+    void restoreTotals(double realizedPL, uint32_t nextLot) {
+        realized = realizedPL;
+        nextLotId = nextLot;
+    }
+
+    uint32_t open(InstrumentId id, double qty, double price) {
+        auto it = findBook(id);
+        if (it == books.end() || it->first != id) it = books.insert(it, make_pair(id, LotRing()));
+        Lot l = {qty, price, nextLotId++};
+        it->second.push_back(l);
+        return l.id;
+    }
+
+    const LotRing* lots(InstrumentId id) const {
+        auto it = const_cast<LotBook*>(this)->findBook(id);
+        return (it != books.end() && it->first == id) ? &it->second : nullptr;
+    }
+
+    // Units left in one open lot (0 when it is not open)
+    double lotQty(InstrumentId id, uint32_t lotId) const {
+        const LotRing* r = lots(id);
+        if (!r) return 0.0;
+        uint32_t i = r->indexOf(lotId);
+        return i < r->size() ? (*r)[i].qty : 0.0;
+    }
+
+    // Close qty units at price and return the realized P/L of this sale. The
+    // named lot goes first when given, then lots in method order. Units with
+    // no open lot behind them are reported through unmatched.
+    double close(InstrumentId id, double qty, double price, uint32_t lotId = kAnyLot, double* unmatched = nullptr) {
+        double pl = 0.0;
+        auto it = findBook(id);
+        if (it != books.end() && it->first == id) {
+            LotRing& r = it->second;
+            if (lotId != kAnyLot) {
+                uint32_t i = r.indexOf(lotId);
+                if (i < r.size()) {
+                    Lot& l = r[i];
+                    double take = min(qty, l.qty);
+                    pl += (price - l.price) * take;
+                    qty -= take;
+                    l.qty -= take;
+                    if (l.qty <= 1e-9) r.erase(i);
+                }
+            }
+            while (qty > 1e-9 && !r.empty()) {
+                Lot& l = method == LotMethod::FIFO ? r[0] : r[r.size() - 1];
+                double take = min(qty, l.qty);
+                pl += (price - l.price) * take;
+                qty -= take;
+                l.qty -= take;
+                if (l.qty <= 1e-9) {
+                    if (method == LotMethod::FIFO) r.pop_front();
+                    else r.pop_back();
+                }
+            }
+            if (r.empty()) books.erase(it);
+        }
+        if (unmatched) *unmatched = qty > 1e-9 ? qty : 0.0;
+        realized += pl;
+        return pl;
+    }
+
+    // A split: every open lot gets ratio times the units at 1/ratio the cost
+    void split(InstrumentId id, double ratio) {
+        auto it = findBook(id);
+        if (it == books.end() || it->first != id) return;
+        LotRing& r = it->second;
+        for (uint32_t i = 0; i < r.size(); ++i) {
+            r[i].qty *= ratio;
+            r[i].price /= ratio;
+        }
+    }
+
+    // Units and cost across the open lots of one instrument
+    double openQty(InstrumentId id) const {
+        const LotRing* r = lots(id);
+        double q = 0.0;
+        if (r) for (uint32_t i = 0; i < r->size(); ++i) q += (*r)[i].qty;
+        return q;
+    }
+    double costBasis(InstrumentId id) const {
+        const LotRing* r = lots(id);
+        double c = 0.0;
+        if (r) for (uint32_t i = 0; i < r->size(); ++i) c += (*r)[i].qty * (*r)[i].price;
+        return c;
+    }
+    size_t openLots() const {
+        size_t n = 0;
+        for (const auto& b : books) n += b.second.size();
+        return n;
+    }
+    // Replace whatever lots an instrument has with one lot (used when a saved
+    // holding is not backed by its log)
+    void reset(InstrumentId id, double qty, double price) {
+        auto it = findBook(id);
+        if (it != books.end() && it->first == id) books.erase(it);
+        if (qty > 1e-9) open(id, qty, price);
+    }
+    const vector<pair<InstrumentId, LotRing> >& all() const { return books; }
+};
+
+struct LotReplayStats {
+    size_t lines;
+    size_t trades;
+    double unmatchedQty; // sold units with no recorded buy behind them
+    LotReplayStats() : lines(0), trades(0), unmatchedQty(0.0) {}
+};
+
+// Rebuild lots by streaming a .txlog: BUYs open lots, SELLs close them. Lines are
+// split in place and symbols are resolved through a local cache, so many of
+// these can run in parallel without contending on the instrument table.
+bool replayLots(istream& in, LotBook& book, LotReplayStats& stats) {
+    unordered_map<string, InstrumentId> symCache;
+    string line;
+    const char* f[9];
+    size_t flen[9];
+    while (getline(in, line)) {
+        if (line.empty()) continue;
+        ++stats.lines;
+        size_t start = 0;
+        int n = 0;
+        for (; n < 9 && start <= line.size(); ++n) {
+            size_t bar = line.find('|', start);
+            if (bar == string::npos) bar = line.size();
+            f[n] = line.c_str() + start;
+            flen[n] = bar - start;
+            start = bar + 1;
+        }
+        if (n < 8) return false;
+        uint32_t lotId = n == 9 ? (uint32_t)strtoul(f[8], nullptr, 10) : kAnyLot;
+        bool isBuy = flen[1] == 3 && memcmp(f[1], "BUY", 3) == 0;
+        bool isSell = flen[1] == 4 && memcmp(f[1], "SELL", 4) == 0;
+        bool isSplit = flen[1] == 5 && memcmp(f[1], "SPLIT", 5) == 0;
+        if (!isBuy && !isSell && !isSplit) continue;
+        string sym(f[3], flen[3]);
+        auto it = symCache.find(sym);
+        if (it == symCache.end())
+            it = symCache.emplace(sym, instruments().intern(sym, string(f[4], flen[4]), parseKind(string(f[2], flen[2])))).first;
+        double qty = strtod(f[5], nullptr);
+        double price = strtod(f[6], nullptr);
+        if (isSplit) {
+            book.split(it->second, price);
+        } else if (isBuy) {
+            book.open(it->second, qty, price);
+        } else {
+            double unmatched = 0.0;
+            book.close(it->second, qty, price, lotId, &unmatched);
+            stats.unmatchedQty += unmatched;
+        }
+        ++stats.trades;
+    }
+    return true;
+}
+
+// Bulk mode: rebuild every account's lots from its .txlog, files spread over
+// worker threads that each stream one file at a time.
+int runLotRebuild(const vector<string>& files, LotMethod method, unsigned threads) {
+    struct Result {
+        bool ok;
+        LotReplayStats stats;
+        double realized;
+        size_t openLots;
+        Result() : ok(false), realized(0.0), openLots(0) {}
+    };
+    vector<Result> results(files.size());
+    atomic<size_t> nextFile(0);
+    Stopwatch timer;
+    auto worker = [&]() {
+        for (size_t i = nextFile++; i < files.size(); i = nextFile++) {
+            ifstream ifs(files[i]);
+            if (!ifs) continue;
+            LotBook book;
+            book.method = method;
+            results[i].ok = replayLots(ifs, book, results[i].stats);
+            results[i].realized = book.realizedPL();
+            results[i].openLots = book.openLots();
+        }
+    };
+    threads = workerThreads(threads);
+    vector<thread> pool;
+    for (unsigned t = 1; t < threads; ++t) pool.emplace_back(worker);
+    worker();
+    for (auto& t : pool) t.join();
+    double secs = timer.seconds();
+
+    size_t lines = 0, failed = 0;
+    cout << left << setw(40) << "Log" << right << setw(10) << "Trades" << setw(10) << "OpenLots"
+         << setw(14) << "Realized" << setw(12) << "Unmatched" << "\n";
+    for (size_t i = 0; i < files.size(); ++i) {
+        const Result& r = results[i];
+        lines += r.stats.lines;
+        if (!r.ok) {
+            ++failed;
+            cout << left << setw(40) << files[i] << "  (unreadable)\n";
+            continue;
+        }
+        cout << left << setw(40) << files[i] << right << setw(10) << r.stats.trades << setw(10) << r.openLots
+             << setw(14) << fixed << setprecision(2) << r.realized << setw(12) << r.stats.unmatchedQty << "\n";
+    }
+    cout << files.size() << " logs, " << lines << " lines, " << lotMethodName(method) << ", "
+         << threads << " threads, " << fixed << setprecision(3) << secs << " s ("
+         << setprecision(0) << (secs > 0 ? lines / secs : 0.0) << " lines/s)\n";
+    return failed ? 1 : 0;
+}
+
+// --------------------------- Published versions ---------------------------
+// Immutable images of live state. Writers publish a new one after each change;
+// reports pin one and read it without locks while trading carries on.
+struct InstrumentCatalog {
+    vector<InstrumentId> listed; // display order: stocks, then funds, then bonds, each by symbol
+    vector<InstrumentKind> kind; // by instrument id; None when not listed here
+    vector<uint64_t> listedBits; // bit id % 64 of word id / 64 set when listed; see indexListed()
+    map<InstrumentId, BondTerms> bonds; // terms of every listed bond
+
+    // Rebuild listedBits from listed (once per catalog, so screens start from a copy)
+    void indexListed() {
+        listedBits.assign((kind.size() + 63) / 64, 0);
+        for (InstrumentId id : listed) listedBits[id / 64] |= uint64_t(1) << (id % 64);
+    }
+};
+
+// Columns are indexed directly by InstrumentId, so valuation is one load per holding.
+struct MarketVersion {
+    uint64_t seq;
+    shared_ptr<const InstrumentCatalog> catalog; // shared until an instrument is added
+    vector<double> price;     // price or NAV by instrument id
+    vector<double> available; // shares or units left by instrument id
+    MarketVersion() : seq(0), catalog(make_shared<InstrumentCatalog>()) {}
+
+    bool lists(InstrumentId id) const {
+        return id < catalog->kind.size() && catalog->kind[id] != InstrumentKind::None;
+    }
+    // 0 when the instrument is not listed
+    double priceOf(InstrumentId id) const { return id < price.size() ? price[id] : 0.0; }
+};
+
+struct InvestorState {
+    double cashBalance;
+    double realizedPL;
+    LotMethod lotMethod;
+    Portfolio holdings;
+    InvestorState() : cashBalance(0.0), realizedPL(0.0), lotMethod(LotMethod::FIFO) {}
+};
+
+// --------------------------- TransactionLog ---------------------------
+// Dividend: qty is the units held and price the payout per unit. Split: qty is
+// the units added and price the ratio. A stock's fraction left over by a split
+// is paid out as a SELL at the post-split price (cash in lieu).
+enum class TxAction : unsigned char { Buy, Sell, Deposit, Withdraw, Dividend, Split };
+
+inline const char* actionName(TxAction a) {
+    switch (a) {
+        case TxAction::Buy: return "BUY";
+        case TxAction::Sell: return "SELL";
+        case TxAction::Deposit: return "DEPOSIT";
+        case TxAction::Dividend: return "DIVIDEND";
+        case TxAction::Split: return "SPLIT";
+        default: return "WITHDRAW";
+    }
+}
+
+inline bool parseAction(const string& s, TxAction& out) {
+    if (s == "BUY") out = TxAction::Buy;
+    else if (s == "SELL") out = TxAction::Sell;
+    else if (s == "DEPOSIT") out = TxAction::Deposit;
+    else if (s == "WITHDRAW") out = TxAction::Withdraw;
+    else if (s == "DIVIDEND") out = TxAction::Dividend;
+    else if (s == "SPLIT") out = TxAction::Split;
+    else return false;
+    return true;
+}
+
+struct TxEntry {
+    Timestamp time;            // EventClock nanoseconds; shown as local YYYY-MM-DD HH:MM:SS
+    TxAction action;
+    InstrumentKind kind;
+    InstrumentId instrument;   // kNoInstrument for cash movements
+    double qty;
+    double price;
+    double balanceAfter;
+    uint32_t lot;              // tax lot named by a specific-lot SELL, else kAnyLot
+};
+
+// Parse one pipe-delimited .txlog line. On failure prints why and returns false.
+bool parseTxLine(const string& line, TxEntry& e) {
+    stringstream ss(line);
+    string act, tp, sym, nm, tmp;
+    getline(ss, tmp, '|');
+    if (!timeText().parse(tmp.data(), tmp.size(), e.time)) {
+        cout << "Error parsing time in transaction log.\n";
+        return false;
+    }
+    getline(ss, act, '|');
+    getline(ss, tp, '|');
+    getline(ss, sym, '|');
+    getline(ss, nm, '|');
+    if (!parseAction(act, e.action)) {
+        cout << "Error parsing action in transaction log.\n";
+        return false;
+    }
+    e.kind = parseKind(tp);
+    e.instrument = sym == "-" ? kNoInstrument : instruments().intern(sym, nm, e.kind);
+    getline(ss, tmp, '|');
+    try {
+        e.qty = tmp.empty() ? 0.0 : stod(tmp);
+    } catch (const exception& ex) {
+        cout << "Error parsing quantity in transaction log.\n";
+        return false;
+    }
+    getline(ss, tmp, '|');
+    try {
+        e.price = tmp.empty() ? 0.0 : stod(tmp);
+    } catch (const exception& ex) {
+        cout << "Error parsing price in transaction log.\n";
+        return false;
+    }
+    getline(ss, tmp, '|');
+    try {
+        e.balanceAfter = tmp.empty() ? 0.0 : stod(tmp);
+    } catch (const exception& ex) {
+        cout << "Error parsing balance in transaction log.\n";
+        return false;
+    }
+    e.lot = kAnyLot;
+    if (getline(ss, tmp, '\n') && !tmp.empty()) e.lot = (uint32_t)strtoul(tmp.c_str(), nullptr, 10);
+    return true;
+}
+
+// The time is written to the nanosecond so a save and reload keeps the exact stamp
+void writeTxLine(ostream& os, const TxEntry& e) {
+    bool cash = e.instrument == kNoInstrument;
+    char when[TimeText::kMaxLen];
+    os.write(when, (streamsize)timeText().format(e.time, when, true));
+    os << '|' << actionName(e.action) << '|' << kindName(e.kind) << '|'
+       << (cash ? "-" : instruments().symbol(e.instrument).c_str()) << '|'
+       << (cash ? "-" : instruments().name(e.instrument).c_str()) << '|'
+       << e.qty << '|' << e.price << '|' << e.balanceAfter;
+    if (e.lot != kAnyLot) os << '|' << e.lot; // optional ninth field
+    os << '\n';
+}
+
+// Filter for TransactionLog::query / TxLogFile::query. Empty fields match everything.
+struct TxQuery {
+    string symbol;
+    bool anyAction;
+    TxAction action;
+    Timestamp from; // inclusive
+    Timestamp to;   // inclusive
+    TxQuery()
+        : anyAction(true), action(TxAction::Buy), from(numeric_limits<Timestamp>::min()),
+          to(numeric_limits<Timestamp>::max()) {}
+};
+
+// Secondary indexes over a log, maintained as entries are appended. A "position"
+// is an entry number for the in-memory log and a byte offset for a .txlog file.
+// Blocks of kBlock entries carry min/max time (a sparse time index), and each
+// symbol keeps a posting list of positions in log order. While the log is in
+// time order both support binary search; otherwise queries fall back to
+// skipping blocks by their time bounds.
+class TxIndex {
+public:
+    static const size_t kBlock = 64;
+    struct Block {
+        uint64_t pos;  // position of the block's first entry
+        Timestamp minTime;
+        Timestamp maxTime;
+    };
+
+    TxIndex() : count(0), ordered(true), lastTime(numeric_limits<Timestamp>::min()) {}
+
+    void clear() {
+        blocks.clear();
+        postings.clear();
+        count = 0;
+        ordered = true;
+        lastTime = numeric_limits<Timestamp>::min();
+    }
+    size_t size() const { return count; }
+
+    void add(uint64_t pos, const TxEntry& e) {
+        if (count % kBlock == 0) blocks.push_back(Block{pos, e.time, e.time});
+        Block& b = blocks.back();
+        if (e.time < b.minTime) b.minTime = e.time;
+        if (e.time > b.maxTime) b.maxTime = e.time;
+        if (e.time < lastTime) ordered = false;
+        lastTime = e.time;
+        if (e.instrument != kNoInstrument) postings[e.instrument].push_back(pos);
+        ++count;
+    }
+
+    // Source must provide: bool read(uint64_t pos, TxEntry& e, uint64_t& next)
+    template <typename Source>
+    void query(Source& src, const TxQuery& q, vector<TxEntry>& out) const {
+        const Timestamp to = q.to;
+        TxEntry e;
+        uint64_t next;
+        if (!q.symbol.empty()) {
+            InstrumentId id = instruments().find(q.symbol);
+            auto it = id == kNoInstrument ? postings.end() : postings.find(id);
+            if (it == postings.end()) return;
+            const vector<uint64_t>& plist = it->second;
+            size_t i = 0;
+            if (ordered) { // positions rise with log order, so the first block that can hold 'from' bounds the list
+                size_t b = firstBlockEndingAfter(q.from);
+                if (b == blocks.size()) return;
+                i = (size_t)(lower_bound(plist.begin(), plist.end(), blocks[b].pos) - plist.begin());
+            }
+            for (; i < plist.size(); ++i) {
+                if (!src.read(plist[i], e, next)) break;
+                if (e.time > to) { if (ordered) break; else continue; }
+                if (e.time < q.from) continue;
+                if (q.anyAction || e.action == q.action) out.push_back(e);
+            }
+            return;
+        }
+        for (size_t b = firstBlockEndingAfter(q.from); b < blocks.size(); ++b) {
+            if (blocks[b].minTime > to) { if (ordered) break; else continue; }
+            if (blocks[b].maxTime < q.from) continue;
+            uint64_t pos = blocks[b].pos;
+            for (size_t k = 0; k < kBlock && src.read(pos, e, next); ++k, pos = next) {
+                if (e.time < q.from || e.time > to) continue;
+                if (q.anyAction || e.action == q.action) out.push_back(e);
+            }
+        }
+    }
+
+    // Balance after the latest entry stamped at or before t
+    template <typename Source>
+    bool balanceAt(Source& src, Timestamp t, double& balance) const {
+        TxEntry e;
+        uint64_t next;
+        bool found = false;
+        Timestamp best = 0;
+        size_t first = 0, last = blocks.size();
+        if (ordered) { // only the last block that starts at or before t matters
+            size_t lo = 0, hi = blocks.size();
+            while (lo < hi) {
+                size_t mid = (lo + hi) / 2;
+                if (blocks[mid].minTime <= t) lo = mid + 1;
+                else hi = mid;
+            }
+            if (lo == 0) return false;
+            first = lo - 1;
+            last = lo;
+        }
+        for (size_t i = first; i < last; ++i) {
+            if (blocks[i].minTime > t) continue;
+            uint64_t pos = blocks[i].pos;
+            for (size_t k = 0; k < kBlock && src.read(pos, e, next); ++k, pos = next) {
+                if (e.time <= t && (!found || e.time >= best)) {
+                    found = true;
+                    best = e.time;
+                    balance = e.balanceAfter;
+                }
+            }
+        }
+        return found;
+    }
+
+    // Sidecar format, native byte order, fixed-width records so load() is a few bulk copies:
+    //   header   "TXIDX3\0\0", log bytes, entries, ordered, last time, blocks, symbols
+    //   blocks   {pos, minTime, maxTime} each
+    //   symbols  {kind, symbol length, name length, postings} each, then the
+    //            symbol and name bytes and the postings as u64 positions
+    bool save(const string& fname, uint64_t logBytes) const {
+        string out(kMagic, 8);
+        uint64_t head[] = {logBytes, (uint64_t)count, ordered ? 1u : 0u, (uint64_t)lastTime,
+                           (uint64_t)blocks.size(), (uint64_t)postings.size()};
+        out.append((const char*)head, sizeof(head));
+        if (!blocks.empty()) out.append((const char*)&blocks[0], blocks.size() * sizeof(Block));
+        for (const auto& p : postings) {
+            const string& sym = instruments().symbol(p.first);
+            const string& nm = instruments().name(p.first);
+            uint64_t rec[] = {(uint64_t)instruments().kind(p.first), sym.size(), nm.size(), p.second.size()};
+            out.append((const char*)rec, sizeof(rec));
+            out += sym;
+            out += nm;
+            out.append((const char*)p.second.data(), p.second.size() * sizeof(uint64_t));
+        }
+        ofstream ofs(fname, ios::binary);
+        if (!ofs) return false;
+        ofs.write(out.data(), (streamsize)out.size());
+        return !ofs.fail();
+    }
+
+    // Loads a sidecar written by save(); fails if it was built for a log of another size
+    bool load(const string& fname, uint64_t logBytes) {
+        ifstream ifs(fname, ios::binary);
+        if (!ifs) return false;
+        ifs.seekg(0, ios::end);
+        string in((size_t)ifs.tellg(), '\0');
+        ifs.seekg(0);
+        if (!ifs.read(&in[0], (streamsize)in.size())) return false;
+        clear();
+        const char* p = in.data();
+        const char* end = p + in.size();
+        uint64_t head[6];
+        // TXIDX and TXIDX2 were text; a sidecar in either is rebuilt
+        if (in.size() < 8 + sizeof(head) || memcmp(p, kMagic, 8) != 0) return false;
+        memcpy(head, p + 8, sizeof(head));
+        p += 8 + sizeof(head);
+        if (head[0] != logBytes || head[4] > (uint64_t)(end - p) / sizeof(Block)) return false;
+        count = (size_t)head[1];
+        ordered = head[2] != 0;
+        lastTime = (Timestamp)head[3];
+        blocks.resize((size_t)head[4]);
+        if (!blocks.empty()) memcpy(&blocks[0], p, blocks.size() * sizeof(Block));
+        p += blocks.size() * sizeof(Block);
+        for (uint64_t s = 0; s < head[5]; ++s) {
+            uint64_t rec[4];
+            if ((size_t)(end - p) < sizeof(rec)) { clear(); return false; }
+            memcpy(rec, p, sizeof(rec));
+            p += sizeof(rec);
+            if (rec[1] + rec[2] > (uint64_t)(end - p) || rec[3] > (uint64_t)(end - p - rec[1] - rec[2]) / 8) {
+                clear();
+                return false;
+            }
+            string sym(p, (size_t)rec[1]), nm(p + rec[1], (size_t)rec[2]);
+            p += rec[1] + rec[2];
+            vector<uint64_t>& plist = postings[instruments().intern(sym, nm, (InstrumentKind)rec[0])];
+            plist.resize((size_t)rec[3]);
+            if (!plist.empty()) memcpy(&plist[0], p, plist.size() * sizeof(uint64_t));
+            p += plist.size() * sizeof(uint64_t);
+        }
+        return true;
+    }
+
+private:
+    static const char kMagic[8];
+    vector<Block> blocks;
+    unordered_map<InstrumentId, vector<uint64_t> > postings;
+    size_t count;
+    bool ordered;
+    Timestamp lastTime;
+
+    size_t firstBlockEndingAfter(Timestamp from) const {
+        if (!ordered || from == numeric_limits<Timestamp>::min()) return 0;
+        size_t lo = 0, hi = blocks.size();
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (blocks[mid].maxTime < from) lo = mid + 1;
+            else hi = mid;
+        }
+        return lo;
+    }
+};
+const char TxIndex::kMagic[8] = {'T', 'X', 'I', 'D', 'X', '3', 0, 0};
+
+class TransactionLog {
+public:
+    typedef PagedVector<TxEntry>::Snapshot Snapshot;
+private:
+    PagedVector<TxEntry> entries;
+    TxIndex index;
+
+    // TxIndex source over the in-memory entries
+    struct MemorySource {
+        const PagedVector<TxEntry>& entries;
+        bool read(uint64_t pos, TxEntry& e, uint64_t& next) const {
+            if (pos >= entries.size()) return false;
+            e = entries[pos];
+            next = pos + 1;
+            return true;
+        }
+    };
+
+    void append(const TxEntry& e) {
+        index.add(entries.size(), e);
+        entries.push_back(e);
+    }
+    void append(TxEntry&& e) {
+        index.add(entries.size(), e);
+        entries.push_back(move(e));
+    }
+public:
+    void add(TxAction action, InstrumentId instrument, InstrumentKind kind,
+             double qty, double price, double balanceAfter, uint32_t lot = kAnyLot) {
+        AllocScope scope(AllocTag::LogAppend);
+        TxEntry e;
+        e.time = clockNow();
+        e.action = action;
+        e.kind = kind;
+        e.instrument = instrument;
+        e.qty = qty;
+        e.price = price;
+        e.balanceAfter = balanceAfter;
+        e.lot = lot;
+        append(move(e));
+    }
+    // Append an entry as recorded elsewhere (journal replay, checkpoint load)
+    void add(const TxEntry& e) { append(e); }
+    const TxEntry& back() const { return entries.back(); }
+    void clear() { entries.clear(); index.clear(); }
+    void showAll() const { showPage(0, entries.size()); }
+    // Rows [offset, offset + limit) of the full listing
+    void showPage(size_t offset, size_t limit, ostream& os = cout) const {
+        if (entries.empty()) {
+            os << "No transactions yet.\n";
+            return;
+        }
+        size_t end = offset >= entries.size() ? offset : offset + min(limit, entries.size() - offset);
+        {
+            TableWriter out(os);
+            printHeader(out);
+            for (size_t i = offset; i < end; ++i) printRow(out, entries[i]);
+        }
+        keepTableFormat(os, offset < end);
+    }
+    size_t size() const { return entries.size(); }
+    // The entries logged so far; stays valid and unchanged while trading continues
+    Snapshot snapshot() const { return entries.snapshot(); }
+    static void printHeader(TableWriter& out) {
+        out.cell("Time", 20).cell("Act", 8).cell("Type", 8).cell("Symbol", 8).cell("Name", 20)
+           .cell("Qty", 10).cell("Price", 12).cell("BalAfter", 12).put('\n');
+        out.repeat('-', 100).put('\n');
+    }
+    static void printRow(TableWriter& out, const TxEntry& e) {
+        bool cash = e.instrument == kNoInstrument;
+        char when[TimeText::kMaxLen];
+        out.cell(when, timeText().format(e.time, when), 20).cell(actionName(e.action), 8).cell(kindName(e.kind), 8);
+        if (cash) out.cell("-", 8).cell("-", 20);
+        else out.cell(instruments().symbol(e.instrument), 8).cell(instruments().name(e.instrument), 20);
+        out.money(e.qty, 10).money(e.price, 12).money(e.balanceAfter, 12).put('\n');
+    }
+
+    // Indexed lookups: O(log n + k) while entries are in time order
+    vector<TxEntry> query(const TxQuery& q) const {
+        vector<TxEntry> out;
+        MemorySource src = {entries};
+        index.query(src, q, out);
+        return out;
+    }
+    bool balanceAt(Timestamp t, double& balance) const {
+        MemorySource src = {entries};
+        return index.balanceAt(src, t, balance);
+    }
+
+    // Save transaction log to file, plus a .idx sidecar so TxLogFile can query it in place
+    bool saveToFile(const string& fname) const {
+        ofstream ofs(fname);
+        if (!ofs) return false;
+        TxIndex fileIndex;
+        uint64_t bytes = writeEntries(ofs, entries.snapshot(), fileIndex);
+        ofs.close();
+        fileIndex.save(fname + ".idx", bytes);
+        return true;
+    }
+    // Writes .txlog lines, indexing them by byte offset; returns bytes written
+    static uint64_t writeEntries(ostream& os, const Snapshot& snap, TxIndex& fileIndex,
+                                 atomic<uint64_t>* rowsDone = nullptr) {
+        for (size_t i = 0; i < snap.size(); ++i) {
+            fileIndex.add((uint64_t)os.tellp(), snap[i]);
+            writeTxLine(os, snap[i]);
+            if (rowsDone && (i & 1023) == 1023) rowsDone->fetch_add(1024, memory_order_relaxed);
+        }
+        if (rowsDone) rowsDone->fetch_add(snap.size() & 1023, memory_order_relaxed);
+        return (uint64_t)os.tellp();
+    }
+    // Load from file (appends)
+    bool loadFromFile(const string& fname) {
+        ifstream ifs(fname);
+        if (!ifs) return false;
+        string line;
+        while (getline(ifs, line)) {
+            if (line.empty()) continue;
+            TxEntry e;
+            if (!parseTxLine(line, e)) return false;
+            append(e);
+        }
+        ifs.close();
+        return true;
+    }
+};
+
+// --------------------------- Journal ---------------------------
+// Write-ahead log of every state change, one '|'-delimited line per record
+// with a log sequence number (LSN). Doubles are written with 17 significant
+// digits so replay reproduces the exact bits the live process had.
+//
+//   S|lsn|STOCK/FUND|sym|name|price|avail     listing
+//   P|lsn|sym|price                           price move
+//   V|lsn|volatility
+//   N|lsn|acct|name|cash                      new account
+//   T|lsn|acct|avail|<txlog fields>           cash movement or trade; avail is
+//                                             the instrument's supply afterwards
+//   M|lsn|acct|FIFO/LIFO                      lot method change
+//   C|lsn|sym|SPLIT/DIVIDEND|value|price|avail|time
+//                                             corporate action with the quote
+//                                             and supply afterwards; replay
+//                                             applies it to every holder
+//   D|lsn|digest                              state digest at a clean shutdown
+
+inline void appendNum(string& out, double v) {
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), "%.17g", v);
+    out.append(buf, n);
+}
+inline void appendNum(string& out, uint64_t v) {
+    char buf[24];
+    int n = snprintf(buf, sizeof(buf), "%llu", (unsigned long long)v);
+    out.append(buf, n);
+}
+
+// The .txlog line layout, written losslessly (the time as integer nanoseconds)
+void appendTxFields(string& out, const TxEntry& e) {
+    bool cash = e.instrument == kNoInstrument;
+    appendNum(out, (uint64_t)e.time); out += '|';
+    out += actionName(e.action); out += '|';
+    out += kindName(e.kind); out += '|';
+    out += cash ? string("-") : instruments().symbol(e.instrument); out += '|';
+    out += cash ? string("-") : instruments().name(e.instrument); out += '|';
+    appendNum(out, e.qty); out += '|';
+    appendNum(out, e.price); out += '|';
+    appendNum(out, e.balanceAfter);
+    if (e.lot != kAnyLot) { out += '|'; appendNum(out, (uint64_t)e.lot); }
+}
+
+// Walks the fields of one line in place. Numbers are parsed straight out of the
+// buffer, which is safe because every line ends in '|' or '\n'.
+class FieldReader {
+private:
+    const char* p;
+    const char* end;
+    bool done;
+public:
+    bool bad;
+    FieldReader(const char* b, const char* e) : p(b), end(e), done(false), bad(false) {}
+    bool more() const { return !done; }
+    bool next(const char*& f, size_t& n) {
+        if (done) { bad = true; return false; }
+        const char* bar = static_cast<const char*>(memchr(p, '|', end - p));
+        if (!bar) { bar = end; done = true; }
+        f = p;
+        n = bar - p;
+        p = bar + 1;
+        return true;
+    }
+    string str() {
+        const char* f; size_t n;
+        return next(f, n) ? string(f, n) : string();
+    }
+    // from_chars rounds exactly as strtod does at a fraction of the cost; strtod
+    // still takes anything it does not read whole (leading blanks, a '+')
+    double num() {
+        const char* f; size_t n;
+        if (!next(f, n)) return 0.0;
+#ifdef __cpp_lib_to_chars
+        double v;
+        from_chars_result r = from_chars(f, f + n, v);
+        if (r.ec == errc() && r.ptr == f + n) return v;
+#endif
+        return strtod(f, nullptr);
+    }
+    uint64_t u64() {
+        const char* f; size_t n;
+        if (!next(f, n)) return 0;
+        uint64_t v = 0;
+        size_t i = 0;
+        for (; i < n && i < 19 && (unsigned)(f[i] - '0') < 10; ++i) v = v * 10 + (unsigned)(f[i] - '0');
+        return i == n ? v : strtoull(f, nullptr, 10);
+    }
+};
+
+// Per-thread symbol -> id cache so parallel parsers rarely touch the shared table
+class SymbolCache {
+private:
+    unordered_map<string, InstrumentId> ids;
+    string key;
+public:
+    InstrumentId resolve(const string& sym, const string& name, InstrumentKind kind) {
+        auto it = ids.find(sym);
+        if (it == ids.end()) it = ids.emplace(sym, instruments().intern(sym, name, kind)).first;
+        return it->second;
+    }
+    // Same, straight from the buffer; the name is only copied on a miss
+    InstrumentId resolve(const char* sym, size_t symLen, const char* name, size_t nameLen, InstrumentKind kind) {
+        key.assign(sym, symLen);
+        auto it = ids.find(key);
+        if (it == ids.end()) it = ids.emplace(key, instruments().intern(key, string(name, nameLen), kind)).first;
+        return it->second;
+    }
+};
+
+// The time is nanoseconds in the journal and local-time text in a .txlog
+bool parseTxFields(FieldReader& r, TxEntry& e, SymbolCache& syms) {
+    const char* when;
+    size_t whenLen;
+    if (!r.next(when, whenLen)) return false;
+    if (whenLen > 4 && when[4] == '-') {
+        if (!timeText().parse(when, whenLen, e.time)) return false;
+    } else {
+        e.time = (Timestamp)strtoull(when, nullptr, 10);
+    }
+    if (!parseAction(r.str(), e.action)) return false;
+    e.kind = parseKind(r.str());
+    const char *sym, *nm;
+    size_t symLen, nmLen;
+    if (!r.next(sym, symLen) || !r.next(nm, nmLen)) return false;
+    e.instrument = symLen == 1 && *sym == '-' ? kNoInstrument : syms.resolve(sym, symLen, nm, nmLen, e.kind);
+    e.qty = r.num();
+    e.price = r.num();
+    e.balanceAfter = r.num();
+    e.lot = r.more() ? (uint32_t)r.u64() : kAnyLot;
+    return !r.bad;
+}
+
+// Queries a .txlog on disk without loading it: only the index is kept in
+// memory, and matching lines are read by seeking to their offsets. Lines read
+// back to back (a block scan, a run of postings) share one seek.
+class TxLogFile {
+private:
+    string path;
+    ifstream ifs;
+    TxIndex index;
+    SymbolCache syms;
+    string line;      // scratch
+    uint64_t cursor;  // offset the stream is at, or UINT64_MAX after a seek is needed
+
+    bool parse(TxEntry& e) {
+        FieldReader r(line.data(), line.data() + line.size());
+        return parseTxFields(r, e, syms);
+    }
+public:
+    TxLogFile() : cursor(UINT64_MAX) {}
+
+    // Uses the .idx sidecar when it matches the log; otherwise indexes the file in one streaming pass
+    bool open(const string& fname) {
+        path = fname;
+        ifs.close();
+        ifs.clear();
+        cursor = UINT64_MAX;
+        ifs.open(fname, ios::binary);
+        if (!ifs) return false;
+        ifs.seekg(0, ios::end);
+        uint64_t bytes = (uint64_t)ifs.tellg();
+        ifs.seekg(0);
+        if (index.load(fname + ".idx", bytes)) return true;
+        index.clear();
+        uint64_t pos = 0;
+        while (getline(ifs, line)) {
+            TxEntry e;
+            if (!line.empty()) {
+                if (!parse(e)) {
+                    cout << "Error parsing transaction log " << fname << " at byte " << pos << ".\n";
+                    return false;
+                }
+                index.add(pos, e);
+            }
+            pos += line.size() + 1;
+        }
+        ifs.clear();
+        index.save(fname + ".idx", bytes);
+        return true;
+    }
+    size_t size() const { return index.size(); }
+
+    bool read(uint64_t pos, TxEntry& e, uint64_t& next) {
+        if (pos != cursor) {
+            ifs.clear();
+            ifs.seekg((streamoff)pos);
+        }
+        while (getline(ifs, line)) {
+            pos += line.size() + 1;
+            if (!line.empty()) {
+                cursor = ifs.eof() ? UINT64_MAX : pos;
+                next = pos;
+                return parse(e);
+            }
+        }
+        cursor = UINT64_MAX;
+        return false;
+    }
+    vector<TxEntry> query(const TxQuery& q) {
+        vector<TxEntry> out;
+        index.query(*this, q, out);
+        return out;
+    }
+    bool balanceAt(Timestamp t, double& balance) {
+        return index.balanceAt(*this, t, balance);
+    }
+};
+
+// FNV-1a over exact bit patterns, for the recovery determinism check
+class StateDigest {
+private:
+    uint64_t h;
+public:
+    StateDigest() : h(1469598103934665603ull) {}
+    void add(const void* p, size_t n) {
+        const unsigned char* b = static_cast<const unsigned char*>(p);
+        for (size_t i = 0; i < n; ++i) { h ^= b[i]; h *= 1099511628211ull; }
+    }
+    void add(double v) { add(&v, sizeof(v)); }
+    void add(uint64_t v) { add(&v, sizeof(v)); }
+    void add(const string& s) { add(s.data(), s.size()); add((uint64_t)s.size()); }
+    uint64_t value() const { return h; }
+};
+
+class Journal {
+private:
+    mutex mtx;
+    FILE* fp;
+    string prefix;
+    uint64_t lsn;        // last LSN handed out
+    uint64_t segStart;   // first LSN of the open segment
+    bool durable;        // fsync on commit (off for benchmarks)
+    string line;         // scratch, guarded by mtx
+
+    void begin(char type) {
+        line.clear();
+        line += type;
+        line += '|';
+        appendNum(line, ++lsn);
+    }
+    void field(const string& s) { line += '|'; line += s; }
+    void field(double v) { line += '|'; appendNum(line, v); }
+    void field(uint64_t v) { line += '|'; appendNum(line, v); }
+    void end() {
+        line += '\n';
+        if (fp) fwrite(line.data(), 1, line.size(), fp);
+    }
+    Journal(const Journal&);
+    Journal& operator=(const Journal&);
+public:
+    Journal() : fp(nullptr), lsn(0), segStart(1), durable(true) {}
+    ~Journal() { close(); }
+
+    static string segmentName(const string& prefix, uint64_t start) {
+        return prefix + ".journal." + to_string(start);
+    }
+
+    // Start a fresh segment whose first record will be nextLsn
+    bool open(const string& p, uint64_t nextLsn, bool syncOnCommit = true) {
+        lock_guard<mutex> lk(mtx);
+        if (fp) fclose(fp);
+        prefix = p;
+        lsn = nextLsn - 1;
+        segStart = nextLsn;
+        durable = syncOnCommit;
+        fp = fopen(segmentName(prefix, segStart).c_str(), "wb");
+        if (fp) setvbuf(fp, nullptr, _IOFBF, 1 << 20);
+        return fp != nullptr;
+    }
+    void close() {
+        lock_guard<mutex> lk(mtx);
+        if (fp) fclose(fp);
+        fp = nullptr;
+    }
+    bool isOpen() const { return fp != nullptr; }
+    uint64_t lastLsn() {
+        lock_guard<mutex> lk(mtx);
+        return lsn;
+    }
+    uint64_t segmentStart() {
+        lock_guard<mutex> lk(mtx);
+        return segStart;
+    }
+
+    // Make everything appended so far survive a crash (group commit)
+    bool commit() {
+        lock_guard<mutex> lk(mtx);
+        if (!fp) return false;
+        if (fflush(fp) != 0) return false;
+        if (!durable) return true;
+#ifdef _WIN32
+        return _commit(_fileno(fp)) == 0;
+#else
+        return fsync(fileno(fp)) == 0;
+#endif
+    }
+
+    // A bond's record carries its terms after the supply
+    void logListing(InstrumentKind kind, const string& sym, const string& name, double price, double avail,
+                    const BondTerms* terms = nullptr) {
+        lock_guard<mutex> lk(mtx);
+        begin('S');
+        field(string(kind == InstrumentKind::Stock ? "STOCK" : kind == InstrumentKind::Bond ? "BOND" : "FUND"));
+        field(sym); field(name); field(price); field(avail);
+        if (terms) {
+            field(terms->coupon); field((uint64_t)terms->frequency); field(terms->maturity); field(terms->face);
+        }
+        end();
+    }
+    void logPrice(const string& sym, double price) {
+        lock_guard<mutex> lk(mtx);
+        begin('P');
+        field(sym); field(price);
+        end();
+    }
+    void logVolatility(double v) {
+        lock_guard<mutex> lk(mtx);
+        begin('V');
+        field(v);
+        end();
+    }
+    // Returns the record's LSN, which identifies the action to its holders
+    uint64_t logCorporateAction(const string& sym, CorporateActionKind kind, double value, double price, double avail,
+                                Timestamp at) {
+        lock_guard<mutex> lk(mtx);
+        begin('C');
+        field(sym); field(string(corporateActionName(kind))); field(value); field(price); field(avail);
+        field((uint64_t)at);
+        end();
+        return lsn;
+    }
+    void logAccount(uint32_t acct, const string& name, double cash) {
+        lock_guard<mutex> lk(mtx);
+        begin('N');
+        field((uint64_t)acct); field(name); field(cash);
+        end();
+    }
+    void logTx(uint32_t acct, const TxEntry& e, double avail) {
+        lock_guard<mutex> lk(mtx);
+        begin('T');
+        field((uint64_t)acct); field(avail);
+        line += '|';
+        appendTxFields(line, e);
+        end();
+    }
+    void logLotMethod(uint32_t acct, LotMethod m) {
+        lock_guard<mutex> lk(mtx);
+        begin('M');
+        field((uint64_t)acct); field(string(lotMethodName(m)));
+        end();
+    }
+    void logDigest(uint64_t d) {
+        lock_guard<mutex> lk(mtx);
+        begin('D');
+        field(d);
+        end();
+    }
+};
+
+// --------------------------- Tick history ---------------------------
+// Every price a tick produced, in tick order, for export and analysis.
+struct TickRow {
+    uint64_t tick;           // market version the price was published in
+    Timestamp timeNs;        // EventClock nanoseconds since the Unix epoch
+    InstrumentId instrument;
+    double price;
+};
+
+class TickHistory {
+private:
+    PagedVector<TickRow> rows;
+public:
+    typedef PagedVector<TickRow>::Snapshot Snapshot;
+    // Append one row per listed instrument of a freshly published version
+    void record(const MarketVersion& v) { record(v, clockNow()); }
+    // Same, stamped `at`; with `due`, only the instruments that ticked
+    void record(const MarketVersion& v, Timestamp at, const vector<unsigned char>* due = nullptr) {
+        for (InstrumentId id : v.catalog->listed) {
+            if (due && (id >= due->size() || !(*due)[id])) continue;
+            TickRow r = {v.seq, at, id, v.price[id]};
+            rows.push_back(r);
+        }
+    }
+    size_t size() const { return rows.size(); }
+    void clear() { rows.clear(); }
+    // Rows recorded so far; stays valid while ticks continue (on the writer thread)
+    Snapshot snapshot() const { return rows.snapshot(); }
+};
+
+// Per-instrument technical indicators, advanced once per tick
+class MarketIndicators {
+public:
+    static const int kRsiPeriod = 14;
+    static const int kEmaPeriod = 20;
+
+    // Columns by instrument id; NaN until an instrument has enough ticks
+    vector<double> rsi;    // Wilder's 14-tick relative strength index, 0-100
+    vector<double> change; // percent move on the last tick
+    vector<double> ema;    // 20-tick exponential moving average of the price
+
+    // With `due`, only the instruments that ticked take a sample
+    void update(const MarketVersion& v, const vector<unsigned char>* due = nullptr) {
+        size_t n = v.price.size();
+        if (rsi.size() < n) {
+            const double nan = numeric_limits<double>::quiet_NaN();
+            rsi.resize(n, nan);
+            change.resize(n, nan);
+            ema.resize(n, nan);
+            last.resize(n, 0.0);
+            avgGain.resize(n, 0.0);
+            avgLoss.resize(n, 0.0);
+            samples.resize(n, 0);
+        }
+        const double k = 2.0 / (kEmaPeriod + 1);
+        for (InstrumentId id : v.catalog->listed) {
+            if (due && (id >= due->size() || !(*due)[id])) continue;
+            double p = v.price[id];
+            if (samples[id] == 0) {
+                ema[id] = p;
+            } else {
+                double d = p - last[id];
+                double gain = d > 0 ? d : 0.0, loss = d < 0 ? -d : 0.0;
+                change[id] = last[id] != 0.0 ? 100.0 * d / last[id] : 0.0;
+                ema[id] += k * (p - ema[id]);
+                if (samples[id] <= (uint32_t)kRsiPeriod) { // seed with a simple average
+                    avgGain[id] += gain / kRsiPeriod;
+                    avgLoss[id] += loss / kRsiPeriod;
+                } else {
+                    avgGain[id] = (avgGain[id] * (kRsiPeriod - 1) + gain) / kRsiPeriod;
+                    avgLoss[id] = (avgLoss[id] * (kRsiPeriod - 1) + loss) / kRsiPeriod;
+                }
+                if (samples[id] >= (uint32_t)kRsiPeriod)
+                    rsi[id] = avgLoss[id] == 0.0 ? 100.0 : 100.0 - 100.0 / (1.0 + avgGain[id] / avgLoss[id]);
+            }
+            last[id] = p;
+            ++samples[id];
+        }
+    }
+    void clear() { *this = MarketIndicators(); }
+
+private:
+    vector<double> last, avgGain, avgLoss;
+    vector<uint32_t> samples;
+};
+
+// --------------------------- Shared price table ---------------------------
+// The market's prices and NAVs in a named shared-memory segment (shm_open),
+// for risk tools and dashboards in other processes. There is one writer, the
+// market (on every publish, under its writer lock), and any number of
+// read-only mappings. Each row carries its own seqlock: the writer makes the
+// sequence odd, stores the fields and makes it even again, and a reader keeps
+// the fields only if it saw the same even sequence before and after. Reads
+// take no lock and make no syscall. Layout (native byte order):
+//
+//   header, 64 bytes: "SMPRICE1", u32 layout version, u32 row bytes,
+//                     u64 capacity, u64 rows in use, u64 generation (publishes
+//                     that changed a row), i64 time of the last change
+//   capacity rows of 64 bytes: u64 sequence, price, available (doubles),
+//                     i64 time of the row's last change, u8 kind, symbol
+//                     (NUL padded; written once, before the row is counted)
+struct PriceTableHeader {
+    char magic[8];
+    uint32_t layout;
+    uint32_t rowBytes;
+    uint64_t capacity;
+    atomic<uint64_t> rows;
+    atomic<uint64_t> generation;
+    atomic<int64_t> updated;
+    char pad[16];
+};
+
+struct alignas(64) PriceTableRow {
+    atomic<uint64_t> seq;       // odd while the writer is in the row
+    atomic<uint64_t> price;     // bits of the double
+    atomic<uint64_t> available; // bits of the double
+    atomic<int64_t> at;
+    unsigned char kind;
+    char symbol[31];
+};
+static_assert(sizeof(PriceTableHeader) == 64 && sizeof(PriceTableRow) == 64, "price table layout");
+
+namespace pricetable {
+const char kMagic[8] = {'S', 'M', 'P', 'R', 'I', 'C', 'E', '1'};
+const uint32_t kLayout = 1;
+
+inline uint64_t bits(double d) {
+    uint64_t u;
+    memcpy(&u, &d, 8);
+    return u;
+}
+inline double value(uint64_t u) {
+    double d;
+    memcpy(&d, &u, 8);
+    return d;
+}
+} // namespace pricetable
+
+// Writer side; owns the segment and removes the name when closed.
+class SharedPriceTable {
+private:
+    string name;
+    void* base;
+    size_t bytes;
+    PriceTableHeader* header;
+    PriceTableRow* rows;
+    vector<int64_t> rowOf;     // row by instrument id, -1 = none yet
+    vector<double> lastPrice;  // what each row holds, so unchanged rows are not touched
+    vector<double> lastAvail;
+    uint64_t writes;
+    size_t skipped;            // listed instruments that found no room (or too long a symbol)
+    uint64_t inode;            // the segment's identity, so close() never unlinks a successor's
+
+    SharedPriceTable(const SharedPriceTable&);
+    SharedPriceTable& operator=(const SharedPriceTable&);
+public:
+    SharedPriceTable() : base(nullptr), bytes(0), header(nullptr), rows(nullptr), writes(0), skipped(0), inode(0) {}
+    ~SharedPriceTable() { close(); }
+
+    // Create the segment, e.g. "/sharemarket-prices", with room for `capacity`
+    // instruments. Fails with errno EEXIST if the name is taken, since another
+    // publisher and its readers may still be mapped to it; takeOver unlinks the
+    // old name first, leaving those mappings to the old segment.
+    bool create(const string& segment, size_t capacity = 65536, bool takeOver = false) {
+        close();
+        if (capacity == 0) return false;
+#ifdef _WIN32
+        (void)segment;
+        return false;
+#else
+        size_t size = sizeof(PriceTableHeader) + capacity * sizeof(PriceTableRow);
+        if (takeOver) shm_unlink(segment.c_str());
+        int fd = shm_open(segment.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+        if (fd < 0) return false;
+        void* p = MAP_FAILED;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && ftruncate(fd, (off_t)size) == 0)
+            p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) {
+            shm_unlink(segment.c_str());
+            return false;
+        }
+        name = segment;
+        inode = (uint64_t)st.st_ino;
+        base = p;
+        bytes = size;
+        // the segment comes zero-filled, which is every row at sequence 0
+        header = new (base) PriceTableHeader();
+        rows = reinterpret_cast<PriceTableRow*>(static_cast<char*>(base) + sizeof(PriceTableHeader));
+        header->layout = pricetable::kLayout;
+        header->rowBytes = sizeof(PriceTableRow);
+        header->capacity = capacity;
+        header->rows.store(0);
+        header->generation.store(0);
+        header->updated.store(0);
+        // readers check the magic last
+        atomic_thread_fence(memory_order_release);
+        memcpy(header->magic, pricetable::kMagic, 8);
+        return true;
+#endif
+    }
+
+    void close() {
+        if (!base) return;
+#ifndef _WIN32
+        munmap(base, bytes);
+        // after a takeover the name belongs to the new segment; leave it be
+        int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        struct stat st;
+        if (fd >= 0 && fstat(fd, &st) == 0 && (uint64_t)st.st_ino == inode) shm_unlink(name.c_str());
+        if (fd >= 0) ::close(fd);
+#endif
+        base = nullptr;
+        header = nullptr;
+        rows = nullptr;
+        rowOf.clear();
+        lastPrice.clear();
+        lastAvail.clear();
+        name.clear();
+    }
+
+    bool isOpen() const { return base != nullptr; }
+    const string& getName() const { return name; }
+    size_t size() const { return header ? (size_t)header->rows.load() : 0; }
+    uint64_t rowWrites() const { return writes; }
+    size_t unpublished() const { return skipped; }
+
+    // Set one instrument's row, adding it on first sight. False when it does not fit.
+    bool put(InstrumentId id, InstrumentKind kind, double price, double available, Timestamp at) {
+        if (!header) return false;
+        if (id >= rowOf.size()) {
+            rowOf.resize(id + 1, -1);
+            lastPrice.resize(id + 1, 0.0);
+            lastAvail.resize(id + 1, 0.0);
+        }
+        if (rowOf[id] < 0) {
+            uint64_t n = header->rows.load(memory_order_relaxed);
+            const string& sym = instruments().symbol(id);
+            if (n == header->capacity || sym.size() >= sizeof(rows[n].symbol)) {
+                ++skipped;
+                rowOf[id] = -2; // never retried
+                return false;
+            }
+            PriceTableRow& r = rows[n];
+            memcpy(r.symbol, sym.data(), sym.size());
+            r.kind = (unsigned char)kind;
+            rowOf[id] = (int64_t)n;
+        } else if (rowOf[id] == -2) {
+            return false;
+        }
+        PriceTableRow& r = rows[rowOf[id]];
+        uint64_t s = r.seq.load(memory_order_relaxed);
+        r.seq.store(s + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        r.price.store(pricetable::bits(price), memory_order_relaxed);
+        r.available.store(pricetable::bits(available), memory_order_relaxed);
+        r.at.store(at, memory_order_relaxed);
+        r.seq.store(s + 2, memory_order_release);
+        if (s == 0) header->rows.store((uint64_t)rowOf[id] + 1, memory_order_release); // new row is complete
+        lastPrice[id] = price;
+        lastAvail[id] = available;
+        ++writes;
+        return true;
+    }
+
+    // Bring the rows of ids[0..n) up to date with v
+    void update(const MarketVersion& v, const InstrumentId* ids, size_t n) {
+        if (!header) return;
+        Timestamp at = 0;
+        for (size_t i = 0; i < n; ++i) {
+            InstrumentId id = ids[i];
+            if (!v.lists(id) || (id < rowOf.size() && rowOf[id] == -2)) continue;
+            if (at == 0) at = clockNow();
+            put(id, v.catalog->kind[id], v.price[id], v.available[id], at);
+        }
+        if (at) {
+            header->updated.store(at, memory_order_relaxed);
+            header->generation.fetch_add(1, memory_order_release);
+        }
+    }
+    // Bring the rows up to date with v; only instruments whose price or
+    // supply changed are written
+    void update(const MarketVersion& v) {
+        if (!header) return;
+        Timestamp at = 0;
+        for (InstrumentId id : v.catalog->listed) {
+            bool known = id < rowOf.size() && rowOf[id] >= 0;
+            if (known && lastPrice[id] == v.price[id] && lastAvail[id] == v.available[id]) continue;
+            if (id < rowOf.size() && rowOf[id] == -2) continue;
+            if (at == 0) at = clockNow();
+            put(id, v.catalog->kind[id], v.price[id], v.available[id], at);
+        }
+        if (at) {
+            header->updated.store(at, memory_order_relaxed);
+            header->generation.fetch_add(1, memory_order_release);
+        }
+    }
+};
+
+// One row as a reader saw it
+struct PriceQuote {
+    string symbol;
+    InstrumentKind kind;
+    double price;       // NAV for funds
+    double available;
+    Timestamp at;       // when the row last changed
+    PriceQuote() : kind(InstrumentKind::None), price(0.0), available(0.0), at(0) {}
+};
+
+// Read-only client of a SharedPriceTable, for use from any process. Rows never
+// move, so a caller looks a symbol up once and keeps the row number.
+class PriceTableReader {
+private:
+    const void* base;
+    size_t bytes;
+    const PriceTableHeader* header;
+    const PriceTableRow* rows;
+    mutable uint64_t retried; // reads that had to start again
+
+    PriceTableReader(const PriceTableReader&);
+    PriceTableReader& operator=(const PriceTableReader&);
+public:
+    PriceTableReader() : base(nullptr), bytes(0), header(nullptr), rows(nullptr), retried(0) {}
+    ~PriceTableReader() { close(); }
+
+    bool open(const string& segment) {
+        close();
+#ifdef _WIN32
+        (void)segment;
+        return false;
+#else
+        int fd = shm_open(segment.c_str(), O_RDONLY, 0);
+        if (fd < 0) return false;
+        struct stat st;
+        void* p = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(PriceTableHeader))
+            p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) return false;
+        base = p;
+        bytes = (size_t)st.st_size;
+        header = static_cast<const PriceTableHeader*>(base);
+        rows = reinterpret_cast<const PriceTableRow*>(static_cast<const char*>(base) + sizeof(PriceTableHeader));
+        if (memcmp(header->magic, pricetable::kMagic, 8) != 0 || header->layout != pricetable::kLayout ||
+            header->rowBytes != sizeof(PriceTableRow) ||
+            sizeof(PriceTableHeader) + header->capacity * sizeof(PriceTableRow) > bytes) {
+            close();
+            return false;
+        }
+        atomic_thread_fence(memory_order_acquire);
+        return true;
+#endif
+    }
+
+    void close() {
+#ifndef _WIN32
+        if (base) munmap(const_cast<void*>(base), bytes);
+#endif
+        base = nullptr;
+        header = nullptr;
+        rows = nullptr;
+    }
+
+    bool isOpen() const { return base != nullptr; }
+    size_t size() const { return header ? (size_t)header->rows.load(memory_order_acquire) : 0; }
+    // Bumped by every publish that changed a row; unchanged means nothing to re-read
+    uint64_t generation() const { return header ? header->generation.load(memory_order_acquire) : 0; }
+    uint64_t retries() const { return retried; }
+
+    // Row of a symbol, or -1
+    long find(const string& symbol) const {
+        size_t n = size();
+        for (size_t i = 0; i < n; ++i)
+            if (strncmp(rows[i].symbol, symbol.c_str(), sizeof(rows[i].symbol)) == 0) return (long)i;
+        return -1;
+    }
+
+    // Consistent price and supply of one row. False for a row not in use, or
+    // when the row stayed mid-write (a writer that died there).
+    bool read(size_t row, double& price, double& available, Timestamp* at = nullptr) const {
+        if (row >= size()) return false;
+        const PriceTableRow& r = rows[row];
+        for (unsigned spins = 0; spins < (1u << 20); ++spins) {
+            uint64_t s = r.seq.load(memory_order_acquire);
+            if (s & 1) {
+                ++retried;
+                if (spins > 64) this_thread::yield();
+                continue;
+            }
+            uint64_t p = r.price.load(memory_order_relaxed);
+            uint64_t a = r.available.load(memory_order_relaxed);
+            int64_t t = r.at.load(memory_order_relaxed);
+            atomic_thread_fence(memory_order_acquire);
+            if (r.seq.load(memory_order_relaxed) == s) {
+                price = pricetable::value(p);
+                available = pricetable::value(a);
+                if (at) *at = t;
+                return true;
+            }
+            ++retried;
+        }
+        return false;
+    }
+    bool read(size_t row, PriceQuote& q) const {
+        if (!read(row, q.price, q.available, &q.at)) return false;
+        const PriceTableRow& r = rows[row];
+        q.symbol.assign(r.symbol, strnlen(r.symbol, sizeof(r.symbol)));
+        q.kind = (InstrumentKind)r.kind;
+        return true;
+    }
+    // Every row in use
+    size_t readAll(vector<PriceQuote>& out) const {
+        size_t n = size();
+        out.resize(n);
+        size_t ok = 0;
+        for (size_t i = 0; i < n; ++i)
+            if (read(i, out[ok])) ++ok;
+        out.resize(ok);
+        return ok;
+    }
+};
+
+// What another process sees: the named symbols (all rows when none) as they
+// are in the segment now
+int runPriceReader(const string& segment, const vector<string>& symbols) {
+    PriceTableReader reader;
+    if (!reader.open(segment.empty() || segment[0] == '/' ? segment : "/" + segment)) {
+        cout << "No price table at " << segment << ".\n";
+        return 1;
+    }
+    vector<PriceQuote> quotes;
+    int missing = 0;
+    if (symbols.empty()) {
+        reader.readAll(quotes);
+    } else {
+        for (const string& sym : symbols) {
+            PriceQuote q;
+            long row = reader.find(sym);
+            if (row < 0 || !reader.read((size_t)row, q)) {
+                cout << sym << ": not published.\n";
+                ++missing;
+                continue;
+            }
+            quotes.push_back(q);
+        }
+    }
+    ios::fmtflags flags = cout.flags();
+    streamsize prec = cout.precision();
+    cout << fixed << setprecision(2);
+    for (const PriceQuote& q : quotes) {
+        cout << left << setw(6) << q.symbol << " | " << setw(10) << kindName(q.kind) << right
+             << (q.kind == InstrumentKind::MutualFund ? " | NAV: " : " | Price: ") << setw(9) << q.price
+             << " | Available: " << q.available << " | " << formatTime(q.at) << "\n";
+    }
+    cout << reader.size() << " rows, generation " << reader.generation() << "\n";
+    cout.flags(flags);
+    cout.precision(prec);
+    return missing ? 1 : 0;
+}
+
+// --------------------------- Price models ---------------------------
+// Stochastic models for one tick of an asset class, used as policy types by
+// BasicMarket. Each advances a contiguous price column (and its per-instrument
+// state) in one call that the compiler inlines into the market's tick loop.
+// `vol` is the market volatility, the per-tick standard deviation of returns
+// before the model's own scaling. A model asks for kNormals standard normals
+// and kUniforms uniforms per instrument; they arrive as n-long blocks.
+// State::save/load turn a model's per-instrument state into kFields doubles
+// for checkpoints.
+
+// State of a model that keeps nothing between ticks
+struct NoModelState {
+    static const int kFields = 0;
+    void save(double*) const {}
+    void load(const double*) {}
+};
+
+// The original simulator: a uniform percentage move in [-vol, vol], capped
+// at cap times the old price plus 10 in one tick
+struct UniformWalkModel {
+    typedef NoModelState State;
+    static const int kNormals = 0, kUniforms = 1;
+    double scale;
+    double cap;
+    explicit UniformWalkModel(double volScale = 1.0, double capMultiple = 10.0) : scale(volScale), cap(capMultiple) {}
+    void step(double* px, State*, const double*, const double* u, size_t n, double vol) const {
+        const double s = vol * scale;
+        for (size_t i = 0; i < n; ++i) {
+            double p = px[i] * (1.0 + (2.0 * u[i] - 1.0) * s);
+            px[i] = min(p, px[i] * cap + 10.0);
+        }
+    }
+};
+
+// Geometric Brownian motion
+struct GbmModel {
+    typedef NoModelState State;
+    static const int kNormals = 1, kUniforms = 0;
+    double scale;
+    double drift; // per tick
+    explicit GbmModel(double volScale = 1.0, double mu = 0.0) : scale(volScale), drift(mu) {}
+    void step(double* px, State*, const double* z, const double*, size_t n, double vol) const {
+        const double s = vol * scale, m = drift - 0.5 * s * s;
+        for (size_t i = 0; i < n; ++i) px[i] *= exp(m + s * z[i]);
+    }
+};
+
+// Merton jump-diffusion: GBM plus rare lognormal gaps (news, earnings)
+struct MertonJumpModel {
+    typedef NoModelState State;
+    static const int kNormals = 2, kUniforms = 1;
+    double scale;
+    double lambda;   // jump probability per tick
+    double jumpMean; // mean log jump
+    double jumpVol;  // stdev of the log jump
+    explicit MertonJumpModel(double volScale = 1.0, double jumpsPerTick = 0.01, double mean = -0.01, double sd = 0.04)
+        : scale(volScale), lambda(jumpsPerTick), jumpMean(mean), jumpVol(sd) {}
+    void step(double* px, State*, const double* z, const double* u, size_t n, double vol) const {
+        const double s = vol * scale;
+        // compensate the jumps so the expected price change is zero
+        const double k = exp(jumpMean + 0.5 * jumpVol * jumpVol) - 1.0;
+        const double m = -0.5 * s * s - lambda * k;
+        const double* zj = z + n;
+        for (size_t i = 0; i < n; ++i) {
+            double jump = u[i] < lambda ? jumpMean + jumpVol * zj[i] : 0.0;
+            px[i] *= exp(m + s * z[i] + jump);
+        }
+    }
+};
+
+// GARCH(1,1): each instrument's variance reacts to its own last shock and
+// reverts to (vol * scale)^2, which gives volatility clustering
+struct Garch11Model {
+    struct State {
+        double var; // conditional variance for the next tick; 0 = not started
+        State() : var(0.0) {}
+        static const int kFields = 1;
+        void save(double* f) const { f[0] = var; }
+        void load(const double* f) { var = f[0] > 0.0 ? f[0] : 0.0; }
+    };
+    static const int kNormals = 1, kUniforms = 0;
+    double scale, alpha, beta;
+    explicit Garch11Model(double volScale = 1.0, double a = 0.08, double b = 0.90)
+        : scale(volScale), alpha(a), beta(b) {}
+    void step(double* px, State* st, const double* z, const double*, size_t n, double vol) const {
+        const double target = vol * scale * vol * scale;
+        const double omega = target * (1.0 - alpha - beta);
+        for (size_t i = 0; i < n; ++i) {
+            double h = st[i].var > 0.0 ? st[i].var : target;
+            double r = sqrt(h) * z[i];
+            px[i] *= exp(r - 0.5 * h);
+            st[i].var = omega + alpha * r * r + beta * h;
+        }
+    }
+};
+
+// Two-state Markov regime switching: calm and turbulent volatility levels
+struct RegimeSwitchingModel {
+    struct State {
+        unsigned char turbulent;
+        State() : turbulent(0) {}
+        static const int kFields = 1;
+        void save(double* f) const { f[0] = turbulent; }
+        void load(const double* f) { turbulent = f[0] != 0.0; }
+    };
+    static const int kNormals = 1, kUniforms = 1;
+    double scale;
+    double calm, stormy;     // volatility multiples in each regime
+    double enter, leave;     // per-tick probability of switching into / out of turbulence
+    explicit RegimeSwitchingModel(double volScale = 1.0, double calmMul = 0.7, double stormyMul = 2.5,
+                                  double pEnter = 0.02, double pLeave = 0.10)
+        : scale(volScale), calm(calmMul), stormy(stormyMul), enter(pEnter), leave(pLeave) {}
+    void step(double* px, State* st, const double* z, const double* u, size_t n, double vol) const {
+        const double sc = vol * scale * calm, ss = vol * scale * stormy;
+        for (size_t i = 0; i < n; ++i) {
+            bool t = st[i].turbulent != 0;
+            double s = t ? ss : sc;
+            px[i] *= exp(s * z[i] - 0.5 * s * s);
+            st[i].turbulent = t ? (u[i] >= leave) : (u[i] < enter);
+        }
+    }
+};
+
+// Which model each asset class ticks with. A bundle is picked at compile time:
+// g++ -DSHAREMARKET_PRICE_MODELS=JumpDiffusionPriceModels ...
+// The default is the simulator's original walk, so a plain build behaves as it always has.
+struct DefaultPriceModels {
+    typedef UniformWalkModel StockModel;
+    typedef UniformWalkModel FundModel;
+    static StockModel stockModel() { return StockModel(1.0, 10.0); }
+    static FundModel fundModel() { return FundModel(0.8, 5.0); }
+};
+
+// Jump-diffusion stocks and GBM funds
+struct JumpDiffusionPriceModels {
+    typedef MertonJumpModel StockModel;
+    typedef GbmModel FundModel;
+    static StockModel stockModel() { return StockModel(1.0); }
+    // a diversified basket moves less than single names and does not gap
+    static FundModel fundModel() { return FundModel(0.8); }
+};
+
+// Clustered stock volatility and funds that flip between calm and turbulent
+struct StressPriceModels {
+    typedef Garch11Model StockModel;
+    typedef RegimeSwitchingModel FundModel;
+    static StockModel stockModel() { return StockModel(1.0); }
+    static FundModel fundModel() { return FundModel(0.8); }
+};
+
+#ifndef SHAREMARKET_PRICE_MODELS
+#define SHAREMARKET_PRICE_MODELS DefaultPriceModels
+#endif
+
+inline void setQuote(Stock& s, double p) { s.setPrice(p); }
+inline void setQuote(MutualFund& f, double p) { f.setNAV(p); }
+
+// One asset class's model, with its instruments' prices and model state in
+// dense columns that persist between ticks, so a tick runs the kernel on them
+// in place. Slot k belongs to ids[k]; slot[id] - 1 finds it (0 = not tracked).
+// quote[k] points at the instrument in the market's map (map nodes never move)
+// and is handed each new price. A copy keeps the columns but must rebind the
+// pointers to its own map, which tick() does on first use.
+template <class Model, class T>
+class PriceColumns {
+public:
+    typedef typename Model::State State;
+    Model model;
+
+    explicit PriceColumns(const Model& m) : model(m), bound(true) {}
+    PriceColumns(const PriceColumns& o)
+        : model(o.model), ids(o.ids), slot(o.slot), price(o.price), state(o.state), quote(o.quote), bound(false) {}
+    PriceColumns& operator=(const PriceColumns& o) {
+        model = o.model;
+        ids = o.ids;
+        slot = o.slot;
+        price = o.price;
+        state = o.state;
+        quote = o.quote;
+        bound = false;
+        return *this;
+    }
+
+    // List or re-list an instrument at its current price; a re-list keeps its model state
+    void track(T& inst) {
+        InstrumentId id = inst.getId();
+        if (slot.size() <= id) slot.resize(id + 1, 0);
+        if (!slot[id]) {
+            ids.push_back(id);
+            price.push_back(0.0);
+            state.push_back(State());
+            quote.push_back(nullptr);
+            slot[id] = (uint32_t)ids.size();
+        }
+        price[slot[id] - 1] = inst.T::currentPrice();
+        quote[slot[id] - 1] = &inst;
+    }
+    // Forget every instrument (the market's map was cleared)
+    void clear() {
+        ids.clear();
+        slot.clear();
+        price.clear();
+        state.clear();
+        quote.clear();
+        bound = true;
+    }
+    // A price set outside a tick (recovery, corporate actions, shocks)
+    void setPrice(InstrumentId id, double p) {
+        if (id < slot.size() && slot[id]) price[slot[id] - 1] = p;
+    }
+    // Scatter the column into an id-indexed price column
+    void copyPrices(vector<double>& byId) const {
+        for (size_t k = 0; k < ids.size(); ++k)
+            if (ids[k] < byId.size()) byId[ids[k]] = price[k];
+    }
+
+    // Advance every tracked instrument one tick and journal the new prices.
+    // With `due`, only instruments whose due[id] is set move; each run of
+    // consecutive due slots is stepped in place.
+    void tick(map<string, T>& insts, double vol, mt19937_64& rng, Journal* journal,
+              const vector<unsigned char>* due = nullptr) {
+        if (!bound) rebind(insts);
+        size_t n = ids.size();
+        if (!due) {
+            if (n) run(0, n, vol, rng, journal);
+            return;
+        }
+        for (size_t b = 0; b < n;) {
+            if (!isDue(due, ids[b])) { ++b; continue; }
+            size_t e = b + 1;
+            while (e < n && isDue(due, ids[e])) ++e;
+            run(b, e, vol, rng, journal);
+            b = e;
+        }
+    }
+
+    // Advance a bare price column (benchmarks); `state` must hold n entries
+    void step(double* prices, State* st, size_t n, double vol, mt19937_64& rng) {
+        draw(n, rng);
+        model.step(prices, st, z.data(), u.data(), n, vol);
+    }
+
+    // Checkpoint rows "tag|symbol|field..." for every tracked instrument;
+    // nothing for a model without state
+    void writeState(ostream& os, const char* tag) const {
+        if (State::kFields == 0) return;
+        double f[State::kFields > 0 ? State::kFields : 1];
+        for (size_t k = 0; k < ids.size(); ++k) {
+            state[k].save(f);
+            os << tag << '|' << instruments().symbol(ids[k]);
+            for (int i = 0; i < State::kFields; ++i) os << '|' << f[i];
+            os << '\n';
+        }
+    }
+    // One row written by writeState, after its tag; rows for another model
+    // (a different field count) or an unlisted symbol are skipped
+    void restoreState(FieldReader& r) {
+        InstrumentId id = instruments().find(r.str());
+        double f[State::kFields > 0 ? State::kFields : 1];
+        int got = 0;
+        while (r.more() && got <= State::kFields) {
+            double x = r.num();
+            if (got < State::kFields) f[got] = x;
+            ++got;
+        }
+        if (got != State::kFields || r.bad || id == kNoInstrument || id >= slot.size() || !slot[id]) return;
+        state[slot[id] - 1].load(f);
+    }
+
+private:
+    vector<InstrumentId> ids;
+    vector<uint32_t> slot;   // by instrument id: slot + 1, 0 when not tracked
+    vector<double> price;    // by slot
+    vector<State> state;     // by slot
+    vector<T*> quote;        // by slot
+    bool bound;              // quote points into this market's map
+    vector<double> z, u;     // this tick's random draws
+
+    static bool isDue(const vector<unsigned char>* due, InstrumentId id) {
+        return !due || (id < due->size() && (*due)[id]);
+    }
+    void rebind(map<string, T>& insts) {
+        for (auto& p : insts) {
+            InstrumentId id = p.second.getId();
+            if (id < slot.size() && slot[id]) quote[slot[id] - 1] = &p.second;
+        }
+        bound = true;
+    }
+    void run(size_t b, size_t e, double vol, mt19937_64& rng, Journal* journal) {
+        draw(e - b, rng);
+        model.step(&price[b], &state[b], z.data(), u.data(), e - b, vol);
+        for (size_t k = b; k < e; ++k) {
+            if (price[k] < 0.01) price[k] = 0.01;
+            setQuote(*quote[k], price[k]);
+            if (journal) journal->logPrice(instruments().symbol(ids[k]), price[k]);
+        }
+    }
+    void draw(size_t n, mt19937_64& rng) {
+        z.resize(n * Model::kNormals);
+        u.resize(n * Model::kUniforms);
+        normal_distribution<double> normal;
+        uniform_real_distribution<double> uniform;
+        for (double& x : z) x = normal(rng);
+        for (double& x : u) x = uniform(rng);
+    }
+};
+
+// --------------------------- Market ---------------------------
+// Models is a price-model bundle (see DefaultPriceModels)
+template <class Models>
+class BasicMarket {
+private:
+    map<string, Stock> stocks;           // keyed by symbol
+    map<string, MutualFund> funds;       // keyed by symbol
+    map<string, Bond> bonds;             // keyed by symbol; priced off the yield curve, not ticked
+    double volatility; // a small factor to control price randomness
+    Versioned<MarketVersion> published;  // what readers see
+    bool catalogDirty;                   // instrument set changed since last publish
+    Journal* journal;                    // not owned; null when not journaling
+    TickHistory* history;                // not owned; null when ticks are not kept
+    MarketIndicators* indicators;        // not owned; advanced on every tick when set
+    SharedPriceTable* priceTable;        // not owned; brought up to date on every publish when set
+    // Serialises writers when several threads trade at once (trades and ticks take
+    // it; listing and loading are setup steps and do not). Copies get their own.
+    struct WriterMutex {
+        mutex m;
+        WriterMutex() {}
+        WriterMutex(const WriterMutex&) {}
+        WriterMutex& operator=(const WriterMutex&) { return *this; }
+    };
+    WriterMutex writer;
+    PriceColumns<typename Models::StockModel, Stock> stockTicks;
+    PriceColumns<typename Models::FundModel, MutualFund> fundTicks;
+    mt19937_64 rng; // draws for the price models
+public:
+    BasicMarket()
+        : volatility(0.02), catalogDirty(false), journal(nullptr), history(nullptr), indicators(nullptr), // default volatility 2%
+          priceTable(nullptr),
+          stockTicks(Models::stockModel()), fundTicks(Models::fundModel()),
+          rng((unsigned)chrono::high_resolution_clock::now().time_since_epoch().count()) {}
+
+    // Record listings and price moves from now on (null to stop)
+    void attachJournal(Journal* j) { journal = j; }
+    Journal* getJournal() const { return journal; }
+    // Keep every tick's prices in h from now on (null to stop)
+    void attachTickHistory(TickHistory* h) { history = h; }
+    // Advance ind on every tick from now on (null to stop)
+    void attachIndicators(MarketIndicators* ind) { indicators = ind; }
+    // Mirror every published version into t from now on (null to stop)
+    void attachPriceTable(SharedPriceTable* t) {
+        priceTable = t;
+        if (t) t->update(*published.get());
+    }
+
+    // Add sample data
+    void addStock(const Stock& s) {
+        AllocScope scope(AllocTag::ListInstrument);
+        stockTicks.track(stocks[s.getSymbol()] = s);
+        if (journal) journal->logListing(Stock::kind, s.getSymbol(), s.getName(), s.currentPrice(), s.getAvailable());
+        catalogDirty = true;
+        publish();
+    }
+    void addFund(const MutualFund& f) {
+        AllocScope scope(AllocTag::ListInstrument);
+        fundTicks.track(funds[f.getSymbol()] = f);
+        if (journal) journal->logListing(MutualFund::kind, f.getSymbol(), f.getName(), f.currentPrice(), f.getUnits());
+        catalogDirty = true;
+        publish();
+    }
+    void addBond(const Bond& b) {
+        AllocScope scope(AllocTag::ListInstrument);
+        bonds[b.getSymbol()] = b;
+        if (journal)
+            journal->logListing(Bond::kind, b.getSymbol(), b.getName(), b.currentPrice(), b.getAvailable(), &b.getTerms());
+        catalogDirty = true;
+        publish();
+    }
+
+    // Copy the live tables into a new immutable version and swap it in.
+    // Walks every instrument, so it is for listings, loads and batches of
+    // trades; a writer that moved a few instruments publishes just those.
+    void publish() {
+        const MarketVersion* prev = published.get();
+        MarketVersion* v = published.draft();
+        v->seq = prev->seq + 1;
+        if (catalogDirty) {
+            shared_ptr<InstrumentCatalog> cat = make_shared<InstrumentCatalog>();
+            cat->kind.assign(instruments().size(), InstrumentKind::None);
+            for (const auto& p : stocks) {
+                cat->listed.push_back(p.second.getId());
+                cat->kind[p.second.getId()] = Stock::kind;
+            }
+            for (const auto& p : funds) {
+                cat->listed.push_back(p.second.getId());
+                cat->kind[p.second.getId()] = MutualFund::kind;
+            }
+            for (const auto& p : bonds) {
+                cat->listed.push_back(p.second.getId());
+                cat->kind[p.second.getId()] = Bond::kind;
+                cat->bonds[p.second.getId()] = p.second.getTerms();
+            }
+            cat->indexListed();
+            v->catalog = cat;
+            catalogDirty = false;
+        } else {
+            v->catalog = prev->catalog;
+        }
+        size_t n = v->catalog->kind.size();
+        v->price.assign(n, 0.0);
+        v->available.assign(n, 0.0);
+        for (const auto& p : stocks) {
+            v->price[p.second.getId()] = p.second.currentPrice();
+            v->available[p.second.getId()] = p.second.getAvailable();
+        }
+        for (const auto& p : funds) {
+            v->price[p.second.getId()] = p.second.currentPrice();
+            v->available[p.second.getId()] = p.second.getUnits();
+        }
+        for (const auto& p : bonds) {
+            v->price[p.second.getId()] = p.second.currentPrice();
+            v->available[p.second.getId()] = p.second.getAvailable();
+        }
+        published.publish(v);
+        if (priceTable) priceTable->update(*v);
+    }
+    // New version that differs from the last only in ids[0..n): the previous
+    // columns are copied and those ids re-read, so a trade does not walk the market
+    void publish(const InstrumentId* ids, size_t n) {
+        if (catalogDirty) {
+            publish();
+            return;
+        }
+        MarketVersion* v = draftFromPrevious();
+        for (size_t i = 0; i < n; ++i) patchQuote(*v, ids[i]);
+        published.publish(v);
+        if (priceTable) priceTable->update(*v, ids, n);
+    }
+    void publish(InstrumentId id) { publish(&id, 1); }
+
+    // Latest published version; only valid while the caller holds an EpochGuard.
+    const MarketVersion* view() const { return published.get(); }
+
+    // Held by Investor::tryBuy/trySell for the whole trade
+    mutex& writeMutex() { return writer.m; }
+
+    // find pointers to investments (non-const)
+    Investment* findInvestment(const string& symbol) {
+        auto itS = stocks.find(symbol);
+        if (itS != stocks.end()) return &itS->second;
+        auto itF = funds.find(symbol);
+        if (itF != funds.end()) return &itF->second;
+        auto itB = bonds.find(symbol);
+        if (itB != bonds.end()) return &itB->second;
+        return nullptr;
+    }
+    Stock* findStock(const string& symbol) {
+        auto it = stocks.find(symbol);
+        if (it != stocks.end()) return &it->second;
+        return nullptr;
+    }
+    MutualFund* findFund(const string& symbol) {
+        auto it = funds.find(symbol);
+        if (it != funds.end()) return &it->second;
+        return nullptr;
+    }
+    Bond* findBond(const string& symbol) {
+        auto it = bonds.find(symbol);
+        if (it != bonds.end()) return &it->second;
+        return nullptr;
+    }
+
+    // const overloads so const Market can be queried
+    const Investment* findInvestment(const string& symbol) const {
+        auto itS = stocks.find(symbol);
+        if (itS != stocks.end()) return &itS->second;
+        auto itF = funds.find(symbol);
+        if (itF != funds.end()) return &itF->second;
+        auto itB = bonds.find(symbol);
+        if (itB != bonds.end()) return &itB->second;
+        return nullptr;
+    }
+    const Stock* findStock(const string& symbol) const {
+        auto it = stocks.find(symbol);
+        if (it != stocks.end()) return &it->second;
+        return nullptr;
+    }
+    const MutualFund* findFund(const string& symbol) const {
+        auto it = funds.find(symbol);
+        if (it != funds.end()) return &it->second;
+        return nullptr;
+    }
+    const Bond* findBond(const string& symbol) const {
+        auto it = bonds.find(symbol);
+        if (it != bonds.end()) return &it->second;
+        return nullptr;
+    }
+
+    void showMarket(ostream& os = cout) const {
+        EpochGuard guard;
+        const MarketVersion* v = view();
+        const InstrumentCatalog& cat = *v->catalog;
+        bool rows = false;
+        {
+            TableWriter out(os);
+            out.cell("\n---- AVAILABLE STOCKS ----\n");
+            out.cell("Sym", 6).cell(" | ").cell("Name", 20).cell(" | ").cell("Price | Available\n");
+            out.repeat('-', 60).put('\n');
+            for (InstrumentId id : cat.listed) {
+                if (cat.kind[id] != InstrumentKind::Stock) continue;
+                out.cell(instruments().symbol(id), 6).cell(" | ").cell(instruments().name(id), 20)
+                   .cell(" | Price: ").money(v->price[id], 9)
+                   .cell(" | Available: ").integer((int)v->available[id]).put('\n');
+                rows = true;
+            }
+            out.cell("\n---- AVAILABLE MUTUAL FUNDS ----\n");
+            for (InstrumentId id : cat.listed) {
+                if (cat.kind[id] != InstrumentKind::MutualFund) continue;
+                out.cell(instruments().symbol(id), 6).cell(" | ").cell(instruments().name(id), 20)
+                   .cell(" | NAV: ").money(v->price[id], 9)
+                   .cell(" | UnitsAvail: ").money(v->available[id], 8).put('\n');
+                rows = true;
+            }
+            if (!cat.bonds.empty()) out.cell("\n---- AVAILABLE BONDS ----\n");
+            for (InstrumentId id : cat.listed) {
+                if (cat.kind[id] != InstrumentKind::Bond) continue;
+                const BondTerms& t = cat.bonds.find(id)->second;
+                out.cell(instruments().symbol(id), 6).cell(" | ").cell(instruments().name(id), 20)
+                   .cell(" | Price: ").money(v->price[id], 9)
+                   .cell(" | Coupon%: ").money(t.coupon * 100.0, 5).cell(" | Years: ").money(t.maturity, 5)
+                   .cell(" | Available: ").integer((int)v->available[id]).put('\n');
+                rows = true;
+            }
+        }
+        keepTableFormat(os, rows);
+    }
+
+    // Simulate market movement: each asset class ticks with its own price model
+    void simulatePriceMovement() {
+        AllocScope scope(AllocTag::Tick);
+        lock_guard<mutex> lk(writer.m);
+        stockTicks.tick(stocks, volatility, rng, journal);
+        fundTicks.tick(funds, volatility, rng, journal);
+        // occasionally vary volatility a bit
+        volatility = clamp_double(volatility + rand_double(-0.002, 0.002), 0.003, 0.08);
+        if (journal) journal->logVolatility(volatility);
+        publishTick();
+        if (history) history->record(*published.get());
+        if (indicators) indicators->update(*published.get());
+    }
+    // One tick of only the instruments with due[id] set (the event scheduler's
+    // per-symbol rates), recorded in the tick history at simulated time `at`.
+    // volScale shrinks the move (and the volatility drift) for a tick that
+    // covers only part of what a whole simulatePriceMovement() stands for.
+    void simulatePriceMovement(const vector<unsigned char>& due, Timestamp at, double volScale = 1.0) {
+        AllocScope scope(AllocTag::Tick);
+        lock_guard<mutex> lk(writer.m);
+        stockTicks.tick(stocks, volatility * volScale, rng, journal, &due);
+        fundTicks.tick(funds, volatility * volScale, rng, journal, &due);
+        volatility = clamp_double(volatility + rand_double(-0.002, 0.002) * volScale, 0.003, 0.08);
+        if (journal) journal->logVolatility(volatility);
+        publishTick();
+        if (history) history->record(*published.get(), at, &due);
+        if (indicators) indicators->update(*published.get(), &due);
+    }
+
+    // Gap one quote by a log return (earnings surprises and other news)
+    bool shockPrice(InstrumentId id, double logReturn) {
+        if (id >= instruments().size()) return false;
+        const string& sym = instruments().symbol(id);
+        lock_guard<mutex> lk(writer.m);
+        Investment* inv = findInvestment(sym);
+        if (!inv) return false;
+        double p = max(0.01, inv->currentPrice() * exp(logReturn));
+        restorePrice(sym, p);
+        if (journal) journal->logPrice(sym, p);
+        publish(id);
+        return true;
+    }
+
+    // Market side of a corporate action. A split divides the quote and
+    // multiplies the supply by the ratio; a dividend comes off the quote as the
+    // instrument goes ex-dividend. Journaled as one record with the results.
+    // Holders are adjusted by CorporateActionEngine, which calls the unlocked
+    // form below.
+    bool applyCorporateAction(const CorporateAction& a, Timestamp at = clockNow()) {
+        lock_guard<mutex> lk(writer.m);
+        return corporateAction(a, at);
+    }
+    // Same with writeMutex() held by the caller. lsn gets the journal record's
+    // LSN (0 when not journaling) and priceAfter the new quote.
+    bool corporateAction(const CorporateAction& a, Timestamp at, uint64_t* lsn = nullptr, double* priceAfter = nullptr) {
+        if (a.value <= 0.0 || a.instrument >= instruments().size()) return false;
+        const string& sym = instruments().symbol(a.instrument);
+        Stock* s = findStock(sym);
+        MutualFund* f = s ? nullptr : findFund(sym);
+        if (!s && !f) return false;
+        double price = s ? s->Stock::currentPrice() : f->MutualFund::currentPrice();
+        double avail = s ? s->getAvailable() : f->getUnits();
+        if (a.kind == CorporateActionKind::Split) {
+            price /= a.value;
+            avail *= a.value;
+            if (s) avail = floor(avail + 0.5);
+        } else {
+            price = max(0.01, price - a.value);
+        }
+        restorePrice(sym, price);
+        restoreAvailable(sym, avail);
+        uint64_t id = journal ? journal->logCorporateAction(sym, a.kind, a.value, price, avail, at) : 0;
+        if (lsn) *lsn = id;
+        if (priceAfter) *priceAfter = price;
+        publish(a.instrument);
+        return true;
+    }
+
+    // Save market snapshot to file
+    bool saveSnapshot(const string& fname) const {
+        AllocScope scope(AllocTag::SaveMarket);
+        ofstream ofs(fname);
+        if (!ofs) {
+            cout << "Error: Could not open file " << fname << " for writing.\n";
+            return false;
+        }
+        EpochGuard guard;
+        writeSnapshot(ofs, *view());
+        ofs.close();
+        return true;
+    }
+    // Snapshot file body for one published version
+    static void writeSnapshot(ostream& os, const MarketVersion& v) {
+        const InstrumentCatalog& cat = *v.catalog;
+        for (InstrumentId id : cat.listed) {
+            const string& sym = instruments().symbol(id);
+            const string& nm = instruments().name(id);
+            if (cat.kind[id] == InstrumentKind::Stock) {
+                os << "STOCK|" << sym << '|' << nm << '|' << v.price[id] << '|' << (int)v.available[id] << '\n';
+            } else if (cat.kind[id] == InstrumentKind::Bond) {
+                const BondTerms& t = cat.bonds.find(id)->second;
+                os << "BOND|" << sym << '|' << nm << '|' << v.price[id] << '|' << (int)v.available[id] << '|'
+                   << t.coupon << '|' << t.frequency << '|' << t.maturity << '|' << t.face << '\n';
+            } else {
+                os << "FUND|" << sym << '|' << nm << '|' << v.price[id] << '|' << v.available[id] << '\n';
+            }
+        }
+    }
+
+    // Load market snapshot (clears existing)
+    bool loadSnapshot(const string& fname) {
+        ifstream ifs(fname);
+        if (!ifs) {
+            cout << "Error: Could not open file " << fname << " for reading.\n";
+            return false;
+        }
+        return loadSnapshot(ifs);
+    }
+    bool loadSnapshot(istream& in) {
+        AllocScope scope(AllocTag::LoadMarket);
+        stocks.clear();
+        funds.clear();
+        bonds.clear();
+        bool ok = loadRows(in);
+        stockTicks.clear();
+        fundTicks.clear();
+        for (auto& p : stocks) stockTicks.track(p.second);
+        for (auto& p : funds) fundTicks.track(p.second);
+        // publish once for the whole file, even a partial one, so readers match the live tables
+        catalogDirty = true;
+        publish();
+        return ok;
+    }
+
+    // Recovery hooks: set state recorded in a checkpoint or journal. They do not
+    // publish; the caller publishes once when it is done.
+    double getVolatility() const { return volatility; }
+    void setVolatility(double v) { volatility = v; }
+    void restorePrice(const string& sym, double price) {
+        if (Stock* s = findStock(sym)) {
+            s->setPrice(price);
+            stockTicks.setPrice(s->getId(), price);
+        } else if (MutualFund* f = findFund(sym)) {
+            f->setNAV(price);
+            fundTicks.setPrice(f->getId(), price);
+        } else if (Bond* b = findBond(sym)) {
+            b->setPrice(price);
+        }
+    }
+    // Price models' per-instrument state (GARCH variance, regimes), which the
+    // journal does not carry: STOCK|sym|field... and FUND|sym|field... rows
+    void writeModelState(ostream& os) {
+        lock_guard<mutex> lk(writer.m);
+        os.precision(17);
+        stockTicks.writeState(os, "STOCK");
+        fundTicks.writeState(os, "FUND");
+    }
+    void loadModelState(istream& in) {
+        lock_guard<mutex> lk(writer.m);
+        string line;
+        while (getline(in, line)) {
+            line += '\n';
+            FieldReader r(line.data(), line.data() + line.size() - 1);
+            string tag = r.str();
+            if (tag == "STOCK") stockTicks.restoreState(r);
+            else if (tag == "FUND") fundTicks.restoreState(r);
+        }
+    }
+    void restoreAvailable(const string& sym, double avail) {
+        if (Stock* s = findStock(sym)) s->setAvailable((int)avail);
+        else if (MutualFund* f = findFund(sym)) f->setUnits(avail);
+        else if (Bond* b = findBond(sym)) b->setAvailable((int)avail);
+    }
+
+    // New quotes for many bonds at once (a yield curve update), journaled and
+    // published together. Ids that are not listed bonds are skipped.
+    size_t setBondPrices(const InstrumentId* ids, const double* prices, size_t n) {
+        lock_guard<mutex> lk(writer.m);
+        vector<InstrumentId> set;
+        for (size_t i = 0; i < n; ++i) {
+            if (ids[i] >= instruments().size() || instruments().kind(ids[i]) != InstrumentKind::Bond) continue;
+            const string& sym = instruments().symbol(ids[i]);
+            Bond* b = findBond(sym);
+            if (!b) continue;
+            b->setPrice(prices[i]);
+            if (journal) journal->logPrice(sym, prices[i]);
+            set.push_back(ids[i]);
+        }
+        if (!set.empty()) publish(set.data(), set.size());
+        return set.size();
+    }
+
+private:
+    // Draft holding the last version's catalog and columns
+    MarketVersion* draftFromPrevious() {
+        const MarketVersion* prev = published.get();
+        MarketVersion* v = published.draft();
+        v->seq = prev->seq + 1;
+        v->catalog = prev->catalog;
+        v->price = prev->price; // a reclaimed draft keeps its capacity, so this is a copy, not an allocation
+        v->available = prev->available;
+        return v;
+    }
+    // Re-read one instrument's quote and supply into v
+    void patchQuote(MarketVersion& v, InstrumentId id) {
+        if (id >= v.price.size()) return;
+        const string& sym = instruments().symbol(id);
+        if (const Stock* s = findStock(sym)) {
+            v.price[id] = s->Stock::currentPrice();
+            v.available[id] = s->getAvailable();
+        } else if (const MutualFund* f = findFund(sym)) {
+            v.price[id] = f->MutualFund::currentPrice();
+            v.available[id] = f->getUnits();
+        } else if (const Bond* b = findBond(sym)) {
+            v.price[id] = b->Bond::currentPrice();
+            v.available[id] = b->getAvailable();
+        }
+    }
+    // After a tick: the price columns hold every ticked quote; supply and bonds are unchanged
+    void publishTick() {
+        if (catalogDirty) {
+            publish();
+            return;
+        }
+        MarketVersion* v = draftFromPrevious();
+        stockTicks.copyPrices(v->price);
+        fundTicks.copyPrices(v->price);
+        published.publish(v);
+        if (priceTable) priceTable->update(*v);
+    }
+
+    bool loadRows(istream& ifs) {
+        string line;
+        while (getline(ifs, line)) {
+            if (line.empty()) continue;
+            stringstream ss(line);
+            string type; getline(ss, type, '|');
+            if (type == "STOCK") {
+                string sym, nm, tmp;
+                double price; int avail;
+                getline(ss, sym, '|'); getline(ss, nm, '|'); getline(ss, tmp, '|'); 
+                try {
+                    price = stod(tmp);
+                } catch (const exception& e) {
+                    cout << "Error parsing price in market snapshot.\n";
+                    return false;
+                }
+                getline(ss, tmp, '\n'); 
+                try {
+                    avail = stoi(tmp);
+                } catch (const exception& e) {
+                    cout << "Error parsing available in market snapshot.\n";
+                    return false;
+                }
+                stocks[sym] = Stock(nm, sym, price, avail);
+            } else if (type == "FUND") {
+                string sym, nm, tmp;
+                double nav, units;
+                getline(ss, sym, '|'); getline(ss, nm, '|'); getline(ss, tmp, '|'); 
+                try {
+                    nav = stod(tmp);
+                } catch (const exception& e) {
+                    cout << "Error parsing NAV in market snapshot.\n";
+                    return false;
+                }
+                getline(ss, tmp, '\n'); 
+                try {
+                    units = stod(tmp);
+                } catch (const exception& e) {
+                    cout << "Error parsing units in market snapshot.\n";
+                    return false;
+                }
+                funds[sym] = MutualFund(nm, sym, nav, units);
+            } else if (type == "BOND") {
+                string sym, nm, tmp;
+                double price = 0.0;
+                int avail = 0;
+                BondTerms t;
+                getline(ss, sym, '|'); getline(ss, nm, '|');
+                try {
+                    getline(ss, tmp, '|'); price = stod(tmp);
+                    getline(ss, tmp, '|'); avail = stoi(tmp);
+                    getline(ss, tmp, '|'); t.coupon = stod(tmp);
+                    getline(ss, tmp, '|'); t.frequency = stoi(tmp);
+                    getline(ss, tmp, '|'); t.maturity = stod(tmp);
+                    getline(ss, tmp, '\n'); t.face = stod(tmp);
+                } catch (const exception& e) {
+                    cout << "Error parsing bond in market snapshot.\n";
+                    return false;
+                }
+                bonds[sym] = Bond(nm, sym, t, price, avail);
+            }
+        }
+        return true;
+    }
+};
+
+typedef BasicMarket<SHAREMARKET_PRICE_MODELS> Market;
+
+// --------------------------- Trade dispatch ---------------------------
+enum class TradeStatus : unsigned char {
+    Ok, UnknownSymbol, BadQuantity, FractionalBuy, FractionalSell,
+    SharesUnavailable, UnitsUnavailable, InsufficientCash,
+    NotHeld, NotEnoughHeld, Delisted, LotUnavailable
+};
+const int kTradeStatuses = 12;
+
+inline const char* tradeStatusMessage(TradeStatus st) {
+    switch (st) {
+        case TradeStatus::Ok: return "OK.";
+        case TradeStatus::UnknownSymbol: return "Investment symbol not found in market.";
+        case TradeStatus::BadQuantity: return "Quantity must be positive.";
+        case TradeStatus::FractionalBuy: return "Stocks must be bought in whole shares only.";
+        case TradeStatus::FractionalSell: return "You must sell whole shares for stocks.";
+        case TradeStatus::SharesUnavailable: return "Not enough shares available in market.";
+        case TradeStatus::UnitsUnavailable: return "Not enough units available in fund.";
+        case TradeStatus::InsufficientCash: return "Insufficient cash balance.";
+        case TradeStatus::NotHeld: return "You do not hold this symbol.";
+        case TradeStatus::NotEnoughHeld: return "You don't have enough quantity to sell.";
+        case TradeStatus::Delisted: return "Market no longer lists this investment; cannot sell here.";
+        case TradeStatus::LotUnavailable: return "That lot is not open or holds less than the quantity.";
+    }
+    return "Unknown trade status.";
+}
+
+// What a successful trade did
+struct TradeFill {
+    InstrumentKind kind;
+    double qty;
+    double price;
+    double amount;   // cost of a buy, proceeds of a sell
+    double realized; // P/L closed by a sell
+    TradeFill() : kind(InstrumentKind::None), qty(0.0), price(0.0), amount(0.0), realized(0.0) {}
+    TradeFill(InstrumentKind k, double q, double p, double a, double r = 0.0)
+        : kind(k), qty(q), price(p), amount(a), realized(r) {}
+};
+
+// Per-instrument trade rules, resolved at compile time. Stock and MutualFund are
+// final, so the qualified accessors below are direct (inlinable) calls.
+template <typename T> struct InstrumentTraits;
+
+template <> struct InstrumentTraits<Stock> {
+    static const bool wholeUnits = true;
+    static const TradeStatus shortSupply = TradeStatus::SharesUnavailable;
+    static double price(const Stock& s) { return s.Stock::currentPrice(); }
+    static double supply(const Stock& s) { return s.getAvailable(); }
+    static void take(Stock& s, double qty) { s.changeAvailable(-static_cast<int>(qty)); }
+    static void giveBack(Stock& s, double qty) { s.changeAvailable(static_cast<int>(qty)); }
+    static Stock* find(Market& m, const string& sym) { return m.findStock(sym); }
+};
+
+template <> struct InstrumentTraits<MutualFund> {
+    static const bool wholeUnits = false;
+    static const TradeStatus shortSupply = TradeStatus::UnitsUnavailable;
+    static double price(const MutualFund& f) { return f.MutualFund::currentPrice(); }
+    static double supply(const MutualFund& f) { return f.getUnits(); }
+    static void take(MutualFund& f, double qty) { f.changeUnits(-qty); }
+    static void giveBack(MutualFund& f, double qty) { f.changeUnits(qty); }
+    static MutualFund* find(Market& m, const string& sym) { return m.findFund(sym); }
+};
+
+template <> struct InstrumentTraits<Bond> {
+    static const bool wholeUnits = true;
+    static const TradeStatus shortSupply = TradeStatus::SharesUnavailable;
+    static double price(const Bond& b) { return b.Bond::currentPrice(); }
+    static double supply(const Bond& b) { return b.getAvailable(); }
+    static void take(Bond& b, double qty) { b.changeAvailable(-static_cast<int>(qty)); }
+    static void giveBack(Bond& b, double qty) { b.changeAvailable(static_cast<int>(qty)); }
+    static Bond* find(Market& m, const string& sym) { return m.findBond(sym); }
+};
+
+// --------------------------- Investor ---------------------------
+// Which accounts may hold each instrument, so a corporate action visits its
+// holders instead of every account. An account is added when it opens a
+// position and only dropped when an action finds it no longer holds one, so a
+// list may carry stale or repeated entries but never misses a holder.
+class HolderIndex {
+private:
+    mutable mutex mtx;
+    vector<vector<uint32_t> > byInstrument;
+public:
+    void add(InstrumentId id, uint32_t acct) {
+        lock_guard<mutex> lk(mtx);
+        if (id >= byInstrument.size()) byInstrument.resize(id + 1);
+        byInstrument[id].push_back(acct);
+    }
+    // Candidates for id, sorted and without repeats
+    vector<uint32_t> holders(InstrumentId id) const {
+        vector<uint32_t> out;
+        {
+            lock_guard<mutex> lk(mtx);
+            if (id < byInstrument.size()) out = byInstrument[id];
+        }
+        sort(out.begin(), out.end());
+        out.erase(unique(out.begin(), out.end()), out.end());
+        return out;
+    }
+    // Replace id's list with the accounts found holding it. Accounts added since
+    // `seen` entries were read are kept.
+    void prune(InstrumentId id, size_t seen, const vector<uint32_t>& live) {
+        lock_guard<mutex> lk(mtx);
+        if (id >= byInstrument.size()) return;
+        vector<uint32_t>& v = byInstrument[id];
+        vector<uint32_t> next(live);
+        if (seen < v.size()) next.insert(next.end(), v.begin() + seen, v.end());
+        v.swap(next);
+    }
+    size_t entries(InstrumentId id) const {
+        lock_guard<mutex> lk(mtx);
+        return id < byInstrument.size() ? byInstrument[id].size() : 0;
+    }
+    void clear() {
+        lock_guard<mutex> lk(mtx);
+        byInstrument.clear();
+    }
+};
+
+class Investor {
+private:
+    string name;
+    double cashBalance;
+    Portfolio portfolio; // sorted by instrument id
+    TransactionLog tlog;
+    LotBook lots; // open tax lots per holding
+    Versioned<InvestorState> published; // cash + holdings as readers see them
+    Journal* journal;  // not owned; null when not journaling
+    uint32_t account;  // this investor's number in the journal
+    HolderIndex* holderIndex; // not owned; told about each position opened
+    uint64_t lastAction; // journal LSN of the last corporate action applied here
+
+    // Log a change that has already been applied to cashBalance
+    void record(TxAction action, InstrumentId id, InstrumentKind kind, double qty, double price,
+                uint32_t lot, double availAfter) {
+        tlog.add(action, id, kind, qty, price, cashBalance, lot);
+        if (journal) journal->logTx(account, tlog.back(), availAfter);
+    }
+
+    void publishState() {
+        InvestorState* st = published.draft();
+        st->cashBalance = cashBalance;
+        st->realizedPL = lots.realizedPL();
+        st->lotMethod = lots.method;
+        st->holdings = portfolio;
+        published.publish(st);
+    }
+public:
+    Investor() : name("Unnamed"), cashBalance(0.0), journal(nullptr), account(0), holderIndex(nullptr), lastAction(0) {
+        publishState();
+    }
+    Investor(const string& n, double balance)
+        : name(n), cashBalance(balance), journal(nullptr), account(0), holderIndex(nullptr), lastAction(0) {
+        publishState();
+    }
+
+    void attachJournal(Journal* j, uint32_t acct) { journal = j; account = acct; }
+    // Register current and future positions in idx (null to stop)
+    void attachHolderIndex(HolderIndex* idx) {
+        holderIndex = idx;
+        if (idx) for (const Holding& h : portfolio) idx->add(h.id, account);
+    }
+
+    string getName() const { return name; }
+    double getBalance() const { return cashBalance; }
+    // Latest published state; only valid while the caller holds an EpochGuard.
+    const InvestorState* view() const { return published.get(); }
+
+    void deposit(double amt) {
+        AllocScope scope(AllocTag::Deposit);
+        if (amt <= 0) {
+            cout << "Deposit amount must be positive.\n";
+            return;
+        }
+        cashBalance += amt;
+        record(TxAction::Deposit, kNoInstrument, InstrumentKind::None, 0.0, 0.0, kAnyLot, 0.0);
+        publishState();
+        cout << "Deposited " << fixed << setprecision(2) << amt << ". New balance: " << cashBalance << "\n";
+    }
+    bool withdraw(double amt) {
+        AllocScope scope(AllocTag::Withdraw);
+        if (amt <= 0) {
+            cout << "Withdraw amount must be positive.\n";
+            return false;
+        }
+        if (amt > cashBalance) {
+            cout << "Insufficient balance.\n";
+            return false;
+        }
+        cashBalance -= amt;
+        record(TxAction::Withdraw, kNoInstrument, InstrumentKind::None, 0.0, 0.0, kAnyLot, 0.0);
+        publishState();
+        cout << "Withdrew " << fixed << setprecision(2) << amt << ". New balance: " << cashBalance << "\n";
+        return true;
+    }
+
+    // Buy N units of an investment
+    bool buy(Market& market, const string& symbol, double qty) {
+        TradeFill fill;
+        TradeStatus st = tryBuy(market, symbol, qty, &fill);
+        if (st != TradeStatus::Ok) {
+            cout << tradeStatusMessage(st) << "\n";
+            return false;
+        }
+        if (fill.kind == InstrumentKind::Stock)
+            cout << "Bought " << qty << " shares of " << symbol << " for " << fill.amount << ".\n";
+        else if (fill.kind == InstrumentKind::Bond)
+            cout << "Bought " << qty << " bonds of " << symbol << " for " << fill.amount << ".\n";
+        else
+            cout << "Bought " << fixed << setprecision(2) << qty << " units of " << symbol << " for " << fill.amount << ".\n";
+        return true;
+    }
+
+    // Sell N units
+    bool sell(Market& market, const string& symbol, double qty) {
+        TradeFill fill;
+        TradeStatus st = trySell(market, symbol, qty, &fill);
+        if (st != TradeStatus::Ok) {
+            cout << tradeStatusMessage(st) << "\n";
+            return false;
+        }
+        cout << "Sold " << fixed << setprecision(2) << qty << " of " << symbol << " for " << fill.amount << ".\n";
+        return true;
+    }
+
+    // Quiet trade core used by buy(): validates, applies and logs, but prints nothing.
+    // The symbol is resolved to its concrete instrument once; everything after that
+    // is specialised through InstrumentTraits.
+    TradeStatus tryBuy(Market& market, const string& symbol, double qty, TradeFill* fill = nullptr) {
+        AllocScope scope(AllocTag::Buy);
+        lock_guard<mutex> lk(market.writeMutex());
+        if (Stock* s = market.findStock(symbol)) return buyAs(market, *s, qty, fill);
+        if (MutualFund* f = market.findFund(symbol)) return buyAs(market, *f, qty, fill);
+        if (Bond* b = market.findBond(symbol)) return buyAs(market, *b, qty, fill);
+        return TradeStatus::UnknownSymbol;
+    }
+
+    // Quiet trade core used by sell(); dispatches on the holding's kind tag.
+    // lotId picks the tax lot to close first (specific-lot identification).
+    TradeStatus trySell(Market& market, const string& symbol, double qty, TradeFill* fill = nullptr,
+                        uint32_t lotId = kAnyLot) {
+        AllocScope scope(AllocTag::Sell);
+        lock_guard<mutex> lk(market.writeMutex());
+        InstrumentId id = instruments().find(symbol);
+        TradeStatus st = checkSell(id, qty, lotId);
+        if (st != TradeStatus::Ok) return st;
+        Holding* h = portfolio.find(id);
+        switch (instruments().kind(id)) {
+            case InstrumentKind::Stock: return sellAs<Stock>(market, h, qty, fill, lotId);
+            case InstrumentKind::MutualFund: return sellAs<MutualFund>(market, h, qty, fill, lotId);
+            case InstrumentKind::Bond: return sellAs<Bond>(market, h, qty, fill, lotId);
+            default: return TradeStatus::Delisted;
+        }
+    }
+
+    // What this account itself allows of a sell, before the market is asked
+    TradeStatus checkSell(InstrumentId id, double qty, uint32_t lotId = kAnyLot) const {
+        const Holding* h = id == kNoInstrument ? nullptr : portfolio.find(id);
+        if (!h) return TradeStatus::NotHeld;
+        if (qty <= 0) return TradeStatus::BadQuantity;
+        if (qty > h->quantity + 1e-9) return TradeStatus::NotEnoughHeld;
+        if (lotId != kAnyLot && lots.lotQty(id, lotId) < qty - 1e-9) return TradeStatus::LotUnavailable;
+        return TradeStatus::Ok;
+    }
+
+    // Book a fill that a market shard (ShardedMarket) already executed against
+    // its own supply. The buyer's cash went with the order as its limit, and
+    // sells are checked with checkSell() before they are sent.
+    void bookBuy(InstrumentId id, const TradeFill& f, double availAfter) {
+        settleBuy(id, f.kind, f.qty, f.price, availAfter);
+        publishState();
+    }
+    // Returns the realized P/L
+    double bookSell(InstrumentId id, const TradeFill& f, double availAfter, uint32_t lotId = kAnyLot) {
+        Holding* h = portfolio.find(id);
+        if (!h) return 0.0;
+        double realized = settleSell(h, f.kind, f.qty, f.price, lotId, availAfter);
+        publishState();
+        return realized;
+    }
+
+private:
+    template <typename T>
+    TradeStatus buyAs(Market& market, T& inst, double qty, TradeFill* fill) {
+        typedef InstrumentTraits<T> Traits;
+        if (qty <= 0) return TradeStatus::BadQuantity;
+        double price = Traits::price(inst);
+        double cost = price * qty;
+        if (Traits::wholeUnits && static_cast<int>(qty) != qty) return TradeStatus::FractionalBuy;
+        if (qty > Traits::supply(inst)) return Traits::shortSupply;
+        if (cost > cashBalance) return TradeStatus::InsufficientCash;
+        // proceed
+        Traits::take(inst, qty);
+        settleBuy(inst.getId(), T::kind, qty, price, Traits::supply(inst));
+        market.publish(inst.getId());
+        publishState();
+        if (fill) *fill = TradeFill(T::kind, qty, price, cost);
+        return TradeStatus::Ok;
+    }
+
+    template <typename T>
+    TradeStatus sellAs(Market& market, Holding* h, double qty, TradeFill* fill, uint32_t lotId) {
+        typedef InstrumentTraits<T> Traits;
+        const string& symbol = instruments().symbol(h->id);
+        T* inst = Traits::find(market, symbol);
+        if (!inst) return TradeStatus::Delisted;
+        if (Traits::wholeUnits && static_cast<int>(qty) != qty) return TradeStatus::FractionalSell;
+        double price = Traits::price(*inst);
+        double proceed = price * qty;
+        // update market availability
+        Traits::giveBack(*inst, qty);
+        double realized = settleSell(h, T::kind, qty, price, lotId, Traits::supply(*inst));
+        market.publish(inst->getId());
+        publishState();
+        if (fill) *fill = TradeFill(T::kind, qty, price, proceed, realized);
+        return TradeStatus::Ok;
+    }
+
+    // Investor side of a trade whose market side is done; availAfter is the
+    // supply left, for the journal
+    void settleBuy(InstrumentId id, InstrumentKind kind, double qty, double price, double availAfter) {
+        cashBalance -= price * qty;
+        addOrUpdateHolding(id, qty, price);
+        lots.open(id, qty, price);
+        record(TxAction::Buy, id, kind, qty, price, kAnyLot, availAfter);
+    }
+    // Returns the realized P/L; h is gone afterwards if the position closed
+    double settleSell(Holding* h, InstrumentKind kind, double qty, double price, uint32_t lotId, double availAfter) {
+        h->quantity -= qty;
+        cashBalance += price * qty;
+        double realized = lots.close(h->id, qty, price, lotId);
+        // the remaining lots are the cost basis of what is still held
+        double lotQty = lots.openQty(h->id);
+        if (lotQty > 1e-9 && fabs(lotQty - h->quantity) < 1e-6) h->avgPrice = lots.costBasis(h->id) / lotQty;
+        record(TxAction::Sell, h->id, kind, qty, price, lotId, availAfter);
+        if (h->quantity <= 1e-9) portfolio.erase(h);
+        return realized;
+    }
+
+public:
+    void addOrUpdateHolding(InstrumentId id, double qty, double price) {
+        Holding* existing = portfolio.find(id);
+        if (!existing) {
+            Holding& h = portfolio.upsert(id);
+            h.quantity = qty;
+            h.avgPrice = price;
+            if (holderIndex) holderIndex->add(id, account);
+        } else {
+            Holding& h = *existing;
+            // update average price: newAvg = (oldQty*oldAvg + qty*price) / (oldQty+qty)
+            double newQty = h.quantity + qty;
+            if (newQty > 0.0) {
+                double newAvg = (h.quantity * h.avgPrice + qty * price) / newQty;
+                h.avgPrice = newAvg;
+            }
+            h.quantity = newQty;
+        }
+    }
+
+    void displayPortfolio(const Market& market) const {
+        // Pin one investor version and one market version so the report is consistent
+        EpochGuard guard;
+        const InvestorState* st = view();
+        const MarketVersion* mv = market.view();
+        bool table = !st->holdings.empty();
+        {
+            TableWriter out(cout);
+            out.cell("\n---- ").cell(name).cell(" PORTFOLIO ----\n");
+            out.cell("Cash Balance: ").money(st->cashBalance).put('\n');
+            out.cell("Realized P/L (").cell(lotMethodName(st->lotMethod)).cell("): ").money(st->realizedPL).put('\n');
+            if (!table) {
+                out.cell("No holdings.\n");
+            } else {
+                out.cell("Sym", 8).cell("Name", 20).cell("Type", 8).cell("Qty", 10).cell("AvgPrice", 12)
+                   .cell("MktPrice", 12).cell("MktValue", 12).cell("P/L\n", 12);
+                out.repeat('-', 90).put('\n');
+                double totalValue = st->cashBalance;
+                for (const Holding* hp : st->holdings.bySymbol()) {
+                    const Holding& h = *hp;
+                    double mprice = mv->priceOf(h.id);
+                    double mvalue = h.quantity * mprice;
+                    double pl = (mprice - h.avgPrice) * h.quantity;
+                    totalValue += mvalue;
+                    out.cell(instruments().symbol(h.id), 8).cell(instruments().name(h.id), 20)
+                       .cell(kindName(instruments().kind(h.id)), 8)
+                       .money(h.quantity, 10).money(h.avgPrice, 12).money(mprice, 12).money(mvalue, 12)
+                       .money(pl, 12).put('\n');
+                }
+                out.repeat('-', 90).put('\n');
+                out.cell("Total Net Worth (cash + investments): ").money(totalValue).put('\n');
+            }
+        }
+        // the stream code set fixed for the cash line and left only for the table
+        if (table) cout << left;
+        cout << fixed << setprecision(2);
+    }
+
+    void setLotMethod(LotMethod m) {
+        lots.method = m;
+        if (journal) journal->logLotMethod(account, m);
+        publishState();
+    }
+
+    // Sell qty units out of one specific tax lot
+    bool sellLot(Market& market, const string& symbol, uint32_t lotId, double qty) {
+        TradeFill fill;
+        TradeStatus st = trySell(market, symbol, qty, &fill, lotId);
+        if (st != TradeStatus::Ok) {
+            cout << tradeStatusMessage(st) << "\n";
+            return false;
+        }
+        cout << "Sold " << fixed << setprecision(2) << qty << " of " << symbol << " from lot " << lotId
+             << " for " << fill.amount << " (realized " << fill.realized << ").\n";
+        return true;
+    }
+
+    void showLots() const {
+        cout << "\n---- " << name << " TAX LOTS (" << lotMethodName(lots.method) << ") ----\n";
+        if (lots.all().empty()) {
+            cout << "No open lots.\n";
+        } else {
+            cout << left << setw(8) << "Sym" << setw(8) << "Lot" << setw(12) << "Qty" << setw(12) << "Cost" << "\n";
+            cout << string(40, '-') << "\n";
+            for (const auto& b : lots.all()) {
+                for (uint32_t i = 0; i < b.second.size(); ++i) {
+                    const Lot& l = b.second[i];
+                    cout << setw(8) << instruments().symbol(b.first) << setw(8) << l.id
+                         << setw(12) << fixed << setprecision(2) << l.qty << setw(12) << l.price << "\n";
+                }
+            }
+        }
+        cout << "Realized P/L: " << fixed << setprecision(2) << lots.realizedPL() << "\n";
+    }
+
+    // Rebuild tax lots from a saved .txlog, then make sure they agree with the
+    // saved holdings; holdings the log cannot explain become a single lot.
+    void rebuildLots(const string& txlogFile) {
+        LotMethod m = lots.method;
+        lots.clear();
+        lots.method = m;
+        ifstream ifs(txlogFile);
+        LotReplayStats stats;
+        if (ifs) replayLots(ifs, lots, stats);
+        vector<InstrumentId> stale;
+        for (const auto& b : lots.all())
+            if (!portfolio.find(b.first)) stale.push_back(b.first);
+        for (InstrumentId id : stale) lots.reset(id, 0.0, 0.0);
+        for (const Holding& h : portfolio)
+            if (fabs(lots.openQty(h.id) - h.quantity) > 1e-6) lots.reset(h.id, h.quantity, h.avgPrice);
+    }
+
+    // ---- crash recovery ----
+    // Re-apply a journaled entry exactly as buyAs/sellAs/deposit applied it. The
+    // journal carries the resulting balance, so cash is restored bit for bit.
+    // Nothing is published until finishReplay().
+    void replay(const TxEntry& e) {
+        cashBalance = e.balanceAfter;
+        if (e.action == TxAction::Buy) {
+            addOrUpdateHolding(e.instrument, e.qty, e.price);
+            lots.open(e.instrument, e.qty, e.price);
+        } else if (e.action == TxAction::Sell) {
+            if (Holding* h = portfolio.find(e.instrument)) {
+                h->quantity -= e.qty;
+                lots.close(h->id, e.qty, e.price, e.lot);
+                double lotQty = lots.openQty(h->id);
+                if (lotQty > 1e-9 && fabs(lotQty - h->quantity) < 1e-6) h->avgPrice = lots.costBasis(h->id) / lotQty;
+                if (h->quantity <= 1e-9) portfolio.erase(h);
+            }
+        }
+        tlog.add(e);
+    }
+    void replayLotMethod(LotMethod m) { lots.method = m; }
+    void finishReplay() { publishState(); }
+
+    // ---- corporate actions ----
+    // Adjust this account's position for a split or dividend and log what it
+    // did here (the journal holds one record for all holders, not these rows).
+    // id is the action's journal LSN; an id already applied is skipped, which
+    // makes replay idempotent. 0 means not journaled and always applies.
+    // priceAfter pays out a stock's split fraction. True when a position was
+    // adjusted; cash gets what was credited.
+    bool applyCorporateAction(const CorporateAction& a, uint64_t id, Timestamp at, double priceAfter,
+                              double* cash = nullptr) {
+        bool hit = adjustForAction(a, id, at, priceAfter, cash);
+        if (hit) publishState();
+        return hit;
+    }
+    // Recovery: the same without publishing (finishReplay() does that)
+    void replayCorporateAction(const CorporateAction& a, uint64_t id, Timestamp at, double priceAfter) {
+        adjustForAction(a, id, at, priceAfter, nullptr);
+    }
+    uint64_t lastCorporateAction() const { return lastAction; }
+    bool holds(InstrumentId id) const { return portfolio.find(id) != nullptr; }
+
+private:
+    bool adjustForAction(const CorporateAction& a, uint64_t id, Timestamp at, double priceAfter, double* cash) {
+        if (cash) *cash = 0.0;
+        if (id && id <= lastAction) return false;
+        Holding* h = portfolio.find(a.instrument);
+        if (!h || a.value <= 0.0) return false;
+        // only holders move the mark, so live runs (which visit holders) and
+        // replay (which visits everyone) leave identical state
+        if (id) lastAction = id;
+        TxEntry e;
+        e.time = at;
+        e.kind = instruments().kind(a.instrument);
+        e.instrument = a.instrument;
+        e.lot = kAnyLot;
+        if (a.kind == CorporateActionKind::Dividend) {
+            double paid = h->quantity * a.value;
+            cashBalance += paid;
+            if (cash) *cash = paid;
+            e.action = TxAction::Dividend;
+            e.qty = h->quantity;
+            e.price = a.value;
+            e.balanceAfter = cashBalance;
+            tlog.add(e);
+            return true;
+        }
+        double before = h->quantity;
+        h->quantity *= a.value;
+        h->avgPrice /= a.value;
+        lots.split(a.instrument, a.value);
+        e.action = TxAction::Split;
+        e.qty = h->quantity - before;
+        e.price = a.value;
+        e.balanceAfter = cashBalance;
+        tlog.add(e);
+        double frac = 0.0;
+        if (e.kind == InstrumentKind::Stock) {
+            double whole = floor(h->quantity + 1e-6);
+            frac = h->quantity - whole;
+            if (frac < 0.0) h->quantity = whole; // rounding left it a hair short
+        }
+        if (frac > 1e-9) { // cash in lieu of the fractional share
+            h->quantity -= frac;
+            cashBalance += frac * priceAfter;
+            if (cash) *cash = frac * priceAfter;
+            lots.close(a.instrument, frac, priceAfter);
+            double lotQty = lots.openQty(a.instrument);
+            if (lotQty > 1e-9 && fabs(lotQty - h->quantity) < 1e-6) h->avgPrice = lots.costBasis(a.instrument) / lotQty;
+            e.action = TxAction::Sell;
+            e.qty = frac;
+            e.price = priceAfter;
+            e.balanceAfter = cashBalance;
+            tlog.add(e);
+            if (h->quantity <= 1e-9) portfolio.erase(h);
+        }
+        return true;
+    }
+
+public:
+    // Lossless checkpoint block for this account:
+    //   A|acct|name|cash|method|realized|nextLot|lastAction
+    //   H|sym|name|kind|qty|avg      one per holding
+    //   L|sym|name|kind|lotId|qty|price   one per open lot, in buy order
+    //   X|<txlog fields>             one per log entry (left out without withLog)
+    void writeCheckpoint(string& out, uint32_t acct, bool withLog = true) const {
+        out += "A|"; appendNum(out, (uint64_t)acct);
+        out += '|'; out += name;
+        out += '|'; appendNum(out, cashBalance);
+        out += '|'; out += lotMethodName(lots.method);
+        out += '|'; appendNum(out, lots.realizedPL());
+        out += '|'; appendNum(out, (uint64_t)lots.nextId());
+        out += '|'; appendNum(out, lastAction);
+        out += '\n';
+        for (const Holding& h : portfolio) {
+            out += "H|"; out += instruments().symbol(h.id);
+            out += '|'; out += instruments().name(h.id);
+            out += '|'; out += kindName(instruments().kind(h.id));
+            out += '|'; appendNum(out, h.quantity);
+            out += '|'; appendNum(out, h.avgPrice);
+            out += '\n';
+        }
+        for (const auto& b : lots.all()) {
+            for (uint32_t i = 0; i < b.second.size(); ++i) {
+                const Lot& l = b.second[i];
+                out += "L|"; out += instruments().symbol(b.first);
+                out += '|'; out += instruments().name(b.first);
+                out += '|'; out += kindName(instruments().kind(b.first));
+                out += '|'; appendNum(out, (uint64_t)l.id);
+                out += '|'; appendNum(out, l.qty);
+                out += '|'; appendNum(out, l.price);
+                out += '\n';
+            }
+        }
+        if (!withLog) return;
+        TransactionLog::Snapshot log = tlog.snapshot();
+        for (size_t i = 0; i < log.size(); ++i) {
+            out += "X|";
+            appendTxFields(out, log[i]);
+            out += '\n';
+        }
+    }
+
+    // Put entries from before this object's log (paged in from an
+    // InvestorStore) ahead of it
+    void prependHistory(const vector<TxEntry>& older) {
+        if (older.empty()) return;
+        TransactionLog::Snapshot recent = tlog.snapshot();
+        vector<TxEntry> keep;
+        keep.reserve(recent.size());
+        for (size_t i = 0; i < recent.size(); ++i) keep.push_back(recent[i]);
+        tlog.clear();
+        for (const TxEntry& e : older) tlog.add(e);
+        for (const TxEntry& e : keep) tlog.add(e);
+    }
+
+    // Apply one line of a checkpoint block (text after the type and '|').
+    // An 'A' line resets the account. False when the line is malformed.
+    bool restoreLine(char type, FieldReader& r, SymbolCache& syms) {
+        switch (type) {
+            case 'A': {
+                r.u64(); // account number, already used to pick this investor
+                name = r.str();
+                cashBalance = r.num();
+                lots.clear();
+                lots.method = r.str() == "LIFO" ? LotMethod::LIFO : LotMethod::FIFO;
+                double realized = r.num();
+                lots.restoreTotals(realized, (uint32_t)r.u64());
+                lastAction = r.more() ? r.u64() : 0;
+                portfolio.clear();
+                tlog.clear();
+                return !r.bad;
+            }
+            case 'H': {
+                string sym = r.str(), nm = r.str();
+                InstrumentId id = syms.resolve(sym, nm, parseKind(r.str()));
+                Holding& h = portfolio.upsert(id);
+                h.quantity = r.num();
+                h.avgPrice = r.num();
+                if (holderIndex) holderIndex->add(id, account);
+                return !r.bad;
+            }
+            case 'L': {
+                string sym = r.str(), nm = r.str();
+                InstrumentId id = syms.resolve(sym, nm, parseKind(r.str()));
+                Lot l;
+                l.id = (uint32_t)r.u64();
+                l.qty = r.num();
+                l.price = r.num();
+                if (r.bad) return false;
+                lots.restore(id, l);
+                return true;
+            }
+            case 'X': {
+                TxEntry e;
+                if (!parseTxFields(r, e, syms)) return false;
+                tlog.add(e);
+                return true;
+            }
+            default:
+                return false;
+        }
+    }
+
+    // Everything replay must reproduce, hashed in a process-independent order
+    void addToDigest(StateDigest& d) const {
+        d.add(name);
+        d.add(cashBalance);
+        d.add((uint64_t)lots.method);
+        d.add(lots.realizedPL());
+        d.add((uint64_t)lots.nextId());
+        d.add(lastAction);
+        d.add((uint64_t)lots.openLots());
+        for (const Holding* h : portfolio.bySymbol()) {
+            d.add(instruments().symbol(h->id));
+            d.add(h->quantity);
+            d.add(h->avgPrice);
+            if (const LotRing* r = lots.lots(h->id)) {
+                for (uint32_t i = 0; i < r->size(); ++i) {
+                    d.add((uint64_t)(*r)[i].id);
+                    d.add((*r)[i].qty);
+                    d.add((*r)[i].price);
+                }
+            }
+        }
+        TransactionLog::Snapshot log = tlog.snapshot();
+        d.add((uint64_t)log.size());
+        for (size_t i = 0; i < log.size(); ++i) {
+            const TxEntry& e = log[i];
+            d.add((uint64_t)e.time);
+            d.add((uint64_t)e.action);
+            d.add(e.instrument == kNoInstrument ? string("-") : instruments().symbol(e.instrument));
+            d.add(e.qty);
+            d.add(e.price);
+            d.add(e.balanceAfter);
+            d.add((uint64_t)e.lot);
+        }
+    }
+
+    void showTransactions() const {
+        cout << "\n--- Transaction History ---\n";
+        tlog.showAll();
+    }
+    void showTransactions(size_t offset, size_t limit) const {
+        if (tlog.size() == 0) {
+            showTransactions();
+            return;
+        }
+        if (offset >= tlog.size() || limit == 0) {
+            cout << "No transactions in that range (" << tlog.size() << " logged).\n";
+            return;
+        }
+        size_t last = min(tlog.size(), offset + min(limit, tlog.size()));
+        cout << "\n--- Transaction History (rows " << offset + 1 << "-" << last << " of " << tlog.size() << ") ---\n";
+        tlog.showPage(offset, limit);
+    }
+    const TransactionLog& transactions() const { return tlog; }
+
+    // Save investor data (portfolio + cash)
+    bool saveToFile(const string& fname) const {
+        AllocScope scope(AllocTag::SaveInvestor);
+        ofstream ofs(fname);
+        if (!ofs) {
+            cout << "Error: Could not open file " << fname << " for writing.\n";
+            return false;
+        }
+        EpochGuard guard;
+        writeState(ofs, name, *view());
+        ofs.close();
+        // save transaction log separately
+        tlog.saveToFile(fname + ".txlog");
+        return true;
+    }
+    // Investor file body (name, cash, holdings) for one published state
+    static void writeState(ostream& os, const string& name, const InvestorState& st) {
+        os << name << '\n';
+        os << fixed << setprecision(2) << st.cashBalance << '\n';
+        // portfolio entries
+        for (const Holding* h : st.holdings.bySymbol()) {
+            InstrumentId id = h->id;
+            os << instruments().symbol(id) << '|' << instruments().name(id) << '|' << kindName(instruments().kind(id))
+               << '|' << h->quantity << '|' << h->avgPrice << '\n';
+        }
+    }
+
+    bool loadFromFile(const string& fname) {
+        AllocScope scope(AllocTag::LoadInvestor);
         ifstream ifs(fname);
         if (!ifs) {
             cout << "Error: Could not open file " << fname << " for reading.\n";
             return false;
         }
-        stocks.clear();
-        funds.clear();
-        string line;
-        while (getline(ifs, line)) {
-            if (line.empty()) continue;
-            stringstream ss(line);
-            string type; getline(ss, type, '|');
-            if (type == "STOCK") {
-                string sym, nm, tmp;
-                double price; int avail;
-                getline(ss, sym, '|'); getline(ss, nm, '|'); getline(ss, tmp, '|'); 
-                try {
-                    price = stod(tmp);
-                } catch (const exception& e) {
-                    cout << "Error parsing price in market snapshot.\n";
-                    return false;
+        portfolio.clear();
+        string line;
+        getline(ifs, name);
+        if (name.empty()) return false;
+        string tmp;
+        getline(ifs, tmp);
+        try {
+            cashBalance = tmp.empty() ? 0.0 : stod(tmp);
+        } catch (const exception& e) {
+            cout << "Error parsing cash balance.\n";
+            return false;
+        }
+        while (getline(ifs, line)) {
+            if (line.empty()) continue;
+            stringstream ss(line);
+            string sym, nm, tp, qstr, avgstr;
+            getline(ss, sym, '|');
+            getline(ss, nm, '|');
+            getline(ss, tp, '|');
+            getline(ss, qstr, '|');
+            getline(ss, avgstr, '\n');
+            try {
+                double q = stod(qstr), avg = stod(avgstr);
+                Holding& h = portfolio.upsert(instruments().intern(sym, nm, parseKind(tp)));
+                h.quantity = q;
+                h.avgPrice = avg;
+                if (holderIndex) holderIndex->add(h.id, account);
+            } catch (const exception& e) {
+                cout << "Error parsing holding data.\n";
+                return false;
+            }
+        }
+        rebuildLots(fname + ".txlog");
+        publishState();
+        // load transactions if present
+        tlog.loadFromFile(fname + ".txlog");
+        ifs.close();
+        return true;
+    }
+};
+
+// --------------------------- Background checkpoints ---------------------------
+// streambuf that fills one buffer while a writer thread flushes the other, so
+// formatting and disk I/O overlap. The data goes to path + ".tmp", which
+// close() syncs and renames over path, so readers only ever see whole files.
+class DoubleBufferedFile : public streambuf {
+private:
+    static const size_t kBufSize = 1 << 20;
+    string path;
+    FILE* fp;
+    vector<char> bufs[2];
+    int cur;
+    uint64_t produced;      // bytes handed to the writer so far
+    atomic<uint64_t>* bytesOut;
+
+    mutex mtx;
+    condition_variable cv;
+    bool pending;           // bufs[cur ^ 1] holds pendingLen bytes to write
+    size_t pendingLen;
+    bool stopping;
+    bool failed;
+    thread writer;
+
+    void writerLoop() {
+        unique_lock<mutex> lk(mtx);
+        for (;;) {
+            cv.wait(lk, [this] { return pending || stopping; });
+            if (!pending) break;
+            const char* data = bufs[cur ^ 1].data();
+            size_t n = pendingLen;
+            lk.unlock();
+            bool ok = fwrite(data, 1, n, fp) == n;
+            if (bytesOut) bytesOut->fetch_add(n, memory_order_relaxed);
+            lk.lock();
+            if (!ok) failed = true;
+            pending = false;
+            cv.notify_all();
+        }
+    }
+    // Wait for the writer to free the back buffer, then swap
+    void handOff() {
+        size_t n = pptr() - pbase();
+        if (n == 0) return;
+        unique_lock<mutex> lk(mtx);
+        cv.wait(lk, [this] { return !pending; });
+        cur ^= 1;
+        pending = true;
+        pendingLen = n;
+        produced += n;
+        cv.notify_all();
+        lk.unlock();
+        setp(bufs[cur].data(), bufs[cur].data() + kBufSize);
+    }
+    DoubleBufferedFile(const DoubleBufferedFile&);
+    DoubleBufferedFile& operator=(const DoubleBufferedFile&);
+protected:
+    int_type overflow(int_type ch) override {
+        handOff();
+        if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(ch);
+            pbump(1);
+        }
+        return traits_type::not_eof(ch);
+    }
+    // Only supports tellp()
+    pos_type seekoff(off_type off, ios_base::seekdir dir, ios_base::openmode which) override {
+        if (off != 0 || dir != ios_base::cur || !(which & ios_base::out)) return pos_type(off_type(-1));
+        return pos_type(off_type(produced + (pptr() - pbase())));
+    }
+public:
+    DoubleBufferedFile() : fp(nullptr), cur(0), produced(0), bytesOut(nullptr),
+                           pending(false), pendingLen(0), stopping(false), failed(false) {}
+    ~DoubleBufferedFile() { if (fp) close(); }
+
+    bool open(const string& p, atomic<uint64_t>* counter = nullptr) {
+        path = p;
+        fp = fopen((path + ".tmp").c_str(), "wb");
+        if (!fp) return false;
+        bufs[0].resize(kBufSize);
+        bufs[1].resize(kBufSize);
+        cur = 0;
+        produced = 0;
+        bytesOut = counter;
+        pending = stopping = failed = false;
+        setp(bufs[0].data(), bufs[0].data() + kBufSize);
+        writer = thread(&DoubleBufferedFile::writerLoop, this);
+        return true;
+    }
+
+    // Flush, sync to disk and atomically replace the target. False on any I/O error.
+    bool close() {
+        handOff();
+        {
+            lock_guard<mutex> lk(mtx);
+            stopping = true;
+        }
+        cv.notify_all();
+        writer.join();
+        bool ok = !failed && fflush(fp) == 0;
+#ifdef _WIN32
+        ok = ok && _commit(_fileno(fp)) == 0;
+#else
+        ok = ok && fsync(fileno(fp)) == 0;
+#endif
+        ok = fclose(fp) == 0 && ok;
+        fp = nullptr;
+        string tmp = path + ".tmp";
+        if (!ok) {
+            remove(tmp.c_str());
+            return false;
+        }
+#ifdef _WIN32
+        // one call, so a crash leaves either the old file or the new one
+        return MoveFileExA(tmp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+        if (rename(tmp.c_str(), path.c_str()) != 0) return false;
+        // the rename is only durable once the directory entry is on disk
+        size_t slash = path.rfind('/');
+        string dir = slash == string::npos ? string(".") : slash == 0 ? string("/") : path.substr(0, slash);
+        int dfd = ::open(dir.c_str(), O_RDONLY);
+        if (dfd < 0) return false;
+        ok = fsync(dfd) == 0;
+        ::close(dfd);
+        return ok;
+#endif
+    }
+};
+
+struct CheckpointProgress {
+    bool running;
+    bool done;        // a checkpoint has finished since the last one started
+    bool ok;          // ... and all its files were written and renamed
+    uint64_t rowsTotal;
+    uint64_t rowsDone;
+    uint64_t bytesWritten;
+    double seconds;   // elapsed (running) or total (done)
+};
+
+// Saves market + investor snapshots in the background. start() only pins the
+// current published versions and shares the log's pages, so the caller pauses
+// for microseconds; a worker thread then serializes the captured image through
+// DoubleBufferedFile.
+class Checkpointer {
+private:
+    struct Image {
+        string prefix;
+        string investorName;
+        EpochPin pin; // keeps the two versions below alive on the worker thread
+        const MarketVersion* market;
+        const InvestorState* investor;
+        TransactionLog::Snapshot log;
+        Image() : market(nullptr), investor(nullptr) {}
+    };
+
+    thread worker;
+    atomic<bool> running;
+    atomic<bool> finished;
+    atomic<bool> succeeded;
+    atomic<uint64_t> rowsTotal;
+    atomic<uint64_t> rowsDone;
+    atomic<uint64_t> bytesWritten;
+    Stopwatch clock;
+    atomic<double> elapsed;
+    function<void(bool)> onComplete;
+
+    bool writeFile(const string& path, const function<void(ostream&)>& body) {
+        DoubleBufferedFile file;
+        if (!file.open(path, &bytesWritten)) return false;
+        ostream os(&file);
+        body(os);
+        os.flush();
+        return file.close();
+    }
+
+    void run(shared_ptr<Image> img) {
+        const string mfile = img->prefix + "_market.txt";
+        const string ifile = img->prefix + "_investor.txt";
+        bool ok = writeFile(mfile, [&](ostream& os) { Market::writeSnapshot(os, *img->market); });
+        rowsDone.fetch_add(img->market->catalog->listed.size());
+        ok = ok && writeFile(ifile, [&](ostream& os) { Investor::writeState(os, img->investorName, *img->investor); });
+        rowsDone.fetch_add(img->investor->holdings.size());
+        img->pin.release(); // versions no longer needed; the log pages are refcounted
+        TxIndex fileIndex;
+        uint64_t logBytes = 0;
+        ok = ok && writeFile(ifile + ".txlog", [&](ostream& os) {
+            logBytes = TransactionLog::writeEntries(os, img->log, fileIndex, &rowsDone);
+        });
+        ok = ok && fileIndex.save(ifile + ".txlog.idx", logBytes);
+        elapsed.store(clock.seconds());
+        succeeded.store(ok);
+        finished.store(true);
+        running.store(false);
+        if (onComplete) onComplete(ok);
+    }
+public:
+    Checkpointer() : running(false), finished(false), succeeded(false), rowsTotal(0),
+                     rowsDone(0), bytesWritten(0), elapsed(0.0) {}
+    ~Checkpointer() { wait(); }
+
+    // Called on the worker thread when a checkpoint ends
+    void setCompletionHandler(const function<void(bool)>& fn) { onComplete = fn; }
+
+    // Capture and start writing; false if a checkpoint is still running.
+    bool start(const Market& market, const Investor& investor, const string& prefix) {
+        if (running.load()) return false;
+        if (worker.joinable()) worker.join();
+        shared_ptr<Image> img = make_shared<Image>();
+        img->prefix = prefix;
+        img->investorName = investor.getName();
+        img->market = market.view();   // read under img->pin
+        img->investor = investor.view();
+        img->log = investor.transactions().snapshot();
+        rowsTotal.store(img->market->catalog->listed.size() + img->investor->holdings.size() + img->log.size());
+        rowsDone.store(0);
+        bytesWritten.store(0);
+        finished.store(false);
+        running.store(true);
+        clock = Stopwatch();
+        worker = thread(&Checkpointer::run, this, img);
+        return true;
+    }
+
+    CheckpointProgress progress() const {
+        CheckpointProgress p;
+        p.running = running.load();
+        p.done = finished.load();
+        p.ok = succeeded.load();
+        p.rowsTotal = rowsTotal.load();
+        p.rowsDone = rowsDone.load();
+        p.bytesWritten = bytesWritten.load();
+        p.seconds = p.running ? clock.seconds() : elapsed.load();
+        return p;
+    }
+
+    // Block until the current checkpoint (if any) is on disk; returns its result
+    bool wait() {
+        if (worker.joinable()) worker.join();
+        return succeeded.load();
+    }
+};
+
+// --------------------------- Crash recovery ---------------------------
+// Every account of the process, numbered in creation order; the number is the
+// account field of journal records.
+class InvestorBook {
+private:
+    vector<unique_ptr<Investor> > accounts;
+    Journal* journal;
+    HolderIndex index;
+
+    Investor& adopt(Investor* inv, uint32_t acct) {
+        inv->attachJournal(journal, acct);
+        inv->attachHolderIndex(&index);
+        return *inv;
+    }
+public:
+    InvestorBook() : journal(nullptr) {}
+    size_t size() const { return accounts.size(); }
+    Investor& operator[](size_t i) { return *accounts[i]; }
+    const Investor& operator[](size_t i) const { return *accounts[i]; }
+    // Accounts that may hold each instrument
+    const HolderIndex& holders() const { return index; }
+    HolderIndex& holders() { return index; }
+
+    Investor& open(const string& name, double cash) {
+        uint32_t acct = (uint32_t)accounts.size();
+        accounts.push_back(unique_ptr<Investor>(new Investor(name, cash)));
+        if (journal) journal->logAccount(acct, name, cash);
+        return adopt(accounts.back().get(), acct);
+    }
+    // Recovery: grow to n blank accounts, or recreate one from its 'N' record
+    void resize(size_t n) {
+        while (accounts.size() < n) {
+            accounts.push_back(unique_ptr<Investor>(new Investor()));
+            adopt(accounts.back().get(), (uint32_t)(accounts.size() - 1));
+        }
+    }
+    void reset(size_t i, const string& name, double cash) {
+        resize(i + 1);
+        accounts[i].reset(new Investor(name, cash));
+        adopt(accounts[i].get(), (uint32_t)i);
+    }
+    void clear() {
+        accounts.clear();
+        index.clear();
+    }
+
+    void attachJournal(Journal* j) {
+        journal = j;
+        for (size_t i = 0; i < accounts.size(); ++i) accounts[i]->attachJournal(j, (uint32_t)i);
+    }
+};
+
+// Digest of everything recovery restores: market quotes, volatility and all accounts
+uint64_t stateDigest(const Market& market, const InvestorBook& book) {
+    StateDigest d;
+    {
+        EpochGuard guard;
+        const MarketVersion* v = market.view();
+        for (InstrumentId id : v->catalog->listed) {
+            d.add(instruments().symbol(id));
+            d.add(v->price[id]);
+            d.add(v->available[id]);
+        }
+    }
+    d.add(market.getVolatility());
+    d.add((uint64_t)book.size());
+    for (size_t i = 0; i < book.size(); ++i) book[i].addToDigest(d);
+    return d.value();
+}
+
+struct RecoveryStats {
+    uint64_t checkpointLsn;
+    uint64_t lastLsn;
+    size_t accounts;
+    size_t records;        // journal records replayed
+    size_t tornBytes;      // incomplete record at the end of the log, ignored
+    unsigned threads;
+    double loadSeconds;    // checkpoint
+    double replaySeconds;  // journal
+    bool digestChecked;    // the log ended with a clean-shutdown digest
+    bool digestOk;
+    RecoveryStats() : checkpointLsn(0), lastLsn(0), accounts(0), records(0), tornBytes(0), threads(1),
+                      loadSeconds(0.0), replaySeconds(0.0), digestChecked(false), digestOk(false) {}
+};
+
+// Checkpoint + write-ahead journal for one Market and InvestorBook. Files:
+//   prefix.current            CHECKPOINT|lsn|parts|accounts|volatility|digest
+//   prefix.ckpt.<lsn>.market  market rows as of lsn
+//   prefix.ckpt.<lsn>.models  price models' per-instrument state as of lsn
+//   prefix.ckpt.<lsn>.<k>     accounts with number % parts == k
+//   prefix.journal.<first>    journal segments; a new one starts at each
+//                             checkpoint and after each recovery
+// Recovery loads the checkpoint named by .current and replays the segment chain
+// that follows it. Account records are partitioned by account number and
+// replayed on parallel threads; market records are applied last-writer-wins.
+// checkpoint() must not run concurrently with trading.
+class Recovery {
+private:
+    string prefix;
+    unsigned threads;
+    Journal journal;
+    bool durable;
+    Market* market;
+    InvestorBook* book;
+    uint64_t checkpointLsn;
+    unsigned checkpointParts;
+    vector<uint64_t> segments; // segments written since checkpointLsn
+
+    string currentFile() const { return prefix + ".current"; }
+    string checkpointFile(uint64_t lsn, const string& part) const {
+        return prefix + ".ckpt." + to_string(lsn) + "." + part;
+    }
+
+    bool writeCheckpoint(uint64_t lsn, unsigned parts, uint64_t digest) {
+        atomic<bool> ok(true);
+        {
+            DoubleBufferedFile file;
+            if (!file.open(checkpointFile(lsn, "market"))) return false;
+            ostream os(&file);
+            os.precision(17);
+            EpochGuard guard;
+            Market::writeSnapshot(os, *market->view());
+            os.flush();
+            if (!file.close()) return false;
+        }
+        {
+            DoubleBufferedFile file;
+            if (!file.open(checkpointFile(lsn, "models"))) return false;
+            ostream os(&file);
+            market->writeModelState(os);
+            os.flush();
+            if (!file.close()) return false;
+        }
+        parallelFor(threads, parts, [&](unsigned k) {
+            DoubleBufferedFile file;
+            if (!file.open(checkpointFile(lsn, to_string(k)))) { ok = false; return; }
+            string buf;
+            for (size_t a = k; a < book->size(); a += parts) {
+                (*book)[a].writeCheckpoint(buf, (uint32_t)a);
+                if (buf.size() >= (1 << 20)) {
+                    file.sputn(buf.data(), buf.size());
+                    buf.clear();
+                }
+            }
+            file.sputn(buf.data(), buf.size());
+            if (!file.close()) ok = false;
+        });
+        if (!ok) return false;
+        DoubleBufferedFile file;
+        if (!file.open(currentFile())) return false;
+        string line = "CHECKPOINT|";
+        appendNum(line, lsn); line += '|';
+        appendNum(line, (uint64_t)parts); line += '|';
+        appendNum(line, (uint64_t)book->size()); line += '|';
+        appendNum(line, market->getVolatility()); line += '|';
+        appendNum(line, digest); line += '\n';
+        file.sputn(line.data(), line.size());
+        return file.close();
+    }
+
+    void removeCheckpoint(uint64_t lsn, unsigned parts) {
+        remove(checkpointFile(lsn, "market").c_str());
+        remove(checkpointFile(lsn, "models").c_str());
+        for (unsigned k = 0; k < parts; ++k) remove(checkpointFile(lsn, to_string(k)).c_str());
+    }
+
+    // One journal record routed to the thread that owns its account
+    struct AccountRecord {
+        uint64_t lsn;
+        uint32_t acct;
+        bool isMethod;
+        LotMethod method;
+        TxEntry tx;
+    };
+    // A corporate action, applied to every account that holds the instrument
+    struct ActionRecord {
+        uint64_t lsn;
+        CorporateAction action;
+        double priceAfter;
+        Timestamp at;
+    };
+    struct Listing {
+        InstrumentKind kind;
+        string sym, name;
+        double price, avail;
+        BondTerms terms; // bonds only
+    };
+    // Everything parsed out of one slice of a journal window
+    struct Slice {
+        vector<vector<AccountRecord> > byPart;
+        vector<pair<uint32_t, pair<string, double> > > newAccounts;
+        vector<Listing> listings;
+        vector<ActionRecord> actions;
+        unordered_map<InstrumentId, double> lastPrice, lastAvail;
+        bool hasVolatility;
+        double volatility;
+        uint64_t firstLsn, lastLsn;
+        size_t records;
+        char lastType;
+        uint64_t lastDigest;
+        bool bad;
+        Slice() : hasVolatility(false), volatility(0.0), firstLsn(0), lastLsn(0), records(0),
+                  lastType(0), lastDigest(0), bad(false) {}
+    };
+
+    void parseSlice(const char* p, const char* end, unsigned parts, Slice& s) {
+        SymbolCache syms;
+        s.byPart.resize(parts);
+        for (auto& v : s.byPart) v.reserve((end - p) / 96 / parts); // ~96 bytes per trade record
+        while (p < end) {
+            const char* eol = static_cast<const char*>(memchr(p, '\n', end - p));
+            FieldReader r(p, eol);
+            p = eol + 1;
+            string type = r.str();
+            uint64_t lsn = r.u64();
+            if (type.size() != 1 || r.bad || (s.records && lsn != s.lastLsn + 1)) { s.bad = true; return; }
+            if (!s.records) s.firstLsn = lsn;
+            s.lastLsn = lsn;
+            s.lastType = type[0];
+            ++s.records;
+            switch (type[0]) {
+                case 'T': {
+                    AccountRecord rec;
+                    rec.lsn = lsn;
+                    rec.acct = (uint32_t)r.u64();
+                    rec.isMethod = false;
+                    rec.method = LotMethod::FIFO;
+                    double avail = r.num();
+                    if (!parseTxFields(r, rec.tx, syms)) { s.bad = true; return; }
+                    if (rec.tx.instrument != kNoInstrument) s.lastAvail[rec.tx.instrument] = avail;
+                    s.byPart[rec.acct % parts].push_back(move(rec));
+                    break;
+                }
+                case 'M': {
+                    AccountRecord rec;
+                    rec.lsn = lsn;
+                    rec.acct = (uint32_t)r.u64();
+                    rec.isMethod = true;
+                    rec.method = r.str() == "LIFO" ? LotMethod::LIFO : LotMethod::FIFO;
+                    s.byPart[rec.acct % parts].push_back(move(rec));
+                    break;
+                }
+                case 'N': {
+                    uint32_t acct = (uint32_t)r.u64();
+                    string name = r.str();
+                    s.newAccounts.push_back(make_pair(acct, make_pair(name, r.num())));
+                    break;
+                }
+                case 'S': {
+                    Listing l;
+                    string kind = r.str();
+                    l.kind = kind == "STOCK" ? InstrumentKind::Stock
+                           : kind == "BOND" ? InstrumentKind::Bond : InstrumentKind::MutualFund;
+                    l.sym = r.str();
+                    l.name = r.str();
+                    l.price = r.num();
+                    l.avail = r.num();
+                    if (l.kind == InstrumentKind::Bond) {
+                        l.terms.coupon = r.num();
+                        l.terms.frequency = (int)r.u64();
+                        l.terms.maturity = r.num();
+                        l.terms.face = r.num();
+                    }
+                    InstrumentId id = syms.resolve(l.sym, l.name, l.kind);
+                    s.lastPrice[id] = l.price;
+                    s.lastAvail[id] = l.avail;
+                    s.listings.push_back(l);
+                    break;
+                }
+                case 'P': {
+                    InstrumentId id = instruments().find(r.str());
+                    double price = r.num();
+                    if (id != kNoInstrument) s.lastPrice[id] = price;
+                    break;
+                }
+                case 'C': {
+                    ActionRecord act;
+                    act.lsn = lsn;
+                    act.action.instrument = instruments().find(r.str());
+                    if (!parseCorporateAction(r.str(), act.action.kind)) { s.bad = true; return; }
+                    act.action.value = r.num();
+                    act.priceAfter = r.num();
+                    double avail = r.num();
+                    act.at = (Timestamp)r.u64();
+                    if (act.action.instrument != kNoInstrument) {
+                        s.lastPrice[act.action.instrument] = act.priceAfter;
+                        s.lastAvail[act.action.instrument] = avail;
+                        s.actions.push_back(act);
+                    }
+                    break;
+                }
+                case 'V':
+                    s.hasVolatility = true;
+                    s.volatility = r.num();
+                    break;
+                case 'D':
+                    s.lastDigest = r.u64();
+                    break;
+                default:
+                    s.bad = true;
+                    return;
+            }
+            if (r.bad) { s.bad = true; return; }
+        }
+    }
+
+    // Parse [p, end) (whole lines) on all threads, then apply it
+    bool replayWindow(const char* p, const char* end, RecoveryStats& stats, char& lastType, uint64_t& lastDigest) {
+        unsigned parts = max(1u, threads);
+        // cut the window into one slice per thread at line boundaries
+        vector<const char*> cuts(1, p);
+        for (unsigned t = 1; t < parts; ++t) {
+            const char* c = p + (end - p) * t / parts;
+            if (c < cuts.back()) c = cuts.back();
+            const char* nl = static_cast<const char*>(memchr(c, '\n', end - c));
+            cuts.push_back(nl ? nl + 1 : end);
+        }
+        cuts.push_back(end);
+        vector<Slice> slices(parts);
+        parallelFor(threads, parts, [&](unsigned i) { parseSlice(cuts[i], cuts[i + 1], parts, slices[i]); });
+
+        for (Slice& s : slices) {
+            if (s.bad) {
+                cout << "Journal record after LSN " << s.lastLsn << " is malformed.\n";
+                return false;
+            }
+            if (!s.records) continue;
+            if (s.firstLsn != stats.lastLsn + 1) {
+                cout << "Journal gap: expected LSN " << stats.lastLsn + 1 << ", found " << s.firstLsn << ".\n";
+                return false;
+            }
+            stats.lastLsn = s.lastLsn;
+            stats.records += s.records;
+            lastType = s.lastType;
+            if (s.lastType == 'D') lastDigest = s.lastDigest;
+            // accounts and listings first, in log order; account records can only refer to earlier ones
+            for (const auto& n : s.newAccounts) book->reset(n.first, n.second.first, n.second.second);
+            for (const Listing& l : s.listings) {
+                if (l.kind == InstrumentKind::Stock) market->addStock(Stock(l.name, l.sym, l.price, (int)l.avail));
+                else if (l.kind == InstrumentKind::Bond) market->addBond(Bond(l.name, l.sym, l.terms, l.price, (int)l.avail));
+                else market->addFund(MutualFund(l.name, l.sym, l.price, l.avail));
+            }
+        }
+        vector<const ActionRecord*> actions;
+        for (const Slice& s : slices)
+            for (const ActionRecord& a : s.actions) actions.push_back(&a);
+        // Each thread owns the accounts of one partition. Its records are
+        // bucketed by account (a counting sort, since the partition's accounts
+        // are part, part + parts, ...), which keeps every account's log order
+        // but visits each account once instead of hopping across the whole book
+        // per record. Records for accounts past the book are never applied.
+        parallelFor(threads, parts, [&](unsigned part) {
+            size_t owned = book->size() / parts + 1;
+            vector<uint32_t> at(owned + 1, 0);
+            for (const Slice& s : slices)
+                for (const AccountRecord& rec : s.byPart[part])
+                    if (rec.acct < book->size()) ++at[rec.acct / parts + 1];
+            for (size_t i = 1; i <= owned; ++i) at[i] += at[i - 1];
+            vector<const AccountRecord*> recs(at[owned]);
+            for (const Slice& s : slices)
+                for (const AccountRecord& rec : s.byPart[part])
+                    if (rec.acct < book->size()) recs[at[rec.acct / parts]++] = &rec;
+            auto apply = [](Investor& inv, const AccountRecord& rec) {
+                if (rec.isMethod) inv.replayLotMethod(rec.method);
+                else inv.replay(rec.tx);
+            };
+            if (actions.empty()) {
+                for (const AccountRecord* rec : recs) apply((*book)[rec->acct], *rec);
+                return;
+            }
+            // A corporate action reaches every holder, including accounts with no
+            // records here, so walk all of the partition's accounts and slot the
+            // actions between each account's own records by LSN
+            size_t r = 0;
+            for (size_t acct = part; acct < book->size(); acct += parts) {
+                Investor& inv = (*book)[acct];
+                size_t k = 0;
+                for (; r < recs.size() && recs[r]->acct == acct; ++r) {
+                    for (; k < actions.size() && actions[k]->lsn < recs[r]->lsn; ++k)
+                        inv.replayCorporateAction(actions[k]->action, actions[k]->lsn, actions[k]->at, actions[k]->priceAfter);
+                    apply(inv, *recs[r]);
+                }
+                for (; k < actions.size(); ++k)
+                    inv.replayCorporateAction(actions[k]->action, actions[k]->lsn, actions[k]->at, actions[k]->priceAfter);
+            }
+        });
+        for (const Slice& s : slices) {
+            for (const auto& q : s.lastPrice) market->restorePrice(instruments().symbol(q.first), q.second);
+            for (const auto& q : s.lastAvail) market->restoreAvailable(instruments().symbol(q.first), q.second);
+            if (s.hasVolatility) market->setVolatility(s.volatility);
+        }
+        return true;
+    }
+
+    // Stream one segment through replayWindow in fixed-size windows
+    bool replaySegment(const string& fname, RecoveryStats& stats, char& lastType, uint64_t& lastDigest) {
+        FILE* fp = fopen(fname.c_str(), "rb");
+        if (!fp) return false;
+        fseek(fp, 0, SEEK_END);
+        long size = ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+        const size_t kWindow = min<size_t>(64 << 20, size > 0 ? (size_t)size + 1 : 1);
+        string buf;
+        size_t carry = 0;
+        bool ok = true;
+        for (;;) {
+            buf.resize(carry + kWindow);
+            size_t got = fread(&buf[carry], 1, kWindow, fp);
+            size_t len = carry + got;
+            size_t lastNl = len ? buf.rfind('\n', len - 1) : string::npos;
+            size_t whole = lastNl == string::npos ? 0 : lastNl + 1;
+            if (whole && !replayWindow(buf.data(), buf.data() + whole, stats, lastType, lastDigest)) { ok = false; break; }
+            carry = len - whole;
+            if (carry) memmove(&buf[0], &buf[whole], carry);
+            if (got < kWindow) {
+                stats.tornBytes += carry; // a record cut off by the crash; it was never committed
+                break;
+            }
+        }
+        fclose(fp);
+        return ok;
+    }
+
+    Recovery(const Recovery&);
+    Recovery& operator=(const Recovery&);
+public:
+    explicit Recovery(const string& p, unsigned nThreads = 0, bool syncOnCommit = true)
+        : prefix(p), threads(workerThreads(nThreads)),
+          durable(syncOnCommit), market(nullptr), book(nullptr), checkpointLsn(0), checkpointParts(0) {}
+
+    bool exists() const { return (bool)ifstream(currentFile()); }
+    Journal& log() { return journal; }
+    uint64_t lastCheckpoint() const { return checkpointLsn; }
+
+    // Start journaling a fresh state: checkpoint it as LSN 0 and open the journal
+    bool begin(Market& m, InvestorBook& b) {
+        market = &m;
+        book = &b;
+        if (!journal.open(prefix, 1, durable)) return false;
+        segments.assign(1, 1);
+        checkpointLsn = 0;
+        checkpointParts = 0;
+        market->attachJournal(&journal);
+        book->attachJournal(&journal);
+        return checkpoint();
+    }
+
+    // Re-attach after market/book were replaced wholesale (snapshot load, demo
+    // reset) and checkpoint, since those changes are not in the journal
+    bool rebase() {
+        market->attachJournal(&journal);
+        book->attachJournal(&journal);
+        return checkpoint();
+    }
+
+    bool checkpoint() {
+        if (!journal.commit()) return false;
+        uint64_t lsn = journal.lastLsn();
+        if (journal.segmentStart() != lsn + 1) {
+            if (!journal.open(prefix, lsn + 1, durable)) return false;
+        }
+        unsigned parts = (unsigned)max<size_t>(1, min<size_t>(threads, (book->size() + 4095) / 4096));
+        if (!writeCheckpoint(lsn, parts, stateDigest(*market, *book))) return false;
+        if (checkpointParts && checkpointLsn != lsn) removeCheckpoint(checkpointLsn, checkpointParts);
+        for (uint64_t s : segments)
+            if (s <= lsn) remove(Journal::segmentName(prefix, s).c_str());
+        segments.assign(1, lsn + 1);
+        checkpointLsn = lsn;
+        checkpointParts = parts;
+        return true;
+    }
+
+    // Rebuild m and b from the latest checkpoint plus the journal, then resume journaling
+    bool recover(Market& m, InvestorBook& b, RecoveryStats& stats) {
+        market = &m;
+        book = &b;
+        stats = RecoveryStats();
+        stats.threads = threads;
+        Stopwatch clock;
+        string line;
+        {
+            ifstream cur(currentFile());
+            if (!cur || !getline(cur, line)) {
+                cout << "Error: no checkpoint at " << currentFile() << ".\n";
+                return false;
+            }
+        }
+        line += '\n';
+        FieldReader hdr(line.data(), line.data() + line.size() - 1);
+        bool tagOk = hdr.str() == "CHECKPOINT";
+        uint64_t lsn = hdr.u64();
+        unsigned parts = (unsigned)hdr.u64();
+        size_t accounts = (size_t)hdr.u64();
+        double vol = hdr.num();
+        uint64_t digest = hdr.u64();
+        if (!tagOk || hdr.bad || parts == 0) {
+            cout << "Error: malformed " << currentFile() << ".\n";
+            return false;
+        }
+        market->attachJournal(nullptr);
+        {
+            ifstream mf(checkpointFile(lsn, "market"));
+            if (!mf || !market->loadSnapshot(mf)) {
+                cout << "Error: could not load market checkpoint.\n";
+                return false;
+            }
+        }
+        market->setVolatility(vol);
+        {
+            // absent in checkpoints from before the models file; the models then start afresh
+            ifstream sf(checkpointFile(lsn, "models"));
+            if (sf) market->loadModelState(sf);
+        }
+        book->attachJournal(nullptr);
+        book->clear();
+        book->resize(accounts);
+        atomic<bool> ok(true);
+        parallelFor(threads, parts, [&](unsigned k) {
+            FILE* fp = fopen(checkpointFile(lsn, to_string(k)).c_str(), "rb");
+            if (!fp) { ok = false; return; }
+            string data;
+            char chunk[1 << 16];
+            size_t n;
+            while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) data.append(chunk, n);
+            fclose(fp);
+            SymbolCache syms;
+            Investor* inv = nullptr;
+            const char* p = data.data();
+            const char* end = p + data.size();
+            while (p < end) {
+                const char* eol = static_cast<const char*>(memchr(p, '\n', end - p));
+                if (!eol || eol - p < 2) { ok = false; return; }
+                FieldReader r(p + 2, eol);
+                if (*p == 'A') {
+                    size_t acct = strtoull(p + 2, nullptr, 10);
+                    inv = acct < book->size() ? &(*book)[acct] : nullptr;
+                }
+                if (!inv || !inv->restoreLine(*p, r, syms)) { ok = false; return; }
+                p = eol + 1;
+            }
+        });
+        if (!ok) {
+            cout << "Error: could not load account checkpoint.\n";
+            return false;
+        }
+        if (stateDigest(*market, *book) != digest) {
+            cout << "Error: checkpoint " << lsn << " does not match its digest.\n";
+            return false;
+        }
+        stats.checkpointLsn = stats.lastLsn = lsn;
+        stats.accounts = book->size();
+        stats.loadSeconds = clock.seconds();
+
+        // follow the segment chain: each one starts right after the last record seen
+        clock = Stopwatch();
+        char lastType = 0;
+        uint64_t lastDigest = 0;
+        segments.clear();
+        for (uint64_t seg = lsn + 1;; seg = stats.lastLsn + 1) {
+            string fname = Journal::segmentName(prefix, seg);
+            if (!ifstream(fname)) break;
+            segments.push_back(seg);
+            uint64_t before = stats.lastLsn;
+            if (!replaySegment(fname, stats, lastType, lastDigest)) return false;
+            if (stats.lastLsn == before) break;
+        }
+        parallelFor(threads, threads, [&](unsigned t) {
+            for (size_t a = t; a < book->size(); a += threads) (*book)[a].finishReplay();
+        });
+        market->publish();
+        stats.accounts = book->size();
+        stats.replaySeconds = clock.seconds();
+        if (lastType == 'D') {
+            stats.digestChecked = true;
+            stats.digestOk = stateDigest(*market, *book) == lastDigest;
+        }
+
+        checkpointLsn = lsn;
+        checkpointParts = parts;
+        if (!journal.open(prefix, stats.lastLsn + 1, durable)) return false;
+        if (segments.empty() || segments.back() != stats.lastLsn + 1) segments.push_back(stats.lastLsn + 1);
+        market->attachJournal(&journal);
+        book->attachJournal(&journal);
+        return true;
+    }
+
+    // Clean shutdown: seal the log with a digest the next recovery can verify
+    bool shutdown() {
+        journal.logDigest(stateDigest(*market, *book));
+        bool ok = journal.commit();
+        journal.close();
+        return ok;
+    }
+
+    // Delete every file of this checkpoint/journal set
+    void removeFiles() {
+        journal.close();
+        if (checkpointParts) removeCheckpoint(checkpointLsn, checkpointParts);
+        for (uint64_t s : segments) remove(Journal::segmentName(prefix, s).c_str());
+        remove(currentFile().c_str());
+    }
+};
+
+// --------------------------- Investor store ---------------------------
+// A single-file database for more accounts than fit in memory (*.smdb). The
+// file is 4 KB pages read through a fixed-size page cache (CLOCK eviction;
+// dirty pages are written when evicted and by flush()):
+//
+//   page 0     header: "SMSTORE1", page size, root, tree height, free list,
+//              accounts, history append position
+//   B+tree     keyed by account id. Leaves are slotted pages: {id, offset,
+//              length} slots grow up from the header and values grow down
+//              from the end. Internal pages hold child page numbers between
+//              separator ids. A value is the account's checkpoint block (A/H/L
+//              lines, see Investor::writeCheckpoint) behind the position and
+//              length of its stored log; a value too big for a leaf lives in
+//              a chain of overflow pages.
+//   history    transaction log entries as X-line text, appended as accounts
+//              are written back, each linked to its account's previous entry;
+//              compactHistory() lays them out again account by account
+//   free       pages given back (replaced overflow chains, compacted history),
+//              linked from the header and reused before the file grows
+//
+// Accounts become Investor objects only when asked for, and at most a set
+// number stay loaded (least recently used go first; one changed through
+// edit() is written back on the way out). Logs stay on disk until
+// loadHistory() pages them in. A flush is not atomic; across a crash the
+// journal (Recovery) remains the source of truth.
+const size_t kStorePage = 4096;
+
+namespace storefmt {
+template <typename T> inline T get(const char* p) {
+    T v;
+    memcpy(&v, p, sizeof(T));
+    return v;
+}
+template <typename T> inline void put(char* p, T v) { memcpy(p, &v, sizeof(T)); }
+
+const char kMagic[8] = {'S', 'M', 'S', 'T', 'O', 'R', 'E', '1'};
+// byte 0 of every page; leaf and internal pages keep a u16 count at 2
+enum PageType : unsigned char { kFree = 0, kLeaf = 1, kInternal = 2, kHistory = 3, kOverflow = 4 };
+const size_t kHeaderBytes = 16;
+const size_t kSlotBytes = 12;         // leaf slot: u64 id, u16 value offset, u16 value length
+const size_t kEntryBytes = 12;        // internal entry: u64 separator, u32 child (ids >= separator)
+const size_t kMaxKeys = (kStorePage - kHeaderBytes) / kEntryBytes;
+const size_t kMaxInline = 1024;       // longer values go to overflow pages
+const uint16_t kOverflowBit = 0x8000; // in a slot's length: the value is {u32 first page, u32 length}
+const size_t kOverflowPayload = kStorePage - kHeaderBytes;
+const uint32_t kNoPage = 0xffffffffu;  // an empty cache frame
+
+inline uint16_t count(const char* pg) { return get<uint16_t>(pg + 2); }
+inline void setCount(char* pg, size_t n) { put<uint16_t>(pg + 2, (uint16_t)n); }
+// leaf: u16 start of the value area at 4, u32 right sibling at 8
+inline size_t dataStart(const char* pg) { return get<uint16_t>(pg + 4) ? get<uint16_t>(pg + 4) : kStorePage; }
+inline void setDataStart(char* pg, size_t off) { put<uint16_t>(pg + 4, (uint16_t)(off == kStorePage ? 0 : off)); }
+inline uint32_t next(const char* pg) { return get<uint32_t>(pg + 8); }
+inline void setNext(char* pg, uint32_t p) { put<uint32_t>(pg + 8, p); }
+inline char* slot(char* pg, size_t i) { return pg + kHeaderBytes + i * kSlotBytes; }
+inline const char* slot(const char* pg, size_t i) { return pg + kHeaderBytes + i * kSlotBytes; }
+inline uint64_t slotKey(const char* pg, size_t i) { return get<uint64_t>(slot(pg, i)); }
+inline uint16_t slotOffset(const char* pg, size_t i) { return get<uint16_t>(slot(pg, i) + 8); }
+inline uint16_t slotLength(const char* pg, size_t i) { return get<uint16_t>(slot(pg, i) + 10); }
+inline size_t valueBytes(uint16_t length) { return length & ~kOverflowBit; }
+inline size_t leafFree(const char* pg) { return dataStart(pg) - kHeaderBytes - count(pg) * kSlotBytes; }
+// first slot with an id >= key
+inline size_t leafFind(const char* pg, uint64_t key) {
+    size_t lo = 0, hi = count(pg);
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (slotKey(pg, mid) < key) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+// internal: u32 leftmost child at 8, then the entries
+inline uint64_t entryKey(const char* pg, size_t i) { return get<uint64_t>(pg + kHeaderBytes + i * kEntryBytes); }
+inline uint32_t entryChild(const char* pg, size_t i) { return get<uint32_t>(pg + kHeaderBytes + i * kEntryBytes + 8); }
+inline void setEntry(char* pg, size_t i, uint64_t key, uint32_t child) {
+    put<uint64_t>(pg + kHeaderBytes + i * kEntryBytes, key);
+    put<uint32_t>(pg + kHeaderBytes + i * kEntryBytes + 8, child);
+}
+// number of separators <= key, which is also the index of the child to follow
+inline size_t childIndex(const char* pg, uint64_t key) {
+    size_t lo = 0, hi = count(pg);
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (entryKey(pg, mid) <= key) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+inline uint32_t childAt(const char* pg, size_t j) { return j == 0 ? next(pg) : entryChild(pg, j - 1); }
+} // namespace storefmt
+
+// Fixed number of page frames over one file
+class PageCache {
+private:
+    FILE* fp;
+    uint32_t pages;          // pages in the file, including ones not written yet
+    size_t capacity;
+    vector<char> frames;
+    vector<uint32_t> pageOf; // page held by each frame, storefmt::kNoPage when free
+    vector<uint32_t> pins;
+    vector<unsigned char> dirty, referenced;
+    unordered_map<uint32_t, uint32_t> frameOf;
+    uint32_t hand;           // CLOCK position
+    uint64_t reads, writes, hits;
+
+    bool io(uint32_t page, char* buf, bool write) {
+        uint64_t off = (uint64_t)page * kStorePage;
+#ifdef _WIN32
+        if (_fseeki64(fp, (__int64)off, SEEK_SET) != 0) return false;
+#else
+        if (fseeko(fp, (off_t)off, SEEK_SET) != 0) return false;
+#endif
+        if (write) return fwrite(buf, 1, kStorePage, fp) == kStorePage;
+        size_t n = fread(buf, 1, kStorePage, fp);
+        memset(buf + n, 0, kStorePage - n); // past the end: never written
+        return !ferror(fp);
+    }
+    char* frame(uint32_t f) { return &frames[(size_t)f * kStorePage]; }
+
+    uint32_t victim() {
+        for (size_t scanned = 0; scanned <= 2 * capacity; ++scanned) {
+            uint32_t f = hand;
+            hand = (uint32_t)((hand + 1) % capacity);
+            if (pageOf[f] == storefmt::kNoPage) return f;
+            if (pins[f]) continue;
+            if (referenced[f]) {
+                referenced[f] = 0;
+                continue;
+            }
+            if (dirty[f]) {
+                if (!io(pageOf[f], frame(f), true)) throw runtime_error("investor store: cannot write page " + to_string(pageOf[f]));
+                dirty[f] = 0;
+                ++writes;
+            }
+            frameOf.erase(pageOf[f]);
+            pageOf[f] = storefmt::kNoPage;
+            return f;
+        }
+        throw runtime_error("investor store: every cached page is pinned");
+    }
+    uint32_t load(uint32_t page, bool read) {
+        auto it = frameOf.find(page);
+        if (it != frameOf.end()) {
+            ++hits;
+            referenced[it->second] = 1;
+            return it->second;
+        }
+        uint32_t f = victim();
+        if (read) {
+            if (!io(page, frame(f), false)) throw runtime_error("investor store: cannot read page " + to_string(page));
+            ++reads;
+        } else {
+            memset(frame(f), 0, kStorePage);
+        }
+        pageOf[f] = page;
+        frameOf[page] = f;
+        referenced[f] = 1;
+        dirty[f] = 0;
+        return f;
+    }
+
+    PageCache(const PageCache&);
+    PageCache& operator=(const PageCache&);
+public:
+    PageCache() : fp(nullptr), pages(0), capacity(0), hand(0), reads(0), writes(0), hits(0) {}
+    ~PageCache() { close(); }
+
+    // Open or create the file with room for `frameCount` pages in memory
+    bool open(const string& path, size_t frameCount) {
+        close();
+        fp = fopen(path.c_str(), "r+b");
+        if (!fp) fp = fopen(path.c_str(), "w+b");
+        if (!fp) return false;
+        setvbuf(fp, nullptr, _IONBF, 0); // whole pages only; the frames are the buffer
+#ifdef _WIN32
+        _fseeki64(fp, 0, SEEK_END);
+        pages = (uint32_t)(_ftelli64(fp) / kStorePage);
+#else
+        fseeko(fp, 0, SEEK_END);
+        pages = (uint32_t)(ftello(fp) / kStorePage);
+#endif
+        capacity = max<size_t>(frameCount, 64);
+        frames.assign(capacity * kStorePage, 0);
+        pageOf.assign(capacity, storefmt::kNoPage);
+        pins.assign(capacity, 0);
+        dirty.assign(capacity, 0);
+        referenced.assign(capacity, 0);
+        frameOf.clear();
+        frameOf.reserve(capacity * 2);
+        hand = 0;
+        reads = writes = hits = 0;
+        return true;
+    }
+
+    // Writes dirty pages back first
+    void close() {
+        if (!fp) return;
+        flush(false);
+        fclose(fp);
+        fp = nullptr;
+        frames.clear();
+        frames.shrink_to_fit();
+        frameOf.clear();
+    }
+
+    bool isOpen() const { return fp != nullptr; }
+    uint32_t pageCount() const { return pages; }
+    size_t frameCount() const { return capacity; }
+    size_t resident() const { return frameOf.size(); }
+    uint64_t pageReads() const { return reads; }
+    uint64_t pageWrites() const { return writes; }
+    uint64_t pageHits() const { return hits; }
+
+    // Keep the page in memory until unpin(); write marks it dirty
+    char* pin(uint32_t page, bool write) {
+        if (page >= pages) throw runtime_error("investor store: page " + to_string(page) + " is past the end");
+        uint32_t f = load(page, true);
+        ++pins[f];
+        if (write) dirty[f] = 1;
+        return frame(f);
+    }
+    void unpin(const char* data) { --pins[(size_t)(data - frames.data()) / kStorePage]; }
+    void markDirty(const char* data) { dirty[(size_t)(data - frames.data()) / kStorePage] = 1; }
+    // A zeroed page at the end of the file, pinned and dirty
+    char* append(uint32_t& page) {
+        page = pages++;
+        uint32_t f = load(page, false);
+        ++pins[f];
+        dirty[f] = 1;
+        return frame(f);
+    }
+
+    bool flush(bool durable) {
+        if (!fp) return false;
+        bool ok = true;
+        for (size_t f = 0; f < capacity; ++f) {
+            if (pageOf[f] == storefmt::kNoPage || !dirty[f]) continue;
+            if (io(pageOf[f], frame((uint32_t)f), true)) {
+                dirty[f] = 0;
+                ++writes;
+            } else {
+                ok = false;
+            }
+        }
+        ok = fflush(fp) == 0 && ok;
+        if (ok && durable) {
+#ifdef _WIN32
+            ok = _commit(_fileno(fp)) == 0;
+#else
+            ok = fsync(fileno(fp)) == 0;
+#endif
+        }
+        return ok;
+    }
+};
+
+// A pinned page for the length of a scope
+class PageRef {
+private:
+    PageCache* cache;
+    char* p;
+    PageRef(const PageRef&);
+    PageRef& operator=(const PageRef&);
+public:
+    PageRef(PageCache& c, uint32_t page, bool write = false) : cache(&c), p(c.pin(page, write)) {}
+    // a new page at the end of the file
+    PageRef(PageCache& c, uint32_t* page) : cache(&c), p(c.append(*page)) {}
+    ~PageRef() { cache->unpin(p); }
+    char* data() const { return p; }
+    void touch() { cache->markDirty(p); }
+};
+
+struct StoreStats {
+    uint64_t accounts;
+    uint64_t filePages;
+    uint32_t height;
+    size_t cachedPages;   // of frames
+    size_t frames;
+    uint64_t pageReads, pageWrites, pageHits;
+    size_t liveAccounts;  // loaded as Investor objects
+    uint64_t loads, hits, writeBacks, evictions;
+};
+
+// What InvestorStore::compactHistory() moved and gave back
+struct HistoryCompaction {
+    uint64_t entries; // log entries rewritten
+    uint64_t dropped; // older than the kept tail of their account's log
+    size_t oldPages;  // history pages put on the free list
+    size_t newPages;  // history pages the rewritten logs take
+};
+
+class InvestorStore {
+private:
+    struct Cached {
+        unique_ptr<Investor> inv;
+        uint64_t historyRef;   // newest stored log entry, 0 = none
+        uint64_t historyCount; // entries stored
+        uint64_t storedAtLoad; // ... of which were stored before this object was loaded
+        size_t unsaved;        // first entry of the object's log not stored yet
+        bool dirty;
+        bool historyLoaded;
+        list<uint64_t>::iterator lru;
+    };
+    struct Split {
+        bool happened;
+        uint64_t key;   // smallest id of the new right page
+        uint32_t right;
+        Split() : happened(false), key(0), right(0) {}
+    };
+    struct LeafEntry {
+        uint64_t key;
+        string bytes;
+        uint16_t length;
+    };
+
+    static const uint32_t kHeaderPage = 0;
+
+    PageCache cache;
+    bool durable; // fsync on flush
+    uint32_t root, height, freeHead, historyPage, historyUsed;
+    uint64_t accounts;
+    size_t maxLive;
+    unordered_map<uint64_t, Cached> live;
+    list<uint64_t> lru; // most recently used first
+    uint64_t loads, hits, writeBacks, evictions;
+    SymbolCache syms;
+    string scratch;
+
+    // ---- pages ----
+    uint32_t newPage(storefmt::PageType type) {
+        uint32_t page = freeHead;
+        if (page) {
+            PageRef r(cache, page, true);
+            freeHead = storefmt::next(r.data());
+            memset(r.data(), 0, kStorePage);
+            r.data()[0] = (char)type;
+        } else {
+            PageRef r(cache, &page);
+            r.data()[0] = (char)type;
+        }
+        return page;
+    }
+    void freePage(uint32_t page) {
+        PageRef r(cache, page, true);
+        memset(r.data(), 0, kStorePage);
+        storefmt::setNext(r.data(), freeHead);
+        freeHead = page;
+    }
+
+    void writeHeader() {
+        PageRef r(cache, kHeaderPage, true);
+        char* p = r.data();
+        memcpy(p, storefmt::kMagic, 8);
+        storefmt::put<uint32_t>(p + 8, (uint32_t)kStorePage);
+        storefmt::put<uint32_t>(p + 12, root);
+        storefmt::put<uint32_t>(p + 16, height);
+        storefmt::put<uint32_t>(p + 20, freeHead);
+        storefmt::put<uint64_t>(p + 24, accounts);
+        storefmt::put<uint32_t>(p + 32, historyPage);
+        storefmt::put<uint32_t>(p + 36, historyUsed);
+    }
+    bool readHeader() {
+        PageRef r(cache, kHeaderPage);
+        const char* p = r.data();
+        if (memcmp(p, storefmt::kMagic, 8) != 0 || storefmt::get<uint32_t>(p + 8) != kStorePage) return false;
+        root = storefmt::get<uint32_t>(p + 12);
+        height = storefmt::get<uint32_t>(p + 16);
+        freeHead = storefmt::get<uint32_t>(p + 20);
+        accounts = storefmt::get<uint64_t>(p + 24);
+        historyPage = storefmt::get<uint32_t>(p + 32);
+        historyUsed = storefmt::get<uint32_t>(p + 36);
+        return root != 0 && root < cache.pageCount();
+    }
+
+    // ---- overflow chains ----
+    uint32_t writeChain(const string& value) {
+        uint32_t first = 0, prev = 0;
+        for (size_t done = 0; done < value.size();) {
+            uint32_t page = newPage(storefmt::kOverflow);
+            size_t n = min(storefmt::kOverflowPayload, value.size() - done);
+            {
+                PageRef r(cache, page, true);
+                memcpy(r.data() + storefmt::kHeaderBytes, value.data() + done, n);
+            }
+            if (prev) {
+                PageRef p(cache, prev, true);
+                storefmt::setNext(p.data(), page);
+            } else {
+                first = page;
+            }
+            prev = page;
+            done += n;
+        }
+        return first;
+    }
+    void readChain(uint32_t page, size_t length, string& out) {
+        out.clear();
+        while (page && out.size() < length) {
+            PageRef r(cache, page);
+            size_t n = min(storefmt::kOverflowPayload, length - out.size());
+            out.append(r.data() + storefmt::kHeaderBytes, n);
+            page = storefmt::next(r.data());
+        }
+    }
+    void freeChain(uint32_t page) {
+        while (page) {
+            uint32_t next;
+            {
+                PageRef r(cache, page);
+                next = storefmt::next(r.data());
+            }
+            freePage(page);
+            page = next;
+        }
+    }
+
+    // ---- leaves ----
+    // Pack the values again, leaving out slot `skip`'s (it is about to be rewritten)
+    static void compactLeaf(char* pg, size_t skip) {
+        char copy[kStorePage];
+        memcpy(copy, pg, kStorePage);
+        size_t end = kStorePage;
+        for (size_t i = 0; i < storefmt::count(copy); ++i) {
+            size_t n = i == skip ? 0 : storefmt::valueBytes(storefmt::slotLength(copy, i));
+            end -= n;
+            memcpy(pg + end, copy + storefmt::slotOffset(copy, i), n);
+            storefmt::put<uint16_t>(storefmt::slot(pg, i) + 8, (uint16_t)end);
+        }
+        storefmt::setDataStart(pg, end);
+    }
+    static void writeLeaf(char* pg, const vector<LeafEntry>& es, size_t from, size_t to, uint32_t next) {
+        memset(pg, 0, kStorePage);
+        pg[0] = (char)storefmt::kLeaf;
+        storefmt::setCount(pg, to - from);
+        storefmt::setNext(pg, next);
+        size_t end = kStorePage;
+        for (size_t i = from; i < to; ++i) {
+            end -= es[i].bytes.size();
+            memcpy(pg + end, es[i].bytes.data(), es[i].bytes.size());
+            char* s = storefmt::slot(pg, i - from);
+            storefmt::put<uint64_t>(s, es[i].key);
+            storefmt::put<uint16_t>(s + 8, (uint16_t)end);
+            storefmt::put<uint16_t>(s + 10, es[i].length);
+        }
+        storefmt::setDataStart(pg, end);
+    }
+    // Insert or replace in place; false when the page has no room even compacted.
+    // oldChain gets the overflow chain of a replaced value.
+    static bool leafPut(char* pg, uint64_t key, const string& bytes, uint16_t length, uint32_t& oldChain) {
+        size_t n = storefmt::count(pg), i = storefmt::leafFind(pg, key);
+        bool exists = i < n && storefmt::slotKey(pg, i) == key;
+        if (exists) {
+            uint16_t old = storefmt::slotLength(pg, i);
+            if (old & storefmt::kOverflowBit) oldChain = storefmt::get<uint32_t>(pg + storefmt::slotOffset(pg, i));
+            if (bytes.size() <= storefmt::valueBytes(old)) {
+                memcpy(pg + storefmt::slotOffset(pg, i), bytes.data(), bytes.size());
+                storefmt::put<uint16_t>(storefmt::slot(pg, i) + 10, length);
+                return true;
+            }
+        }
+        size_t need = bytes.size() + (exists ? 0 : storefmt::kSlotBytes);
+        if (storefmt::leafFree(pg) < need) {
+            compactLeaf(pg, exists ? i : n);
+            if (storefmt::leafFree(pg) < need) return false;
+        }
+        if (!exists) {
+            memmove(storefmt::slot(pg, i + 1), storefmt::slot(pg, i), (n - i) * storefmt::kSlotBytes);
+            storefmt::setCount(pg, n + 1);
+            storefmt::put<uint64_t>(storefmt::slot(pg, i), key);
+        }
+        size_t at = storefmt::dataStart(pg) - bytes.size();
+        memcpy(pg + at, bytes.data(), bytes.size());
+        storefmt::setDataStart(pg, at);
+        storefmt::put<uint16_t>(storefmt::slot(pg, i) + 8, (uint16_t)at);
+        storefmt::put<uint16_t>(storefmt::slot(pg, i) + 10, length);
+        return true;
+    }
+    // After leafPut found no room: its compaction may have dropped the replaced
+    // value, so that slot's offset no longer points at it
+    Split splitLeaf(PageRef& ref, uint64_t key, const string& bytes, uint16_t length) {
+        char* pg = ref.data();
+        vector<LeafEntry> es;
+        size_t n = storefmt::count(pg);
+        bool placed = false, appended = false;
+        for (size_t i = 0; i <= n; ++i) {
+            uint64_t k = i < n ? storefmt::slotKey(pg, i) : 0;
+            if (!placed && (i == n || k >= key)) {
+                LeafEntry e = {key, bytes, length};
+                es.push_back(e);
+                placed = true;
+                appended = i == n;
+                if (i < n && k == key) continue; // leafPut already took its overflow chain
+            }
+            if (i == n) break;
+            uint16_t len = storefmt::slotLength(pg, i);
+            LeafEntry e = {k, string(pg + storefmt::slotOffset(pg, i), storefmt::valueBytes(len)), len};
+            es.push_back(e);
+        }
+        // ids mostly arrive in order: then the old page stays full and the new one starts empty
+        size_t cut = es.size() - 1;
+        if (!appended) {
+            size_t total = 0, acc = 0;
+            for (const LeafEntry& e : es) total += e.bytes.size() + storefmt::kSlotBytes;
+            for (cut = 0; cut + 1 < es.size() && acc < total / 2; ++cut) acc += es[cut].bytes.size() + storefmt::kSlotBytes;
+            cut = max<size_t>(cut, 1);
+        }
+        uint32_t right = newPage(storefmt::kLeaf);
+        PageRef r(cache, right, true);
+        writeLeaf(r.data(), es, cut, es.size(), storefmt::next(pg));
+        writeLeaf(pg, es, 0, cut, right);
+        ref.touch();
+        Split s;
+        s.happened = true;
+        s.key = es[cut].key;
+        s.right = right;
+        return s;
+    }
+
+    // ---- tree ----
+    // Put (key, child) as entry j of an internal page, splitting it when full
+    Split internalInsert(PageRef& ref, size_t j, uint64_t key, uint32_t child) {
+        char* pg = ref.data();
+        size_t n = storefmt::count(pg);
+        ref.touch();
+        if (n < storefmt::kMaxKeys) {
+            char* at = pg + storefmt::kHeaderBytes + j * storefmt::kEntryBytes;
+            memmove(at + storefmt::kEntryBytes, at, (n - j) * storefmt::kEntryBytes);
+            storefmt::setEntry(pg, j, key, child);
+            storefmt::setCount(pg, n + 1);
+            return Split();
+        }
+        vector<uint64_t> keys;
+        vector<uint32_t> kids(1, storefmt::next(pg));
+        for (size_t i = 0; i < n; ++i) {
+            if (i == j) {
+                keys.push_back(key);
+                kids.push_back(child);
+            }
+            keys.push_back(storefmt::entryKey(pg, i));
+            kids.push_back(storefmt::entryChild(pg, i));
+        }
+        if (j == n) {
+            keys.push_back(key);
+            kids.push_back(child);
+        }
+        size_t mid = keys.size() / 2;
+        uint32_t right = newPage(storefmt::kInternal);
+        PageRef r(cache, right, true);
+        storefmt::setNext(r.data(), kids[mid + 1]);
+        for (size_t i = mid + 1; i < keys.size(); ++i) storefmt::setEntry(r.data(), i - mid - 1, keys[i], kids[i + 1]);
+        storefmt::setCount(r.data(), keys.size() - mid - 1);
+        for (size_t i = 0; i < mid; ++i) storefmt::setEntry(pg, i, keys[i], kids[i + 1]);
+        storefmt::setCount(pg, mid);
+        Split s;
+        s.happened = true;
+        s.key = keys[mid];
+        s.right = right;
+        return s;
+    }
+    Split insert(uint32_t page, uint64_t key, const string& bytes, uint16_t length, uint32_t& oldChain) {
+        PageRef ref(cache, page);
+        char* pg = ref.data();
+        if (pg[0] == (char)storefmt::kLeaf) {
+            if (leafPut(pg, key, bytes, length, oldChain)) {
+                ref.touch();
+                return Split();
+            }
+            return splitLeaf(ref, key, bytes, length);
+        }
+        size_t j = storefmt::childIndex(pg, key);
+        Split s = insert(storefmt::childAt(pg, j), key, bytes, length, oldChain);
+        return s.happened ? internalInsert(ref, j, s.key, s.right) : s;
+    }
+    void putRecord(uint64_t key, const string& value) {
+        string bytes;
+        uint16_t length;
+        if (value.size() > storefmt::kMaxInline) {
+            bytes.resize(8);
+            storefmt::put<uint32_t>(&bytes[0], writeChain(value));
+            storefmt::put<uint32_t>(&bytes[4], (uint32_t)value.size());
+            length = (uint16_t)(8 | storefmt::kOverflowBit);
+        } else {
+            bytes = value;
+            length = (uint16_t)value.size();
+        }
+        uint32_t oldChain = 0;
+        Split s = insert(root, key, bytes, length, oldChain);
+        if (s.happened) {
+            uint32_t top = newPage(storefmt::kInternal);
+            PageRef r(cache, top, true);
+            storefmt::setNext(r.data(), root);
+            storefmt::setEntry(r.data(), 0, s.key, s.right);
+            storefmt::setCount(r.data(), 1);
+            root = top;
+            ++height;
+        }
+        if (oldChain) freeChain(oldChain);
+    }
+    bool getRecord(uint64_t key, string& value) {
+        for (uint32_t page = root;;) {
+            PageRef ref(cache, page);
+            const char* pg = ref.data();
+            if (pg[0] != (char)storefmt::kLeaf) {
+                page = storefmt::childAt(pg, storefmt::childIndex(pg, key));
+                continue;
+            }
+            size_t i = storefmt::leafFind(pg, key);
+            if (i == storefmt::count(pg) || storefmt::slotKey(pg, i) != key) return false;
+            uint16_t length = storefmt::slotLength(pg, i);
+            const char* v = pg + storefmt::slotOffset(pg, i);
+            if (length & storefmt::kOverflowBit) readChain(storefmt::get<uint32_t>(v), storefmt::get<uint32_t>(v + 4), value);
+            else value.assign(v, length);
+            return true;
+        }
+    }
+
+    // ---- history ----
+    // Entry: u32 text length, u64 the account's previous entry, text. Returns its position.
+    uint64_t appendHistory(uint64_t prev, const string& text) {
+        size_t need = 12 + text.size();
+        if (need > kStorePage - storefmt::kHeaderBytes) throw runtime_error("investor store: log entry too long");
+        if (!historyPage || historyUsed + need > kStorePage) {
+            historyPage = newPage(storefmt::kHistory);
+            historyUsed = (uint32_t)storefmt::kHeaderBytes;
+        }
+        PageRef r(cache, historyPage, true);
+        char* p = r.data() + historyUsed;
+        storefmt::put<uint32_t>(p, (uint32_t)text.size());
+        storefmt::put<uint64_t>(p + 4, prev);
+        memcpy(p + 12, text.data(), text.size());
+        uint64_t at = (uint64_t)historyPage * kStorePage + historyUsed;
+        historyUsed += (uint32_t)need;
+        return at;
+    }
+    // The stored log ending at `at`, oldest first
+    void readHistory(uint64_t at, vector<TxEntry>& out) {
+        out.clear();
+        string line;
+        while (at) {
+            PageRef r(cache, (uint32_t)(at / kStorePage));
+            const char* p = r.data() + at % kStorePage;
+            uint32_t n = storefmt::get<uint32_t>(p);
+            // parsed from a copy that ends in '\n', as FieldReader expects
+            line.assign(p + 12, n);
+            line += '\n';
+            FieldReader fr(line.data(), line.data() + n);
+            TxEntry e;
+            if (!parseTxFields(fr, e, syms)) throw runtime_error("investor store: bad log entry");
+            out.push_back(e);
+            at = storefmt::get<uint64_t>(p + 4);
+        }
+        reverse(out.begin(), out.end());
+    }
+
+    // The raw entries of the stored log ending at `at`, newest first, and the
+    // pages they sit on
+    void readHistoryText(uint64_t at, vector<string>& texts, vector<uint32_t>& pages) {
+        texts.clear();
+        while (at) {
+            uint32_t page = (uint32_t)(at / kStorePage);
+            PageRef r(cache, page);
+            const char* p = r.data() + at % kStorePage;
+            texts.push_back(string(p + 12, storefmt::get<uint32_t>(p)));
+            if (pages.empty() || pages.back() != page) pages.push_back(page);
+            at = storefmt::get<uint64_t>(p + 4);
+        }
+    }
+
+    // ---- accounts ----
+    void writeBack(uint64_t id, Cached& c) {
+        TransactionLog::Snapshot log = c.inv->transactions().snapshot();
+        for (size_t i = c.unsaved; i < log.size(); ++i) {
+            scratch.clear();
+            appendTxFields(scratch, log[i]);
+            c.historyRef = appendHistory(c.historyRef, scratch);
+            ++c.historyCount;
+        }
+        c.unsaved = log.size();
+        string value(16, '\0');
+        storefmt::put<uint64_t>(&value[0], c.historyRef);
+        storefmt::put<uint64_t>(&value[8], c.historyCount);
+        c.inv->writeCheckpoint(value, (uint32_t)id, false);
+        putRecord(id, value);
+        c.dirty = false;
+        ++writeBacks;
+    }
+
+    Cached* fetch(uint64_t id) {
+        if (id >= accounts) return nullptr;
+        auto it = live.find(id);
+        if (it != live.end()) {
+            ++hits;
+            lru.splice(lru.begin(), lru, it->second.lru);
+            return &it->second;
+        }
+        string value;
+        if (!getRecord(id, value) || value.size() < 16) throw runtime_error("investor store: account " + to_string(id) + " is missing");
+        Cached c;
+        c.inv.reset(new Investor());
+        c.historyRef = storefmt::get<uint64_t>(value.data());
+        c.historyCount = c.storedAtLoad = storefmt::get<uint64_t>(value.data() + 8);
+        c.unsaved = 0;
+        c.dirty = false;
+        c.historyLoaded = c.historyCount == 0;
+        const char* p = value.data() + 16;
+        const char* end = value.data() + value.size();
+        while (p < end) {
+            const char* eol = static_cast<const char*>(memchr(p, '\n', end - p));
+            FieldReader r(p + 2, eol ? eol : end);
+            if (!eol || eol - p < 2 || !c.inv->restoreLine(*p, r, syms))
+                throw runtime_error("investor store: account " + to_string(id) + " is damaged");
+            p = eol + 1;
+        }
+        c.inv->finishReplay();
+        ++loads;
+        lru.push_front(id);
+        c.lru = lru.begin();
+        Cached& slot = live.emplace(id, move(c)).first->second;
+        while (live.size() > maxLive && lru.back() != id) {
+            uint64_t old = lru.back();
+            Cached& o = live[old];
+            if (o.dirty) writeBack(old, o);
+            live.erase(old);
+            lru.pop_back();
+            ++evictions;
+        }
+        return &slot;
+    }
+
+    InvestorStore(const InvestorStore&);
+    InvestorStore& operator=(const InvestorStore&);
+public:
+    InvestorStore()
+        : durable(false), root(0), height(0), freeHead(0), historyPage(0), historyUsed(0), accounts(0), maxLive(1),
+          loads(0), hits(0), writeBacks(0), evictions(0) {}
+    ~InvestorStore() {
+        try {
+            close();
+        } catch (const exception& e) {
+            cout << "Error closing investor store: " << e.what() << "\n";
+        }
+    }
+
+    // Open the file, creating an empty store when it does not exist. cachePages
+    // bounds the page cache, liveAccounts the loaded Investor objects.
+    bool open(const string& file, size_t cachePages = 16384, size_t liveAccounts = 100000, bool sync = false) {
+        close();
+        if (!cache.open(file, cachePages)) return false;
+        durable = sync;
+        maxLive = max<size_t>(liveAccounts, 1);
+        loads = hits = writeBacks = evictions = 0;
+        if (cache.pageCount() == 0) {
+            uint32_t header;
+            { PageRef h(cache, &header); }
+            freeHead = historyPage = historyUsed = 0;
+            accounts = 0;
+            root = newPage(storefmt::kLeaf);
+            height = 1;
+            writeHeader();
+        } else if (!readHeader()) {
+            cache.close();
+            return false;
+        }
+        return true;
+    }
+
+    // Write everything back and release the file
+    bool close() {
+        if (!cache.isOpen()) return true;
+        bool ok = flush();
+        live.clear();
+        lru.clear();
+        cache.close();
+        return ok;
+    }
+
+    bool isOpen() const { return cache.isOpen(); }
+    uint64_t size() const { return accounts; }
+
+    // A new account; it is written to the store, not loaded
+    uint64_t create(const string& name, double cash) {
+        uint64_t id = accounts++;
+        Investor fresh(name, cash);
+        string value(16, '\0');
+        fresh.writeCheckpoint(value, (uint32_t)id, false);
+        putRecord(id, value);
+        return id;
+    }
+
+    // The account, loaded if it is not (null when there is no such account).
+    // Valid until the next call that may load another account. edit() is for
+    // changes: the account is written back before it is dropped.
+    const Investor* peek(uint64_t id) {
+        Cached* c = fetch(id);
+        return c ? c->inv.get() : nullptr;
+    }
+    Investor* edit(uint64_t id) {
+        Cached* c = fetch(id);
+        if (!c) return nullptr;
+        c->dirty = true;
+        return c->inv.get();
+    }
+
+    // Page the account's stored log in ahead of what it logged since loading
+    bool loadHistory(uint64_t id) {
+        Cached* c = fetch(id);
+        if (!c) return false;
+        if (c->historyLoaded) return true;
+        vector<TxEntry> stored;
+        readHistory(c->historyRef, stored);
+        stored.resize((size_t)c->storedAtLoad); // the rest came from this object and is in its log
+        c->inv->prependHistory(stored);
+        c->unsaved += stored.size();
+        c->historyLoaded = true;
+        return true;
+    }
+
+    // Everything the account has logged, without keeping it loaded
+    size_t history(uint64_t id, vector<TxEntry>& out) {
+        out.clear();
+        auto it = live.find(id);
+        if (it != live.end()) {
+            loadHistory(id);
+            TransactionLog::Snapshot log = it->second.inv->transactions().snapshot();
+            for (size_t i = 0; i < log.size(); ++i) out.push_back(log[i]);
+            return out.size();
+        }
+        string value;
+        if (id >= accounts || !getRecord(id, value) || value.size() < 16) return 0;
+        readHistory(storefmt::get<uint64_t>(value.data()), out);
+        return out.size();
+    }
+
+    // Copy each account's stored log, keeping at most its newest `keep` entries,
+    // into fresh history pages in order, so a log reads forward through a few
+    // adjacent pages, and put the old history pages on the free list for later
+    // pages to reuse. Every loaded account is written back and dropped first.
+    HistoryCompaction compactHistory(uint64_t keep = UINT64_MAX) {
+        HistoryCompaction out = {0, 0, 0, 0};
+        if (!cache.isOpen()) return out;
+        for (auto& kv : live)
+            if (kv.second.dirty) writeBack(kv.first, kv.second);
+        live.clear();
+        lru.clear();
+        vector<uint32_t> old;
+        if (historyPage) old.push_back(historyPage);
+        historyPage = historyUsed = 0; // rewritten entries start a new page
+        vector<uint32_t> fresh; // each is filled before the next is taken
+        vector<string> texts;
+        string value;
+        for (uint64_t id = 0; id < accounts; ++id) {
+            if (!getRecord(id, value) || value.size() < 16) continue;
+            uint64_t at = storefmt::get<uint64_t>(value.data());
+            if (!at) continue;
+            readHistoryText(at, texts, old);
+            size_t n = (size_t)min<uint64_t>(keep, texts.size());
+            uint64_t prev = 0;
+            for (size_t i = n; i-- > 0;) {
+                prev = appendHistory(prev, texts[i]);
+                if (fresh.empty() || fresh.back() != historyPage) fresh.push_back(historyPage);
+            }
+            out.entries += n;
+            out.dropped += texts.size() - n;
+            storefmt::put<uint64_t>(&value[0], prev);
+            storefmt::put<uint64_t>(&value[8], n);
+            putRecord(id, value);
+        }
+        sort(old.begin(), old.end());
+        old.erase(unique(old.begin(), old.end()), old.end());
+        for (uint32_t page : old) freePage(page);
+        out.oldPages = old.size();
+        out.newPages = fresh.size();
+        writeHeader();
+        return out;
+    }
+
+    // Write back every changed account and every dirty page
+    bool flush() {
+        if (!cache.isOpen()) return false;
+        for (auto& kv : live)
+            if (kv.second.dirty) writeBack(kv.first, kv.second);
+        writeHeader();
+        return cache.flush(durable);
+    }
+
+    StoreStats stats() const {
+        StoreStats s;
+        s.accounts = accounts;
+        s.filePages = cache.pageCount();
+        s.height = height;
+        s.cachedPages = cache.resident();
+        s.frames = cache.frameCount();
+        s.pageReads = cache.pageReads();
+        s.pageWrites = cache.pageWrites();
+        s.pageHits = cache.pageHits();
+        s.liveAccounts = live.size();
+        s.loads = loads;
+        s.hits = hits;
+        s.writeBacks = writeBacks;
+        s.evictions = evictions;
+        return s;
+    }
+};
+
+// --------------------------- Price triggers ---------------------------
+// Resting stop-loss, take-profit, buy and alert orders keyed by price level.
+enum class TriggerType : unsigned char { StopLoss, TakeProfit, BuyBelow, BuyAbove, AlertAbove, AlertBelow };
+
+inline const char* triggerTypeName(TriggerType t) {
+    switch (t) {
+        case TriggerType::StopLoss: return "STOP-LOSS";
+        case TriggerType::TakeProfit: return "TAKE-PROFIT";
+        case TriggerType::BuyBelow: return "BUY-BELOW";
+        case TriggerType::BuyAbove: return "BUY-ABOVE";
+        case TriggerType::AlertAbove: return "ALERT-ABOVE";
+        default: return "ALERT-BELOW";
+    }
+}
+inline bool parseTriggerType(const string& s, TriggerType& t) {
+    static const TriggerType all[] = {TriggerType::StopLoss, TriggerType::TakeProfit, TriggerType::BuyBelow,
+                                      TriggerType::BuyAbove, TriggerType::AlertAbove, TriggerType::AlertBelow};
+    for (TriggerType x : all)
+        if (s == triggerTypeName(x)) { t = x; return true; }
+    return false;
+}
+// Fires when the price rises to the level (otherwise when it falls to it)
+inline bool firesAbove(TriggerType t) {
+    return t == TriggerType::TakeProfit || t == TriggerType::BuyAbove || t == TriggerType::AlertAbove;
+}
+
+struct TriggerSpec {
+    uint32_t account;
+    InstrumentId instrument;
+    TriggerType type;
+    double level;
+    double qty; // units to trade; <= 0 sells the whole holding (ignored by alerts)
+};
+
+// One trigger that fired on a tick and what happened to its order
+struct TriggerEvent {
+    uint32_t id;
+    TriggerSpec spec;
+    double price;       // price that crossed the level
+    TradeStatus status; // Ok for alerts
+    TradeFill fill;
+};
+
+// Per instrument, two flat arrays of (level, id): "above" triggers sorted so
+// the lowest level is at the back, "below" triggers so the highest is at the
+// back. A tick pops from the back while the level is crossed, so it costs
+// O(fired) per instrument; insert is a binary search, and batches are merged
+// in one pass. Cancelled ids are tombstoned and swept out in bulk.
+class TriggerBook {
+private:
+    struct Entry {
+        double level;
+        uint32_t id;
+    };
+    struct Side {
+        vector<Entry> entries;
+        size_t dead; // cancelled ids still in entries
+        Side() : dead(0) {}
+    };
+    struct Sides {
+        Side above, below;
+    };
+    enum class State : unsigned char { Resting, Fired, Cancelled };
+
+    vector<TriggerSpec> specs; // by trigger id
+    vector<State> states;
+    vector<Sides> byInstrument;
+    size_t resting;
+
+    // Strict order with the next trigger to fire last; ties fire in id order
+    static bool aboveOrder(const Entry& a, const Entry& b) {
+        return a.level > b.level || (a.level == b.level && a.id > b.id);
+    }
+    static bool belowOrder(const Entry& a, const Entry& b) {
+        return a.level < b.level || (a.level == b.level && a.id > b.id);
+    }
+
+    Side& sideOf(const TriggerSpec& s) {
+        if (s.instrument >= byInstrument.size()) byInstrument.resize(s.instrument + 1);
+        return firesAbove(s.type) ? byInstrument[s.instrument].above : byInstrument[s.instrument].below;
+    }
+    uint32_t record(const TriggerSpec& s) {
+        uint32_t id = (uint32_t)specs.size();
+        specs.push_back(s);
+        states.push_back(State::Resting);
+        ++resting;
+        return id;
+    }
+    void sweep(Side& side) {
+        const vector<State>& st = states;
+        side.entries.erase(remove_if(side.entries.begin(), side.entries.end(),
+                                     [&st](const Entry& e) { return st[e.id] != State::Resting; }),
+                           side.entries.end());
+        side.dead = 0;
+    }
+public:
+    TriggerBook() : resting(0) {}
+
+    size_t size() const { return resting; }
+    const TriggerSpec& spec(uint32_t id) const { return specs[id]; }
+    bool isResting(uint32_t id) const { return id < states.size() && states[id] == State::Resting; }
+
+    uint32_t add(const TriggerSpec& s) {
+        uint32_t id = record(s);
+        Side& side = sideOf(s);
+        Entry e = {s.level, id};
+        auto cmp = firesAbove(s.type) ? aboveOrder : belowOrder;
+        side.entries.insert(upper_bound(side.entries.begin(), side.entries.end(), e, cmp), e);
+        return id;
+    }
+
+    // Ids are assigned in input order. Each touched side is sorted and merged once.
+    vector<uint32_t> addBatch(const vector<TriggerSpec>& batch) {
+        vector<uint32_t> ids;
+        ids.reserve(batch.size());
+        InstrumentId maxId = 0;
+        for (const TriggerSpec& s : batch) maxId = max(maxId, s.instrument);
+        if (!batch.empty() && maxId >= byInstrument.size()) byInstrument.resize(maxId + 1);
+        // where each side (instrument * 2 + above) stood before this batch
+        const size_t kUntouched = numeric_limits<size_t>::max();
+        vector<size_t> from(byInstrument.size() * 2, kUntouched);
+        vector<size_t> touched;
+        for (const TriggerSpec& s : batch) {
+            uint32_t id = record(s);
+            ids.push_back(id);
+            Side& side = sideOf(s);
+            size_t slot = s.instrument * 2 + (firesAbove(s.type) ? 1 : 0);
+            if (from[slot] == kUntouched) {
+                from[slot] = side.entries.size();
+                touched.push_back(slot);
+            }
+            Entry e = {s.level, id};
+            side.entries.push_back(e);
+        }
+        for (size_t slot : touched) {
+            bool above = slot & 1;
+            vector<Entry>& v = above ? byInstrument[slot / 2].above.entries : byInstrument[slot / 2].below.entries;
+            auto cmp = above ? aboveOrder : belowOrder;
+            auto mid = v.begin() + from[slot];
+            sort(mid, v.end(), cmp);
+            inplace_merge(v.begin(), mid, v.end(), cmp);
+        }
+        return ids;
+    }
+
+    bool cancel(uint32_t id) {
+        if (!isResting(id)) return false;
+        states[id] = State::Cancelled;
+        --resting;
+        Side& side = sideOf(specs[id]);
+        if (++side.dead * 2 > side.entries.size()) sweep(side);
+        return true;
+    }
+    size_t cancelBatch(const vector<uint32_t>& ids) {
+        size_t n = 0;
+        for (uint32_t id : ids)
+            if (cancel(id)) ++n;
+        return n;
+    }
+
+    // Pop every trigger whose level the current prices have crossed, in
+    // instrument order, then "above" before "below", each in firing order.
+    vector<uint32_t> collectFired(const MarketVersion& v) {
+        vector<uint32_t> fired;
+        size_t n = min(byInstrument.size(), v.price.size());
+        for (InstrumentId id = 0; id < n; ++id) {
+            if (!v.lists(id)) continue;
+            double px = v.price[id];
+            vector<Entry>& up = byInstrument[id].above.entries;
+            while (!up.empty() && up.back().level <= px) {
+                uint32_t t = up.back().id;
+                up.pop_back();
+                if (states[t] == State::Resting) fired.push_back(t);
+                else --byInstrument[id].above.dead;
+            }
+            vector<Entry>& down = byInstrument[id].below.entries;
+            while (!down.empty() && down.back().level >= px) {
+                uint32_t t = down.back().id;
+                down.pop_back();
+                if (states[t] == State::Resting) fired.push_back(t);
+                else --byInstrument[id].below.dead;
+            }
+        }
+        for (uint32_t t : fired) states[t] = State::Fired;
+        resting -= fired.size();
+        return fired;
+    }
+
+    // Check the latest prices and send fired orders through the owning
+    // investor's trade path (the same tryBuy/trySell behind Investor::buy/sell).
+    vector<TriggerEvent> evaluate(Market& market, InvestorBook& book) {
+        vector<uint32_t> fired;
+        vector<double> prices;
+        {
+            EpochGuard guard;
+            const MarketVersion* v = market.view();
+            fired = collectFired(*v);
+            for (uint32_t t : fired) prices.push_back(v->price[specs[t].instrument]);
+        }
+        vector<TriggerEvent> events(fired.size());
+        for (size_t i = 0; i < fired.size(); ++i) {
+            TriggerEvent& ev = events[i];
+            ev.id = fired[i];
+            ev.spec = specs[fired[i]];
+            ev.price = prices[i];
+            ev.status = TradeStatus::Ok;
+            if (ev.spec.account >= book.size()) {
+                ev.status = TradeStatus::NotHeld;
+                continue;
+            }
+            Investor& inv = book[ev.spec.account];
+            const string& sym = instruments().symbol(ev.spec.instrument);
+            switch (ev.spec.type) {
+                case TriggerType::StopLoss:
+                case TriggerType::TakeProfit: {
+                    double qty = ev.spec.qty;
+                    if (qty <= 0) {
+                        EpochGuard guard;
+                        const Holding* h = inv.view()->holdings.find(ev.spec.instrument);
+                        qty = h ? h->quantity : 0.0;
+                        if (qty <= 0) { ev.status = TradeStatus::NotHeld; break; }
+                    }
+                    ev.status = inv.trySell(market, sym, qty, &ev.fill);
+                    break;
+                }
+                case TriggerType::BuyBelow:
+                case TriggerType::BuyAbove:
+                    ev.status = inv.tryBuy(market, sym, ev.spec.qty, &ev.fill);
+                    break;
+                default:
+                    break;
+            }
+        }
+        return events;
+    }
+
+    // Resting triggers of one account, in id order
+    vector<uint32_t> restingFor(uint32_t account) const {
+        vector<uint32_t> out;
+        for (uint32_t id = 0; id < specs.size(); ++id)
+            if (states[id] == State::Resting && specs[id].account == account) out.push_back(id);
+        return out;
+    }
+};
+
+void printTriggerEvents(const vector<TriggerEvent>& events) {
+    for (const TriggerEvent& ev : events) {
+        const string& sym = instruments().symbol(ev.spec.instrument);
+        cout << "Trigger #" << ev.id << " " << triggerTypeName(ev.spec.type) << " " << sym << " @ "
+             << fixed << setprecision(2) << ev.spec.level << " fired at " << ev.price << ": ";
+        if (ev.spec.type == TriggerType::AlertAbove || ev.spec.type == TriggerType::AlertBelow)
+            cout << "alert.\n";
+        else if (ev.status != TradeStatus::Ok)
+            cout << tradeStatusMessage(ev.status) << "\n";
+        else if (ev.spec.type == TriggerType::BuyBelow || ev.spec.type == TriggerType::BuyAbove)
+            cout << "Bought " << ev.fill.qty << " for " << ev.fill.amount << ".\n";
+        else
+            cout << "Sold " << ev.fill.qty << " for " << ev.fill.amount << ".\n";
+    }
+}
+
+// --------------------------- Load generator ---------------------------
+// Simulated traders that hit the Market concurrently through the Investor API.
+
+// Log-linear latency histogram: 16 buckets per power of two, so any reported
+// percentile is within about 6% of the true value.
+class LatencyHistogram {
+public:
+    LatencyHistogram() : total(0), maxNs(0) { memset(counts, 0, sizeof(counts)); }
+
+    void add(uint64_t ns) {
+        ++counts[bucket(ns)];
+        ++total;
+        if (ns > maxNs) maxNs = ns;
+    }
+    void merge(const LatencyHistogram& o) {
+        for (int i = 0; i < kBuckets; ++i) counts[i] += o.counts[i];
+        total += o.total;
+        maxNs = max(maxNs, o.maxNs);
+    }
+    uint64_t count() const { return total; }
+    uint64_t maxLatency() const { return maxNs; }
+
+    // Upper bound of the bucket holding the q-th quantile (0 < q <= 1)
+    uint64_t percentile(double q) const {
+        if (total == 0) return 0;
+        uint64_t rank = (uint64_t)ceil(q * total), seen = 0;
+        for (int b = 0; b < kBuckets; ++b) {
+            seen += counts[b];
+            if (seen >= rank) return std::min(upperBound(b), maxNs);
+        }
+        return maxNs;
+    }
+
+private:
+    static const int kSub = 16;
+    static const int kBuckets = 61 * kSub;
+    uint64_t counts[kBuckets];
+    uint64_t total;
+    uint64_t maxNs;
+
+    static int bucket(uint64_t ns) {
+        if (ns < (uint64_t)kSub) return (int)ns;
+        int msb = 63 - __builtin_clzll(ns);
+        return (msb - 3) * kSub + (int)((ns >> (msb - 4)) & (kSub - 1));
+    }
+    static uint64_t upperBound(int b) {
+        if (b < kSub) return (uint64_t)b;
+        int msb = b / kSub + 3;
+        return ((uint64_t)(kSub + b % kSub + 1) << (msb - 4)) - 1;
+    }
+};
+
+enum class AgentKind : unsigned char { Momentum, MeanReversion, Noise, MarketMaker };
+const int kAgentKinds = 4;
+
+inline const char* agentKindName(AgentKind k) {
+    switch (k) {
+        case AgentKind::Momentum: return "momentum";
+        case AgentKind::MeanReversion: return "mean-reversion";
+        case AgentKind::Noise: return "noise";
+        default: return "market-maker";
+    }
+}
+
+// Everything a trader remembers between decisions: 20 bytes, so a million
+// agents are 20 MB and a worker's chunk of them stays in cache.
+struct Agent {
+    uint32_t account;
+    InstrumentId instrument; // the one symbol it trades
+    float anchor;            // price EMA (momentum, mean reversion) or last quote seen (market maker)
+    uint32_t rng;            // xorshift32 state, never 0
+    AgentKind kind;
+};
+
+inline uint32_t xorshift32(uint32_t& s) {
+    s ^= s << 13;
+    s ^= s >> 17;
+    s ^= s << 5;
+    return s;
+}
+
+// Order the agent places after seeing price px: > 0 buys, < 0 sells, 0 holds
+inline double agentDecide(Agent& a, double px) {
+    if (a.anchor <= 0.0f) {
+        a.anchor = (float)px;
+        return 0.0;
+    }
+    double dev = px / a.anchor - 1.0;
+    uint32_t r = xorshift32(a.rng);
+    double qty = 1 + r % 4;
+    switch (a.kind) {
+        case AgentKind::Momentum: // follow the move away from the trend
+            a.anchor += 0.25f * ((float)px - a.anchor);
+            return dev > 0.001 ? qty : dev < -0.001 ? -qty : 0.0;
+        case AgentKind::MeanReversion: // bet on the return to the trend
+            a.anchor += 0.05f * ((float)px - a.anchor);
+            return dev < -0.002 ? qty : dev > 0.002 ? -qty : 0.0;
+        case AgentKind::Noise:
+            return (r >> 16) & 1 ? qty : -qty;
+        default: // market maker: its bid is hit when the price falls, its ask lifted when it rises
+            a.anchor = (float)px;
+            if (dev == 0.0) return (r >> 16) & 1 ? 2.0 : -2.0;
+            return dev < 0.0 ? 5.0 : -5.0;
+    }
+}
+
+struct LoadGenConfig {
+    size_t agents;
+    double rate;        // target orders/sec; 0 = as fast as the engine allows
+    double seconds;
+    unsigned threads;   // 0 = one per core
+    size_t instruments;
+    double tickMs;      // simulatePriceMovement period, run on its own thread
+    LoadGenConfig() : agents(10000), rate(0.0), seconds(5.0), threads(0), instruments(200), tickMs(10.0) {}
+};
+
+// What one worker saw; merged after the run
+struct AgentWorkerStats {
+    uint64_t woken;  // agent looked at the market
+    uint64_t orders; // ... and placed an order
+    uint64_t fills;
+    uint64_t ordersByKind[kAgentKinds];
+    uint64_t rejects[kTradeStatuses];
+    LatencyHistogram latency; // time inside tryBuy/trySell, lock wait included
+    AgentWorkerStats() : woken(0), orders(0), fills(0) {
+        memset(ordersByKind, 0, sizeof(ordersByKind));
+        memset(rejects, 0, sizeof(rejects));
+    }
+};
+
+// Build a market and one account per agent, let the agents trade for the
+// configured time while a ticker thread moves prices, then report throughput
+// and engine latency.
+int runLoadGenerator(const LoadGenConfig& cfg) {
+    if (cfg.agents == 0 || cfg.instruments == 0 || cfg.seconds <= 0.0) {
+        cout << "Load generator needs agents, instruments and a positive duration.\n";
+        return 1;
+    }
+    Market market;
+    vector<InstrumentId> ids;
+    for (size_t i = 0; i < cfg.instruments; ++i) {
+        string sym = "LG" + to_string(i);
+        if (i % 10 == 9) market.addFund(MutualFund("Load Fund " + to_string(i), sym, 50.0, 1e12));
+        else market.addStock(Stock("Load Stock " + to_string(i), sym, 100.0 + i % 50, 2000000000));
+        ids.push_back(instruments().find(sym));
+    }
+
+    // 30% momentum, 30% mean reversion, 30% noise, 10% market makers
+    InvestorBook book;
+    vector<Agent> agents(cfg.agents);
+    size_t population[kAgentKinds] = {0, 0, 0, 0};
+    mt19937 rng(2024);
+    for (size_t i = 0; i < cfg.agents; ++i) {
+        Agent& a = agents[i];
+        unsigned slot = i % 10;
+        a.kind = slot < 3 ? AgentKind::Momentum : slot < 6 ? AgentKind::MeanReversion
+               : slot < 9 ? AgentKind::Noise : AgentKind::MarketMaker;
+        a.account = (uint32_t)i;
+        a.instrument = ids[rng() % ids.size()];
+        a.anchor = 0.0f;
+        a.rng = rng() | 1;
+        ++population[(int)a.kind];
+        Investor& inv = book.open("AGENT" + to_string(i), 1e6);
+        // market makers start with inventory so they can quote both sides
+        if (a.kind == AgentKind::MarketMaker) inv.tryBuy(market, instruments().symbol(a.instrument), 500);
+    }
+
+    WorkStealingPool pool(cfg.threads);
+    vector<AgentWorkerStats> stats(pool.size());
+    const size_t chunk = 256;
+    const size_t chunks = (agents.size() + chunk - 1) / chunk;
+    const double roundSecs = 0.005;
+    // Chance that an agent looks at the market in a round, as a cut-off on its rng.
+    // With a target rate it is re-aimed every round at the orders still owed.
+    uint32_t wakeCut = 0xffffffffu;
+
+    auto runChunk = [&](size_t c, unsigned worker) {
+        AgentWorkerStats& ws = stats[worker];
+        size_t end = min(agents.size(), (c + 1) * chunk);
+        for (size_t i = c * chunk; i < end; ++i) {
+            Agent& a = agents[i];
+            if (xorshift32(a.rng) > wakeCut) continue;
+            ++ws.woken;
+            double px;
+            {
+                EpochGuard guard;
+                px = market.view()->price[a.instrument];
+            }
+            double qty = agentDecide(a, px);
+            if (qty == 0.0) continue;
+            Investor& inv = book[a.account];
+            const string& sym = instruments().symbol(a.instrument);
+            Timestamp t0 = clockNow();
+            TradeStatus st = qty > 0 ? inv.tryBuy(market, sym, qty) : inv.trySell(market, sym, -qty);
+            ws.latency.add((uint64_t)(clockNow() - t0));
+            ++ws.orders;
+            ++ws.ordersByKind[(int)a.kind];
+            if (st == TradeStatus::Ok) ++ws.fills;
+            else ++ws.rejects[(int)st];
+        }
+    };
+
+    atomic<bool> done(false);
+    atomic<uint64_t> ticks(0);
+    thread ticker([&] {
+        chrono::steady_clock::time_point next = chrono::steady_clock::now();
+        while (!done.load()) {
+            next += chrono::microseconds((long long)(cfg.tickMs * 1000.0));
+            this_thread::sleep_until(next);
+            market.simulatePriceMovement();
+            ticks.fetch_add(1);
+        }
+    });
+
+    Stopwatch clock;
+    uint64_t rounds = 0;
+    while (clock.seconds() < cfg.seconds) {
+        chrono::steady_clock::time_point roundEnd =
+            chrono::steady_clock::now() + chrono::microseconds((long long)(roundSecs * 1e6));
+        if (cfg.rate > 0.0) {
+            uint64_t woken = 0, orders = 0;
+            for (const AgentWorkerStats& ws : stats) {
+                woken += ws.woken;
+                orders += ws.orders;
+            }
+            double perWake = woken > 1000 ? (double)orders / woken : 0.5; // not every agent trades when it looks
+            double owed = cfg.rate * (clock.seconds() + roundSecs) - (double)orders;
+            double wake = owed <= 0.0 ? 0.0 : owed / (perWake * agents.size());
+            wakeCut = wake >= 1.0 ? 0xffffffffu : (uint32_t)(wake * 4294967295.0);
+        }
+        for (size_t c = 0; c < chunks; ++c)
+            pool.submit([&runChunk, c](unsigned worker) { runChunk(c, worker); }, c);
+        pool.wait();
+        ++rounds;
+        if (cfg.rate > 0.0) this_thread::sleep_until(roundEnd);
+    }
+    double elapsed = clock.seconds();
+    done.store(true);
+    ticker.join();
+
+    AgentWorkerStats total;
+    for (const AgentWorkerStats& ws : stats) {
+        total.orders += ws.orders;
+        total.fills += ws.fills;
+        for (int k = 0; k < kAgentKinds; ++k) total.ordersByKind[k] += ws.ordersByKind[k];
+        for (int s = 0; s < kTradeStatuses; ++s) total.rejects[s] += ws.rejects[s];
+        total.latency.merge(ws.latency);
+    }
+
+    ios::fmtflags flags = cout.flags();
+    streamsize prec = cout.precision();
+    cout << "\n---- load generator ----\n";
+    cout << cfg.agents << " agents on " << cfg.instruments << " instruments, " << pool.size() << " worker threads, "
+         << fixed << setprecision(1) << elapsed << " s, target ";
+    if (cfg.rate > 0.0) cout << setprecision(0) << cfg.rate << " orders/s\n";
+    else cout << "unthrottled\n";
+    cout << left << setw(16) << "Agent kind" << right << setw(10) << "agents" << setw(14) << "orders" << "\n";
+    for (int k = 0; k < kAgentKinds; ++k)
+        cout << left << setw(16) << agentKindName((AgentKind)k) << right << setw(10) << population[k]
+             << setw(14) << total.ordersByKind[k] << "\n";
+    cout << "orders: " << total.orders << " (" << total.fills << " filled, " << total.orders - total.fills
+         << " rejected)\n";
+    for (int s = 0; s < kTradeStatuses; ++s)
+        if (total.rejects[s]) cout << "  " << total.rejects[s] << " x " << tradeStatusMessage((TradeStatus)s) << "\n";
+    cout << "achieved: " << setprecision(0) << total.orders / elapsed << " orders/s over " << rounds << " rounds, "
+         << ticks.load() << " price ticks, " << pool.steals() << " stolen tasks\n";
+    cout << "engine latency (ns): p50 " << total.latency.percentile(0.50) << "  p90 " << total.latency.percentile(0.90)
+         << "  p99 " << total.latency.percentile(0.99) << "  p99.9 " << total.latency.percentile(0.999)
+         << "  max " << total.latency.maxLatency() << "\n";
+    cout.flags(flags);
+    cout.precision(prec);
+    return 0;
+}
+
+// --------------------------- Corporate actions ---------------------------
+struct CorporateActionStats {
+    size_t candidates; // accounts the holder index named
+    size_t adjusted;   // positions actually changed
+    double cash;       // dividends and cash in lieu paid out
+    unsigned threads;
+    double seconds;
+    uint64_t lsn;      // journal record of the action; 0 when not journaling
+    CorporateActionStats() : candidates(0), adjusted(0), cash(0.0), threads(1), seconds(0.0), lsn(0) {}
+};
+
+// Applies splits and dividends to the market and to every position in the
+// instrument at once. Holders come from the book's HolderIndex and are split
+// into contiguous ranges across threads; the journal gets the market's one C
+// record, which replay applies to the holders again (see Recovery).
+class CorporateActionEngine {
+private:
+    Market* market;
+    InvestorBook* book;
+    unsigned threads;
+    static const size_t kPerThread = 4096; // fewer holders than this per thread run inline
+
+    CorporateActionEngine(const CorporateActionEngine&);
+    CorporateActionEngine& operator=(const CorporateActionEngine&);
+public:
+    CorporateActionEngine(Market& m, InvestorBook& b, unsigned nThreads = 0)
+        : market(&m), book(&b), threads(workerThreads(nThreads)) {}
+
+    // Trading is held off (writeMutex) until every holder is adjusted, so no
+    // trade sees the new quote against an old position.
+    bool apply(const CorporateAction& a, Timestamp at, CorporateActionStats* stats = nullptr) {
+        CorporateActionStats local;
+        CorporateActionStats& st = stats ? *stats : local;
+        st = CorporateActionStats();
+        Stopwatch t;
+        lock_guard<mutex> lk(market->writeMutex());
+        double priceAfter = 0.0;
+        if (!market->corporateAction(a, at, &st.lsn, &priceAfter)) return false;
+        HolderIndex& index = book->holders();
+        size_t seen = index.entries(a.instrument);
+        vector<uint32_t> cands = index.holders(a.instrument);
+        st.candidates = cands.size();
+        unsigned nt = (unsigned)max<size_t>(1, min<size_t>(threads, cands.size() / kPerThread));
+        st.threads = nt;
+        vector<unsigned char> held(cands.size(), 0);
+        vector<double> paid(nt, 0.0);
+        vector<size_t> adjusted(nt, 0);
+        auto work = [&](unsigned k) {
+            size_t begin = cands.size() * k / nt, end = cands.size() * (k + 1) / nt;
+            for (size_t i = begin; i < end; ++i) {
+                if (cands[i] >= book->size()) continue;
+                Investor& inv = (*book)[cands[i]];
+                double cash = 0.0;
+                if (inv.applyCorporateAction(a, st.lsn, at, priceAfter, &cash)) ++adjusted[k];
+                paid[k] += cash;
+                held[i] = inv.holds(a.instrument);
+            }
+        };
+        parallelFor(nt, nt, work);
+        vector<uint32_t> live;
+        for (size_t i = 0; i < cands.size(); ++i)
+            if (held[i]) live.push_back(cands[i]);
+        index.prune(a.instrument, seen, live);
+        for (unsigned k = 0; k < nt; ++k) {
+            st.cash += paid[k];
+            st.adjusted += adjusted[k];
+        }
+        st.seconds = t.seconds();
+        return true;
+    }
+};
+
+// --------------------------- Event scheduler ---------------------------
+// Simulated-time driver for a Market: trading sessions, per-symbol tick rates,
+// earnings gaps, dividends and splits. Events wait in a 4-ary min-heap keyed
+// on (time, insertion order). Everything due at one instant is drained as a
+// batch, and the batch's ticks go through a single simulatePriceMovement.
+enum class SimEventKind : unsigned char { Open, Close, Tick, Earnings, Dividend, Split };
+
+struct SimEvent {
+    Timestamp at;
+    double value;            // earnings log return, dividend per unit or split ratio
+    InstrumentId instrument; // kNoInstrument for session events
+    SimEventKind kind;
+};
+
+// The heap orders 16-byte keys with four children per node: half the depth of
+// a binary heap, and a node's children share one cache line. Events wait in a
+// slab beside it and are only touched when pushed and popped.
+class EventQueue {
+private:
+    struct Key {
+        Timestamp at;
+        uint32_t seq;  // insertion order, breaks ties at one instant (wraps after 4G
+                       // pushes, which can only reorder events of one instant)
+        uint32_t slot; // into events
+    };
+    vector<Key> heap;
+    vector<SimEvent> events;
+    vector<uint32_t> freeSlots;
+    uint32_t nextSeq;
+    static bool before(const Key& a, const Key& b) {
+        return a.at < b.at || (a.at == b.at && (int32_t)(a.seq - b.seq) < 0);
+    }
+public:
+    EventQueue() : nextSeq(0) {}
+    bool empty() const { return heap.empty(); }
+    size_t size() const { return heap.size(); }
+    const SimEvent& top() const { return events[heap.front().slot]; }
+    void clear() {
+        heap.clear();
+        events.clear();
+        freeSlots.clear();
+    }
+
+    void push(Timestamp at, SimEventKind kind, InstrumentId inst = kNoInstrument, double value = 0.0) {
+        Key k;
+        k.at = at;
+        k.seq = nextSeq++;
+        if (freeSlots.empty()) {
+            k.slot = (uint32_t)events.size();
+            events.push_back(SimEvent());
+        } else {
+            k.slot = freeSlots.back();
+            freeSlots.pop_back();
+        }
+        SimEvent& e = events[k.slot];
+        e.at = at;
+        e.value = value;
+        e.instrument = inst;
+        e.kind = kind;
+        size_t i = heap.size();
+        heap.push_back(k);
+        while (i > 0) {
+            size_t parent = (i - 1) / 4;
+            if (!before(k, heap[parent])) break;
+            heap[i] = heap[parent];
+            i = parent;
+        }
+        heap[i] = k;
+    }
+    void pop() {
+        freeSlots.push_back(heap.front().slot);
+        Key last = heap.back();
+        heap.pop_back();
+        size_t n = heap.size();
+        if (n == 0) return;
+        // Walk the hole down to a leaf along the smallest children, then sift
+        // the last key up from there. It almost always belongs near the bottom,
+        // so this saves comparing it at every level on the way down.
+        size_t i = 0;
+        for (;;) {
+            size_t c = 4 * i + 1;
+            if (c >= n) break;
+            size_t best;
+            if (c + 3 < n) {
+                size_t a = before(heap[c + 1], heap[c]) ? c + 1 : c;
+                size_t b = before(heap[c + 3], heap[c + 2]) ? c + 3 : c + 2;
+                best = before(heap[b], heap[a]) ? b : a;
+            } else {
+                best = c;
+                for (size_t k = c + 1; k < n; ++k)
+                    if (before(heap[k], heap[best])) best = k;
+            }
+            heap[i] = heap[best];
+            i = best;
+        }
+        while (i > 0) {
+            size_t parent = (i - 1) / 4;
+            if (!before(last, heap[parent])) break;
+            heap[i] = heap[parent];
+            i = parent;
+        }
+        heap[i] = last;
+    }
+};
+
+struct SimConfig {
+    int openMinute, closeMinute; // session, in minutes after local midnight, Monday to Friday
+    Timestamp tickInterval;      // for instruments without a rate of their own
+    int earningsEvery;           // trading days between a stock's results (staggered by id); 0 = none
+    double earningsVol;          // stdev of the log gap when results come out
+    double dividendYield;        // annual, paid quarterly by stocks; 0 = none
+    int exDividendLag;           // trading days from results to ex-dividend
+    double splitAbove;           // a stock opening above this price splits; 0 = never
+    double splitRatio;
+    bool batchTicks;             // false ticks once per event (the benchmark's baseline)
+    SimConfig()
+        : openMinute(9 * 60 + 15), closeMinute(15 * 60 + 30), tickInterval(60 * kNsPerSecond),
+          earningsEvery(63), earningsVol(0.05), dividendYield(0.015), exDividendLag(10),
+          splitAbove(5000.0), splitRatio(2.0), batchTicks(true) {}
+};
+
+struct SimStats {
+    size_t sessions;
+    size_t events;
+    size_t batches;    // simulatePriceMovement calls
+    size_t ticks;      // instrument ticks inside them
+    size_t earnings, dividends, splits;
+    Timestamp simulated;
+    double seconds;
+    SimStats() : sessions(0), events(0), batches(0), ticks(0), earnings(0), dividends(0), splits(0),
+                 simulated(0), seconds(0.0) {}
+};
+
+class MarketScheduler {
+private:
+    Market* market;
+    CorporateActionEngine* actions; // not owned; when set, dividends and splits reach the holders
+    SimConfig config;
+    EventQueue queue;
+    Timestamp clock;              // simulated now
+    Timestamp closeAt;            // end of the running session
+    bool open;
+    int64_t day;                  // civil day of the next (or running) session
+    uint64_t tradingDay;          // sessions opened so far
+    vector<Timestamp> interval;   // tick period by instrument id; 0 = config.tickInterval
+    vector<InstrumentId> dueList; // ticks popped at this instant
+    vector<InstrumentId> moving;  // the ones moving in the current call
+    vector<unsigned char> due;    // the same as a mask by instrument id
+    mt19937_64 rng;
+    function<void(Timestamp)> onBatch;
+    SimStats stats;
+
+    // Local time `minute` minutes into civil day d (mktime normalises the day count)
+    static Timestamp localTime(int64_t d, int minute) {
+        tm lt;
+        memset(&lt, 0, sizeof(lt));
+        lt.tm_year = 70;
+        lt.tm_mday = (int)(1 + d);
+        lt.tm_min = minute;
+        lt.tm_isdst = -1;
+        return (Timestamp)mktime(&lt) * kNsPerSecond;
+    }
+    static int64_t localDay(Timestamp t) {
+        time_t tt = (time_t)(t / kNsPerSecond);
+        tm lt;
+#ifdef _WIN32
+        localtime_s(&lt, &tt);
+#else
+        localtime_r(&tt, &lt);
+#endif
+        return daysFromCivil(lt.tm_year + 1900, (unsigned)lt.tm_mon + 1, (unsigned)lt.tm_mday);
+    }
+
+    void scheduleOpen() {
+        while ((day + 4) % 7 == 0 || (day + 4) % 7 == 6) ++day; // 1970-01-01 was a Thursday
+        queue.push(localTime(day, config.openMinute), SimEventKind::Open);
+    }
+    Timestamp periodOf(InstrumentId id) const {
+        return id < interval.size() && interval[id] > 0 ? interval[id] : config.tickInterval;
+    }
+
+    void openSession(Timestamp at) {
+        open = true;
+        closeAt = localTime(day, config.closeMinute);
+        queue.push(closeAt, SimEventKind::Close);
+        normal_distribution<double> gap(0.0, config.earningsVol);
+        EpochGuard guard;
+        const MarketVersion* v = market->view();
+        for (InstrumentId id : v->catalog->listed) {
+            if (at + periodOf(id) < closeAt) queue.push(at + periodOf(id), SimEventKind::Tick, id);
+            if (v->catalog->kind[id] != InstrumentKind::Stock) continue;
+            // results, ex-dividend and splits all take effect at the open, ahead of the first tick
+            if (config.earningsEvery > 0) {
+                uint64_t phase = (tradingDay + id) % (uint64_t)config.earningsEvery;
+                if (phase == 0) queue.push(at, SimEventKind::Earnings, id, gap(rng));
+                if (config.dividendYield > 0 && phase == (uint64_t)config.exDividendLag % config.earningsEvery)
+                    queue.push(at, SimEventKind::Dividend, id, v->price[id] * config.dividendYield / 4);
+            }
+            if (config.splitAbove > 0 && v->price[id] > config.splitAbove)
+                queue.push(at, SimEventKind::Split, id, config.splitRatio);
+        }
+    }
+
+    void dispatch(const SimEvent& e) {
+        ++stats.events;
+        switch (e.kind) {
+            case SimEventKind::Open:
+                openSession(e.at);
+                break;
+            case SimEventKind::Close:
+                open = false;
+                ++stats.sessions;
+                ++tradingDay;
+                ++day;
+                scheduleOpen();
+                break;
+            case SimEventKind::Tick: {
+                if (!open || e.at >= closeAt) break;
+                Timestamp next = e.at + periodOf(e.instrument);
+                if (next < closeAt) queue.push(next, SimEventKind::Tick, e.instrument);
+                dueList.push_back(e.instrument);
+                if (!config.batchTicks) flushTicks(e.at);
+                break;
+            }
+            case SimEventKind::Earnings:
+                if (market->shockPrice(e.instrument, e.value)) ++stats.earnings;
+                break;
+            case SimEventKind::Dividend: {
+                CorporateAction a = {e.instrument, CorporateActionKind::Dividend, e.value};
+                if (actions ? actions->apply(a, e.at) : market->applyCorporateAction(a, e.at)) ++stats.dividends;
+                break;
+            }
+            case SimEventKind::Split: {
+                CorporateAction a = {e.instrument, CorporateActionKind::Split, e.value};
+                if (actions ? actions->apply(a, e.at) : market->applyCorporateAction(a, e.at)) ++stats.splits;
+                break;
+            }
+        }
+    }
+
+    // The market's volatility is per session, so a tick moves by the share of
+    // the session its period covers. Instruments on different rates that meet
+    // at one instant therefore move in one call per rate.
+    void flushTicks(Timestamp at) {
+        if (due.size() < instruments().size()) due.resize(instruments().size(), 0);
+        const double session = (double)(config.closeMinute - config.openMinute) * 60 * kNsPerSecond;
+        while (!dueList.empty()) {
+            Timestamp period = periodOf(dueList.front());
+            size_t rest = 0;
+            moving.clear();
+            for (InstrumentId id : dueList) {
+                if (periodOf(id) == period) {
+                    due[id] = 1;
+                    moving.push_back(id);
+                } else {
+                    dueList[rest++] = id;
+                }
+            }
+            dueList.resize(rest);
+            market->simulatePriceMovement(due, at, sqrt(min(1.0, (double)period / session)));
+            ++stats.batches;
+            stats.ticks += moving.size();
+            for (InstrumentId id : moving) due[id] = 0;
+        }
+    }
+
+    MarketScheduler(const MarketScheduler&);
+    MarketScheduler& operator=(const MarketScheduler&);
+public:
+    explicit MarketScheduler(Market& m, const SimConfig& cfg = SimConfig())
+        : market(&m), actions(nullptr), config(cfg), clock(0), closeAt(0), open(false), day(0), tradingDay(0),
+          rng((unsigned)chrono::high_resolution_clock::now().time_since_epoch().count()) {}
+
+    const SimConfig& getConfig() const { return config; }
+    Timestamp now() const { return clock; }
+    bool sessionOpen() const { return open; }
+    size_t pending() const { return queue.size(); }
+    void seed(uint64_t s) { rng.seed(s); }
+
+    // Tick this instrument every `every` nanoseconds of session time (0 = the default rate)
+    void setTickInterval(InstrumentId id, Timestamp every) {
+        if (id >= interval.size()) interval.resize(id + 1, 0);
+        interval[id] = every;
+    }
+    void attachCorporateActions(CorporateActionEngine* engine) { actions = engine; }
+    // Called after every instant that moved prices, with the simulated time
+    void setBatchHandler(const function<void(Timestamp)>& fn) { onBatch = fn; }
+
+    // Queue a one-off earnings shock, dividend or split at simulated time `at`
+    // (ticks come from the rates, sessions from the calendar)
+    bool schedule(Timestamp at, SimEventKind kind, InstrumentId id, double value) {
+        if (kind != SimEventKind::Earnings && kind != SimEventKind::Dividend && kind != SimEventKind::Split) return false;
+        queue.push(at, kind, id, value);
+        return true;
+    }
+
+    // Start the calendar at the first session on or after `from`
+    void start(Timestamp from) {
+        queue.clear();
+        clock = from;
+        open = false;
+        tradingDay = 0;
+        day = localDay(from);
+        if (localTime(day, config.openMinute) < from) ++day;
+        scheduleOpen();
+        stats = SimStats();
+    }
+
+    // Run until `sessions` more sessions have closed; returns the totals since start()
+    const SimStats& runSessions(size_t sessions) {
+        Stopwatch t;
+        Timestamp begin = clock;
+        size_t target = stats.sessions + sessions;
+        while (stats.sessions < target && !queue.empty()) {
+            Timestamp at = queue.top().at;
+            size_t before = stats.earnings + stats.dividends + stats.splits + stats.batches;
+            do {
+                SimEvent e = queue.top();
+                queue.pop();
+                dispatch(e);
+            } while (!queue.empty() && queue.top().at == at);
+            clock = at;
+            flushTicks(at);
+            if (onBatch && stats.earnings + stats.dividends + stats.splits + stats.batches != before) onBatch(at);
+        }
+        stats.simulated += clock - begin;
+        stats.seconds += t.seconds();
+        return stats;
+    }
+};
+
+// --------------------------- Bulk valuation ---------------------------
+struct BulkValuation {
+    vector<double> marketValue; // by account
+    vector<double> netWorth;    // cash + marketValue
+    vector<double> unrealized;  // marketValue - cost of the positions
+    double totalNetWorth;
+    double totalUnrealized;
+    unsigned threads;
+    size_t chunks;
+    double seconds;
+    BulkValuation() : totalNetWorth(0.0), totalUnrealized(0.0), threads(1), chunks(0), seconds(0.0) {}
+};
+
+// Every account's holdings as one sparse matrix in CSR form: row a holds account
+// a's positions as (instrument id, quantity) pairs in instrument order. Marking
+// the whole book is one sparse matrix-vector product with the price column over
+// contiguous arrays, without pinning each account or following its pointers.
+// Rows are cut into chunks of about equal entries, many more than threads, and
+// threads claim chunks as they finish, so a few large portfolios cannot hold up
+// the pass. The matrix is a copy: rebuild it after trading to see new positions;
+// between rebuilds it can be revalued against any number of price vectors.
+class HoldingMatrix {
+private:
+    vector<uint64_t> rowStart;  // row a is entries [rowStart[a], rowStart[a + 1])
+    vector<InstrumentId> col;
+    vector<double> qty;
+    vector<double> rowCost;     // sum of quantity x average price, by account
+    vector<double> cashCol;     // by account
+    InstrumentId columns;       // one past the largest instrument id held
+    unsigned threads;
+    static const size_t kChunksPerThread = 16;
+    static const size_t kMinChunk = 4096; // entries; smaller books use fewer chunks
+
+    HoldingMatrix(const HoldingMatrix&);
+    HoldingMatrix& operator=(const HoldingMatrix&);
+public:
+    explicit HoldingMatrix(unsigned nThreads = 0)
+        : rowStart(1, 0), columns(0), threads(workerThreads(nThreads)) {}
+
+    size_t rows() const { return cashCol.size(); }
+    size_t entries() const { return col.size(); }
+    InstrumentId width() const { return columns; }
+    unsigned threadCount() const { return threads; }
+    void setThreads(unsigned n) { threads = workerThreads(n); }
+    uint64_t rowBegin(size_t a) const { return rowStart[a]; }
+    uint64_t rowEnd(size_t a) const { return rowStart[a + 1]; }
+    InstrumentId column(uint64_t k) const { return col[k]; }
+    double quantity(uint64_t k) const { return qty[k]; }
+    double cash(size_t a) const { return cashCol[a]; }
+    double cost(size_t a) const { return rowCost[a]; }
+    size_t bytes() const {
+        return rowStart.size() * sizeof(uint64_t) + col.size() * sizeof(InstrumentId) +
+               qty.size() * sizeof(double) + (rowCost.size() + cashCol.size()) * sizeof(double);
+    }
+
+    // Copy every account's published state. Each row is consistent with itself;
+    // accounts trading meanwhile may be caught before or after a trade.
+    void build(const InvestorBook& book) {
+        size_t n = book.size();
+        unsigned parts = (unsigned)max<size_t>(1, min<size_t>(threads * 4, n / 4096));
+        vector<vector<InstrumentId> > partCols(parts);
+        vector<vector<double> > partQty(parts);
+        vector<InstrumentId> partWidth(parts, 0);
+        vector<uint64_t> count(n);
+        rowCost.assign(n, 0.0);
+        cashCol.assign(n, 0.0);
+        parallelFor(threads, parts, [&](unsigned p) {
+            EpochGuard guard;
+            size_t begin = n * p / parts, end = n * (p + 1) / parts;
+            for (size_t a = begin; a < end; ++a) {
+                const InvestorState* st = book[a].view();
+                double c = 0.0;
+                for (const Holding& h : st->holdings) {
+                    partCols[p].push_back(h.id);
+                    partQty[p].push_back(h.quantity);
+                    c += h.quantity * h.avgPrice;
+                    partWidth[p] = max<InstrumentId>(partWidth[p], h.id + 1);
+                }
+                count[a] = st->holdings.size();
+                rowCost[a] = c;
+                cashCol[a] = st->cashBalance;
+            }
+        });
+        rowStart.assign(n + 1, 0);
+        for (size_t a = 0; a < n; ++a) rowStart[a + 1] = rowStart[a] + count[a];
+        col.resize(rowStart[n]);
+        qty.resize(rowStart[n]);
+        columns = 0;
+        for (InstrumentId w : partWidth) columns = max(columns, w);
+        parallelFor(threads, parts, [&](unsigned p) {
+            uint64_t at = rowStart[n * p / parts];
+            if (partCols[p].empty()) return;
+            memcpy(&col[at], partCols[p].data(), partCols[p].size() * sizeof(InstrumentId));
+            memcpy(&qty[at], partQty[p].data(), partQty[p].size() * sizeof(double));
+        });
+    }
+
+    // Row boundaries of `parts` chunks with about the same number of entries
+    vector<size_t> balancedCuts(size_t parts) const {
+        size_t n = rows();
+        parts = max<size_t>(1, min(parts, max<size_t>(n, 1)));
+        vector<size_t> cuts(parts + 1, n);
+        cuts[0] = 0;
+        for (size_t i = 1; i < parts; ++i) {
+            uint64_t target = entries() * i / parts;
+            size_t a = upper_bound(rowStart.begin(), rowStart.end(), target) - rowStart.begin() - 1;
+            cuts[i] = max(cuts[i - 1], min(a, n));
+        }
+        return cuts;
+    }
+    // The chunk count valuate() uses
+    size_t chunkCount() const {
+        return max<size_t>(1, min<size_t>(threads * kChunksPerThread, entries() / kMinChunk));
+    }
+
+    // Value of row a's positions. Four independent sums take the add latency out
+    // of the loop; the products are a gather the compiler can vectorize where
+    // the target has one.
+    double rowValue(size_t a, const double* price) const {
+        const InstrumentId* c = col.data();
+        const double* q = qty.data();
+        uint64_t k = rowStart[a], end = rowStart[a + 1];
+        double s0 = 0.0, s1 = 0.0, s2 = 0.0, s3 = 0.0;
+        for (; k + 4 <= end; k += 4) {
+            s0 += q[k] * price[c[k]];
+            s1 += q[k + 1] * price[c[k + 1]];
+            s2 += q[k + 2] * price[c[k + 2]];
+            s3 += q[k + 3] * price[c[k + 3]];
+        }
+        for (; k < end; ++k) s0 += q[k] * price[c[k]];
+        return (s0 + s1) + (s2 + s3);
+    }
+
+    // price is indexed by instrument id and must cover width() entries
+    void valuate(const double* price, BulkValuation& out) const {
+        Stopwatch t;
+        size_t n = rows();
+        out.marketValue.resize(n);
+        out.netWorth.resize(n);
+        out.unrealized.resize(n);
+        vector<size_t> cuts = balancedCuts(chunkCount());
+        size_t chunks = cuts.size() - 1;
+        vector<double> worth(chunks, 0.0), gain(chunks, 0.0);
+        parallelFor(threads, (unsigned)chunks, [&](unsigned c) {
+            double w = 0.0, g = 0.0;
+            for (size_t a = cuts[c]; a < cuts[c + 1]; ++a) {
+                double v = rowValue(a, price);
+                out.marketValue[a] = v;
+                out.netWorth[a] = cashCol[a] + v;
+                out.unrealized[a] = v - rowCost[a];
+                w += cashCol[a] + v;
+                g += v - rowCost[a];
+            }
+            worth[c] = w;
+            gain[c] = g;
+        });
+        out.totalNetWorth = out.totalUnrealized = 0.0;
+        for (size_t c = 0; c < chunks; ++c) {
+            out.totalNetWorth += worth[c];
+            out.totalUnrealized += gain[c];
+        }
+        out.threads = (unsigned)min<size_t>(threads, chunks);
+        out.chunks = chunks;
+        out.seconds = t.seconds();
+    }
+    // Against the market's latest prices (0 for anything no longer listed)
+    void valuate(const Market& market, BulkValuation& out) const {
+        vector<double> price(columns, 0.0);
+        {
+            EpochGuard guard;
+            const MarketVersion* mv = market.view();
+            for (InstrumentId id = 0; id < columns; ++id) price[id] = mv->priceOf(id);
+        }
+        valuate(price.data(), out);
+    }
+};
+
+// --------------------------- Yield curve ---------------------------
+// A benchmark the zero curve is bootstrapped from: a money-market deposit when
+// frequency is 0 (one payment of 100 * (1 + coupon * maturity)), otherwise a
+// coupon bond, usually at par (price 100) so that coupon is the par yield.
+struct CurveInstrument {
+    double maturity;
+    double coupon;
+    int frequency;
+    double price; // dirty, per 100 face
+    CurveInstrument(double m = 0.0, double c = 0.0, int f = 2, double p = 100.0)
+        : maturity(m), coupon(c), frequency(f), price(p) {}
+
+    void cashflows(vector<double>& times, vector<double>& amounts) const {
+        if (frequency > 0) {
+            BondTerms(coupon, frequency, maturity).cashflows(times, amounts);
+            return;
+        }
+        times.assign(1, maturity);
+        amounts.assign(1, 100.0 * (1.0 + coupon * maturity));
+    }
+};
+
+// Bit of knot i in a knot mask; knots past 63 share the last bit
+inline uint64_t knotBit(size_t i) { return uint64_t(1) << min<size_t>(i, 63); }
+
+// Continuously compounded zero rates at knot tenors, linear in between and flat
+// beyond both ends; the discount factor for t years is exp(-z(t) * t).
+class YieldCurve {
+private:
+    vector<double> tenors;
+    vector<double> zeros;
+public:
+    size_t knots() const { return tenors.size(); }
+    bool empty() const { return tenors.empty(); }
+    double tenor(size_t i) const { return tenors[i]; }
+    double zero(size_t i) const { return zeros[i]; }
+    const double* zeroData() const { return zeros.data(); }
+
+    // Knots either side of t and the weight of the upper one (lo == hi off the ends)
+    void locate(double t, uint32_t& lo, uint32_t& hi, double& w) const {
+        size_t n = tenors.size();
+        size_t j = upper_bound(tenors.begin(), tenors.end(), t) - tenors.begin();
+        if (j == 0 || j == n) {
+            lo = hi = (uint32_t)(j == 0 ? 0 : n - 1);
+            w = 0.0;
+            return;
+        }
+        lo = (uint32_t)(j - 1);
+        hi = (uint32_t)j;
+        w = (t - tenors[lo]) / (tenors[hi] - tenors[lo]);
+    }
+    double zeroRate(double t) const {
+        if (tenors.empty()) return 0.0;
+        uint32_t lo, hi;
+        double w;
+        locate(t, lo, hi, w);
+        return zeros[lo] + w * (zeros[hi] - zeros[lo]);
+    }
+    double discount(double t) const { return exp(-zeroRate(t) * t); }
+
+    // One knot per benchmark, solved in maturity order so that the benchmark
+    // reprices exactly with the earlier knots held fixed (Newton on the new
+    // knot's rate). False, leaving the curve empty, when two benchmarks share a
+    // maturity or a knot does not converge.
+    bool bootstrap(vector<CurveInstrument> bench) {
+        sort(bench.begin(), bench.end(),
+             [](const CurveInstrument& a, const CurveInstrument& b) { return a.maturity < b.maturity; });
+        tenors.clear();
+        zeros.clear();
+        vector<double> t, cf;
+        for (const CurveInstrument& b : bench) {
+            if (b.maturity <= 0.0 || b.price <= 0.0 || (!tenors.empty() && b.maturity <= tenors.back() + 1e-9)) {
+                tenors.clear();
+                zeros.clear();
+                return false;
+            }
+            b.cashflows(t, cf);
+            size_t k = tenors.size();
+            tenors.push_back(b.maturity);
+            zeros.push_back(k ? zeros.back() : log(1.0 + max(b.coupon, 0.0)));
+            bool solved = false;
+            for (int it = 0; it < 50 && !solved; ++it) {
+                double pv = 0.0, slope = 0.0;
+                for (size_t j = 0; j < t.size(); ++j) {
+                    uint32_t lo, hi;
+                    double w;
+                    locate(t[j], lo, hi, w);
+                    double d = cf[j] * exp(-t[j] * (zeros[lo] + w * (zeros[hi] - zeros[lo])));
+                    pv += d;
+                    slope -= t[j] * (hi != k ? 0.0 : lo == k ? 1.0 : w) * d; // d pv / d zeros[k]
+                }
+                double diff = pv - b.price;
+                if (fabs(diff) < 1e-11 * b.price) solved = true;
+                else if (slope == 0.0) break;
+                else zeros[k] -= diff / slope;
+            }
+            if (!solved) {
+                tenors.clear();
+                zeros.clear();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool sameTenors(const YieldCurve& o) const { return tenors == o.tenors; }
+    // Knots whose rate moved from prev; every knot when the tenors differ
+    uint64_t changedKnots(const YieldCurve& prev, double eps = 1e-12) const {
+        if (!sameTenors(prev)) return ~uint64_t(0);
+        uint64_t m = 0;
+        for (size_t i = 0; i < zeros.size(); ++i)
+            if (fabs(zeros[i] - prev.zeros[i]) > eps) m |= knotBit(i);
+        return m;
+    }
+};
+
+struct BondAnalytics {
+    double dirty;    // per bond, what it trades at
+    double clean;    // dirty less accrued interest
+    double accrued;
+    double ytm;      // yield to maturity, compounded at the coupon frequency (annually for zeros)
+    double duration; // modified duration in years
+    BondAnalytics() : dirty(0.0), clean(0.0), accrued(0.0), ytm(0.0), duration(0.0) {}
+    // False when no yield reproduces the price; ytm and duration are then NaN
+    bool hasYield() const { return ytm == ytm; }
+};
+
+// Prices a book of bonds off a YieldCurve. All cash flows sit in flat columns
+// (bond b owns flows [flowStart[b], flowStart[b + 1])) beside the curve segment
+// each falls in, so a full repricing is one branch-free exp() pass over
+// contiguous arrays followed by a sum per bond. Segments depend only on the
+// knot tenors and are found again only when those change. Each bond keeps a
+// mask of the knots its flows read: when a curve update moves some knots, only
+// bonds that read one of them are repriced, re-solved and sent to the market.
+class BondPricer {
+private:
+    vector<InstrumentId> ids;
+    unordered_map<InstrumentId, uint32_t> indexOf;
+    vector<BondTerms> terms;
+    vector<uint32_t> flowStart; // size() + 1 entries
+    vector<double> flowTime, flowAmount;
+    vector<uint32_t> flowLo, flowHi;
+    vector<double> flowW;
+    vector<double> pv;          // scratch for a full pass
+    vector<uint64_t> knotMask;  // per bond
+    vector<BondAnalytics> quotes;
+    vector<uint32_t> repriced;  // bonds the last setCurve() changed
+    YieldCurve curve;
+    bool located;               // flow segments are for curve's tenors
+    static const size_t kFullPassDivisor = 4; // reprice everything past 1/4 of the book
+
+    void locateFlows() {
+        flowLo.resize(flowTime.size());
+        flowHi.resize(flowTime.size());
+        flowW.resize(flowTime.size());
+        for (size_t k = 0; k < flowTime.size(); ++k) curve.locate(flowTime[k], flowLo[k], flowHi[k], flowW[k]);
+        knotMask.assign(ids.size(), 0);
+        for (size_t b = 0; b < ids.size(); ++b)
+            for (uint32_t k = flowStart[b]; k < flowStart[b + 1]; ++k)
+                knotMask[b] |= knotBit(flowLo[k]) | knotBit(flowHi[k]);
+        located = true;
+    }
+    double priceOne(size_t b) const {
+        const double* z = curve.zeroData();
+        double s = 0.0;
+        for (uint32_t k = flowStart[b]; k < flowStart[b + 1]; ++k)
+            s += flowAmount[k] * exp(-flowTime[k] * (z[flowLo[k]] + flowW[k] * (z[flowHi[k]] - z[flowLo[k]])));
+        return s;
+    }
+    void finish(size_t b, double dirty, bool yields) {
+        BondAnalytics& q = quotes[b];
+        q.dirty = dirty;
+        q.accrued = terms[b].accrued();
+        q.clean = dirty - q.accrued;
+        if (yields) {
+            uint32_t k = flowStart[b], n = flowStart[b + 1] - k;
+            double guess = q.hasYield() && q.ytm != 0.0 ? q.ytm : terms[b].coupon;
+            solveYield(&flowTime[k], &flowAmount[k], n, terms[b].frequency, dirty, guess, q.ytm, q.duration);
+        }
+    }
+public:
+    BondPricer() : located(false) {}
+
+    size_t size() const { return ids.size(); }
+    size_t flows() const { return flowTime.size(); }
+    InstrumentId id(size_t b) const { return ids[b]; }
+    const BondTerms& bondTerms(size_t b) const { return terms[b]; }
+    const BondAnalytics& analytics(size_t b) const { return quotes[b]; }
+    const YieldCurve& getCurve() const { return curve; }
+    const vector<uint32_t>& lastRepriced() const { return repriced; }
+    // Bonds of the last repricing left without a yield
+    size_t unsolved() const {
+        size_t n = 0;
+        for (uint32_t b : repriced) n += !quotes[b].hasYield();
+        return n;
+    }
+    // Book index of a bond, or -1
+    long find(InstrumentId id) const {
+        auto it = indexOf.find(id);
+        return it == indexOf.end() ? -1 : (long)it->second;
+    }
+
+    // Add a bond (once per id); it is priced by the next setCurve()
+    size_t add(InstrumentId id, const BondTerms& t) {
+        auto it = indexOf.find(id);
+        if (it != indexOf.end()) return it->second;
+        uint32_t b = (uint32_t)ids.size();
+        indexOf[id] = b;
+        ids.push_back(id);
+        terms.push_back(t);
+        if (flowStart.empty()) flowStart.push_back(0);
+        vector<double> tm, amt;
+        t.cashflows(tm, amt);
+        flowTime.insert(flowTime.end(), tm.begin(), tm.end());
+        flowAmount.insert(flowAmount.end(), amt.begin(), amt.end());
+        flowStart.push_back((uint32_t)flowTime.size());
+        quotes.push_back(BondAnalytics());
+        located = false;
+        return b;
+    }
+    // Every bond the market lists that is not in the book yet; returns how many
+    size_t addListed(const Market& market) {
+        size_t before = ids.size();
+        EpochGuard guard;
+        for (const auto& p : market.view()->catalog->bonds) add(p.first, p.second);
+        return ids.size() - before;
+    }
+
+    // Price off c. Bonds reading a knot that moved (every bond, when the tenors
+    // changed or bonds were added) are repriced and, with yields, get a new YTM
+    // and duration. Returns how many were repriced; lastRepriced() lists them.
+    size_t setCurve(const YieldCurve& c, bool yields = true) {
+        uint64_t changed = located ? c.changedKnots(curve) : ~uint64_t(0);
+        bool retenor = !located || !c.sameTenors(curve);
+        curve = c;
+        repriced.clear();
+        if (curve.empty() || ids.empty()) return 0;
+        if (retenor) locateFlows();
+        for (size_t b = 0; b < ids.size(); ++b)
+            if (knotMask[b] & changed) repriced.push_back((uint32_t)b);
+        if (repriced.size() * kFullPassDivisor > ids.size()) {
+            // one pass over every flow, then the per-bond sums
+            const double* z = curve.zeroData();
+            size_t n = flowTime.size();
+            pv.resize(n);
+            const double *tm = flowTime.data(), *amt = flowAmount.data(), *w = flowW.data();
+            const uint32_t *lo = flowLo.data(), *hi = flowHi.data();
+            for (size_t k = 0; k < n; ++k) pv[k] = amt[k] * exp(-tm[k] * (z[lo[k]] + w[k] * (z[hi[k]] - z[lo[k]])));
+            for (uint32_t b : repriced) {
+                double s = 0.0;
+                for (uint32_t k = flowStart[b]; k < flowStart[b + 1]; ++k) s += pv[k];
+                finish(b, s, yields);
+            }
+        } else {
+            for (uint32_t b : repriced) finish(b, priceOne(b), yields);
+        }
+        return repriced.size();
+    }
+
+    // Send the last repriced bonds' dirty prices to the market in one publish
+    size_t publish(Market& market) const {
+        vector<InstrumentId> sel;
+        vector<double> px;
+        sel.reserve(repriced.size());
+        px.reserve(repriced.size());
+        for (uint32_t b : repriced) {
+            sel.push_back(ids[b]);
+            px.push_back(max(0.01, quotes[b].dirty));
+        }
+        return market.setBondPrices(sel.data(), px.data(), sel.size());
+    }
+
+    // Yield to maturity (Newton from `guess`, compounded `frequency` times a
+    // year, or annually when 0) and modified duration for a dirty price. Flows
+    // after the first are 1/frequency apart, as BondTerms::cashflows() gives,
+    // so each discount factor is the previous one times 1 / (1 + y/f). When
+    // Newton does not converge the price is bracketed and bisected; when no
+    // yield fits at all, ytm and duration are set to NaN and false returned.
+    static bool solveYield(const double* t, const double* cf, size_t n, int frequency, double price, double guess,
+                           double& ytm, double& duration) {
+        const double f = frequency > 0 ? frequency : 1.0;
+        const double floorY = -0.99 * f + 1e-6; // keeps log1p defined
+        // price and dP/dy at y
+        auto value = [&](double y, double& p, double& tw) {
+            double l = log1p(y / f), step = 1.0 / (1.0 + y / f), d = n ? exp(-f * t[0] * l) : 0.0;
+            p = tw = 0.0;
+            for (size_t k = 0; k < n; ++k, d *= step) {
+                p += cf[k] * d;
+                tw += t[k] * cf[k] * d;
+            }
+            return -tw / (1.0 + y / f);
+        };
+        auto accept = [&](double y, double p, double tw) {
+            ytm = y;
+            duration = p > 0.0 ? tw / p / (1.0 + y / f) : 0.0;
+            return true;
+        };
+        double y = guess, p, tw;
+        for (int it = 0; it < 50; ++it) {
+            double slope = value(y, p, tw);
+            double diff = p - price;
+            if (fabs(diff) < 1e-10 * price) return accept(y, p, tw);
+            if (slope == 0.0 || slope != slope) break;
+            y -= diff / slope;
+            if (y != y) break;
+            if (y <= floorY) y = floorY;
+        }
+        // bisection: with positive flows the price falls as the yield rises
+        double lo = floorY, hi = 1.0;
+        value(lo, p, tw);
+        if (n == 0 || !(price > 0.0) || p < price) {
+            ytm = duration = numeric_limits<double>::quiet_NaN();
+            return false;
+        }
+        for (value(hi, p, tw); p > price && hi < 1e6; value(hi, p, tw)) hi *= 2.0;
+        if (p > price) {
+            ytm = duration = numeric_limits<double>::quiet_NaN();
+            return false;
+        }
+        for (int it = 0; it < 200 && hi - lo > 1e-14 * max(1.0, fabs(hi)); ++it) {
+            double mid = 0.5 * (lo + hi);
+            value(mid, p, tw);
+            if (p > price) lo = mid;
+            else hi = mid;
+        }
+        y = 0.5 * (lo + hi);
+        value(y, p, tw);
+        return accept(y, p, tw);
+    }
+};
+
+// --------------------------- Stress testing ---------------------------
+const uint16_t kNoSector = 0xffff;
+
+// Sector of each symbol, for shocks like "banks -15%". Sector names match
+// case-insensitively; a symbol is in at most one sector.
+class SectorMap {
+private:
+    vector<string> names;                    // as given
+    unordered_map<string, uint16_t> byName;  // lower-cased
+    unordered_map<string, uint16_t> bySymbol;
+
+    static string lower(string s) {
+        for (char& c : s) c = (char)tolower((unsigned char)c);
+        return s;
+    }
+public:
+    void assign(const string& symbol, const string& sector) {
+        string key = lower(sector);
+        auto it = byName.find(key);
+        uint16_t s;
+        if (it != byName.end()) s = it->second;
+        else {
+            s = (uint16_t)names.size();
+            names.push_back(sector);
+            byName.emplace(key, s);
+        }
+        bySymbol[symbol] = s;
+    }
+    uint16_t find(const string& sector) const {
+        auto it = byName.find(lower(sector));
+        return it == byName.end() ? kNoSector : it->second;
+    }
+    uint16_t sectorOf(InstrumentId id) const {
+        auto it = bySymbol.find(instruments().symbol(id));
+        return it == bySymbol.end() ? kNoSector : it->second;
+    }
+    const string& name(uint16_t s) const { return names[s]; }
+    size_t size() const { return names.size(); }
+};
+
+// What one term of a scenario moves. When terms overlap the most specific one
+// wins: a symbol over its sector, a sector over its asset class, and an asset
+// class over "all"; among equals, the later term.
+enum class ShockScope : unsigned char { Symbol, Sector, Kind, All };
+
+struct ShockTerm {
+    ShockScope scope;
+    uint32_t key;   // instrument id, sector or InstrumentKind
+    double move;    // fraction of the price: -0.15 for -15%
+};
+
+struct StressScenario {
+    string label;
+    vector<ShockTerm> terms;
+
+    // Price move of one instrument under this scenario (0 when no term covers it)
+    double moveOf(InstrumentId id, const SectorMap& sectors) const {
+        double move = 0.0;
+        int best = 4;
+        uint16_t sector = kNoSector;
+        bool sectorKnown = false;
+        for (const ShockTerm& t : terms) {
+            int rank = (int)t.scope;
+            if (rank > best) continue;
+            bool hit = false;
+            switch (t.scope) {
+                case ShockScope::Symbol: hit = t.key == id; break;
+                case ShockScope::Sector:
+                    if (!sectorKnown) {
+                        sector = sectors.sectorOf(id);
+                        sectorKnown = true;
+                    }
+                    hit = t.key == sector;
+                    break;
+                case ShockScope::Kind: hit = t.key == (uint32_t)instruments().kind(id); break;
+                case ShockScope::All: hit = true; break;
+            }
+            if (hit) {
+                best = rank;
+                move = t.move;
+            }
+        }
+        return move;
+    }
+};
+
+// Parse "banks -15%, IT -8%, funds -5%": comma-separated terms of a target and
+// a percentage move. A target is a listed symbol, a sector, stocks / funds /
+// bonds, or all (also: market).
+bool parseScenario(const string& text, const SectorMap& sectors, StressScenario& out, string& error) {
+    out = StressScenario();
+    stringstream ss(text);
+    string term;
+    while (getline(ss, term, ',')) {
+        stringstream ts(term);
+        string target, pct, extra;
+        if (!(ts >> target)) continue;
+        if (!(ts >> pct) || (ts >> extra)) {
+            error = "expected <target> <move>%, got \"" + term + "\"";
+            return false;
+        }
+        if (!pct.empty() && pct.back() == '%') pct.pop_back();
+        char* end = nullptr;
+        double v = strtod(pct.c_str(), &end);
+        if (pct.empty() || *end || v < -100.0) {
+            error = "bad move \"" + pct + "\" for " + target + " (a percentage, no lower than -100)";
+            return false;
+        }
+        ShockTerm t;
+        t.move = v / 100.0;
+        string up = target, low = target;
+        for (char& c : up) c = (char)toupper((unsigned char)c);
+        for (char& c : low) c = (char)tolower((unsigned char)c);
+        InstrumentId id = instruments().find(target);
+        if (id == kNoInstrument) id = instruments().find(up);
+        uint16_t sector = sectors.find(target);
+        if (id != kNoInstrument) {
+            t.scope = ShockScope::Symbol;
+            t.key = id;
+        } else if (sector != kNoSector) {
+            t.scope = ShockScope::Sector;
+            t.key = sector;
+        } else if (low == "stocks" || low == "stock") {
+            t.scope = ShockScope::Kind;
+            t.key = (uint32_t)InstrumentKind::Stock;
+        } else if (low == "funds" || low == "fund") {
+            t.scope = ShockScope::Kind;
+            t.key = (uint32_t)InstrumentKind::MutualFund;
+        } else if (low == "bonds" || low == "bond") {
+            t.scope = ShockScope::Kind;
+            t.key = (uint32_t)InstrumentKind::Bond;
+        } else if (low == "all" || low == "market") {
+            t.scope = ShockScope::All;
+            t.key = 0;
+        } else {
+            error = "unknown symbol or sector \"" + target + "\"";
+            return false;
+        }
+        out.terms.push_back(t);
+    }
+    if (out.terms.empty()) {
+        error = "no shocks given";
+        return false;
+    }
+    size_t b = text.find_first_not_of(" \t"), e = text.find_last_not_of(" \t");
+    out.label = text.substr(b, e - b + 1);
+    return true;
+}
+
+struct StressResult {
+    size_t scenarios;
+    vector<double> baseWorth;            // by account, cash + holdings at the base prices
+    vector<double> worstPnl;             // by account: its lowest P/L over the scenarios
+    vector<uint32_t> worstScenario;      // by account: the scenario of worstPnl
+    vector<double> scenarioPnl;          // by scenario: P/L of the whole book
+    vector<double> scenarioWorst;        // by scenario: P/L of its hardest-hit account
+    vector<uint32_t> scenarioWorstAccount;
+    vector<double> exposure;             // by instrument: its P/L in the book's worst scenario
+    size_t worstScenarioOverall;         // scenario with the lowest book P/L
+    unsigned threads;
+    size_t tiles;
+    double seconds;
+    StressResult() : scenarios(0), worstScenarioOverall(0), threads(1), tiles(0), seconds(0.0) {}
+};
+
+// Revalues every row of a HoldingMatrix under many price scenarios at once.
+// Scenarios are compiled into a table of price moves, instrument-major, so an
+// account's P/L in a run of consecutive scenarios is a sum of quantity x
+// (contiguous moves) over its positions: a short axpy per position that
+// vectorizes. The rows are cut into tiles of a few thousand positions that
+// stay in cache while the scenarios go past them in blocks, and the moves of
+// one block for the whole universe stay in cache while a tile's rows go past
+// them. Tiles are claimed by the threads as they finish, as in valuate().
+// Nothing of size accounts x scenarios is kept: only each account's worst
+// case, and each scenario's total and worst account.
+class StressEngine {
+private:
+    const HoldingMatrix& matrix;
+    vector<double> base;   // by instrument id, the prices the moves apply to
+    vector<double> delta;  // [id * stride + s]: price change of id in scenario s
+    size_t count;
+    size_t stride;         // count rounded up to whole blocks; the padding moves nothing
+    unsigned threads;
+    static const size_t kBlock = 64;         // scenarios per pass over a tile
+    static const size_t kTileEntries = 8192; // positions per tile
+
+    StressEngine(const StressEngine&);
+    StressEngine& operator=(const StressEngine&);
+public:
+    explicit StressEngine(const HoldingMatrix& m, unsigned nThreads = 0)
+        : matrix(m), count(0), stride(0), threads(workerThreads(nThreads)) {}
+
+    size_t scenarios() const { return count; }
+    unsigned threadCount() const { return threads; }
+    void setThreads(unsigned n) { threads = workerThreads(n); }
+    // Price change of an instrument in a scenario, as compiled
+    double move(InstrumentId id, size_t s) const { return id < base.size() ? delta[id * stride + s] : 0.0; }
+
+    // Compile the scenarios against base prices indexed by instrument id,
+    // covering the matrix's width()
+    void prepare(const double* price, const vector<StressScenario>& scen, const SectorMap& sectors) {
+        InstrumentId w = matrix.width();
+        count = scen.size();
+        stride = (count + kBlock - 1) / kBlock * kBlock;
+        base.assign(price, price + w);
+        delta.assign((size_t)w * stride, 0.0);
+        for (InstrumentId id = 0; id < w; ++id)
+            for (size_t s = 0; s < count; ++s) delta[id * stride + s] = base[id] * scen[s].moveOf(id, sectors);
+    }
+    // Against the market's latest prices (0 for anything no longer listed)
+    void prepare(const Market& market, const vector<StressScenario>& scen, const SectorMap& sectors) {
+        vector<double> price(matrix.width(), 0.0);
+        {
+            EpochGuard guard;
+            const MarketVersion* mv = market.view();
+            for (InstrumentId id = 0; id < price.size(); ++id) price[id] = mv->priceOf(id);
+        }
+        prepare(price.data(), scen, sectors);
+    }
+
+    void run(StressResult& out) const {
+        Stopwatch t;
+        const size_t n = matrix.rows(), S = count;
+        const double inf = numeric_limits<double>::infinity();
+        out.scenarios = S;
+        out.baseWorth.resize(n);
+        out.worstPnl.assign(n, S ? inf : 0.0);
+        out.worstScenario.assign(n, 0);
+        vector<size_t> cuts = matrix.balancedCuts(max<size_t>(threads * 4, matrix.entries() / kTileEntries));
+        size_t tiles = cuts.size() - 1;
+        vector<double> tileTotal(tiles * S, 0.0), tileWorst(tiles * S, inf);
+        vector<uint32_t> tileWorstAccount(tiles * S, 0);
+        parallelFor(threads, (unsigned)tiles, [&](unsigned c) {
+            double acc[kBlock];
+            double* total = &tileTotal[c * S];
+            double* worst = &tileWorst[c * S];
+            uint32_t* worstAccount = &tileWorstAccount[c * S];
+            const double* d = delta.data();
+            for (size_t a = cuts[c]; a < cuts[c + 1]; ++a) out.baseWorth[a] = matrix.cash(a) + matrix.rowValue(a, base.data());
+            for (size_t s0 = 0; s0 < S; s0 += kBlock) {
+                const size_t bs = S - s0 < kBlock ? S - s0 : kBlock;
+                for (size_t a = cuts[c]; a < cuts[c + 1]; ++a) {
+                    // always a whole block, so the trip count is fixed and the loop vectorizes
+                    for (size_t j = 0; j < kBlock; ++j) acc[j] = 0.0;
+                    for (uint64_t k = matrix.rowBegin(a), end = matrix.rowEnd(a); k < end; ++k) {
+                        const double q = matrix.quantity(k);
+                        const double* m = d + (size_t)matrix.column(k) * stride + s0;
+                        for (size_t j = 0; j < kBlock; ++j) acc[j] += q * m[j];
+                    }
+                    double w = out.worstPnl[a];
+                    uint32_t ws = out.worstScenario[a];
+                    for (size_t j = 0; j < bs; ++j) {
+                        double p = acc[j];
+                        total[s0 + j] += p;
+                        if (p < worst[s0 + j]) {
+                            worst[s0 + j] = p;
+                            worstAccount[s0 + j] = (uint32_t)a;
+                        }
+                        if (p < w) {
+                            w = p;
+                            ws = (uint32_t)(s0 + j);
+                        }
+                    }
+                    out.worstPnl[a] = w;
+                    out.worstScenario[a] = ws;
+                }
+            }
+        });
+        out.scenarioPnl.assign(S, 0.0);
+        out.scenarioWorst.assign(S, inf);
+        out.scenarioWorstAccount.assign(S, 0);
+        for (size_t c = 0; c < tiles; ++c)
+            for (size_t s = 0; s < S; ++s) {
+                out.scenarioPnl[s] += tileTotal[c * S + s];
+                if (tileWorst[c * S + s] < out.scenarioWorst[s]) {
+                    out.scenarioWorst[s] = tileWorst[c * S + s];
+                    out.scenarioWorstAccount[s] = tileWorstAccount[c * S + s];
+                }
+            }
+        out.worstScenarioOverall = 0;
+        for (size_t s = 1; s < S; ++s)
+            if (out.scenarioPnl[s] < out.scenarioPnl[out.worstScenarioOverall]) out.worstScenarioOverall = s;
+        // what each instrument contributes to the book's worst scenario
+        out.exposure.assign(base.size(), 0.0);
+        if (S) {
+            for (uint64_t k = 0; k < matrix.entries(); ++k) out.exposure[matrix.column(k)] += matrix.quantity(k);
+            for (InstrumentId id = 0; id < base.size(); ++id)
+                out.exposure[id] *= delta[id * stride + out.worstScenarioOverall];
+        }
+        out.threads = (unsigned)min<size_t>(threads, tiles);
+        out.tiles = tiles;
+        out.seconds = t.seconds();
+    }
+};
+
+// Indexes of the (up to) n lowest values, lowest first
+inline vector<size_t> lowestOf(const vector<double>& v, size_t n) {
+    vector<size_t> idx(v.size());
+    for (size_t i = 0; i < idx.size(); ++i) idx[i] = i;
+    n = min(n, idx.size());
+    partial_sort(idx.begin(), idx.begin() + n, idx.end(),
+                 [&](size_t a, size_t b) { return v[a] < v[b] || (v[a] == v[b] && a < b); });
+    idx.resize(n);
+    return idx;
+}
+
+// --------------------------- Rebalancing ---------------------------
+// Target weights of net worth by instrument; whatever the weights leave over
+// is held as cash.
+struct ModelPortfolio {
+    string name;
+    vector<pair<InstrumentId, double> > weights; // sorted by instrument id
+
+    double weightOf(InstrumentId id) const {
+        auto it = lower_bound(weights.begin(), weights.end(), make_pair(id, -1.0));
+        return it != weights.end() && it->first == id ? it->second : 0.0;
+    }
+};
+
+// Parse "INFY 30%, HDFCB 20%, SBI-EQ 40%": comma-separated symbols and
+// weights, adding up to at most 100%. A symbol given twice keeps the last.
+bool parseModel(const string& text, ModelPortfolio& out, string& error) {
+    out = ModelPortfolio();
+    map<InstrumentId, double> w;
+    stringstream ss(text);
+    string term;
+    while (getline(ss, term, ',')) {
+        stringstream ts(term);
+        string sym, pct, extra;
+        if (!(ts >> sym)) continue;
+        if (!(ts >> pct) || (ts >> extra)) {
+            error = "expected <symbol> <weight>%, got \"" + term + "\"";
+            return false;
+        }
+        if (!pct.empty() && pct.back() == '%') pct.pop_back();
+        char* end = nullptr;
+        double v = strtod(pct.c_str(), &end);
+        if (pct.empty() || *end || v < 0.0 || v > 100.0) {
+            error = "bad weight \"" + pct + "\" for " + sym + " (0 to 100%)";
+            return false;
+        }
+        InstrumentId id = instruments().find(sym);
+        if (id == kNoInstrument) {
+            for (char& c : sym) c = (char)toupper((unsigned char)c);
+            id = instruments().find(sym);
+        }
+        if (id == kNoInstrument) {
+            error = "unknown symbol \"" + sym + "\"";
+            return false;
+        }
+        w[id] = v / 100.0;
+    }
+    double total = 0.0;
+    for (const auto& p : w) {
+        total += p.second;
+        if (p.second > 0.0) out.weights.push_back(p);
+    }
+    if (total > 1.0 + 1e-9) {
+        error = "weights add up to more than 100%";
+        return false;
+    }
+    size_t b = text.find_first_not_of(" \t"), e = text.find_last_not_of(" \t");
+    out.name = b == string::npos ? string() : text.substr(b, e - b + 1);
+    return true;
+}
+
+// One line of an account's trade list. qty is what the plan asked for; filled
+// is what execution gave it, less when the market ran short or the account's
+// cash did.
+struct RebalanceOrder {
+    uint32_t account;
+    InstrumentId id;
+    bool sell;
+    double qty;
+    double filled;
+    double price;        // fill price (plan price until executed)
+    TradeStatus status;  // Ok for full and partial fills
+    RebalanceOrder(uint32_t a, InstrumentId i, bool s, double q, double p)
+        : account(a), id(i), sell(s), qty(q), filled(0.0), price(p), status(TradeStatus::Ok) {}
+};
+
+struct RebalanceConfig {
+    double band;      // leave positions within this fraction of net worth of their target
+    double fundStep;  // fund units are traded in multiples of this
+    unsigned threads;
+    RebalanceConfig() : band(0.001), fundStep(0.0001), threads(0) {}
+};
+
+struct RebalanceStats {
+    size_t accounts;     // accounts planned
+    size_t orders;       // lines in the trade lists
+    size_t filled;       // orders filled in full
+    size_t partial;      // orders cut down by supply or cash
+    size_t rejected;     // orders not filled at all
+    size_t instruments;  // instruments traded
+    double crossed;      // units matched between accounts instead of taken from or returned to supply
+    double marketUnits;  // units the net flows moved in market supply
+    double bought, sold; // cash amounts
+    unsigned threads;
+    double planSeconds, executeSeconds;
+    RebalanceStats()
+        : accounts(0), orders(0), filled(0), partial(0), rejected(0), instruments(0), crossed(0.0), marketUnits(0.0),
+          bought(0.0), sold(0.0), threads(1), planSeconds(0.0), executeSeconds(0.0) {}
+};
+
+// Rebalances many accounts to model portfolios in one batch. plan() computes
+// every assigned account's trade list in parallel from published versions:
+// each position is moved to weight x net worth at the plan prices, stocks and
+// bonds in whole units (rounded down, as tryBuy would refuse anything else)
+// and funds in multiples of fundStep; positions the model does not name are
+// sold. execute() then takes the market's writer lock once, nets the buys and
+// sells of every instrument against each other, cuts buys down pro rata where
+// the net would exceed the supply left, moves each instrument's supply once by
+// its net flow, books the fills to the accounts in parallel and publishes one
+// market version. Each fill is journaled as an ordinary trade carrying the
+// supply left after the batch, so replay ends at the same state.
+class Rebalancer {
+private:
+    Market& market;
+    InvestorBook& book;
+    RebalanceConfig cfg;
+    unsigned threads;
+    vector<ModelPortfolio> models;
+    vector<pair<uint32_t, uint32_t> > assigned; // (account, model)
+    vector<RebalanceOrder> orders;             // by account; an account's sells before its buys
+    RebalanceStats stats;
+
+    // One instrument's side of the batch
+    struct Flow {
+        bool quoted;
+        InstrumentKind kind;  // None when the market no longer lists it
+        double price, supply;
+        double buy, sell;     // units
+        double ratio;         // share of each buy the sells and supply can fill
+        double left;          // supply after the batch
+        Flow()
+            : quoted(false), kind(InstrumentKind::None), price(0.0), supply(0.0), buy(0.0), sell(0.0), ratio(1.0),
+              left(0.0) {}
+    };
+
+    template <typename T>
+    bool quoteAs(InstrumentId id, Flow& f) {
+        T* inst = InstrumentTraits<T>::find(market, instruments().symbol(id));
+        if (!inst) return false;
+        f.kind = T::kind;
+        f.price = InstrumentTraits<T>::price(*inst);
+        f.supply = InstrumentTraits<T>::supply(*inst);
+        return true;
+    }
+    // Live price and supply; false when the market no longer lists id
+    bool quote(InstrumentId id, Flow& f) {
+        switch (instruments().kind(id)) {
+            case InstrumentKind::Stock: return quoteAs<Stock>(id, f);
+            case InstrumentKind::MutualFund: return quoteAs<MutualFund>(id, f);
+            case InstrumentKind::Bond: return quoteAs<Bond>(id, f);
+            default: return false;
+        }
+    }
+    // Move supply by the net flow (bought - sold); returns the supply left
+    template <typename T>
+    double settleAs(InstrumentId id, double net) {
+        T& inst = *InstrumentTraits<T>::find(market, instruments().symbol(id));
+        if (net > 0.0) InstrumentTraits<T>::take(inst, net);
+        else if (net < 0.0) InstrumentTraits<T>::giveBack(inst, -net);
+        return InstrumentTraits<T>::supply(inst);
+    }
+    double settle(InstrumentId id, InstrumentKind kind, double net) {
+        switch (kind) {
+            case InstrumentKind::Stock: return settleAs<Stock>(id, net);
+            case InstrumentKind::MutualFund: return settleAs<MutualFund>(id, net);
+            default: return settleAs<Bond>(id, net);
+        }
+    }
+
+    // Round units down to what the instrument trades in
+    double tradable(InstrumentKind kind, double units) const {
+        if (units <= 0.0) return 0.0;
+        if (kind != InstrumentKind::MutualFund) return floor(units + 1e-9);
+        return floor(units / cfg.fundStep + 1e-9) * cfg.fundStep;
+    }
+
+    // Trade list of one account against one market version
+    void planAccount(uint32_t a, const ModelPortfolio& m, const MarketVersion* mv, vector<RebalanceOrder>& out) const {
+        const InvestorState* st = book[a].view();
+        double worth = st->cashBalance;
+        for (const Holding& h : st->holdings) worth += h.quantity * mv->priceOf(h.id);
+        if (worth <= 0.0) return;
+        vector<RebalanceOrder> buys;
+        auto visit = [&](InstrumentId id, double held, double weight) {
+            double p = mv->priceOf(id);
+            if (!mv->lists(id) || p <= 0.0) return; // neither bought nor sold here
+            InstrumentKind kind = mv->catalog->kind[id];
+            double target = weight > 0.0 ? tradable(kind, weight * worth / p) : 0.0;
+            double delta = target - held;
+            if (target > 0.0 && fabs(delta) * p < cfg.band * worth) return;
+            if (delta < 0.0) {
+                double q = kind == InstrumentKind::MutualFund ? -delta : floor(-delta + 1e-9);
+                if (q > 1e-9) out.push_back(RebalanceOrder(a, id, true, q, p));
+            } else if (delta > 1e-9) {
+                buys.push_back(RebalanceOrder(a, id, false, delta, p));
+            }
+        };
+        // merge the holdings and the model, both in id order
+        auto h = st->holdings.begin(), hend = st->holdings.end();
+        auto w = m.weights.begin(), wend = m.weights.end();
+        while (h != hend || w != wend) {
+            if (w == wend || (h != hend && h->id < w->first)) {
+                visit(h->id, h->quantity, 0.0);
+                ++h;
+            } else if (h == hend || w->first < h->id) {
+                visit(w->first, 0.0, w->second);
+                ++w;
+            } else {
+                visit(h->id, h->quantity, w->second);
+                ++h;
+                ++w;
+            }
+        }
+        out.insert(out.end(), buys.begin(), buys.end());
+    }
+
+    Rebalancer(const Rebalancer&);
+    Rebalancer& operator=(const Rebalancer&);
+public:
+    Rebalancer(Market& m, InvestorBook& b, const RebalanceConfig& c = RebalanceConfig())
+        : market(m), book(b), cfg(c), threads(workerThreads(c.threads)) {}
+
+    uint32_t addModel(const ModelPortfolio& m) {
+        models.push_back(m);
+        return (uint32_t)(models.size() - 1);
+    }
+    const ModelPortfolio& model(uint32_t i) const { return models[i]; }
+    // Rebalance account to the model on the next plan(); a later assignment replaces it
+    void assign(uint32_t account, uint32_t model) { assigned.push_back(make_pair(account, model)); }
+    void clearAssignments() { assigned.clear(); }
+    unsigned threadCount() const { return threads; }
+    const vector<RebalanceOrder>& trades() const { return orders; }
+    const RebalanceStats& getStats() const { return stats; }
+
+    // Trade lists of every assigned account; returns the number of orders
+    size_t plan() {
+        Stopwatch t;
+        stats = RebalanceStats();
+        stable_sort(assigned.begin(), assigned.end(),
+                    [](const pair<uint32_t, uint32_t>& x, const pair<uint32_t, uint32_t>& y) { return x.first < y.first; });
+        vector<pair<uint32_t, uint32_t> > jobs;
+        for (size_t i = 0; i < assigned.size(); ++i) {
+            const pair<uint32_t, uint32_t>& j = assigned[i];
+            if (j.first >= book.size() || j.second >= models.size()) continue;
+            if (i + 1 < assigned.size() && assigned[i + 1].first == j.first) continue; // the last one counts
+            jobs.push_back(j);
+        }
+        size_t n = jobs.size();
+        unsigned parts = (unsigned)max<size_t>(1, min<size_t>(threads * 16, n / 256));
+        vector<vector<RebalanceOrder> > partOrders(parts);
+        parallelFor(threads, parts, [&](unsigned p) {
+            EpochGuard guard;
+            const MarketVersion* mv = market.view();
+            for (size_t i = n * p / parts, end = n * (p + 1) / parts; i < end; ++i)
+                planAccount(jobs[i].first, models[jobs[i].second], mv, partOrders[p]);
+        });
+        orders.clear();
+        for (vector<RebalanceOrder>& v : partOrders) orders.insert(orders.end(), v.begin(), v.end());
+        stats.accounts = n;
+        stats.orders = orders.size();
+        stats.threads = (unsigned)min<size_t>(threads, parts);
+        stats.planSeconds = t.seconds();
+        return orders.size();
+    }
+
+    // Execute the planned orders as one batch; returns the number filled in
+    // full or in part
+    size_t execute() {
+        Stopwatch t;
+        stats.filled = stats.partial = stats.rejected = stats.instruments = 0;
+        stats.crossed = stats.marketUnits = stats.bought = stats.sold = 0.0;
+        lock_guard<mutex> lk(market.writeMutex());
+        vector<Flow> flows(instruments().size());
+        vector<InstrumentId> touched;
+        // sells are checked against the accounts as they are now; what they
+        // return can be bought by others before any supply is used
+        for (RebalanceOrder& o : orders) {
+            Flow& f = flows[o.id];
+            if (!f.quoted) {
+                f.quoted = true;
+                if (quote(o.id, f)) touched.push_back(o.id);
+            }
+            o.filled = 0.0;
+            if (f.kind == InstrumentKind::None) {
+                o.status = o.sell ? TradeStatus::Delisted : TradeStatus::UnknownSymbol;
+                continue;
+            }
+            o.price = f.price;
+            o.status = o.sell ? book[o.account].checkSell(o.id, o.qty) : TradeStatus::Ok;
+            if (o.status == TradeStatus::Ok) (o.sell ? f.sell : f.buy) += o.qty;
+        }
+        // buys of an instrument share pro rata what its sells and supply can give
+        for (InstrumentId id : touched) {
+            Flow& f = flows[id];
+            if (f.buy > f.sell + f.supply + 1e-9) f.ratio = (f.sell + f.supply) / f.buy;
+            f.buy = f.sell = 0.0;
+        }
+        // cash: an account's sells fund its buys, in list order
+        for (size_t i = 0; i < orders.size();) {
+            uint32_t a = orders[i].account;
+            double cash = book[a].getBalance();
+            for (; i < orders.size() && orders[i].account == a; ++i) {
+                RebalanceOrder& o = orders[i];
+                if (o.status != TradeStatus::Ok) continue;
+                Flow& f = flows[o.id];
+                if (o.sell) {
+                    o.filled = o.qty;
+                    f.sell += o.qty;
+                    cash += o.qty * o.price;
+                    continue;
+                }
+                double q = f.ratio < 1.0 ? tradable(f.kind, o.qty * f.ratio) : o.qty;
+                if (q * o.price > cash) q = tradable(f.kind, cash / o.price);
+                if (q <= 0.0) {
+                    bool shortCash = min(o.qty, tradable(f.kind, o.qty * f.ratio)) * o.price > cash;
+                    o.status = shortCash ? TradeStatus::InsufficientCash
+                             : f.kind == InstrumentKind::MutualFund ? TradeStatus::UnitsUnavailable
+                                                                    : TradeStatus::SharesUnavailable;
+                    continue;
+                }
+                o.filled = q;
+                f.buy += q;
+                cash -= q * o.price;
+            }
+        }
+        // each instrument's supply moves once, by its net flow
+        for (InstrumentId id : touched) {
+            Flow& f = flows[id];
+            if (f.buy == 0.0 && f.sell == 0.0) continue;
+            f.left = settle(id, f.kind, f.buy - f.sell);
+            stats.crossed += min(f.buy, f.sell);
+            stats.marketUnits += fabs(f.buy - f.sell);
+            ++stats.instruments;
+        }
+        // book the fills, the accounts split across threads
+        unsigned parts = (unsigned)max<size_t>(1, min<size_t>(threads * 16, orders.size() / 1024));
+        vector<size_t> cuts(parts + 1, orders.size());
+        cuts[0] = 0;
+        for (unsigned p = 1; p < parts; ++p) {
+            size_t c = max(cuts[p - 1], orders.size() * p / parts);
+            while (c > cuts[p - 1] && c < orders.size() && orders[c].account == orders[c - 1].account) ++c;
+            cuts[p] = c;
+        }
+        vector<double> bought(parts, 0.0), sold(parts, 0.0);
+        parallelFor(threads, parts, [&](unsigned p) {
+            for (size_t i = cuts[p]; i < cuts[p + 1]; ++i) {
+                const RebalanceOrder& o = orders[i];
+                if (o.filled <= 0.0) continue;
+                const Flow& f = flows[o.id];
+                TradeFill fill(f.kind, o.filled, o.price, o.filled * o.price);
+                if (o.sell) {
+                    book[o.account].bookSell(o.id, fill, f.left);
+                    sold[p] += fill.amount;
+                } else {
+                    book[o.account].bookBuy(o.id, fill, f.left);
+                    bought[p] += fill.amount;
+                }
+            }
+        });
+        market.publish();
+        for (unsigned p = 0; p < parts; ++p) {
+            stats.bought += bought[p];
+            stats.sold += sold[p];
+        }
+        for (const RebalanceOrder& o : orders) {
+            if (o.filled <= 0.0) ++stats.rejected;
+            else if (o.filled < o.qty - 1e-9) ++stats.partial;
+            else ++stats.filled;
+        }
+        stats.executeSeconds = t.seconds();
+        return stats.filled + stats.partial;
+    }
+
+    size_t run() {
+        plan();
+        return execute();
+    }
+};
+
+// --------------------------- Market shards ---------------------------
+// The instruments split across worker processes on one box. Each worker owns
+// the supply and prices of its shard in a Market of its own; the router
+// (ShardedMarket, in the process that holds the investors) sends it orders
+// over a pair of single-producer/single-consumer rings in shared memory and
+// books the fills on the investor side. Workers are forked from the router, so
+// instrument ids mean the same on both sides; start them before any other
+// thread is running.
+#ifndef _WIN32
+enum class ShardOp : unsigned char { Buy, Sell, Tick, Prices, Stop };
+
+// One ring slot, one cache line. A reply echoes the request's tag, op and
+// instrument and fills in the rest.
+struct alignas(64) ShardMessage {
+    uint64_t tag;            // request number
+    double qty;
+    double amount;           // buy: cash the buyer has; reply: cost or proceeds
+    double price;            // reply: execution price, or the quote for Prices
+    double available;        // reply: supply left
+    InstrumentId instrument;
+    ShardOp op;
+    TradeStatus status;
+    InstrumentKind kind;
+    unsigned char last;      // Prices: final row from this shard
+};
+
+// Lives in shared memory. head and tail each have a cache line, so the two
+// processes only meet on the slots they hand over.
+struct ShardRing {
+    static const uint64_t kSlots = 1024;
+    alignas(64) atomic<uint64_t> head; // next slot the producer fills
+    alignas(64) atomic<uint64_t> tail; // next slot the consumer reads
+    ShardMessage slots[kSlots];
+    ShardRing() : head(0), tail(0) {}
+};
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "shard rings need lock-free 64-bit atomics");
+
+// Process-local ends of a ring. Each caches the other side's counter and only
+// reads it again when the ring looks full (or empty).
+class ShardSender {
+private:
+    ShardRing* ring;
+    uint64_t head, tailSeen;
+public:
+    explicit ShardSender(ShardRing* r = nullptr) : ring(r), head(0), tailSeen(0) {}
+    bool tryPush(const ShardMessage& m) {
+        if (head - tailSeen == ShardRing::kSlots) {
+            tailSeen = ring->tail.load(memory_order_acquire);
+            if (head - tailSeen == ShardRing::kSlots) return false;
+        }
+        ring->slots[head & (ShardRing::kSlots - 1)] = m;
+        ring->head.store(++head, memory_order_release);
+        return true;
+    }
+};
+
+class ShardReceiver {
+private:
+    ShardRing* ring;
+    uint64_t tail, headSeen;
+public:
+    explicit ShardReceiver(ShardRing* r = nullptr) : ring(r), tail(0), headSeen(0) {}
+    bool tryPop(ShardMessage& m) {
+        if (tail == headSeen) {
+            headSeen = ring->head.load(memory_order_acquire);
+            if (tail == headSeen) return false;
+        }
+        m = ring->slots[tail & (ShardRing::kSlots - 1)];
+        ring->tail.store(++tail, memory_order_release);
+        return true;
+    }
+};
+
+// Spin a little, then yield, then nap: an idle side should not keep a core
+// from the processes that have work. Returns true once it has started napping.
+inline bool shardBackoff(unsigned& spins) {
+    if (++spins < 64) return false;
+    if (spins < 1024) {
+        this_thread::yield();
+        return false;
+    }
+    this_thread::sleep_for(chrono::microseconds(50));
+    return true;
+}
+
+namespace shardwork {
+// Market side of a buy or sell, with the checks of Investor::buyAs/sellAs that
+// need the instrument
+template <typename T>
+void execute(T& inst, ShardMessage& m) {
+    typedef InstrumentTraits<T> Traits;
+    double price = Traits::price(inst);
+    m.status = TradeStatus::Ok;
+    if (m.qty <= 0) {
+        m.status = TradeStatus::BadQuantity;
+    } else if (m.op == ShardOp::Buy) {
+        if (Traits::wholeUnits && static_cast<int>(m.qty) != m.qty) m.status = TradeStatus::FractionalBuy;
+        else if (m.qty > Traits::supply(inst)) m.status = Traits::shortSupply;
+        else if (price * m.qty > m.amount) m.status = TradeStatus::InsufficientCash;
+        else Traits::take(inst, m.qty);
+    } else {
+        if (Traits::wholeUnits && static_cast<int>(m.qty) != m.qty) m.status = TradeStatus::FractionalSell;
+        else Traits::giveBack(inst, m.qty);
+    }
+    m.kind = T::kind;
+    m.price = price;
+    m.amount = price * m.qty;
+    m.available = Traits::supply(inst);
+}
+
+inline void send(ShardSender& tx, const ShardMessage& m) {
+    for (unsigned spins = 0; !tx.tryPush(m);) shardBackoff(spins);
+}
+
+// Body of a worker process: list the shard's instruments as they were in
+// `source`, then serve requests until Stop (or until the router is gone)
+inline void run(const Market& source, const vector<int>& owner, int shard, ShardRing* in, ShardRing* out,
+                pid_t router) {
+    Market market;
+    {
+        EpochGuard guard;
+        const MarketVersion* v = source.view();
+        for (InstrumentId id : v->catalog->listed) {
+            if (id >= owner.size() || owner[id] != shard) continue;
+            const string& sym = instruments().symbol(id);
+            const string& nm = instruments().name(id);
+            if (v->catalog->kind[id] == InstrumentKind::Stock) market.addStock(Stock(nm, sym, v->price[id], (int)v->available[id]));
+            else if (v->catalog->kind[id] == InstrumentKind::Bond)
+                market.addBond(Bond(nm, sym, v->catalog->bonds.find(id)->second, v->price[id], (int)v->available[id]));
+            else market.addFund(MutualFund(nm, sym, v->price[id], v->available[id]));
+        }
+    }
+    ShardReceiver rx(in);
+    ShardSender tx(out);
+    ShardMessage m;
+    bool dirty = false; // trades not yet published; done once per burst, not per order
+    for (unsigned idle = 0;;) {
+        if (!rx.tryPop(m)) {
+            if (dirty) {
+                market.publish();
+                dirty = false;
+            }
+            if (shardBackoff(idle) && getppid() != router) return;
+            continue;
+        }
+        idle = 0;
+        switch (m.op) {
+            case ShardOp::Buy:
+            case ShardOp::Sell: {
+                const string& sym = instruments().symbol(m.instrument);
+                if (Stock* s = market.findStock(sym)) execute(*s, m);
+                else if (MutualFund* f = market.findFund(sym)) execute(*f, m);
+                else if (Bond* b = market.findBond(sym)) execute(*b, m);
+                else m.status = TradeStatus::UnknownSymbol;
+                dirty = dirty || m.status == TradeStatus::Ok;
+                break;
+            }
+            case ShardOp::Tick:
+                if (dirty) market.publish(); // a tick republishes only prices
+                market.simulatePriceMovement();
+                dirty = false;
+                break;
+            case ShardOp::Prices: {
+                if (dirty) market.publish();
+                dirty = false;
+                EpochGuard guard;
+                const MarketVersion* v = market.view();
+                ShardMessage row = m;
+                row.last = 0;
+                for (InstrumentId id : v->catalog->listed) {
+                    row.instrument = id;
+                    row.kind = v->catalog->kind[id];
+                    row.price = v->price[id];
+                    row.available = v->available[id];
+                    send(tx, row);
+                }
+                m.instrument = kNoInstrument;
+                m.last = 1;
+                break;
+            }
+            case ShardOp::Stop:
+                send(tx, m);
+                return;
+        }
+        send(tx, m);
+    }
+}
+} // namespace shardwork
+
+// One order for the router; status and fill are filled in when it comes back
+struct ShardOrder {
+    uint32_t account;
+    InstrumentId instrument;
+    double qty;
+    bool sell;
+    TradeStatus status;
+    TradeFill fill;
+    ShardOrder() : account(0), instrument(kNoInstrument), qty(0.0), sell(false), status(TradeStatus::Ok) {}
+    ShardOrder(uint32_t acct, InstrumentId id, double q, bool s)
+        : account(acct), instrument(id), qty(q), sell(s), status(TradeStatus::Ok) {}
+};
+
+// Quotes gathered from every shard, indexed by instrument id
+struct ShardPrices {
+    vector<double> price;
+    vector<double> available;
+    vector<unsigned char> listed;
+    uint64_t version; // gathers so far
+    Timestamp at;
+    ShardPrices() : version(0), at(0) {}
+};
+
+struct ShardStats {
+    uint64_t orders;           // sent to a shard
+    uint64_t fills;
+    uint64_t ticks;
+    uint64_t gathers;
+    vector<uint64_t> perShard; // orders by shard
+    ShardStats() : orders(0), fills(0), ticks(0), gathers(0) {}
+};
+
+class ShardedMarket {
+private:
+    struct Worker {
+        pid_t pid;
+        ShardSender requests;
+        ShardReceiver replies;
+    };
+    void* region;        // the rings, two per worker
+    size_t regionBytes;
+    vector<Worker> workers;
+    vector<int> owner;   // shard by instrument id, -1 = not traded here
+    ShardPrices prices;
+    ShardStats stats;
+
+    // Router-side wait; a shard that died would otherwise be waited on forever
+    void wait(unsigned& spins) {
+        if (!shardBackoff(spins)) return;
+        for (size_t k = 0; k < workers.size(); ++k) {
+            int status;
+            if (waitpid(workers[k].pid, &status, WNOHANG) == workers[k].pid) {
+                workers[k].pid = -1;
+                throw runtime_error("market shard " + to_string(k) + " exited");
+            }
+        }
+    }
+    void push(Worker& w, const ShardMessage& m) {
+        for (unsigned spins = 0; !w.requests.tryPush(m);) wait(spins);
+    }
+    ShardMessage awaitReply(Worker& w) {
+        ShardMessage m;
+        for (unsigned spins = 0; !w.replies.tryPop(m);) wait(spins);
+        return m;
+    }
+
+    // Checks what the router can check and fills in the request. Returns the
+    // shard that owns the instrument, or -1 when the order was refused here.
+    int prepare(ShardOrder& o, const Investor& inv, uint64_t tag, ShardMessage& m) const {
+        o.fill = TradeFill();
+        int shard = o.instrument < owner.size() ? owner[o.instrument] : -1;
+        if (shard < 0) {
+            o.status = TradeStatus::UnknownSymbol;
+            return -1;
+        }
+        if (o.sell && (o.status = inv.checkSell(o.instrument, o.qty)) != TradeStatus::Ok) return -1;
+        m = ShardMessage();
+        m.tag = tag;
+        m.op = o.sell ? ShardOp::Sell : ShardOp::Buy;
+        m.instrument = o.instrument;
+        m.qty = o.qty;
+        m.amount = o.sell ? 0.0 : inv.getBalance();
+        return shard;
+    }
+    void settle(ShardOrder& o, Investor& inv, const ShardMessage& m) {
+        o.status = m.status;
+        if (m.status != TradeStatus::Ok) return;
+        o.fill = TradeFill(m.kind, m.qty, m.price, m.amount);
+        if (m.op == ShardOp::Buy) inv.bookBuy(m.instrument, o.fill, m.available);
+        else o.fill.realized = inv.bookSell(m.instrument, o.fill, m.available);
+        ++stats.fills;
+    }
+
+    ShardedMarket(const ShardedMarket&);
+    ShardedMarket& operator=(const ShardedMarket&);
+public:
+    ShardedMarket() : region(nullptr), regionBytes(0) {}
+    ~ShardedMarket() { stop(); }
+
+    // Fork `shards` workers, each owning every shards-th instrument of
+    // `source` in listing order (the router's copy is not traded afterwards)
+    bool start(const Market& source, unsigned shards) {
+        stop();
+        if (shards == 0) return false;
+        regionBytes = 2 * shards * sizeof(ShardRing);
+        region = mmap(nullptr, regionBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (region == MAP_FAILED) {
+            region = nullptr;
+            return false;
+        }
+        ShardRing* rings = static_cast<ShardRing*>(region);
+        for (size_t i = 0; i < 2 * shards; ++i) new (&rings[i]) ShardRing();
+        owner.assign(instruments().size(), -1);
+        {
+            EpochGuard guard;
+            size_t k = 0;
+            for (InstrumentId id : source.view()->catalog->listed) owner[id] = (int)(k++ % shards);
+        }
+        stats = ShardStats();
+        stats.perShard.assign(shards, 0);
+        prices = ShardPrices();
+        cout.flush(); // or the child would inherit (and never write) the buffered text
+        pid_t router = getpid();
+        for (unsigned k = 0; k < shards; ++k) {
+            pid_t pid = fork();
+            if (pid < 0) {
+                stop();
+                return false;
+            }
+            if (pid == 0) {
+#ifdef __linux__
+                prctl(PR_SET_PDEATHSIG, SIGKILL);
+#endif
+                shardwork::run(source, owner, (int)k, &rings[2 * k], &rings[2 * k + 1], router);
+                _exit(0);
+            }
+            Worker w;
+            w.pid = pid;
+            w.requests = ShardSender(&rings[2 * k]);
+            w.replies = ShardReceiver(&rings[2 * k + 1]);
+            workers.push_back(w);
+        }
+        return true;
+    }
+
+    // Stop the workers and release the rings
+    void stop() {
+        ShardMessage m = ShardMessage();
+        m.op = ShardOp::Stop;
+        for (Worker& w : workers) {
+            if (w.pid <= 0) continue;
+            for (unsigned spins = 0; !w.requests.tryPush(m) && spins < 100000;) shardBackoff(spins);
+        }
+        for (Worker& w : workers)
+            if (w.pid > 0) waitpid(w.pid, nullptr, 0);
+        workers.clear();
+        if (region) munmap(region, regionBytes);
+        region = nullptr;
+        owner.clear();
+    }
+
+    unsigned shards() const { return (unsigned)workers.size(); }
+    int shardOf(InstrumentId id) const { return id < owner.size() ? owner[id] : -1; }
+    const ShardStats& getStats() const { return stats; }
+
+    // One order, waited for
+    TradeStatus trade(Investor& inv, InstrumentId id, double qty, bool sell, TradeFill* fill = nullptr) {
+        ShardOrder o(0, id, qty, sell);
+        ShardMessage m;
+        int shard = prepare(o, inv, 0, m);
+        if (shard >= 0) {
+            push(workers[shard], m);
+            ++stats.orders;
+            ++stats.perShard[shard];
+            settle(o, inv, awaitReply(workers[shard]));
+        }
+        if (fill) *fill = o.fill;
+        return o.status;
+    }
+
+    // Run a batch of orders from the book's accounts, pipelined across the
+    // shards. An account has at most one order out at a time, since its cash
+    // and holdings are what its next order is checked against; orders of
+    // different accounts overlap freely. Returns the number filled.
+    size_t execute(InvestorBook& book, vector<ShardOrder>& orders) {
+        vector<unsigned char> busy(book.size(), 0);
+        size_t inflight = 0;
+        uint64_t fills0 = stats.fills;
+        auto drain = [&]() {
+            bool any = false;
+            ShardMessage m;
+            for (Worker& w : workers) {
+                while (w.replies.tryPop(m)) {
+                    ShardOrder& o = orders[m.tag];
+                    settle(o, book[o.account], m);
+                    busy[o.account] = 0;
+                    --inflight;
+                    any = true;
+                }
+            }
+            return any;
+        };
+        for (size_t i = 0; i < orders.size(); ++i) {
+            ShardOrder& o = orders[i];
+            if (o.account >= book.size()) {
+                o.status = TradeStatus::NotHeld; // no such account
+                continue;
+            }
+            for (unsigned spins = 0; busy[o.account];)
+                if (drain()) spins = 0;
+                else wait(spins);
+            ShardMessage m;
+            int shard = prepare(o, book[o.account], i, m);
+            if (shard < 0) continue;
+            for (unsigned spins = 0; !workers[shard].requests.tryPush(m);)
+                if (drain()) spins = 0;
+                else wait(spins);
+            busy[o.account] = 1;
+            ++inflight;
+            ++stats.orders;
+            ++stats.perShard[shard];
+        }
+        for (unsigned spins = 0; inflight > 0;)
+            if (drain()) spins = 0;
+            else wait(spins);
+        return (size_t)(stats.fills - fills0);
+    }
+
+    // Move every shard's prices once
+    void tick() {
+        ShardMessage m = ShardMessage();
+        m.op = ShardOp::Tick;
+        for (Worker& w : workers) push(w, m);
+        for (Worker& w : workers) awaitReply(w);
+        ++stats.ticks;
+    }
+
+    // Ask every shard for its quotes and merge them. Each shard answers from
+    // one published version; the shards are asked together, so the result is
+    // as of the moment the last of them replied.
+    const ShardPrices& gatherPrices() {
+        ShardMessage m = ShardMessage();
+        m.op = ShardOp::Prices;
+        for (Worker& w : workers) push(w, m);
+        prices.price.assign(instruments().size(), 0.0);
+        prices.available.assign(instruments().size(), 0.0);
+        prices.listed.assign(instruments().size(), 0);
+        for (Worker& w : workers) {
+            for (;;) {
+                ShardMessage row = awaitReply(w);
+                if (row.instrument < prices.price.size()) {
+                    prices.price[row.instrument] = row.price;
+                    prices.available[row.instrument] = row.available;
+                    prices.listed[row.instrument] = 1;
+                }
+                if (row.last) break;
+            }
+        }
+        ++prices.version;
+        prices.at = clockNow();
+        ++stats.gathers;
+        return prices;
+    }
+    const ShardPrices& lastPrices() const { return prices; }
+
+    // Net worth (cash + holdings) of one investor at the last gathered prices
+    double valuate(const Investor& inv) const {
+        EpochGuard guard;
+        const InvestorState* st = inv.view();
+        double total = st->cashBalance;
+        for (const Holding& h : st->holdings)
+            if (h.id < prices.price.size()) total += h.quantity * prices.price[h.id];
+        return total;
+    }
+};
+
+struct ShardRunConfig {
+    unsigned workers;
+    size_t investors;
+    size_t orders;
+    size_t instruments;
+    size_t batch;      // orders between price ticks
+    ShardRunConfig() : workers(4), investors(100000), orders(2000000), instruments(200), batch(50000) {}
+};
+
+// Put one order flow through an in-process Market and then through `workers`
+// shard processes. Reports the throughput of both, checks that the shards
+// neither made nor lost supply, and values every account from gathered quotes.
+int runShardedMarket(const ShardRunConfig& cfg) {
+    if (cfg.workers == 0 || cfg.investors == 0 || cfg.instruments == 0 || cfg.batch == 0) {
+        cout << "Sharded run needs workers, investors, instruments and a batch size.\n";
+        return 1;
+    }
+    vector<InstrumentId> ids;
+    auto list = [&](Market& market) {
+        ids.clear();
+        for (size_t i = 0; i < cfg.instruments; ++i) {
+            string sym = "SH" + to_string(i);
+            if (i % 10 == 9) market.addFund(MutualFund("Shard Fund " + to_string(i), sym, 50.0, 1e12));
+            else market.addStock(Stock("Shard Stock " + to_string(i), sym, 100.0 + i % 50, 2000000000));
+            ids.push_back(instruments().find(sym));
+        }
+    };
+    auto open = [&](InvestorBook& book) {
+        for (size_t i = 0; i < cfg.investors; ++i) book.open("SHARD" + to_string(i), 1e6);
+    };
+    Market local;
+    list(local);
+    vector<ShardOrder> flow(cfg.orders);
+    mt19937 rng(7);
+    for (ShardOrder& o : flow) {
+        size_t k = rng() % ids.size();
+        bool fund = k % 10 == 9;
+        o = ShardOrder((uint32_t)(rng() % cfg.investors), ids[k], 0.0, rng() % 3 == 0);
+        o.qty = o.sell ? 1.0 : fund ? 0.25 * (1 + rng() % 8) : (double)(1 + rng() % 5);
+    }
+
+    ios::fmtflags flags = cout.flags();
+    streamsize prec = cout.precision();
+    cout << "\n---- sharded market ----\n";
+    cout << cfg.orders << " orders from " << cfg.investors << " accounts on " << cfg.instruments
+         << " instruments, a tick every " << cfg.batch << " orders\n";
+    size_t localFills = 0;
+    double localSecs;
+    {
+        InvestorBook book;
+        open(book);
+        Stopwatch t;
+        for (size_t i = 0; i < flow.size(); ++i) {
+            const ShardOrder& o = flow[i];
+            Investor& inv = book[o.account];
+            const string& sym = instruments().symbol(o.instrument);
+            TradeStatus st = o.sell ? inv.trySell(local, sym, o.qty) : inv.tryBuy(local, sym, o.qty);
+            if (st == TradeStatus::Ok) ++localFills;
+            if (i % cfg.batch == cfg.batch - 1) local.simulatePriceMovement();
+        }
+        localSecs = t.seconds();
+    }
+    cout << "one process:   " << localFills << " fills, " << fixed << setprecision(0)
+         << flow.size() / localSecs << " orders/s\n";
+
+    Market source;
+    list(source);
+    map<InstrumentId, double> supply;
+    {
+        EpochGuard guard;
+        const MarketVersion* v = source.view();
+        for (InstrumentId id : ids) supply[id] = v->available[id];
+    }
+    InvestorBook book;
+    open(book);
+    ShardedMarket router;
+    if (!router.start(source, cfg.workers)) {
+        cout << "Could not start " << cfg.workers << " shard processes.\n";
+        cout.flags(flags);
+        cout.precision(prec);
+        return 1;
+    }
+    Stopwatch t;
+    size_t fills = 0;
+    for (size_t i = 0; i < flow.size(); i += cfg.batch) {
+        vector<ShardOrder> chunk(flow.begin() + i, flow.begin() + min(flow.size(), i + cfg.batch));
+        fills += router.execute(book, chunk);
+        if (chunk.size() == cfg.batch) router.tick();
+    }
+    double shardSecs = t.seconds();
+    cout << cfg.workers << " shards:      " << fills << " fills, " << flow.size() / shardSecs << " orders/s ("
+         << setprecision(2) << localSecs / shardSecs << "x one process), orders by shard:";
+    for (uint64_t n : router.getStats().perShard) cout << " " << n;
+    cout << "\n";
+
+    // round trips one at a time, for the latency the pipelining hides
+    LatencyHistogram latency;
+    for (size_t i = 0; i < 20000; ++i) {
+        const ShardOrder& o = flow[i % flow.size()];
+        Timestamp t0 = clockNow();
+        router.trade(book[o.account], o.instrument, o.qty, o.sell);
+        latency.add((uint64_t)(clockNow() - t0));
+    }
+    cout << "round trip (ns): p50 " << latency.percentile(0.50) << "  p99 " << latency.percentile(0.99)
+         << "  max " << latency.maxLatency() << "\n";
+
+    t = Stopwatch();
+    const ShardPrices& px = router.gatherPrices();
+    double gatherSecs = t.seconds();
+    t = Stopwatch();
+    double worth = 0.0;
+    for (size_t a = 0; a < book.size(); ++a) worth += router.valuate(book[a]);
+    double valueSecs = t.seconds();
+    cout << "valuation: quotes gathered from " << router.shards() << " shards in " << setprecision(3)
+         << gatherSecs * 1e3 << " ms, " << book.size() << " accounts valued in " << valueSecs * 1e3
+         << " ms, net worth " << setprecision(2) << worth << "\n";
+
+    // what the shards have left plus what the accounts hold is what was listed
+    map<InstrumentId, double> held;
+    {
+        EpochGuard guard;
+        for (size_t a = 0; a < book.size(); ++a)
+            for (const Holding& h : book[a].view()->holdings) held[h.id] += h.quantity;
+    }
+    size_t bad = 0;
+    for (InstrumentId id : ids)
+        if (!px.listed[id] || fabs(px.available[id] + held[id] - supply[id]) > 1e-6 * supply[id]) ++bad;
+    cout << "supply check: " << (bad ? to_string(bad) + " instruments off" : string("every instrument balances")) << "\n";
+    router.stop();
+    cout.flags(flags);
+    cout.precision(prec);
+    return bad ? 1 : 0;
+}
+#endif
+
+// --------------------------- Columnar export ---------------------------
+// Self-describing column files for analytics (.smcol). Rows are cut into row
+// groups; each column of a group is stored as one chunk with its own encoding
+// and min/max statistics, so a reader can skip groups and columns it does not
+// need. Layout (integers little-endian, "varint" = LEB128):
+//
+//   "SMCOL1\0\0"
+//   chunk bytes of row group 0 (column 0, column 1, ...), row group 1, ...
+//   footer: varint version, string table, varint columns, {string name, u8 type}...,
+//           varint groups, {varint rows, {varint offset, varint size, u8 encoding,
+//           stats}...}...     (string = varint length + bytes)
+//   u64 footer length, "SMCOL1\0\0"
+//
+// Chunk encodings:
+//   Plain       8 bytes per value
+//   Delta       zigzag varint of the first value, then of each difference
+//   Rle         {zigzag varint value, varint run length}...
+//   Dictionary  varint entries, the entries (strings as above, doubles plain),
+//               u8 encoding of the indices, then the indices as an int chunk
+// Stats are zigzag varint min/max (Int64), two doubles (Double) or two strings.
+enum class ColumnType : unsigned char { Int64, Double, String };
+enum class ColumnEncoding : unsigned char { Plain, Delta, Rle, Dictionary };
+
+inline const char* columnEncodingName(ColumnEncoding e) {
+    switch (e) {
+        case ColumnEncoding::Plain: return "plain";
+        case ColumnEncoding::Delta: return "delta";
+        case ColumnEncoding::Rle: return "rle";
+        default: return "dictionary";
+    }
+}
+
+// One column of the schema. String columns are fed as integer codes that
+// `label` turns into text (e.g. instrument id -> symbol). When the codes are
+// a small enum 0..domain-1 (actions, kinds), the chunk dictionary is the
+// whole label table and the codes are written as the indices unchanged.
+struct ColumnSpec {
+    string name;
+    ColumnType type;
+    const string& (*label)(int64_t code);
+    int64_t domain;
+};
+
+// Raw values of one column of one row group
+struct ColumnValues {
+    vector<int64_t> ints;    // Int64 values, or codes of a String column
+    vector<double> doubles;  // Double values
+};
+
+struct ColumnStats {
+    int64_t imin, imax;
+    double dmin, dmax;
+    string smin, smax;
+    ColumnStats() : imin(0), imax(0), dmin(0.0), dmax(0.0) {}
+};
+
+namespace colfmt {
+const char kMagic[8] = {'S', 'M', 'C', 'O', 'L', '1', 0, 0};
+
+inline uint64_t zigzag(int64_t v) { return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63); }
+inline int64_t unzigzag(uint64_t v) { return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+inline size_t varintSize(uint64_t v) {
+#ifdef __GNUC__
+    return (size_t)(63 - __builtin_clzll(v | 1)) / 7 + 1;
+#else
+    size_t n = 1;
+    while (v >= 0x80) { v >>= 7; ++n; }
+    return n;
+#endif
+}
+inline void putVarint(string& out, uint64_t v) {
+    char tmp[10];
+    size_t n = 0;
+    while (v >= 0x80) { tmp[n++] = (char)(v | 0x80); v >>= 7; }
+    tmp[n++] = (char)v;
+    out.append(tmp, n);
+}
+inline void putString(string& out, const string& s) {
+    putVarint(out, s.size());
+    out += s;
+}
+inline void putDouble(string& out, double d) { out.append((const char*)&d, 8); }
+inline void putU64(string& out, uint64_t v) { out.append((const char*)&v, 8); }
+
+// Bounds-checked cursor over a chunk or the footer
+struct Cursor {
+    const char* p;
+    const char* e;
+    bool bad;
+    Cursor(const char* b, const char* end) : p(b), e(end), bad(false) {}
+    uint64_t varint() {
+        uint64_t v = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (p >= e) break;
+            unsigned char c = (unsigned char)*p++;
+            v |= (uint64_t)(c & 0x7f) << shift;
+            if (!(c & 0x80)) return v;
+        }
+        bad = true;
+        return 0;
+    }
+    unsigned char byte() {
+        if (p >= e) { bad = true; return 0; }
+        return (unsigned char)*p++;
+    }
+    double dbl() {
+        double d = 0.0;
+        if (e - p < 8) { bad = true; return d; }
+        memcpy(&d, p, 8);
+        p += 8;
+        return d;
+    }
+    string str() {
+        uint64_t n = varint();
+        if (bad || (uint64_t)(e - p) < n) { bad = true; return string(); }
+        string s(p, (size_t)n);
+        p += n;
+        return s;
+    }
+};
+
+inline char* writeVarint(char* p, uint64_t v) {
+    while (v >= 0x80) { *p++ = (char)(v | 0x80); v >>= 7; }
+    *p++ = (char)v;
+    return p;
+}
+
+// Write n integers with whichever of plain, delta and RLE is smallest. One
+// pass sizes all three; the winner is then written into space reserved up front.
+inline ColumnEncoding encodeInts(const int64_t* v, size_t n, string& out) {
+    size_t deltaBytes = 0, rleBytes = 0, runStart = 0;
+    for (size_t i = 0; i < n; ++i) {
+        deltaBytes += varintSize(zigzag(i ? v[i] - v[i - 1] : v[i]));
+        if (i == 0 || v[i] != v[i - 1]) {
+            if (i) rleBytes += varintSize(i - runStart);
+            rleBytes += varintSize(zigzag(v[i]));
+            runStart = i;
+        }
+    }
+    if (n) rleBytes += varintSize(n - runStart);
+    size_t plainBytes = n * 8;
+    size_t at = out.size();
+    if (rleBytes <= deltaBytes && rleBytes < plainBytes) {
+        out.resize(at + rleBytes);
+        char* p = &out[at];
+        for (size_t i = 0; i < n;) {
+            size_t j = i + 1;
+            while (j < n && v[j] == v[i]) ++j;
+            p = writeVarint(p, zigzag(v[i]));
+            p = writeVarint(p, j - i);
+            i = j;
+        }
+        return ColumnEncoding::Rle;
+    }
+    if (deltaBytes < plainBytes) {
+        out.resize(at + deltaBytes);
+        char* p = &out[at];
+        for (size_t i = 0; i < n; ++i) p = writeVarint(p, zigzag(i ? v[i] - v[i - 1] : v[i]));
+        return ColumnEncoding::Delta;
+    }
+    out.append((const char*)v, n * 8);
+    return ColumnEncoding::Plain;
+}
+
+inline bool decodeInts(Cursor& c, ColumnEncoding enc, size_t n, int64_t* out) {
+    if (enc == ColumnEncoding::Plain) {
+        if ((size_t)(c.e - c.p) < n * 8) return false;
+        memcpy(out, c.p, n * 8);
+        c.p += n * 8;
+        return true;
+    }
+    if (enc == ColumnEncoding::Delta) {
+        int64_t prev = 0;
+        for (size_t i = 0; i < n; ++i) out[i] = prev = prev + unzigzag(c.varint());
+        return !c.bad;
+    }
+    if (enc == ColumnEncoding::Rle) {
+        for (size_t i = 0; i < n;) {
+            int64_t v = unzigzag(c.varint());
+            uint64_t run = c.varint();
+            if (c.bad || run == 0 || run > n - i) return false;
+            for (uint64_t k = 0; k < run; ++k) out[i++] = v;
+        }
+        return true;
+    }
+    return false;
+}
+
+// Local dictionary of a Double chunk, or false when the values are too varied
+// for one to pay off (more than a quarter of the rows distinct)
+inline bool buildDoubleDictionary(const double* v, size_t n, vector<double>& dict, vector<int64_t>& index) {
+    size_t limit = min<size_t>(n / 4, 1 << 16);
+    if (limit == 0) return false;
+    size_t cap = 16;
+    int bits = 4;
+    while (cap < limit * 2) { cap <<= 1; ++bits; }
+    vector<uint64_t> keys(cap);
+    vector<int32_t> slot(cap, -1);
+    dict.clear();
+    index.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t key;
+        memcpy(&key, &v[i], 8);
+        // top bits of a Fibonacci hash: round numbers have all-zero low mantissa bits
+        size_t h = (size_t)((key * 0x9E3779B97F4A7C15ULL) >> (64 - bits));
+        while (slot[h] >= 0 && keys[h] != key) h = (h + 1) & (cap - 1);
+        if (slot[h] < 0) {
+            if (dict.size() == limit) return false;
+            keys[h] = key;
+            slot[h] = (int32_t)dict.size();
+            dict.push_back(v[i]);
+        }
+        index[i] = slot[h];
+    }
+    return true;
+}
+
+// Encode one column chunk and fill in its statistics
+inline ColumnEncoding encodeChunk(const ColumnSpec& spec, const ColumnValues& col, size_t n, string& out,
+                                  ColumnStats& st) {
+    if (spec.type == ColumnType::Int64) {
+        const int64_t* v = col.ints.data();
+        st.imin = st.imax = n ? v[0] : 0;
+        for (size_t i = 1; i < n; ++i) {
+            st.imin = min(st.imin, v[i]);
+            st.imax = max(st.imax, v[i]);
+        }
+        return encodeInts(v, n, out);
+    }
+    if (spec.type == ColumnType::Double) {
+        const double* v = col.doubles.data();
+        bool any = false;
+        for (size_t i = 0; i < n; ++i) {
+            if (v[i] != v[i]) continue; // NaN takes no part in min/max
+            if (!any || v[i] < st.dmin) st.dmin = v[i];
+            if (!any || v[i] > st.dmax) st.dmax = v[i];
+            any = true;
+        }
+        vector<double> dict;
+        vector<int64_t> index;
+        if (buildDoubleDictionary(v, n, dict, index)) {
+            putVarint(out, dict.size());
+            out.append((const char*)dict.data(), dict.size() * 8);
+            size_t at = out.size();
+            out += '\0';
+            out[at] = (char)encodeInts(index.data(), n, out);
+            return ColumnEncoding::Dictionary;
+        }
+        out.append((const char*)v, n * 8);
+        return ColumnEncoding::Plain;
+    }
+    if (spec.domain > 0) {
+        // enum codes index the full label table; only the stats need a pass
+        vector<char> seen((size_t)spec.domain, 0);
+        const int64_t* v = col.ints.data();
+        for (size_t i = 0; i < n; ++i) seen[(size_t)(v[i] >= 0 && v[i] < spec.domain ? v[i] : 0)] = 1;
+        putVarint(out, (uint64_t)spec.domain);
+        bool any = false;
+        for (int64_t k = 0; k < spec.domain; ++k) {
+            const string& s = spec.label(k);
+            putString(out, s);
+            if (!seen[(size_t)k]) continue;
+            if (!any || s < st.smin) st.smin = s;
+            if (!any || s > st.smax) st.smax = s;
+            any = true;
+        }
+        size_t at = out.size();
+        out += '\0';
+        out[at] = (char)encodeInts(v, n, out);
+        return ColumnEncoding::Dictionary;
+    }
+    // String: codes -> indices into this chunk's own dictionary. Codes are
+    // usually small ids, looked up in a flat table; anything else goes through a hash map.
+    vector<int64_t> codes;       // dictionary entry -> code
+    vector<int64_t> index(n);
+    int64_t lo = 0, hi = 0;
+    for (size_t i = 0; i < n; ++i) {
+        lo = i ? min(lo, col.ints[i]) : col.ints[i];
+        hi = i ? max(hi, col.ints[i]) : col.ints[i];
+    }
+    if (n && hi - lo < (int64_t)(1 << 20)) {
+        vector<int32_t> flat((size_t)(hi - lo + 1), -1);
+        for (size_t i = 0; i < n; ++i) {
+            int32_t& slot = flat[(size_t)(col.ints[i] - lo)];
+            if (slot < 0) {
+                slot = (int32_t)codes.size();
+                codes.push_back(col.ints[i]);
+            }
+            index[i] = slot;
+        }
+    } else {
+        unordered_map<int64_t, int64_t> local;
+        for (size_t i = 0; i < n; ++i) {
+            auto it = local.find(col.ints[i]);
+            if (it == local.end()) it = local.insert(make_pair(col.ints[i], (int64_t)codes.size())).first;
+            if (it->second == (int64_t)codes.size()) codes.push_back(col.ints[i]);
+            index[i] = it->second;
+        }
+    }
+    putVarint(out, codes.size());
+    for (size_t k = 0; k < codes.size(); ++k) {
+        const string& s = spec.label(codes[k]);
+        putString(out, s);
+        if (k == 0 || s < st.smin) st.smin = s;
+        if (k == 0 || s > st.smax) st.smax = s;
+    }
+    size_t at = out.size();
+    out += '\0';
+    out[at] = (char)encodeInts(index.data(), n, out);
+    return ColumnEncoding::Dictionary;
+}
+} // namespace colfmt
+
+// One encoded row group, ready to append
+struct EncodedRowGroup {
+    uint64_t rows;
+    vector<string> chunks;
+    vector<ColumnEncoding> encodings;
+    vector<ColumnStats> stats;
+    EncodedRowGroup() : rows(0) {}
+};
+
+// Appends encoded row groups to a .smcol file in order and writes the footer.
+// Encoding (the expensive part) is done by the caller, on any thread.
+class ColumnarWriter {
+private:
+    struct GroupInfo {
+        uint64_t rows;
+        vector<uint64_t> offsets, sizes;
+        vector<ColumnEncoding> encodings;
+        vector<ColumnStats> stats;
+    };
+    ofstream out;
+    string path;
+    string table;
+    vector<ColumnSpec> schema;
+    vector<GroupInfo> groups;
+    uint64_t offset;
+public:
+    ColumnarWriter() : offset(0) {}
+
+    bool open(const string& fname, const string& tableName, const vector<ColumnSpec>& cols) {
+        out.open(fname.c_str(), ios::binary | ios::trunc);
+        if (!out) return false;
+        path = fname;
+        table = tableName;
+        schema = cols;
+        groups.clear();
+        out.write(colfmt::kMagic, 8);
+        offset = 8;
+        return (bool)out;
+    }
+
+    static EncodedRowGroup encode(const vector<ColumnSpec>& cols, const vector<ColumnValues>& values, size_t rows) {
+        EncodedRowGroup g;
+        g.rows = rows;
+        g.chunks.resize(cols.size());
+        g.encodings.resize(cols.size());
+        g.stats.resize(cols.size());
+        for (size_t c = 0; c < cols.size(); ++c)
+            g.encodings[c] = colfmt::encodeChunk(cols[c], values[c], rows, g.chunks[c], g.stats[c]);
+        return g;
+    }
+
+    bool write(const EncodedRowGroup& g) {
+        GroupInfo info;
+        info.rows = g.rows;
+        info.encodings = g.encodings;
+        info.stats = g.stats;
+        for (const string& chunk : g.chunks) {
+            info.offsets.push_back(offset);
+            info.sizes.push_back(chunk.size());
+            out.write(chunk.data(), (streamsize)chunk.size());
+            offset += chunk.size();
+        }
+        groups.push_back(info);
+        return (bool)out;
+    }
+
+    // Footer, trailer and close; returns the file size (0 on failure)
+    uint64_t close() {
+        using namespace colfmt;
+        string f;
+        putVarint(f, 1);
+        putString(f, table);
+        putVarint(f, schema.size());
+        for (const ColumnSpec& c : schema) {
+            putString(f, c.name);
+            f += (char)c.type;
+        }
+        putVarint(f, groups.size());
+        for (const GroupInfo& g : groups) {
+            putVarint(f, g.rows);
+            for (size_t c = 0; c < schema.size(); ++c) {
+                putVarint(f, g.offsets[c]);
+                putVarint(f, g.sizes[c]);
+                f += (char)g.encodings[c];
+                const ColumnStats& st = g.stats[c];
+                if (schema[c].type == ColumnType::Int64) {
+                    putVarint(f, zigzag(st.imin));
+                    putVarint(f, zigzag(st.imax));
+                } else if (schema[c].type == ColumnType::Double) {
+                    putDouble(f, st.dmin);
+                    putDouble(f, st.dmax);
+                } else {
+                    putString(f, st.smin);
+                    putString(f, st.smax);
                 }
-                getline(ss, tmp, '\n'); 
-                try {
-                    avail = stoi(tmp);
-                } catch (const exception& e) {
-                    cout << "Error parsing available in market snapshot.\n";
-                    return false;
+            }
+        }
+        putU64(f, f.size());
+        f.append(kMagic, 8);
+        out.write(f.data(), (streamsize)f.size());
+        out.close();
+        bool ok = !out.fail();
+        return ok ? offset + f.size() : 0;
+    }
+};
+
+// Reader: footer on open, then any column chunk of any row group on demand
+class ColumnarFile {
+public:
+    struct Chunk {
+        uint64_t offset, size;
+        ColumnEncoding encoding;
+        ColumnStats stats;
+    };
+    struct RowGroup {
+        uint64_t rows;
+        vector<Chunk> columns;
+    };
+
+    bool open(const string& fname) {
+        using namespace colfmt;
+        in.close();
+        in.clear();
+        in.open(fname.c_str(), ios::binary);
+        if (!in) return false;
+        in.seekg(0, ios::end);
+        uint64_t fileSize = (uint64_t)in.tellg();
+        char trailer[16], head[8];
+        if (fileSize < 24) return false;
+        in.seekg(0);
+        in.read(head, 8);
+        in.seekg((streamoff)(fileSize - 16));
+        in.read(trailer, 16);
+        if (!in || memcmp(head, kMagic, 8) != 0 || memcmp(trailer + 8, kMagic, 8) != 0) return false;
+        uint64_t footerLen;
+        memcpy(&footerLen, trailer, 8);
+        if (footerLen > fileSize - 24) return false;
+        string f((size_t)footerLen, '\0');
+        in.seekg((streamoff)(fileSize - 16 - footerLen));
+        in.read(&f[0], (streamsize)footerLen);
+        if (!in) return false;
+
+        Cursor c(f.data(), f.data() + f.size());
+        if (c.varint() != 1) return false;
+        table = c.str();
+        schema.assign((size_t)c.varint(), ColumnSpec());
+        for (ColumnSpec& s : schema) {
+            s.name = c.str();
+            s.type = (ColumnType)c.byte();
+            s.label = nullptr;
+        }
+        groups.assign((size_t)c.varint(), RowGroup());
+        for (RowGroup& g : groups) {
+            g.rows = c.varint();
+            g.columns.resize(schema.size());
+            for (size_t k = 0; k < schema.size(); ++k) {
+                Chunk& ch = g.columns[k];
+                ch.offset = c.varint();
+                ch.size = c.varint();
+                ch.encoding = (ColumnEncoding)c.byte();
+                if (schema[k].type == ColumnType::Int64) {
+                    ch.stats.imin = unzigzag(c.varint());
+                    ch.stats.imax = unzigzag(c.varint());
+                } else if (schema[k].type == ColumnType::Double) {
+                    ch.stats.dmin = c.dbl();
+                    ch.stats.dmax = c.dbl();
+                } else {
+                    ch.stats.smin = c.str();
+                    ch.stats.smax = c.str();
                 }
-                addStock(Stock(nm, sym, price, avail));
-            } else if (type == "FUND") {
-                string sym, nm, tmp;
-                double nav, units;
-                getline(ss, sym, '|'); getline(ss, nm, '|'); getline(ss, tmp, '|'); 
-                try {
-                    nav = stod(tmp);
-                } catch (const exception& e) {
-                    cout << "Error parsing NAV in market snapshot.\n";
-                    return false;
+                if (ch.offset + ch.size > fileSize - 16 - footerLen) c.bad = true;
+            }
+            if (c.bad) break;
+        }
+        return !c.bad;
+    }
+
+    const string& tableName() const { return table; }
+    const vector<ColumnSpec>& columns() const { return schema; }
+    const vector<RowGroup>& rowGroups() const { return groups; }
+    uint64_t rows() const {
+        uint64_t n = 0;
+        for (const RowGroup& g : groups) n += g.rows;
+        return n;
+    }
+    int column(const string& name) const {
+        for (size_t k = 0; k < schema.size(); ++k)
+            if (schema[k].name == name) return (int)k;
+        return -1;
+    }
+    // Row groups whose Int64 column `col` may hold values in [lo, hi]
+    vector<size_t> groupsOverlapping(int col, int64_t lo, int64_t hi) const {
+        vector<size_t> out;
+        for (size_t g = 0; g < groups.size(); ++g) {
+            const ColumnStats& st = groups[g].columns[col].stats;
+            if (st.imax >= lo && st.imin <= hi) out.push_back(g);
+        }
+        return out;
+    }
+
+    bool readInts(size_t g, int col, vector<int64_t>& out) {
+        string buf;
+        if (!load(g, col, ColumnType::Int64, buf)) return false;
+        out.resize((size_t)groups[g].rows);
+        colfmt::Cursor c(buf.data(), buf.data() + buf.size());
+        return colfmt::decodeInts(c, groups[g].columns[col].encoding, out.size(), out.data());
+    }
+    bool readDoubles(size_t g, int col, vector<double>& out) {
+        string buf;
+        if (!load(g, col, ColumnType::Double, buf)) return false;
+        size_t n = (size_t)groups[g].rows;
+        out.resize(n);
+        colfmt::Cursor c(buf.data(), buf.data() + buf.size());
+        if (groups[g].columns[col].encoding == ColumnEncoding::Plain) {
+            if (buf.size() != n * 8) return false;
+            memcpy(out.data(), buf.data(), n * 8);
+            return true;
+        }
+        vector<double> dict((size_t)c.varint());
+        for (double& d : dict) d = c.dbl();
+        vector<int64_t> index(n);
+        if (c.bad || !colfmt::decodeInts(c, (ColumnEncoding)c.byte(), n, index.data())) return false;
+        for (size_t i = 0; i < n; ++i) {
+            if (index[i] < 0 || (size_t)index[i] >= dict.size()) return false;
+            out[i] = dict[(size_t)index[i]];
+        }
+        return true;
+    }
+    bool readStrings(size_t g, int col, vector<string>& out) {
+        string buf;
+        if (!load(g, col, ColumnType::String, buf)) return false;
+        size_t n = (size_t)groups[g].rows;
+        colfmt::Cursor c(buf.data(), buf.data() + buf.size());
+        vector<string> dict((size_t)c.varint());
+        for (string& s : dict) s = c.str();
+        vector<int64_t> index(n);
+        if (c.bad || !colfmt::decodeInts(c, (ColumnEncoding)c.byte(), n, index.data())) return false;
+        out.resize(n);
+        for (size_t i = 0; i < n; ++i) {
+            if (index[i] < 0 || (size_t)index[i] >= dict.size()) return false;
+            out[i] = dict[(size_t)index[i]];
+        }
+        return true;
+    }
+
+private:
+    ifstream in;
+    string table;
+    vector<ColumnSpec> schema;
+    vector<RowGroup> groups;
+
+    bool load(size_t g, int col, ColumnType type, string& buf) {
+        if (g >= groups.size() || col < 0 || (size_t)col >= schema.size() || schema[col].type != type) return false;
+        const Chunk& ch = groups[g].columns[col];
+        buf.resize((size_t)ch.size);
+        in.clear();
+        in.seekg((streamoff)ch.offset);
+        in.read(&buf[0], (streamsize)ch.size);
+        return (bool)in;
+    }
+};
+
+struct ColumnarExportStats {
+    uint64_t rows;
+    uint64_t groups;
+    uint64_t bytes;
+    double seconds;
+    ColumnarExportStats() : rows(0), groups(0), bytes(0), seconds(0.0) {}
+};
+
+// Gather and encode row groups in parallel, a window of them at a time, and
+// append each window in order, so memory stays bounded however long the source.
+// Source provides: schema(), rows(), and gather(begin, end, vector<ColumnValues>&).
+template <class Source>
+bool exportColumnar(const string& fname, const string& table, const Source& src, WorkStealingPool& pool,
+                    ColumnarExportStats& st, size_t rowsPerGroup = 65536) {
+    Stopwatch clock;
+    vector<ColumnSpec> schema = src.schema();
+    ColumnarWriter w;
+    if (!w.open(fname, table, schema)) return false;
+    size_t total = src.rows();
+    size_t groupCount = (total + rowsPerGroup - 1) / rowsPerGroup;
+    size_t window = max<size_t>(2, pool.size() * 2);
+    vector<EncodedRowGroup> done(window);
+    bool ok = true;
+    for (size_t g0 = 0; g0 < groupCount && ok; g0 += window) {
+        size_t g1 = min(groupCount, g0 + window);
+        for (size_t g = g0; g < g1; ++g) {
+            pool.submit([&, g, g0](unsigned) {
+                size_t b = g * rowsPerGroup, e = min(total, b + rowsPerGroup);
+                vector<ColumnValues> values(schema.size());
+                src.gather(b, e, values);
+                done[g - g0] = ColumnarWriter::encode(schema, values, e - b);
+            }, g);
+        }
+        pool.wait();
+        for (size_t g = g0; g < g1 && ok; ++g) ok = w.write(done[g - g0]);
+    }
+    uint64_t bytes = w.close();
+    st.rows = total;
+    st.groups = groupCount;
+    st.bytes = bytes;
+    st.seconds = clock.seconds();
+    return ok && bytes > 0;
+}
+
+inline const string& instrumentSymbolLabel(int64_t id) {
+    static const string none("-");
+    return id == (int64_t)kNoInstrument ? none : instruments().symbol((InstrumentId)id);
+}
+inline const string& txActionLabel(int64_t a) {
+    static const string names[] = {"BUY", "SELL", "DEPOSIT", "WITHDRAW", "DIVIDEND", "SPLIT"};
+    return names[a >= 0 && a <= 5 ? a : 0];
+}
+inline const string& instrumentKindLabel(int64_t k) {
+    static const string names[] = {"-", "Stock", "MutualFund", "Bond"};
+    return names[k >= 0 && k <= 3 ? k : 0];
+}
+
+// Every account's transaction log, account by account, as one table
+class TxColumnSource {
+private:
+    vector<TransactionLog::Snapshot> logs;
+    vector<size_t> start; // first global row of each account, plus the total
+
+    void index() {
+        start.assign(1, 0);
+        for (const TransactionLog::Snapshot& l : logs) start.push_back(start.back() + l.size());
+    }
+public:
+    explicit TxColumnSource(const InvestorBook& book) {
+        for (size_t a = 0; a < book.size(); ++a) logs.push_back(book[a].transactions().snapshot());
+        index();
+    }
+    // Logs not owned by investors; account numbers are positions in the list
+    explicit TxColumnSource(const vector<TransactionLog::Snapshot>& l) : logs(l) { index(); }
+    size_t rows() const { return start.back(); }
+    vector<ColumnSpec> schema() const {
+        ColumnSpec cols[] = {
+            {"account", ColumnType::Int64, nullptr, 0},           {"time_ns", ColumnType::Int64, nullptr, 0},
+            {"action", ColumnType::String, &txActionLabel, 6},     {"kind", ColumnType::String, &instrumentKindLabel, 4},
+            {"symbol", ColumnType::String, &instrumentSymbolLabel, 0}, {"qty", ColumnType::Double, nullptr, 0},
+            {"price", ColumnType::Double, nullptr, 0},            {"balance_after", ColumnType::Double, nullptr, 0},
+            {"lot", ColumnType::Int64, nullptr, 0}};
+        return vector<ColumnSpec>(cols, cols + 9);
+    }
+    void gather(size_t begin, size_t end, vector<ColumnValues>& v) const {
+        size_t n = end - begin;
+        for (int c : {0, 1, 2, 3, 4, 8}) v[c].ints.resize(n);
+        for (int c : {5, 6, 7}) v[c].doubles.resize(n);
+        size_t a = (size_t)(upper_bound(start.begin(), start.end(), begin) - start.begin()) - 1;
+        for (size_t r = begin, i = 0; r < end; ++r, ++i) {
+            while (r >= start[a + 1]) ++a;
+            const TxEntry& e = logs[a][r - start[a]];
+            v[0].ints[i] = (int64_t)a;
+            v[1].ints[i] = e.time;
+            v[2].ints[i] = (int64_t)e.action;
+            v[3].ints[i] = (int64_t)e.kind;
+            v[4].ints[i] = e.instrument == kNoInstrument ? (int64_t)kNoInstrument : (int64_t)e.instrument;
+            v[5].doubles[i] = e.qty;
+            v[6].doubles[i] = e.price;
+            v[7].doubles[i] = e.balanceAfter;
+            v[8].ints[i] = e.lot == kAnyLot ? -1 : (int64_t)e.lot;
+        }
+    }
+};
+
+class TickColumnSource {
+private:
+    TickHistory::Snapshot ticks;
+public:
+    explicit TickColumnSource(const TickHistory& h) : ticks(h.snapshot()) {}
+    size_t rows() const { return ticks.size(); }
+    vector<ColumnSpec> schema() const {
+        ColumnSpec cols[] = {{"tick", ColumnType::Int64, nullptr, 0}, {"time_ns", ColumnType::Int64, nullptr, 0},
+                             {"symbol", ColumnType::String, &instrumentSymbolLabel, 0},
+                             {"price", ColumnType::Double, nullptr, 0}};
+        return vector<ColumnSpec>(cols, cols + 4);
+    }
+    void gather(size_t begin, size_t end, vector<ColumnValues>& v) const {
+        size_t n = end - begin;
+        v[0].ints.resize(n);
+        v[1].ints.resize(n);
+        v[2].ints.resize(n);
+        v[3].doubles.resize(n);
+        for (size_t r = begin, i = 0; r < end; ++r, ++i) {
+            const TickRow& t = ticks[r];
+            v[0].ints[i] = (int64_t)t.tick;
+            v[1].ints[i] = t.timeNs;
+            v[2].ints[i] = (int64_t)t.instrument;
+            v[3].doubles[i] = t.price;
+        }
+    }
+};
+
+// PREFIX_tx.smcol and PREFIX_ticks.smcol
+bool exportAnalytics(const string& prefix, const InvestorBook& book, const TickHistory& ticks, unsigned threads = 0) {
+    WorkStealingPool pool(threads);
+    ColumnarExportStats tx, tk;
+    bool ok = exportColumnar(prefix + "_tx.smcol", "transactions", TxColumnSource(book), pool, tx) &&
+              exportColumnar(prefix + "_ticks.smcol", "ticks", TickColumnSource(ticks), pool, tk);
+    if (!ok) {
+        cout << "Error writing columnar export.\n";
+        return false;
+    }
+    cout << "Exported " << tx.rows << " transactions (" << tx.bytes << " bytes) to " << prefix << "_tx.smcol and "
+         << tk.rows << " tick prices (" << tk.bytes << " bytes) to " << prefix << "_ticks.smcol.\n";
+    return true;
+}
+
+// --------------------------- Screener ---------------------------
+// Filters the market's columns with expressions such as
+//   price between 400 and 900 && available > 5000 && rsi < 30
+// Grammar (and/or/not may be spelled &&, ||, !):
+//   expr := term ('||' term)*      term := factor ('&&' factor)*
+//   factor := '!' factor | '(' expr ')' | column op number | column 'between' number 'and' number
+//   column := price | available | rsi | change | ema       op := < <= > >= == !=
+// Each comparison becomes a branch-free kernel that turns 64 rows of a column
+// into one word of a selection bitmap. && and || pass the selection so far
+// down, and kernels skip every 64-row block with nothing left selected.
+enum class ScreenColumn : unsigned char { Price, Available, Rsi, Change, Ema };
+enum class ScreenCmp : unsigned char { Lt, Le, Gt, Ge, Eq, Ne, Between };
+
+namespace screenk {
+// AVX kernels are compiled in when the build targets AVX, and otherwise (GCC
+// and Clang on x86) built for AVX alone and picked at run time when the CPU has it
+#if defined(__AVX__)
+#define SCREENK_AVX
+#define SCREENK_HAS_AVX 1
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCREENK_AVX __attribute__((target("avx")))
+#define SCREENK_HAS_AVX 1
+#endif
+
+// One predicate, scalar and SIMD. x is tested against a (and b for Between).
+struct Lt { static bool s(double x, double a, double) { return x < a; }
+#ifdef __SSE2__
+            static __m128d v(__m128d x, __m128d a, __m128d) { return _mm_cmplt_pd(x, a); }
+#endif
+#ifdef SCREENK_HAS_AVX
+            SCREENK_AVX static __m256d v(__m256d x, __m256d a, __m256d) { return _mm256_cmp_pd(x, a, _CMP_LT_OQ); }
+#endif
+};
+struct Le { static bool s(double x, double a, double) { return x <= a; }
+#ifdef __SSE2__
+            static __m128d v(__m128d x, __m128d a, __m128d) { return _mm_cmple_pd(x, a); }
+#endif
+#ifdef SCREENK_HAS_AVX
+            SCREENK_AVX static __m256d v(__m256d x, __m256d a, __m256d) { return _mm256_cmp_pd(x, a, _CMP_LE_OQ); }
+#endif
+};
+struct Gt { static bool s(double x, double a, double) { return x > a; }
+#ifdef __SSE2__
+            static __m128d v(__m128d x, __m128d a, __m128d) { return _mm_cmpgt_pd(x, a); }
+#endif
+#ifdef SCREENK_HAS_AVX
+            SCREENK_AVX static __m256d v(__m256d x, __m256d a, __m256d) { return _mm256_cmp_pd(x, a, _CMP_GT_OQ); }
+#endif
+};
+struct Ge { static bool s(double x, double a, double) { return x >= a; }
+#ifdef __SSE2__
+            static __m128d v(__m128d x, __m128d a, __m128d) { return _mm_cmpge_pd(x, a); }
+#endif
+#ifdef SCREENK_HAS_AVX
+            SCREENK_AVX static __m256d v(__m256d x, __m256d a, __m256d) { return _mm256_cmp_pd(x, a, _CMP_GE_OQ); }
+#endif
+};
+struct Eq { static bool s(double x, double a, double) { return x == a; }
+#ifdef __SSE2__
+            static __m128d v(__m128d x, __m128d a, __m128d) { return _mm_cmpeq_pd(x, a); }
+#endif
+#ifdef SCREENK_HAS_AVX
+            SCREENK_AVX static __m256d v(__m256d x, __m256d a, __m256d) { return _mm256_cmp_pd(x, a, _CMP_EQ_OQ); }
+#endif
+};
+struct Ne { static bool s(double x, double a, double) { return x != a; }
+#ifdef __SSE2__
+            static __m128d v(__m128d x, __m128d a, __m128d) { return _mm_cmpneq_pd(x, a); }
+#endif
+#ifdef SCREENK_HAS_AVX
+            SCREENK_AVX static __m256d v(__m256d x, __m256d a, __m256d) { return _mm256_cmp_pd(x, a, _CMP_NEQ_UQ); }
+#endif
+};
+struct Between { static bool s(double x, double a, double b) { return x >= a && x <= b; }
+#ifdef __SSE2__
+            static __m128d v(__m128d x, __m128d a, __m128d b) { return _mm_and_pd(_mm_cmpge_pd(x, a), _mm_cmple_pd(x, b)); }
+#endif
+#ifdef SCREENK_HAS_AVX
+            SCREENK_AVX static __m256d v(__m256d x, __m256d a, __m256d b) {
+                return _mm256_and_pd(_mm256_cmp_pd(x, a, _CMP_GE_OQ), _mm256_cmp_pd(x, b, _CMP_LE_OQ));
+            }
+#endif
+};
+
+// sel[full] &= predicate over the n % 64 rows past the last full word
+template <class P>
+void filterTail(const double* x, size_t n, double a, double b, uint64_t* sel) {
+    size_t full = n / 64;
+    if (n % 64 && sel[full]) {
+        uint64_t bits = 0;
+        for (size_t j = 0; j < n % 64; ++j) bits |= (uint64_t)P::s(x[full * 64 + j], a, b) << j;
+        sel[full] &= bits;
+    }
+}
+
+#ifdef SCREENK_HAS_AVX
+template <class P>
+SCREENK_AVX void filterAvx(const double* x, size_t n, double a, double b, uint64_t* sel) {
+    const __m256d va = _mm256_set1_pd(a), vb = _mm256_set1_pd(b);
+    for (size_t w = 0; w < n / 64; ++w) {
+        if (!sel[w]) continue;
+        const double* p = x + w * 64;
+        uint64_t bits = 0;
+        for (int j = 0; j < 64; j += 8) {
+            uint64_t m = (uint64_t)_mm256_movemask_pd(P::v(_mm256_loadu_pd(p + j), va, vb))
+                       | (uint64_t)_mm256_movemask_pd(P::v(_mm256_loadu_pd(p + j + 4), va, vb)) << 4;
+            bits |= m << j;
+        }
+        sel[w] &= bits;
+    }
+    filterTail<P>(x, n, a, b, sel);
+}
+#endif
+
+inline bool haveAvx() {
+#if defined(__AVX__)
+    return true;
+#elif defined(SCREENK_HAS_AVX)
+    static const bool avx = __builtin_cpu_supports("avx");
+    return avx;
+#else
+    return false;
+#endif
+}
+
+// sel &= predicate over x[0, n): only words with a selected row are looked at
+template <class P>
+void filter(const double* x, size_t n, double a, double b, uint64_t* sel) {
+#ifdef SCREENK_HAS_AVX
+    if (haveAvx()) {
+        filterAvx<P>(x, n, a, b, sel);
+        return;
+    }
+#endif
+#ifdef __SSE2__
+    const __m128d va = _mm_set1_pd(a), vb = _mm_set1_pd(b);
+#endif
+    for (size_t w = 0; w < n / 64; ++w) {
+        if (!sel[w]) continue;
+        const double* p = x + w * 64;
+        uint64_t bits = 0;
+#ifdef __SSE2__
+        for (int j = 0; j < 64; j += 8) {
+            uint64_t m = (uint64_t)_mm_movemask_pd(P::v(_mm_loadu_pd(p + j), va, vb))
+                       | (uint64_t)_mm_movemask_pd(P::v(_mm_loadu_pd(p + j + 2), va, vb)) << 2
+                       | (uint64_t)_mm_movemask_pd(P::v(_mm_loadu_pd(p + j + 4), va, vb)) << 4
+                       | (uint64_t)_mm_movemask_pd(P::v(_mm_loadu_pd(p + j + 6), va, vb)) << 6;
+            bits |= m << j;
+        }
+#else
+        for (int j = 0; j < 64; ++j) bits |= (uint64_t)P::s(p[j], a, b) << j;
+#endif
+        sel[w] &= bits;
+    }
+    filterTail<P>(x, n, a, b, sel);
+}
+} // namespace screenk
+
+class Screener {
+public:
+    // Parse expr; on failure returns false and says why in error
+    bool compile(const string& expr, string& error) {
+        nodes.clear();
+        toks.clear();
+        pos = 0;
+        err.clear();
+        if (!tokenize(expr)) {
+            error = err;
+            return false;
+        }
+        root = parseOr();
+        if (err.empty() && pos < toks.size()) err = "unexpected '" + toks[pos] + "'";
+        if (err.empty() && nodes.empty()) err = "empty expression";
+        error = err;
+        return err.empty();
+    }
+
+    // Selection bitmap over instrument ids (bit id % 64 of word id / 64) of the
+    // listed instruments matching the expression; returns how many matched.
+    // The bitmap is worked out a stripe at a time, and with threads > 1 (0: one
+    // per core) the stripes are shared out between that many threads.
+    size_t run(const MarketVersion& v, const MarketIndicators* ind, vector<uint64_t>& sel, unsigned threads = 1) const {
+        size_t n = v.price.size();
+        sel = v.catalog->listedBits;
+        sel.resize((n + 63) / 64, 0);
+        if (nodes.empty()) return 0;
+        Columns cols;
+        cols.col[(int)ScreenColumn::Price] = v.price.data();
+        cols.col[(int)ScreenColumn::Available] = v.available.data();
+        cols.col[(int)ScreenColumn::Rsi] = ind ? ind->rsi.data() : nullptr;
+        cols.col[(int)ScreenColumn::Change] = ind ? ind->change.data() : nullptr;
+        cols.col[(int)ScreenColumn::Ema] = ind ? ind->ema.data() : nullptr;
+        cols.len[(int)ScreenColumn::Price] = cols.len[(int)ScreenColumn::Available] = n;
+        cols.len[(int)ScreenColumn::Rsi] = cols.len[(int)ScreenColumn::Change] = cols.len[(int)ScreenColumn::Ema] =
+            ind ? min(n, ind->rsi.size()) : 0;
+        size_t words = sel.size(), stripes = (words + kStripeWords - 1) / kStripeWords;
+        unsigned nt = (unsigned)min<size_t>(workerThreads(threads), stripes);
+        parallelFor(nt, nt, [&](unsigned t) {
+            MonotonicArena scratch; // bitmaps for || and !, released after each stripe
+            for (size_t s = stripes * t / nt; s < stripes * (t + 1) / nt; ++s) {
+                size_t w0 = s * kStripeWords;
+                eval(root, cols, sel.data() + w0, w0, min(kStripeWords, words - w0), scratch);
+                scratch.release();
+            }
+        });
+        size_t count = 0;
+        for (uint64_t w : sel) count += (size_t)__builtin_popcountll(w);
+        return count;
+    }
+    // Matching instrument ids in id order
+    vector<InstrumentId> matches(const MarketVersion& v, const MarketIndicators* ind, unsigned threads = 1) const {
+        vector<uint64_t> sel;
+        vector<InstrumentId> out;
+        out.reserve(run(v, ind, sel, threads));
+        for (size_t w = 0; w < sel.size(); ++w)
+            for (uint64_t bits = sel[w]; bits; bits &= bits - 1)
+                out.push_back((InstrumentId)(w * 64 + __builtin_ctzll(bits)));
+        return out;
+    }
+
+    // The same expression evaluated row by row with branches, for comparison
+    bool matchesRow(const MarketVersion& v, const MarketIndicators* ind, InstrumentId id) const {
+        return !nodes.empty() && evalRow(root, v, ind, id);
+    }
+
+private:
+    enum class Op : unsigned char { Filter, And, Or, Not };
+    struct Node {
+        Op op;
+        ScreenColumn column;
+        ScreenCmp cmp;
+        double a, b;
+        int left, right; // child node indexes
+    };
+    typedef vector<uint64_t, PolyAllocator<uint64_t> > Bits;
+    static const size_t kStripeWords = 256; // 16K rows, so a stripe of each column stays in L2
+    struct Columns {
+        const double* col[5];
+        size_t len[5]; // indicator columns lag behind instruments listed since the last tick
+    };
+    vector<Node> nodes;
+    int root = -1;
+    vector<string> toks;
+    size_t pos = 0;
+    string err;
+
+    bool tokenize(const string& s) {
+        for (size_t i = 0; i < s.size();) {
+            char c = s[i];
+            if (isspace((unsigned char)c)) { ++i; continue; }
+            if (isalpha((unsigned char)c)) {
+                size_t j = i;
+                while (j < s.size() && (isalnum((unsigned char)s[j]) || s[j] == '_')) ++j;
+                string w = s.substr(i, j - i);
+                for (char& ch : w) ch = (char)tolower((unsigned char)ch);
+                toks.push_back(w);
+                i = j;
+            } else if (isdigit((unsigned char)c) || c == '.' || (c == '-' && i + 1 < s.size() && (isdigit((unsigned char)s[i + 1]) || s[i + 1] == '.'))) {
+                size_t j = i + 1;
+                while (j < s.size() && (isdigit((unsigned char)s[j]) || s[j] == '.' || s[j] == 'e' || s[j] == 'E' ||
+                                        ((s[j] == '-' || s[j] == '+') && (s[j - 1] == 'e' || s[j - 1] == 'E')))) ++j;
+                toks.push_back(s.substr(i, j - i));
+                i = j;
+            } else {
+                static const char* ops[] = {"&&", "||", "<=", ">=", "==", "!=", "<", ">", "!", "(", ")", "="};
+                bool found = false;
+                for (const char* op : ops) {
+                    size_t len = strlen(op);
+                    if (s.compare(i, len, op) == 0) {
+                        toks.push_back(op);
+                        i += len;
+                        found = true;
+                        break;
+                    }
                 }
-                getline(ss, tmp, '\n'); 
-                try {
-                    units = stod(tmp);
-                } catch (const exception& e) {
-                    cout << "Error parsing units in market snapshot.\n";
+                if (!found) {
+                    err = string("unexpected character '") + c + "'";
                     return false;
                 }
-                addFund(MutualFund(nm, sym, nav, units));
             }
         }
-        ifs.close();
         return true;
     }
+
+    bool peek(const char* t) const { return pos < toks.size() && toks[pos] == t; }
+    int add(const Node& n) {
+        nodes.push_back(n);
+        return (int)nodes.size() - 1;
+    }
+    int binary(Op op, int l, int r) {
+        Node n = {op, ScreenColumn::Price, ScreenCmp::Lt, 0.0, 0.0, l, r};
+        return add(n);
+    }
+    int parseOr() {
+        int l = parseAnd();
+        while (err.empty() && (peek("||") || peek("or"))) {
+            ++pos;
+            l = binary(Op::Or, l, parseAnd());
+        }
+        return l;
+    }
+    int parseAnd() {
+        int l = parseFactor();
+        while (err.empty() && (peek("&&") || peek("and"))) {
+            ++pos;
+            l = binary(Op::And, l, parseFactor());
+        }
+        return l;
+    }
+    int parseFactor() {
+        if (!err.empty()) return -1;
+        if (pos >= toks.size()) {
+            err = "expression ends early";
+            return -1;
+        }
+        if (peek("!") || peek("not")) {
+            ++pos;
+            return binary(Op::Not, parseFactor(), -1);
+        }
+        if (peek("(")) {
+            ++pos;
+            int e = parseOr();
+            if (err.empty() && !peek(")")) err = "missing ')'";
+            ++pos;
+            return e;
+        }
+        Node n = {Op::Filter, ScreenColumn::Price, ScreenCmp::Lt, 0.0, 0.0, -1, -1};
+        const string& name = toks[pos++];
+        if (name == "price" || name == "nav") n.column = ScreenColumn::Price;
+        else if (name == "available" || name == "units") n.column = ScreenColumn::Available;
+        else if (name == "rsi") n.column = ScreenColumn::Rsi;
+        else if (name == "change") n.column = ScreenColumn::Change;
+        else if (name == "ema") n.column = ScreenColumn::Ema;
+        else {
+            err = "unknown column '" + name + "'";
+            return -1;
+        }
+        if (peek("between")) {
+            ++pos;
+            n.cmp = ScreenCmp::Between;
+            if (!number(n.a)) return -1;
+            if (!peek("and")) {
+                err = "expected 'and' in between";
+                return -1;
+            }
+            ++pos;
+            if (!number(n.b)) return -1;
+            if (n.a > n.b) swap(n.a, n.b);
+            return add(n);
+        }
+        if (pos >= toks.size()) {
+            err = "expected a comparison after '" + name + "'";
+            return -1;
+        }
+        const string& op = toks[pos++];
+        if (op == "<") n.cmp = ScreenCmp::Lt;
+        else if (op == "<=") n.cmp = ScreenCmp::Le;
+        else if (op == ">") n.cmp = ScreenCmp::Gt;
+        else if (op == ">=") n.cmp = ScreenCmp::Ge;
+        else if (op == "==" || op == "=") n.cmp = ScreenCmp::Eq;
+        else if (op == "!=") n.cmp = ScreenCmp::Ne;
+        else {
+            err = "expected a comparison after '" + name + "'";
+            return -1;
+        }
+        if (!number(n.a)) return -1;
+        return add(n);
+    }
+    bool number(double& out) {
+        if (pos >= toks.size()) {
+            err = "expected a number";
+            return false;
+        }
+        const string& t = toks[pos];
+        char* end = nullptr;
+        out = strtod(t.c_str(), &end);
+        if (t.empty() || end != t.c_str() + t.size()) {
+            err = "expected a number, got '" + t + "'";
+            return false;
+        }
+        ++pos;
+        return true;
+    }
+
+    // sel holds the rows still possible in the stripe of words starting at word
+    // w0; on return it holds those that match
+    void eval(int i, const Columns& c, uint64_t* sel, size_t w0, size_t words, MonotonicArena& scratch) const {
+        const Node& n = nodes[i];
+        switch (n.op) {
+            case Op::And:
+                eval(n.left, c, sel, w0, words, scratch);
+                eval(n.right, c, sel, w0, words, scratch);
+                return;
+            case Op::Or: {
+                Bits rest(sel, sel + words, PolyAllocator<uint64_t>(&scratch));
+                eval(n.left, c, sel, w0, words, scratch);
+                for (size_t w = 0; w < words; ++w) rest[w] &= ~sel[w]; // only rows the left side missed
+                eval(n.right, c, rest.data(), w0, words, scratch);
+                for (size_t w = 0; w < words; ++w) sel[w] |= rest[w];
+                return;
+            }
+            case Op::Not: {
+                Bits hit(sel, sel + words, PolyAllocator<uint64_t>(&scratch));
+                eval(n.left, c, hit.data(), w0, words, scratch);
+                for (size_t w = 0; w < words; ++w) sel[w] &= ~hit[w];
+                return;
+            }
+            default:
+                break;
+        }
+        size_t first = w0 * 64, len = c.len[(int)n.column];
+        size_t rows = len > first ? min(len - first, words * 64) : 0;
+        // rows past the end of the column have no value and cannot match (the
+        // kernel clears the rest of a partial last word itself)
+        for (size_t w = (rows + 63) / 64; w < words; ++w) sel[w] = 0;
+        if (!rows) return;
+        const double* x = c.col[(int)n.column] + first;
+        switch (n.cmp) {
+            case ScreenCmp::Lt: screenk::filter<screenk::Lt>(x, rows, n.a, n.b, sel); break;
+            case ScreenCmp::Le: screenk::filter<screenk::Le>(x, rows, n.a, n.b, sel); break;
+            case ScreenCmp::Gt: screenk::filter<screenk::Gt>(x, rows, n.a, n.b, sel); break;
+            case ScreenCmp::Ge: screenk::filter<screenk::Ge>(x, rows, n.a, n.b, sel); break;
+            case ScreenCmp::Eq: screenk::filter<screenk::Eq>(x, rows, n.a, n.b, sel); break;
+            case ScreenCmp::Ne: screenk::filter<screenk::Ne>(x, rows, n.a, n.b, sel); break;
+            default: screenk::filter<screenk::Between>(x, rows, n.a, n.b, sel); break;
+        }
+    }
+
+    bool evalRow(int i, const MarketVersion& v, const MarketIndicators* ind, InstrumentId id) const {
+        const Node& n = nodes[i];
+        switch (n.op) {
+            case Op::And: return evalRow(n.left, v, ind, id) && evalRow(n.right, v, ind, id);
+            case Op::Or: return evalRow(n.left, v, ind, id) || evalRow(n.right, v, ind, id);
+            case Op::Not: return !evalRow(n.left, v, ind, id);
+            default: break;
+        }
+        double x;
+        switch (n.column) {
+            case ScreenColumn::Price: x = v.price[id]; break;
+            case ScreenColumn::Available: x = v.available[id]; break;
+            default:
+                if (!ind || id >= ind->rsi.size()) return false;
+                x = n.column == ScreenColumn::Rsi ? ind->rsi[id] : n.column == ScreenColumn::Change ? ind->change[id] : ind->ema[id];
+        }
+        switch (n.cmp) {
+            case ScreenCmp::Lt: return x < n.a;
+            case ScreenCmp::Le: return x <= n.a;
+            case ScreenCmp::Gt: return x > n.a;
+            case ScreenCmp::Ge: return x >= n.a;
+            case ScreenCmp::Eq: return x == n.a;
+            case ScreenCmp::Ne: return x != n.a;
+            default: return x >= n.a && x <= n.b;
+        }
+    }
 };
 
-// --------------------------- Investor ---------------------------
-class Investor {
+// --------------------------- UI & main ---------------------------
+void showMainMenu() {
+    cout << "\n===== STOCK MARKET SIMULATION (OOP Demo) =====\n";
+    cout << "1. Show Market\n";
+    cout << "2. Show My Portfolio\n";
+    cout << "3. Buy\n";
+    cout << "4. Sell\n";
+    cout << "5. Deposit Cash\n";
+    cout << "6. Withdraw Cash\n";
+    cout << "7. Show Transactions\n";
+    cout << "8. Simulate Market Movement\n";
+    cout << "9. Save Snapshot (Market & Investor)\n";
+    cout << "10. Load Snapshot (Market & Investor)\n";
+    cout << "11. Quick Demo Setup (populate sample market)\n";
+    cout << "12. Query Transactions (symbol / action / time range)\n";
+    cout << "13. Cash Balance At Time\n";
+    cout << "14. Show Tax Lots & Realized P/L\n";
+    cout << "15. Sell From Specific Lot\n";
+    cout << "16. Set Lot Method (FIFO/LIFO)\n";
+    cout << "17. Snapshot Save Progress\n";
+    cout << "18. Recovery Checkpoint (journal mode)\n";
+    cout << "19. Place Price Trigger (stop-loss / take-profit / buy / alert)\n";
+    cout << "20. Show My Triggers\n";
+    cout << "21. Cancel Trigger\n";
+    cout << "22. Show Transactions Page (offset / limit)\n";
+    cout << "23. Export Analytics Files (columnar transactions + ticks)\n";
+    cout << "24. Screen Market (e.g. price between 400 and 900 && rsi < 30)\n";
+    cout << "25. Allocation Report (per operation)\n";
+    cout << "26. Run Simulated Sessions (ticks, earnings, dividends, splits)\n";
+    cout << "27. Apply Corporate Action (split / dividend)\n";
+    cout << "28. Publish Prices to Shared Memory (for other processes)\n";
+    cout << "29. Move Yield Curve (reprice bonds)\n";
+    cout << "30. Stress Test Portfolios (e.g. banks -15%, IT -8%, funds -5%)\n";
+    cout << "31. Rebalance To Model Portfolio (target weights)\n";
+    cout << "0. Exit\n";
+    cout << "Enter choice: ";
+}
+
+// Government benchmark yields the sample bonds are priced off (option 29 moves them)
+vector<CurveInstrument> sampleBenchmarks() {
+    vector<CurveInstrument> b;
+    b.push_back(CurveInstrument(0.25, 0.0650, 0)); // deposits
+    b.push_back(CurveInstrument(0.5, 0.0660, 0));
+    b.push_back(CurveInstrument(1.0, 0.0675, 0));
+    b.push_back(CurveInstrument(2.0, 0.0685));     // par bonds, semi-annual coupons
+    b.push_back(CurveInstrument(3.0, 0.0695));
+    b.push_back(CurveInstrument(5.0, 0.0705));
+    b.push_back(CurveInstrument(7.0, 0.0710));
+    b.push_back(CurveInstrument(10.0, 0.0715));
+    b.push_back(CurveInstrument(15.0, 0.0725));
+    b.push_back(CurveInstrument(30.0, 0.0730));
+    return b;
+}
+
+// Sectors of the sample symbols, for stress scenarios (option 30)
+SectorMap sampleSectors() {
+    SectorMap m;
+    m.assign("HDFCB", "banks");
+    m.assign("ICIC", "banks");
+    m.assign("INFY", "IT");
+    m.assign("WIPR", "IT");
+    m.assign("TATAM", "auto");
+    m.assign("RELI", "energy");
+    return m;
+}
+
+// Dirty price of a bond off a curve
+double priceOffCurve(const BondTerms& t, const YieldCurve& curve) {
+    vector<double> times, amounts;
+    t.cashflows(times, amounts);
+    double p = 0.0;
+    for (size_t k = 0; k < times.size(); ++k) p += amounts[k] * curve.discount(times[k]);
+    return p;
+}
+
+void setupSampleMarket(Market& market) {
+    // Add a bunch of stocks and funds
+    market.addStock(Stock("Tata Motors Ltd", "TATAM", 490.50, 10000));
+    market.addStock(Stock("Infosys Ltd", "INFY", 1830.75, 8000));
+    market.addStock(Stock("Reliance Industries", "RELI", 2979.30, 9000));
+    market.addStock(Stock("HDFC Bank", "HDFCB", 1435.40, 7000));
+    market.addStock(Stock("ICICI Bank", "ICIC", 840.25, 6000));
+    market.addStock(Stock("Wipro Ltd", "WIPR", 420.10, 6500));
+    market.addFund(MutualFund("SBI Equity Fund", "SBI-EQ", 48.30, 50000.0));
+    market.addFund(MutualFund("Nippon India Largecap", "NIP-LC", 34.75, 40000.0));
+    market.addFund(MutualFund("HDFC Hybrid", "HDFC-HY", 20.50, 30000.0));
+    YieldCurve curve;
+    curve.bootstrap(sampleBenchmarks());
+    const BondTerms gs27(0.0738, 2, 1.6), gs29(0.0710, 2, 3.4), gs33(0.0718, 2, 7.8), gs37(0.0726, 2, 11.3);
+    market.addBond(Bond("GOI 7.38% 2027", "GS27", gs27, priceOffCurve(gs27, curve), 20000));
+    market.addBond(Bond("GOI 7.10% 2029", "GS29", gs29, priceOffCurve(gs29, curve), 20000));
+    market.addBond(Bond("GOI 7.18% 2033", "GS33", gs33, priceOffCurve(gs33, curve), 15000));
+    market.addBond(Bond("GOI 7.26% 2037", "GS37", gs37, priceOffCurve(gs37, curve), 10000));
+    cout << "Sample market populated.\n";
+}
+
+void showYieldCurve(const vector<CurveInstrument>& bench, const YieldCurve& curve) {
+    ios::fmtflags flags = cout.flags();
+    streamsize prec = cout.precision();
+    cout << "\n---- YIELD CURVE ----\n";
+    cout << right << setw(8) << "Tenor" << setw(12) << "Benchmark%" << setw(10) << "Zero%" << "\n";
+    for (size_t i = 0; i < bench.size(); ++i) {
+        cout << fixed << setprecision(2) << setw(8) << bench[i].maturity << setprecision(3) << setw(12)
+             << bench[i].coupon * 100.0 << setw(10) << curve.zeroRate(bench[i].maturity) * 100.0
+             << (bench[i].frequency ? "" : "  (deposit)") << "\n";
+    }
+    cout.flags(flags);
+    cout.precision(prec);
+}
+
+// Analytics of the given bonds of the book (all of them when `only` is null)
+void showBondAnalytics(const BondPricer& book, const vector<uint32_t>* only = nullptr) {
+    ios::fmtflags flags = cout.flags();
+    streamsize prec = cout.precision();
+    cout << left << setw(8) << "Sym" << right << setw(8) << "Coupon%" << setw(7) << "Years" << setw(10) << "Clean"
+         << setw(10) << "Dirty" << setw(8) << "YTM%" << setw(8) << "ModDur" << "\n";
+    cout << string(59, '-') << "\n";
+    size_t n = only ? only->size() : book.size();
+    for (size_t i = 0; i < n; ++i) {
+        size_t b = only ? (*only)[i] : i;
+        const BondTerms& t = book.bondTerms(b);
+        const BondAnalytics& q = book.analytics(b);
+        cout << left << setw(8) << instruments().symbol(book.id(b)) << right << fixed << setprecision(2)
+             << setw(8) << t.coupon * 100.0 << setw(7) << t.maturity << setw(10) << q.clean << setw(10) << q.dirty
+             << setprecision(3);
+        if (q.hasYield()) cout << setw(8) << q.ytm * 100.0 << setprecision(2) << setw(8) << q.duration << "\n";
+        else cout << setw(8) << "n/a" << setw(8) << "n/a" << "\n";
+    }
+    cout.flags(flags);
+    cout.precision(prec);
+}
+
+// Stress results: the worst scenarios for the book, the hardest-hit accounts
+// and what drives the book's worst scenario, `top` rows each
+void showStressResult(const StressResult& r, const vector<StressScenario>& scen, const InvestorBook& book,
+                      const SectorMap& sectors, size_t top = 10) {
+    ios::fmtflags flags = cout.flags();
+    streamsize prec = cout.precision();
+    auto label = [&](size_t s) {
+        const string& l = scen[s].label;
+        return l.size() > 32 ? l.substr(0, 29) + "..." : l;
+    };
+    cout << fixed << setprecision(2);
+    cout << "\n---- WORST SCENARIOS (of " << r.scenarios << ") ----\n";
+    cout << left << setw(34) << "Scenario" << right << setw(16) << "Book P/L" << "  " << left << setw(16)
+         << "Worst account" << right << setw(14) << "Its P/L" << "\n";
+    for (size_t s : lowestOf(r.scenarioPnl, top))
+        cout << left << setw(34) << label(s) << right << setw(16) << r.scenarioPnl[s] << "  " << left << setw(16)
+             << book[r.scenarioWorstAccount[s]].getName().substr(0, 16) << right << setw(14) << r.scenarioWorst[s] << "\n";
+
+    cout << "\n---- HARDEST-HIT ACCOUNTS ----\n";
+    cout << left << setw(16) << "Account" << right << setw(16) << "Net worth" << setw(14) << "Worst P/L" << setw(9)
+         << "Loss%" << "  " << left << "Scenario" << "\n";
+    for (size_t a : lowestOf(r.worstPnl, top)) {
+        if (r.worstPnl[a] >= 0.0) break;
+        double pct = r.baseWorth[a] > 0.0 ? -100.0 * r.worstPnl[a] / r.baseWorth[a] : 0.0;
+        cout << left << setw(16) << book[a].getName().substr(0, 16) << right << setw(16) << r.baseWorth[a] << setw(14)
+             << r.worstPnl[a] << setw(9) << pct << "  " << left << label(r.worstScenario[a]) << "\n";
+    }
+
+    if (r.scenarios == 0) {
+        cout.flags(flags);
+        cout.precision(prec);
+        return;
+    }
+    cout << "\n---- EXPOSURE IN \"" << scen[r.worstScenarioOverall].label << "\" ----\n";
+    vector<double> bySector(sectors.size() + 1, 0.0); // last: no sector
+    for (InstrumentId id = 0; id < r.exposure.size(); ++id) {
+        uint16_t sec = sectors.sectorOf(id);
+        bySector[sec == kNoSector ? sectors.size() : sec] += r.exposure[id];
+    }
+    cout << left << setw(10) << "Symbol" << setw(12) << "Sector" << right << setw(16) << "P/L" << "\n";
+    for (size_t id : lowestOf(r.exposure, top)) {
+        if (r.exposure[id] >= 0.0) break;
+        uint16_t sec = sectors.sectorOf((InstrumentId)id);
+        cout << left << setw(10) << instruments().symbol((InstrumentId)id) << setw(12)
+             << (sec == kNoSector ? string("-") : sectors.name(sec)) << right << setw(16) << r.exposure[id] << "\n";
+    }
+    cout << left << setw(22) << "By sector" << right << setw(16) << "P/L" << "\n";
+    for (size_t sec : lowestOf(bySector, bySector.size())) {
+        if (bySector[sec] == 0.0) continue;
+        cout << left << setw(22) << (sec == sectors.size() ? string("(none)") : sectors.name((uint16_t)sec)) << right
+             << setw(16) << bySector[sec] << "\n";
+    }
+    cout.flags(flags);
+    cout.precision(prec);
+}
+
+// A batch's trade list (the first `top` lines) and what the batch did
+void showRebalance(const Rebalancer& r, const InvestorBook& book, size_t top = 20) {
+    ios::fmtflags flags = cout.flags();
+    streamsize prec = cout.precision();
+    const vector<RebalanceOrder>& orders = r.trades();
+    const RebalanceStats& st = r.getStats();
+    cout << "\n---- REBALANCE TRADES ----\n";
+    cout << left << setw(16) << "Account" << setw(6) << "Side" << setw(8) << "Sym" << right << setw(12) << "Planned"
+         << setw(12) << "Filled" << setw(12) << "Price" << "  " << left << "Status" << "\n";
+    cout << string(80, '-') << "\n";
+    for (size_t i = 0; i < orders.size() && i < top; ++i) {
+        const RebalanceOrder& o = orders[i];
+        cout << left << setw(16) << book[o.account].getName().substr(0, 16) << setw(6) << (o.sell ? "SELL" : "BUY")
+             << setw(8) << instruments().symbol(o.id) << right << fixed << setprecision(4) << setw(12) << o.qty
+             << setw(12) << o.filled << setprecision(2) << setw(12) << o.price << "  " << left
+             << (o.status == TradeStatus::Ok ? (o.filled < o.qty - 1e-9 ? "partial" : "filled")
+                                             : tradeStatusMessage(o.status))
+             << "\n";
+    }
+    if (orders.size() > top) cout << "... " << orders.size() - top << " more\n";
+    cout << st.accounts << " accounts, " << st.orders << " orders: " << st.filled << " filled, " << st.partial
+         << " partial, " << st.rejected << " rejected; " << st.instruments << " instruments traded.\n";
+    cout << fixed << setprecision(2) << "Bought " << st.bought << ", sold " << st.sold << "; " << setprecision(4)
+         << st.crossed << " units crossed between accounts, " << st.marketUnits << " units from or to the market.\n";
+    cout.flags(flags);
+    cout.precision(prec);
+}
+
+// --------------------------- Benchmarks ---------------------------
+// Run with: ./sharemarket --bench
+volatile double benchSink; // keeps benchmark loops from being optimised away
+
+const uint64_t kAllocsNotCounted = ~uint64_t(0);
+
+// With -DSHAREMARKET_ALLOC_PROFILE the tables gain an allocations-per-op column
+void printBenchHeader(const string& title) {
+    cout << "\n---- " << title << " ----\n";
+    cout << left << setw(40) << "Benchmark" << right << setw(12) << "ops" << setw(12) << "ns/op";
+    if (allocprof::enabled) cout << setw(12) << "allocs/op";
+    cout << "\n" << string(allocprof::enabled ? 76 : 64, '-') << "\n";
+}
+
+void printBenchRow(const string& name, size_t ops, double secs, uint64_t allocs = kAllocsNotCounted) {
+    cout << left << setw(40) << name << right << setw(12) << ops
+         << setw(12) << fixed << setprecision(1) << (ops ? secs * 1e9 / ops : 0.0);
+    if (allocprof::enabled) {
+        if (allocs == kAllocsNotCounted) cout << setw(12) << "-";
+        else cout << setw(12) << setprecision(3) << (ops ? (double)allocs / ops : 0.0);
+    }
+    cout << "\n";
+}
+
+// The pre-trait trade path: virtual price/typeName() and string compares per trade
+double quoteViaInvestment(Market& m, const string& sym, double qty, double cash) {
+    Investment* inv = m.findInvestment(sym);
+    if (!inv) return -1.0;
+    double cost = inv->currentPrice() * qty;
+    if (inv->typeName() == "Stock") {
+        Stock* s = m.findStock(sym);
+        if (static_cast<int>(qty) != qty || qty > s->getAvailable()) return -1.0;
+        return cost > cash ? -1.0 : cost;
+    }
+    if (inv->typeName() == "MutualFund") {
+        MutualFund* f = m.findFund(sym);
+        if (qty > f->getUnits()) return -1.0;
+        return cost > cash ? -1.0 : cost;
+    }
+    if (inv->typeName() == "Bond") {
+        Bond* b = m.findBond(sym);
+        if (static_cast<int>(qty) != qty || qty > b->getAvailable()) return -1.0;
+        return cost > cash ? -1.0 : cost;
+    }
+    return -1.0;
+}
+
+template <typename T>
+double quoteAs(T& inst, double qty, double cash) {
+    typedef InstrumentTraits<T> Traits;
+    if (Traits::wholeUnits && static_cast<int>(qty) != qty) return -1.0;
+    if (qty > Traits::supply(inst)) return -1.0;
+    double cost = Traits::price(inst) * qty;
+    return cost > cash ? -1.0 : cost;
+}
+
+// Same checks as Investor::tryBuy
+double quoteViaTraits(Market& m, const string& sym, double qty, double cash) {
+    if (Stock* s = m.findStock(sym)) return quoteAs(*s, qty, cash);
+    if (MutualFund* f = m.findFund(sym)) return quoteAs(*f, qty, cash);
+    if (Bond* b = m.findBond(sym)) return quoteAs(*b, qty, cash);
+    return -1.0;
+}
+
+// Hardware counter for the calling thread (Linux perf events); reads 0 elsewhere
+// or when the kernel does not allow it.
+class PerfCounter {
 private:
-    string name;
-    double cashBalance;
-    map<string, Holding> portfolio; // keyed by symbol
-    TransactionLog tlog;
+    int fd;
 public:
-    Investor() : name("Unnamed"), cashBalance(0.0) {}
-    Investor(const string& n, double balance) : name(n), cashBalance(balance) {}
+    PerfCounter() : fd(-1) {
+#ifdef __linux__
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+    }
+    ~PerfCounter() {
+#ifdef __linux__
+        if (fd >= 0) close(fd);
+#endif
+    }
+    bool ok() const { return fd >= 0; }
+    void start() {
+#ifdef __linux__
+        if (fd < 0) return;
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+    }
+    uint64_t stop() {
+        uint64_t v = 0;
+#ifdef __linux__
+        if (fd < 0) return 0;
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &v, sizeof(v)) != (ssize_t)sizeof(v)) v = 0;
+#endif
+        return v;
+    }
+};
 
-    string getName() const { return name; }
-    double getBalance() const { return cashBalance; }
+// Bytes currently allocated from the heap, when the C library can tell us
+size_t heapInUse() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    return mallinfo2().uordblks;
+#else
+    return 0;
+#endif
+}
 
-    void deposit(double amt) {
-        if (amt <= 0) {
-            cout << "Deposit amount must be positive.\n";
-            return;
+void benchTradeDispatch() {
+    Market market;
+    streambuf* saved = cout.rdbuf(nullptr); // setupSampleMarket prints
+    setupSampleMarket(market);
+    cout.rdbuf(saved);
+    const vector<string> syms = {"TATAM", "INFY", "RELI", "HDFCB", "ICIC", "WIPR", "SBI-EQ", "NIP-LC", "HDFC-HY",
+                                 "GS27", "GS33"};
+    const size_t n = 2000000;
+    double sink = 0.0, viaVirtual = 0.0, viaTraits = 0.0;
+
+    printBenchHeader("trade dispatch");
+    {
+        Stopwatch t;
+        for (size_t i = 0; i < n; ++i) viaVirtual += quoteViaInvestment(market, syms[i % syms.size()], 3.0, 1e9);
+        printBenchRow("Investment* + typeName() compare", n, t.seconds(), t.allocs());
+    }
+    {
+        Stopwatch t;
+        for (size_t i = 0; i < n; ++i) viaTraits += quoteViaTraits(market, syms[i % syms.size()], 3.0, 1e9);
+        printBenchRow("InstrumentTraits<T> dispatch", n, t.seconds(), t.allocs());
+    }
+    cout << "  quotes agree: " << (viaVirtual == viaTraits ? "yes" : "NO") << "\n";
+    sink = viaVirtual + viaTraits;
+    {
+        const size_t trips = 100000;
+        Investor inv("bench", 1e12);
+        Stopwatch t;
+        for (size_t i = 0; i < trips; ++i) {
+            const string& sym = syms[i % syms.size()];
+            inv.tryBuy(market, sym, 3.0);
+            inv.trySell(market, sym, 3.0);
         }
-        cashBalance += amt;
-        tlog.add("DEPOSIT", "-", "-", "-", 0.0, 0.0, cashBalance);
-        cout << "Deposited " << fixed << setprecision(2) << amt << ". New balance: " << cashBalance << "\n";
+        printBenchRow("tryBuy + trySell round trip", trips, t.seconds(), t.allocs());
     }
-    bool withdraw(double amt) {
-        if (amt <= 0) {
-            cout << "Withdraw amount must be positive.\n";
-            return false;
+    benchSink = sink;
+}
+
+// The pre-compaction holding: three strings per position in a map node
+struct LegacyHolding {
+    string symbol;
+    string name;
+    string type;
+    double quantity;
+    double avgPrice;
+};
+
+void benchHoldingLayout() {
+    const size_t universe = 2000, investors = 20000, perInvestor = 24;
+    Market market;
+    vector<string> syms(universe);
+    for (size_t i = 0; i < universe; ++i) {
+        syms[i] = "SYM" + to_string(i);
+        market.addStock(Stock("Benchmark Instrument " + to_string(i), syms[i], 100.0 + i % 50, 1000000));
+    }
+    mt19937 rng(7);
+
+    size_t before = heapInUse();
+    vector<map<string, LegacyHolding> > legacy(investors);
+    for (size_t i = 0; i < investors; ++i) {
+        for (size_t k = 0; k < perInvestor; ++k) {
+            const string& sym = syms[rng() % universe];
+            LegacyHolding h = {sym, "Benchmark Instrument " + sym.substr(3), "Stock", 10.0, 100.0};
+            legacy[i][sym] = h;
         }
-        if (amt > cashBalance) {
-            cout << "Insufficient balance.\n";
-            return false;
+    }
+    size_t legacyBytes = heapInUse() - before;
+    size_t legacyPositions = 0;
+    for (const auto& m : legacy) legacyPositions += m.size();
+
+    before = heapInUse();
+    vector<Portfolio> compact(investors);
+    rng.seed(7);
+    for (size_t i = 0; i < investors; ++i) {
+        for (size_t k = 0; k < perInvestor; ++k) {
+            Holding& h = compact[i].upsert(instruments().find(syms[rng() % universe]));
+            h.quantity = 10.0;
+            h.avgPrice = 100.0;
         }
-        cashBalance -= amt;
-        tlog.add("WITHDRAW", "-", "-", "-", 0.0, 0.0, cashBalance);
-        cout << "Withdrew " << fixed << setprecision(2) << amt << ". New balance: " << cashBalance << "\n";
-        return true;
     }
+    size_t compactBytes = heapInUse() - before + investors * sizeof(Portfolio);
+    legacyBytes += investors * sizeof(map<string, LegacyHolding>);
 
-    // Buy N units of an investment
-    bool buy(Market& market, const string& symbol, double qty) {
-        Investment* inv = market.findInvestment(symbol);
-        if (!inv) {
-            cout << "Investment symbol not found in market.\n";
-            return false;
+    cout << "\n---- holding layout (" << investors << " investors x " << perInvestor << " buys) ----\n";
+    if (legacyBytes > investors * sizeof(map<string, LegacyHolding>)) {
+        cout << "map<string, LegacyHolding> bytes/position: " << fixed << setprecision(1)
+             << (double)legacyBytes / legacyPositions << "\n";
+        cout << "Portfolio (SmallVector<Holding, 4>) bytes/position: "
+             << (double)compactBytes / legacyPositions << "\n";
+    } else {
+        cout << "heap statistics unavailable; sizeof(LegacyHolding) = " << sizeof(LegacyHolding)
+             << ", sizeof(Holding) = " << sizeof(Holding) << "\n";
+    }
+
+    PerfCounter misses;
+    double sink = 0.0;
+    printBenchHeader("portfolio valuation");
+    {
+        misses.start();
+        Stopwatch t;
+        for (const auto& m : legacy)
+            for (const auto& p : m) {
+                const Investment* inv = market.findInvestment(p.second.symbol);
+                sink += p.second.quantity * (inv ? inv->currentPrice() : 0.0);
+            }
+        double secs = t.seconds();
+        uint64_t cm = misses.stop();
+        printBenchRow("map + findInvestment per holding", legacyPositions, secs);
+        if (misses.ok()) cout << "  cache misses/valuation: " << fixed << setprecision(1) << (double)cm / investors << "\n";
+    }
+    {
+        EpochGuard guard;
+        const MarketVersion* mv = market.view();
+        misses.start();
+        Stopwatch t;
+        for (const Portfolio& pf : compact)
+            for (const Holding& h : pf) sink += h.quantity * mv->priceOf(h.id);
+        double secs = t.seconds();
+        uint64_t cm = misses.stop();
+        printBenchRow("flat holdings + price column", legacyPositions, secs);
+        if (misses.ok()) cout << "  cache misses/valuation: " << fixed << setprecision(1) << (double)cm / investors << "\n";
+    }
+    benchSink = sink;
+}
+
+// Pause seen by the trading thread: a synchronous save vs. a background checkpoint
+void benchCheckpoint() {
+    const size_t universe = 500, trades = 200000;
+    Market market;
+    for (size_t i = 0; i < universe; ++i)
+        market.addStock(Stock("Benchmark Instrument " + to_string(i), "SYM" + to_string(i), 100.0, 100000000));
+    Investor investor("Bench", 1e12);
+    mt19937 rng(11);
+    for (size_t i = 0; i < trades; ++i)
+        investor.tryBuy(market, "SYM" + to_string(rng() % universe), 1);
+    const string prefix = "bench_checkpoint";
+
+    cout << "\n---- snapshot save (" << trades << " log rows) ----\n";
+    Stopwatch t;
+    bool ok = market.saveSnapshot(prefix + "_market.txt") && investor.saveToFile(prefix + "_investor.txt");
+    double syncSecs = t.seconds();
+
+    Checkpointer ckpt;
+    t = Stopwatch();
+    ckpt.start(market, investor, prefix);
+    double pauseSecs = t.seconds();
+    ok = ckpt.wait() && ok;
+    double totalSecs = t.seconds();
+    CheckpointProgress p = ckpt.progress();
+
+    cout << "synchronous save pause (ms):       " << fixed << setprecision(3) << syncSecs * 1e3 << "\n";
+    cout << "background checkpoint pause (us):  " << setprecision(1) << pauseSecs * 1e6 << "\n";
+    cout << "background checkpoint total (ms):  " << setprecision(3) << totalSecs * 1e3
+         << " (" << p.bytesWritten << " bytes" << (ok ? "" : ", FAILED") << ")\n";
+    const char* suffixes[] = {"_market.txt", "_investor.txt", "_investor.txt.txlog", "_investor.txt.txlog.idx"};
+    for (const char* s : suffixes) remove((prefix + s).c_str());
+}
+
+void printRecoveryStats(const RecoveryStats& st) {
+    ios::fmtflags flags = cout.flags();
+    streamsize prec = cout.precision();
+    cout << "Recovered " << st.accounts << " accounts from checkpoint " << st.checkpointLsn << " + "
+         << st.records << " journal records (LSN " << st.lastLsn << ") on " << st.threads << " threads in "
+         << fixed << setprecision(3) << st.loadSeconds + st.replaySeconds << " s (checkpoint "
+         << st.loadSeconds << " s, replay " << st.replaySeconds << " s).\n";
+    if (st.tornBytes) cout << "Discarded " << st.tornBytes << " bytes of an incomplete last record.\n";
+    if (st.digestChecked)
+        cout << (st.digestOk ? "State digest matches the clean shutdown.\n" : "WARNING: state digest differs from the clean shutdown.\n");
+    cout.flags(flags);
+    cout.precision(prec);
+}
+
+// Journal a day of trading for many accounts, drop the process state without a
+// checkpoint (a crash), recover it and check it against the pre-crash digest.
+int runRecoveryBench(size_t investors, size_t opsPerInvestor) {
+    const string prefix = "recover_bench";
+    const size_t universe = 64;
+    vector<string> syms;
+    uint64_t before = 0;
+    {
+        Market market;
+        for (size_t i = 0; i < universe; ++i) {
+            syms.push_back("RB" + to_string(i));
+            if (i % 8 == 7) market.addFund(MutualFund("Recovery Fund " + to_string(i), syms.back(), 50.0, 1e12));
+            else market.addStock(Stock("Recovery Stock " + to_string(i), syms.back(), 100.0, 2000000000));
         }
-        if (qty <= 0) {
-            cout << "Quantity must be positive.\n";
-            return false;
+        InvestorBook book;
+        for (size_t i = 0; i < investors; ++i) book.open("INV" + to_string(i), 1e6);
+        Recovery rec(prefix);
+        Stopwatch t;
+        if (!rec.begin(market, book)) {
+            cout << "Could not write the start-of-day checkpoint.\n";
+            return 1;
         }
-        double price = inv->currentPrice();
-        double cost = price * qty;
+        cout << "start-of-day checkpoint: " << investors << " accounts in " << fixed << setprecision(3)
+             << t.seconds() << " s\n";
 
-        // For stocks, check integer qty and market availability
-        if (inv->typeName() == "Stock") {
-            Stock* s = market.findStock(symbol);
-            if (!s) { cout << "Stock not found.\n"; return false; }
-            int iqty = static_cast<int>(qty);
-            if (iqty != qty) {
-                cout << "Stocks must be bought in whole shares only.\n";
-                return false;
-            }
-            if (iqty > s->getAvailable()) {
-                cout << "Not enough shares available in market.\n";
-                return false;
-            }
-            if (cost > cashBalance) {
-                cout << "Insufficient cash balance.\n";
-                return false;
-            }
-            // proceed
-            cashBalance -= cost;
-            s->changeAvailable(-iqty);
-            addOrUpdateHolding(symbol, s->getName(), s->typeName(), qty, price);
-            tlog.add("BUY", symbol, s->getName(), s->typeName(), qty, price, cashBalance);
-            cout << "Bought " << qty << " shares of " << symbol << " for " << cost << ".\n";
-            return true;
+        mt19937 rng(42);
+        size_t total = investors * opsPerInvestor, done = 0;
+        t = Stopwatch();
+        for (size_t i = 0; i < total; ++i) {
+            Investor& inv = book[rng() % investors];
+            size_t k = rng() % universe;
+            TradeStatus st;
+            if (rng() % 3) st = inv.tryBuy(market, syms[k], k % 8 == 7 ? 0.25 * (1 + rng() % 8) : 1 + rng() % 5);
+            else st = inv.trySell(market, syms[k], 1);
+            if (st == TradeStatus::Ok) ++done;
+            if (i % 50000 == 49999) market.simulatePriceMovement();
+            if (i % 4096 == 4095) rec.log().commit();
         }
-        // For mutual funds - can buy fractional units
-        if (inv->typeName() == "MutualFund") {
-            MutualFund* f = market.findFund(symbol);
-            if (!f) { cout << "Fund not found.\n"; return false; }
-            if (qty > f->getUnits()) {
-                cout << "Not enough units available in fund.\n";
-                return false;
+        rec.log().commit();
+        cout << "trading day: " << total << " orders, " << done << " fills, " << rec.log().lastLsn()
+             << " journal records in " << t.seconds() << " s\n";
+        before = stateDigest(market, book);
+        // crash: no checkpoint, no shutdown record; the destructors below just drop the state
+    }
+#ifdef __GLIBC__
+    malloc_trim(0); // hand the crashed state's heap back, as a restarted process would start clean
+#endif
+    Market market;
+    InvestorBook book;
+    Recovery rec(prefix);
+    RecoveryStats st;
+    bool ok = rec.recover(market, book, st);
+    if (ok) printRecoveryStats(st);
+    bool same = ok && stateDigest(market, book) == before;
+    cout << "determinism check: " << (same ? "recovered state matches pre-crash state" : "MISMATCH") << "\n";
+    rec.removeFiles();
+    return same ? 0 : 1;
+}
+
+// True when every column of every row group in f decodes to what src holds
+template <class Source>
+bool columnarMatches(ColumnarFile& f, const Source& src) {
+    vector<ColumnSpec> schema = src.schema();
+    bool same = f.rows() == src.rows() && f.columns().size() == schema.size();
+    uint64_t at = 0;
+    for (size_t g = 0; g < f.rowGroups().size() && same; ++g) {
+        size_t n = (size_t)f.rowGroups()[g].rows;
+        vector<ColumnValues> want(schema.size());
+        src.gather((size_t)at, (size_t)at + n, want);
+        for (size_t c = 0; c < schema.size() && same; ++c) {
+            if (schema[c].type == ColumnType::Int64) {
+                vector<int64_t> got;
+                same = f.readInts(g, (int)c, got) && got == want[c].ints;
+            } else if (schema[c].type == ColumnType::Double) {
+                vector<double> got;
+                same = f.readDoubles(g, (int)c, got) && got == want[c].doubles;
+            } else {
+                vector<string> got;
+                same = f.readStrings(g, (int)c, got);
+                for (size_t i = 0; same && i < n; ++i) same = got[i] == schema[c].label(want[c].ints[i]);
             }
-            if (cost > cashBalance) {
-                cout << "Insufficient cash balance.\n";
-                return false;
+        }
+        at += n;
+    }
+    return same;
+}
+
+// Columnar export of a large in-memory log and tick history, read back and checked
+int runExportBench(size_t rows, unsigned threads) {
+    const size_t universe = 500, accounts = max<size_t>(1, rows / 200);
+    Market market;
+    vector<InstrumentId> ids;
+    for (size_t i = 0; i < universe; ++i) {
+        string sym = "EX" + to_string(i);
+        if (i % 10 == 9) market.addFund(MutualFund("Export Fund " + to_string(i), sym, 50.0, 1e12));
+        else if (i % 50 == 24) market.addBond(Bond("Export Bond " + to_string(i), sym, BondTerms(0.07, 2, 5.0), 100.0, 2000000000));
+        else market.addStock(Stock("Export Stock " + to_string(i), sym, 100.0, 2000000000));
+        ids.push_back(instruments().find(sym));
+    }
+    // synthetic history: entries go straight into the logs, 5000 a second
+    mt19937 rng(17);
+    Timestamp base = clockNow() - 86400 * kNsPerSecond;
+    vector<TransactionLog> logs(accounts);
+    TxEntry e;
+    size_t bondRows = 0;
+    for (size_t i = 0; i < rows; ++i) {
+        e.time = base + (Timestamp)i * (kNsPerSecond / 5000);
+        e.action = rng() % 3 ? TxAction::Buy : TxAction::Sell;
+        e.instrument = ids[rng() % universe];
+        e.kind = instruments().kind(e.instrument);
+        e.qty = e.kind == InstrumentKind::MutualFund ? 0.25 * (1 + rng() % 40) : (double)(1 + rng() % 20);
+        bondRows += e.kind == InstrumentKind::Bond;
+        e.price = 100.0 + (rng() % 4000) * 0.05;
+        e.balanceAfter = 1e6 - (double)(rng() % 100000000) / 100.0;
+        e.lot = kAnyLot;
+        logs[i % accounts].add(e);
+    }
+    TickHistory ticks;
+    market.attachTickHistory(&ticks);
+    while (ticks.size() < rows) market.simulatePriceMovement();
+
+    vector<TransactionLog::Snapshot> snaps;
+    for (const TransactionLog& l : logs) snaps.push_back(l.snapshot());
+    TxColumnSource src(snaps);
+
+    WorkStealingPool pool(threads);
+    cout << "\n---- columnar export (" << pool.size() << " threads) ----\n";
+    ColumnarExportStats tx, tk;
+    bool ok = exportColumnar("export_bench_tx.smcol", "transactions", src, pool, tx) &&
+              exportColumnar("export_bench_ticks.smcol", "ticks", TickColumnSource(ticks), pool, tk);
+    if (!ok) {
+        cout << "export failed\n";
+        return 1;
+    }
+    for (const ColumnarExportStats* st : {&tx, &tk}) {
+        cout << (st == &tx ? "transactions: " : "ticks:        ") << st->rows << " rows, " << st->groups
+             << " row groups, " << st->bytes << " bytes (" << fixed << setprecision(1)
+             << (double)st->bytes / max<uint64_t>(1, st->rows) << " B/row) in " << setprecision(3) << st->seconds
+             << " s = " << setprecision(1) << st->rows / st->seconds / 1e6 << " M rows/s\n";
+    }
+
+    // read back: every column of every group must decode to what was exported
+    ColumnarFile f;
+    if (!f.open("export_bench_tx.smcol")) {
+        cout << "could not reopen export\n";
+        return 1;
+    }
+    cout << "chunk encodings of row group 0:";
+    for (size_t c = 0; c < f.columns().size(); ++c)
+        cout << " " << f.columns()[c].name << "=" << columnEncodingName(f.rowGroups()[0].columns[c].encoding);
+    cout << "\n";
+    bool same = f.rows() == rows && columnarMatches(f, src);
+    cout << "read-back check: " << (same ? "all columns match" : "MISMATCH") << "\n";
+    // bond trades must come back labelled as bonds, not "-"
+    size_t bondsBack = 0;
+    for (size_t g = 0; g < f.rowGroups().size(); ++g) {
+        vector<string> kinds;
+        if (f.readStrings(g, f.column("kind"), kinds))
+            for (const string& k : kinds) bondsBack += k == "Bond";
+    }
+    cout << "bond trades: " << bondRows << " exported, " << bondsBack << " read back as Bond\n";
+    same = same && bondRows > 0 && bondsBack == bondRows;
+    // min/max stats let a reader skip row groups: 100 accounts, 10 ticks
+    cout << "accounts 100-199 live in " << f.groupsOverlapping(f.column("account"), 100, 199).size() << " of "
+         << f.rowGroups().size() << " transaction row groups\n";
+    ColumnarFile tf;
+    if (tf.open("export_bench_ticks.smcol")) {
+        vector<int64_t> firstTick;
+        tf.readInts(tf.rowGroups().size() / 2, tf.column("tick"), firstTick);
+        int64_t t0 = firstTick.empty() ? 0 : firstTick[0];
+        cout << "ticks " << t0 << "-" << t0 + 9 << " live in " << tf.groupsOverlapping(tf.column("tick"), t0, t0 + 9).size()
+             << " of " << tf.rowGroups().size() << " tick row groups\n";
+    }
+    remove("export_bench_tx.smcol");
+    remove("export_bench_ticks.smcol");
+    return same ? 0 : 1;
+}
+
+// Resident set size in MB, 0 where it cannot be read
+double residentMB() {
+#ifdef __linux__
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (!f) return 0;
+    unsigned long pages = 0, resident = 0;
+    int n = fscanf(f, "%lu %lu", &pages, &resident);
+    fclose(f);
+    return n == 2 ? resident * (double)sysconf(_SC_PAGESIZE) / (1024.0 * 1024.0) : 0;
+#else
+    return 0;
+#endif
+}
+
+// Many accounts in one store file: skewed trading with a small working set in
+// memory, then a reopen checked against a digest of sampled accounts
+int runStoreBench(const string& path, size_t accounts, size_t ops) {
+    const size_t universe = 32, liveAccounts = 20000, cachePages = 8192;
+    remove(path.c_str());
+    Market market;
+    vector<string> syms;
+    for (size_t i = 0; i < universe; ++i) {
+        syms.push_back("SB" + to_string(i));
+        if (i % 8 == 7) market.addFund(MutualFund("Store Fund " + to_string(i), syms.back(), 50.0, 1e12));
+        else market.addStock(Stock("Store Stock " + to_string(i), syms.back(), 100.0, 2000000000));
+    }
+    cout << "\n---- investor store: " << accounts << " accounts, " << liveAccounts << " loaded, "
+         << cachePages * kStorePage / (1024 * 1024) << " MB page cache ----\n";
+    cout << fixed;
+
+    vector<uint64_t> sample;
+    uint64_t before = 0;
+    {
+        InvestorStore store;
+        if (!store.open(path, cachePages, liveAccounts)) {
+            cout << "could not open " << path << "\n";
+            return 1;
+        }
+        Stopwatch t;
+        for (size_t i = 0; i < accounts; ++i) store.create("INV" + to_string(i), 1e6);
+        cout << "create: " << setprecision(2) << t.seconds() << " s = " << setprecision(0)
+             << accounts / t.seconds() << " accounts/s\n";
+
+        // 90% of orders go to the hottest 1% of accounts
+        mt19937_64 rng(7);
+        size_t hot = max<size_t>(1, accounts / 100), fills = 0;
+        auto trade = [&](size_t orders) {
+            for (size_t i = 0; i < orders; ++i) {
+                uint64_t id = rng() % 10 < 9 ? rng() % hot : rng() % accounts;
+                Investor* inv = store.edit(id);
+                size_t k = rng() % universe;
+                TradeStatus st = rng() % 3 ? inv->tryBuy(market, syms[k], k % 8 == 7 ? 0.5 : 1 + rng() % 4)
+                                           : inv->trySell(market, syms[k], 1);
+                if (st == TradeStatus::Ok) ++fills;
+                if (i % 100000 == 99999) market.simulatePriceMovement();
             }
-            // proceed
-            cashBalance -= cost;
-            f->changeUnits(-qty);
-            addOrUpdateHolding(symbol, f->getName(), f->typeName(), qty, price);
-            tlog.add("BUY", symbol, f->getName(), f->typeName(), qty, price, cashBalance);
-            cout << "Bought " << fixed << setprecision(2) << qty << " units of " << symbol << " for " << cost << ".\n";
-            return true;
+        };
+        t = Stopwatch();
+        trade(ops);
+        double secs = t.seconds();
+        StoreStats s = store.stats();
+        cout << "trade: " << ops << " orders, " << fills << " fills in " << setprecision(2) << secs << " s = "
+             << setprecision(0) << ops / secs << " orders/s; account hits "
+             << setprecision(1) << 100.0 * s.hits / max<uint64_t>(1, s.hits + s.loads) << "%, "
+             << s.loads << " loads, " << s.writeBacks << " write-backs\n";
+        cout << "pages: " << s.filePages << " in file, tree height " << s.height << ", " << s.pageReads << " read, "
+             << s.pageWrites << " written, " << setprecision(1)
+             << 100.0 * s.pageHits / max<uint64_t>(1, s.pageHits + s.pageReads) << "% cache hits\n";
+        cout << "resident: " << setprecision(0) << residentMB() << " MB\n";
+
+        // logs laid out again account by account; more trading then takes the freed pages
+        t = Stopwatch();
+        HistoryCompaction hc = store.compactHistory();
+        double compactSecs = t.seconds();
+        uint64_t pagesBefore = store.stats().filePages;
+        trade(ops / 10);
+        cout << "compact history: " << hc.entries << " entries onto " << hc.newPages << " pages, " << hc.oldPages
+             << " pages freed in " << setprecision(2) << compactSecs << " s; " << ops / 10 << " more orders grew the file "
+             << store.stats().filePages - pagesBefore << " pages\n";
+
+        for (size_t i = 0; i < 200; ++i) sample.push_back(i < 100 ? i : rng() % accounts);
+        StateDigest d;
+        for (uint64_t id : sample) {
+            store.loadHistory(id);
+            store.peek(id)->addToDigest(d);
         }
-        cout << "Unsupported investment type.\n";
-        return false;
+        before = d.value();
+        t = Stopwatch();
+        store.close();
+        cout << "flush + close: " << setprecision(2) << t.seconds() << " s\n";
     }
 
-    // Sell N units
-    bool sell(Market& market, const string& symbol, double qty) {
-        auto it = portfolio.find(symbol);
-        if (it == portfolio.end()) {
-            cout << "You do not hold this symbol.\n";
-            return false;
+    InvestorStore store;
+    if (!store.open(path, cachePages, liveAccounts)) {
+        cout << "could not reopen " << path << "\n";
+        return 1;
+    }
+    // cold loads: nothing cached yet
+    mt19937_64 rng(99);
+    const size_t cold = 2000;
+    Stopwatch t;
+    for (size_t i = 0; i < cold; ++i) store.peek(rng() % accounts);
+    cout << "cold load: " << setprecision(1) << t.seconds() * 1e6 / cold << " us/account\n";
+    StateDigest d;
+    for (uint64_t id : sample) {
+        store.loadHistory(id);
+        store.peek(id)->addToDigest(d);
+    }
+    bool same = d.value() == before && store.size() == accounts;
+    cout << "reopen check: " << (same ? "sampled accounts match" : "MISMATCH") << "\n";
+    double bytes = (double)store.stats().filePages * kStorePage; // ftell is 32-bit on Windows
+    store.close();
+    cout << "file: " << setprecision(1) << bytes / (1024.0 * 1024.0) << " MB, " << setprecision(0)
+         << bytes / max<size_t>(1, accounts) << " B/account\n";
+    remove(path.c_str());
+    return same ? 0 : 1;
+}
+
+// Trigger index vs. checking every resting trigger after each tick
+void benchTriggers() {
+    const size_t universe = 500, count = 2000000, ticks = 50;
+    Market market;
+    for (size_t i = 0; i < universe; ++i)
+        market.addStock(Stock("Trigger Instrument " + to_string(i), "TRG" + to_string(i), 100.0, 1000000));
+    vector<InstrumentId> ids(universe);
+    for (size_t i = 0; i < universe; ++i) ids[i] = instruments().find("TRG" + to_string(i));
+    mt19937 rng(5);
+    uniform_real_distribution<double> band(0.7, 1.3);
+    vector<TriggerSpec> batch(count);
+    for (TriggerSpec& s : batch) {
+        s.account = 0;
+        s.instrument = ids[rng() % universe];
+        s.type = rng() % 2 ? TriggerType::AlertAbove : TriggerType::AlertBelow;
+        s.level = 100.0 * (s.type == TriggerType::AlertAbove ? 1.0 + (band(rng) - 0.7) : 1.0 - (band(rng) - 0.7));
+        s.qty = 0.0;
+    }
+
+    printBenchHeader("price triggers (" + to_string(count) + " resting, " + to_string(universe) + " symbols)");
+    TriggerBook book;
+    Stopwatch t;
+    vector<uint32_t> tids = book.addBatch(batch);
+    printBenchRow("addBatch", count, t.seconds(), t.allocs());
+    TriggerBook single;
+    t = Stopwatch();
+    for (size_t i = 0; i < 200000; ++i) single.add(batch[i]);
+    printBenchRow("add (one at a time, 200k)", 200000, t.seconds(), t.allocs());
+
+    // the same triggers as a plain list, scanned in full after each tick
+    vector<char> live(count, 1);
+    double indexSecs = 0.0, scanSecs = 0.0;
+    size_t fired = 0, scanned = 0;
+    for (size_t k = 0; k < ticks; ++k) {
+        market.simulatePriceMovement();
+        EpochGuard guard;
+        const MarketVersion* v = market.view();
+        t = Stopwatch();
+        fired += book.collectFired(*v).size();
+        indexSecs += t.seconds();
+        t = Stopwatch();
+        for (size_t i = 0; i < count; ++i) {
+            if (!live[i]) continue;
+            const TriggerSpec& s = batch[i];
+            double px = v->price[s.instrument];
+            if (firesAbove(s.type) ? px >= s.level : px <= s.level) { live[i] = 0; ++scanned; }
         }
-        Holding& h = it->second;
-        if (qty <= 0) {
-            cout << "Quantity must be positive.\n";
-            return false;
+        scanSecs += t.seconds();
+    }
+    printBenchRow("tick: full scan of all triggers", ticks, scanSecs);
+    printBenchRow("tick: per-symbol trigger index", ticks, indexSecs);
+    cout << "  fired over " << ticks << " ticks: " << fired << " (scan agrees: " << (fired == scanned ? "yes" : "NO") << ")\n";
+
+    vector<uint32_t> victims;
+    for (size_t i = 0; i < tids.size(); i += 4) victims.push_back(tids[i]);
+    t = Stopwatch();
+    size_t cancelled = book.cancelBatch(victims);
+    printBenchRow("cancelBatch", victims.size(), t.seconds(), t.allocs());
+    cout << "  cancelled " << cancelled << ", still resting " << book.size() << "\n";
+}
+
+// The iostream formatting TransactionLog::showAll used before TableWriter
+void printTxRowViaStream(ostream& os, const TxEntry& e) {
+    bool cash = e.instrument == kNoInstrument;
+    os << setw(20) << formatTime(e.time) << setw(8) << actionName(e.action) << setw(8) << kindName(e.kind)
+       << setw(8) << (cash ? "-" : instruments().symbol(e.instrument).c_str())
+       << setw(20) << (cash ? "-" : instruments().name(e.instrument).c_str())
+       << setw(10) << fixed << setprecision(2) << e.qty
+       << setw(12) << fixed << setprecision(2) << e.price
+       << setw(12) << fixed << setprecision(2) << e.balanceAfter << "\n";
+}
+
+// Dumping a 1M-row transaction log: setw/setprecision per cell vs TableWriter
+void benchTableRender() {
+    const size_t rows = 1000000;
+    Market market;
+    for (int i = 0; i < 16; ++i)
+        market.addStock(Stock("Render Stock " + to_string(i), "RND" + to_string(i), 100.0 + i, 1000000000));
+    Investor inv("Render", 1e12);
+    mt19937 rng(9);
+    for (size_t i = 0; i < rows; ++i) {
+        string sym = "RND" + to_string(rng() % 16);
+        if (i % 3 == 2) inv.trySell(market, sym, 1);
+        else inv.tryBuy(market, sym, 1 + rng() % 9);
+    }
+    const TransactionLog& log = inv.transactions();
+    printBenchHeader("transaction table render (" + to_string(log.size()) + " rows)");
+
+    ostringstream viaStream;
+    Stopwatch t;
+    viaStream << left;
+    TransactionLog::Snapshot snap = log.snapshot();
+    for (size_t i = 0; i < snap.size(); ++i) printTxRowViaStream(viaStream, snap[i]);
+    printBenchRow("iostream setw/setprecision (per row)", log.size(), t.seconds(), t.allocs());
+
+    ostringstream viaTable;
+    t = Stopwatch();
+    {
+        TableWriter out(viaTable);
+        for (size_t i = 0; i < snap.size(); ++i) TransactionLog::printRow(out, snap[i]);
+    }
+    printBenchRow("TableWriter (per row)", log.size(), t.seconds(), t.allocs());
+    cout << "  output identical: " << (viaStream.str() == viaTable.str() ? "yes" : "NO") << " ("
+         << viaTable.str().size() << " bytes)\n";
+}
+
+// One model kernel over a 1M-instrument price column
+template <class Model>
+void benchPriceModel(const string& label, const Model& model) {
+    const size_t n = 1000000, ticks = 10;
+    PriceColumns<Model, Stock> cols(model);
+    vector<double> px(n, 100.0);
+    vector<typename Model::State> st(n);
+    mt19937_64 rng(11);
+    Stopwatch t;
+    for (size_t k = 0; k < ticks; ++k) cols.step(px.data(), st.data(), n, 0.02, rng);
+    printBenchRow(label, n * ticks, t.seconds(), t.allocs());
+    double sum = 0.0;
+    for (double p : px) sum += p;
+    benchSink = sum;
+}
+
+// Whole-market ticks (gather, kernel, scatter, publish) for one model bundle
+template <class Models>
+void benchMarketTicks(const string& label) {
+    const size_t universe = 20000, ticks = 20;
+    BasicMarket<Models> market;
+    for (size_t i = 0; i < universe; ++i) {
+        string sym = "PM" + to_string(i);
+        if (i % 5 == 4) market.addFund(MutualFund("Model Fund " + to_string(i), sym, 50.0, 1e9));
+        else market.addStock(Stock("Model Stock " + to_string(i), sym, 100.0, 1000000));
+    }
+    Stopwatch t;
+    for (size_t k = 0; k < ticks; ++k) market.simulatePriceMovement();
+    printBenchRow(label, universe * ticks, t.seconds(), t.allocs());
+}
+
+void benchPriceModels() {
+    printBenchHeader("price model kernels (per instrument-tick, draws included)");
+    benchPriceModel("uniform walk (default)", UniformWalkModel());
+    benchPriceModel("geometric Brownian motion", GbmModel());
+    benchPriceModel("Merton jump-diffusion", MertonJumpModel());
+    benchPriceModel("GARCH(1,1)", Garch11Model());
+    benchPriceModel("regime switching", RegimeSwitchingModel());
+    printBenchHeader("simulatePriceMovement (per instrument, 20k listed)");
+    benchMarketTicks<DefaultPriceModels>("default bundle (uniform walk)");
+    benchMarketTicks<JumpDiffusionPriceModels>("jump-diffusion bundle (Merton / GBM)");
+    benchMarketTicks<StressPriceModels>("stress bundle (GARCH / regimes)");
+}
+
+// A 1M-instrument market built as a version directly (addStock republishes
+// the whole catalog each time), with 16 ticks of indicators behind it
+void benchScreener() {
+    const size_t universe = 1000000;
+    MarketVersion v;
+    InstrumentCatalog* cat = new InstrumentCatalog();
+    cat->listed.resize(universe);
+    cat->kind.assign(universe, InstrumentKind::Stock);
+    for (size_t i = 0; i < universe; ++i) cat->listed[i] = (InstrumentId)i;
+    cat->indexListed();
+    v.catalog.reset(cat);
+    v.price.resize(universe);
+    v.available.resize(universe);
+    mt19937_64 rng(38);
+    uniform_real_distribution<double> px(10.0, 3000.0), move(-0.03, 0.03);
+    for (size_t i = 0; i < universe; ++i) {
+        v.price[i] = px(rng);
+        v.available[i] = (double)(rng() % 20000);
+    }
+    MarketIndicators ind;
+    for (int t = 0; t <= MarketIndicators::kRsiPeriod + 1; ++t) {
+        for (double& p : v.price) p *= 1.0 + move(rng);
+        ind.update(v);
+    }
+
+    const char* exprs[] = {"price between 400 and 900 && available > 5000 && rsi < 30",
+                           "price < 50 || change > 2.5", "!(rsi >= 30 && rsi <= 70) && ema > 1000"};
+    printBenchHeader("screener (1M instruments, ns per instrument)");
+    for (const char* e : exprs) {
+        Screener sc;
+        string error;
+        if (!sc.compile(e, error)) {
+            cout << "compile failed: " << error << "\n";
+            continue;
         }
-        if (qty > h.quantity + 1e-9) {
-            cout << "You don't have enough quantity to sell.\n";
-            return false;
+        const int reps = 20;
+        vector<uint64_t> sel;
+        size_t hits = 0;
+        Stopwatch t;
+        for (int r = 0; r < reps; ++r) hits = sc.run(v, &ind, sel);
+        double kernelSecs = t.seconds();
+        t = Stopwatch();
+        size_t rowHits = 0;
+        for (int r = 0; r < reps; ++r) {
+            rowHits = 0;
+            for (InstrumentId id : v.catalog->listed) rowHits += sc.matchesRow(v, &ind, id);
         }
-        Investment* inv = market.findInvestment(symbol);
-        if (!inv) {
-            cout << "Market no longer lists this investment; cannot sell here.\n";
-            return false;
+        double rowSecs = t.seconds();
+        cout << e << "\n";
+        printBenchRow("  per-row expression walk", universe * reps, rowSecs);
+        printBenchRow("  bitmap kernels", universe * reps, kernelSecs);
+        unsigned cores = workerThreads(0);
+        if (cores > 1) {
+            size_t shared = 0;
+            t = Stopwatch();
+            for (int r = 0; r < reps; ++r) shared = sc.run(v, &ind, sel, cores);
+            double sharedSecs = t.seconds();
+            printBenchRow("  bitmap kernels, " + to_string(cores) + " threads", universe * reps, sharedSecs);
+            if (shared != hits) cout << "  (MISMATCH between 1 and " << cores << " threads)\n";
         }
-        double price = inv->currentPrice();
-        double proceed = price * qty;
-        // For stock, qty must be integer
-        if (h.type == "Stock") {
-            int iqty = static_cast<int>(qty);
-            if (iqty != qty) {
-                cout << "You must sell whole shares for stocks.\n";
-                return false;
-            }
-            // update market availability
-            Stock* s = market.findStock(symbol);
-            if (s) s->changeAvailable(iqty);
-        } else if (h.type == "MutualFund") {
-            MutualFund* f = market.findFund(symbol);
-            if (f) f->changeUnits(qty);
+        cout << "  " << hits << " matches" << (hits == rowHits ? "" : " (MISMATCH with per-row walk)") << ", "
+             << setprecision(3) << kernelSecs * 1e3 / reps << " ms per screen\n";
+    }
+}
+
+// Trades and ticks with the version bins and node pool on, then off (every
+// published version and lot ring straight from the global heap)
+void benchMemoryPools() {
+    const vector<string> syms = {"TATAM", "INFY", "RELI", "HDFCB", "ICIC", "WIPR", "SBI-EQ", "NIP-LC", "HDFC-HY"};
+    const size_t trips = 200000, ticks = 200000;
+    printBenchHeader("memory pools (steady-state trade path)");
+    for (int pooled = 1; pooled >= 0; --pooled) {
+        memoryPoolsEnabled = pooled != 0;
+        const string how = pooled ? " (pooled)" : " (global heap)";
+        Market market;
+        streambuf* saved = cout.rdbuf(nullptr);
+        setupSampleMarket(market);
+        cout.rdbuf(saved);
+        Investor inv("bench", 1e12);
+        for (size_t i = 0; i < 1000; ++i) { // warm the bins and pool
+            inv.tryBuy(market, syms[i % syms.size()], 3.0);
+            inv.trySell(market, syms[i % syms.size()], 3.0);
         }
-        // update holding
-        h.quantity -= qty;
-        if (h.quantity <= 1e-9) portfolio.erase(it);
-        cashBalance += proceed;
-        tlog.add("SELL", symbol, h.name, h.type, qty, price, cashBalance);
-        cout << "Sold " << fixed << setprecision(2) << qty << " of " << symbol << " for " << proceed << ".\n";
-        return true;
+        Stopwatch t;
+        for (size_t i = 0; i < trips; ++i) {
+            const string& sym = syms[i % syms.size()];
+            inv.tryBuy(market, sym, 3.0);
+            inv.trySell(market, sym, 3.0);
+        }
+        printBenchRow("tryBuy + trySell" + how, trips, t.seconds(), t.allocs());
+        t = Stopwatch();
+        for (size_t i = 0; i < ticks; ++i) market.simulatePriceMovement();
+        printBenchRow("simulatePriceMovement" + how, ticks, t.seconds(), t.allocs());
+    }
+    memoryPoolsEnabled = true;
+}
+
+// A simulated year (252 sessions) on a 100-instrument market where a tenth
+// tick every 10 s, a third every 30 s and the rest every minute
+void benchScheduler() {
+    const size_t universe = 100;
+    printBenchHeader("event scheduler");
+    {
+        EventQueue q;
+        const size_t n = 1 << 20, rounds = 4;
+        mt19937_64 rng(42);
+        for (size_t i = 0; i < n; ++i) q.push((Timestamp)(rng() % 1000000000), SimEventKind::Tick);
+        Stopwatch t;
+        for (size_t i = 0; i < n * rounds; ++i) {
+            Timestamp at = q.top().at;
+            q.pop();
+            q.push(at + (Timestamp)(rng() % 1000000), SimEventKind::Tick);
+        }
+        printBenchRow("4-ary heap pop + push (1M pending)", n * rounds, t.seconds(), t.allocs());
+        // the same events held whole in a binary heap
+        struct Flat {
+            SimEvent e;
+            uint64_t seq;
+            bool operator>(const Flat& o) const { return e.at > o.e.at || (e.at == o.e.at && seq > o.seq); }
+        };
+        priority_queue<Flat, vector<Flat>, greater<Flat> > pq;
+        Flat f = {SimEvent(), 0};
+        f.e.kind = SimEventKind::Tick;
+        for (size_t i = 0; i < n; ++i) {
+            f.e.at = (Timestamp)(rng() % 1000000000);
+            f.seq = i;
+            pq.push(f);
+        }
+        t = Stopwatch();
+        for (size_t i = 0; i < n * rounds; ++i) {
+            f = pq.top();
+            pq.pop();
+            f.e.at += (Timestamp)(rng() % 1000000);
+            f.seq = n + i;
+            pq.push(f);
+        }
+        printBenchRow("std::priority_queue<event> pop + push", n * rounds, t.seconds(), t.allocs());
+    }
+    for (int batched = 1; batched >= 0; --batched) {
+        Market market;
+        for (size_t i = 0; i < universe; ++i) {
+            string sym = "EV" + to_string(i);
+            if (i % 5 == 4) market.addFund(MutualFund("Event Fund " + to_string(i), sym, 50.0, 1e9));
+            else market.addStock(Stock("Event Stock " + to_string(i), sym, 100.0 + 40.0 * (double)i, 1000000));
+        }
+        SimConfig cfg;
+        cfg.batchTicks = batched != 0;
+        MarketScheduler sim(market, cfg);
+        sim.seed(42);
+        for (size_t i = 0; i < universe; ++i) {
+            Timestamp every = i % 10 == 0 ? 10 : i % 3 == 0 ? 30 : 60;
+            sim.setTickInterval(instruments().find("EV" + to_string(i)), every * kNsPerSecond);
+        }
+        sim.start(clockNow());
+        // the unbatched baseline is slow, so it only runs a week
+        const size_t sessions = batched ? 252 : 5;
+        Stopwatch t;
+        const SimStats& st = sim.runSessions(sessions);
+        printBenchRow(batched ? "simulated year, batched (per tick)" : "simulated week, one move per tick",
+                      st.ticks, t.seconds(), t.allocs());
+        if (batched) {
+            ios::fmtflags f = cout.flags();
+            cout << "  " << st.sessions << " sessions, " << st.events << " events, " << st.batches << " moves, "
+                 << st.earnings << " earnings, " << st.dividends << " dividends, " << st.splits << " splits in "
+                 << fixed << setprecision(2) << st.seconds << " s ("
+                 << setprecision(0) << (double)st.simulated / kNsPerSecond / 86400 / max(st.seconds, 1e-9)
+                 << " simulated days per second)\n";
+            cout.flags(f);
+        }
+    }
+}
+
+void benchCorporateActions() {
+    const size_t accounts = 200000, universe = 32;
+    printBenchHeader("corporate actions");
+    Market market;
+    vector<InstrumentId> ids;
+    for (size_t i = 0; i < universe; ++i) {
+        string sym = "CA" + to_string(i);
+        market.addStock(Stock("Action Stock " + to_string(i), sym, 500.0, 1000000000));
+        ids.push_back(instruments().find(sym));
+    }
+    InvestorBook book;
+    mt19937 rng(42);
+    for (size_t a = 0; a < accounts; ++a) {
+        Investor& inv = book.open("CA" + to_string(a), 1e6);
+        // a few positions each; CA0 is held by every 8th account
+        for (int k = 0; k < 4; ++k) inv.addOrUpdateHolding(ids[1 + rng() % (universe - 1)], 1 + rng() % 50, 500.0);
+        if (a % 8 == 0) inv.addOrUpdateHolding(ids[0], 1 + rng() % 50, 500.0);
+    }
+    const int rounds = 10;
+    CorporateAction div = {ids[0], CorporateActionKind::Dividend, 0.5};
+    // without the index: visit every account and adjust the ones that hold it
+    Stopwatch t;
+    size_t adjusted = 0;
+    for (int r = 0; r < rounds; ++r) {
+        double price = market.view()->price[ids[0]];
+        for (size_t a = 0; a < book.size(); ++a)
+            if (book[a].applyCorporateAction(div, 0, clockNow(), price)) ++adjusted;
+    }
+    printBenchRow("dividend, walk every account (per holder)", adjusted, t.seconds(), t.allocs());
+    CorporateActionEngine engine(market, book);
+    CorporateActionStats st;
+    t = Stopwatch();
+    adjusted = 0;
+    for (int r = 0; r < rounds; ++r) {
+        engine.apply(div, clockNow(), &st);
+        adjusted += st.adjusted;
+    }
+    printBenchRow("dividend, holder index batch (per holder)", adjusted, t.seconds(), t.allocs());
+    CorporateAction split = {ids[0], CorporateActionKind::Split, 1.5};
+    t = Stopwatch();
+    engine.apply(split, clockNow(), &st);
+    printBenchRow("3-for-2 split with cash in lieu (per holder)", st.adjusted, t.seconds(), t.allocs());
+}
+
+void benchPriceTable() {
+#ifndef _WIN32
+    const size_t n = 1024, ops = 1 << 22;
+    printBenchHeader("shared price table");
+    Market market;
+    vector<InstrumentId> ids;
+    for (size_t i = 0; i < n; ++i) {
+        string sym = "PT" + to_string(i);
+        market.addStock(Stock("Published Stock " + to_string(i), sym, 100.0 + i, 1000000));
+        ids.push_back(instruments().find(sym));
+    }
+    SharedPriceTable table;
+    string name = "/sharemarket-bench-" + to_string(getpid());
+    PriceTableReader reader;
+    if (!table.create(name, n) || !reader.open(name)) {
+        cout << "Could not create shared memory segment " << name << ".\n";
+        return;
+    }
+    market.attachPriceTable(&table);
+    Stopwatch t;
+    for (size_t i = 0; i < ops; ++i) table.put(ids[i % n], InstrumentKind::Stock, 100.0 + (double)i, 1000.0, (Timestamp)i);
+    printBenchRow("writer alone (per row)", ops, t.seconds(), t.allocs());
+    double p = 0.0, a = 0.0, sum = 0.0;
+    t = Stopwatch();
+    for (size_t i = 0; i < ops; ++i) {
+        reader.read(i % n, p, a);
+        sum += p;
+    }
+    printBenchRow("reader alone (per row)", ops, t.seconds(), t.allocs());
+
+    // readers on their own threads (own mappings) while the writer keeps going;
+    // `hot` has everyone on one row, the worst case for the seqlock
+    const unsigned readers = 2;
+    for (int hot = 0; hot < 2; ++hot) {
+        atomic<bool> stop(false);
+        atomic<uint64_t> reads(0), retries(0);
+        vector<thread> pool;
+        for (unsigned r = 0; r < readers; ++r) {
+            pool.push_back(thread([&, r] {
+                PriceTableReader own;
+                if (!own.open(name)) return;
+                uint64_t k = r, done = 0;
+                double px = 0.0, av = 0.0, s = 0.0;
+                while (!stop.load(memory_order_relaxed)) {
+                    for (int j = 0; j < 256; ++j, ++done) {
+                        own.read(hot ? 0 : (size_t)(k++ % n), px, av);
+                        s += px;
+                    }
+                }
+                reads.fetch_add(done);
+                retries.fetch_add(own.retries() + (s < 0 ? 1 : 0));
+            }));
+        }
+        t = Stopwatch();
+        for (size_t i = 0; i < ops; ++i)
+            table.put(ids[hot ? 0 : i % n], InstrumentKind::Stock, 100.0 + (double)i, 1000.0, (Timestamp)i);
+        double secs = t.seconds();
+        stop.store(true);
+        for (auto& th : pool) th.join();
+        printBenchRow(hot ? "writer + 2 readers, one hot row" : "writer + 2 readers, all rows", ops, secs, t.allocs());
+        ios::fmtflags f = cout.flags();
+        cout << "  readers: " << reads.load() << " reads (" << fixed << setprecision(1)
+             << reads.load() / max(secs, 1e-9) / 1e6 << " M/s), " << setprecision(3)
+             << 100.0 * retries.load() / max<uint64_t>(1, reads.load()) << "% retried\n";
+        cout.flags(f);
+    }
+    market.attachPriceTable(nullptr);
+    if (sum < 0) cout << sum; // keep the read loop
+#endif
+}
+
+// Curve bootstrap, full and incremental repricing, and yield solving for a
+// book of bonds against pricing each bond on its own
+void benchBondPricing() {
+    const size_t bonds = 5000, rounds = 200;
+    vector<CurveInstrument> bench = sampleBenchmarks();
+    BondPricer book;
+    mt19937 rng(31);
+    for (size_t i = 0; i < bonds; ++i) {
+        BondTerms t(0.05 + 0.0001 * (rng() % 400), 2, 0.3 + 0.01 * (rng() % 2970));
+        book.add(instruments().intern("BB" + to_string(i), "Bench Bond " + to_string(i), InstrumentKind::Bond), t);
+    }
+    printBenchHeader("bond pricing (" + to_string(bonds) + " bonds, " + to_string(book.flows()) + " cash flows)");
+    YieldCurve curve;
+    Stopwatch t;
+    for (size_t r = 0; r < rounds; ++r) curve.bootstrap(bench);
+    printBenchRow("bootstrap 10-knot curve", rounds, t.seconds(), t.allocs());
+
+    double sink = 0.0;
+    t = Stopwatch();
+    for (size_t r = 0; r < rounds / 20; ++r)
+        for (size_t b = 0; b < bonds; ++b) sink += priceOffCurve(book.bondTerms(b), curve);
+    printBenchRow("per bond: cash flows + curve lookups", bonds * (rounds / 20), t.seconds(), t.allocs());
+
+    book.setCurve(curve, false);
+    // a parallel shift moves every knot: the whole book in one pass
+    vector<YieldCurve> shifted(2);
+    for (int s = 0; s < 2; ++s) {
+        vector<CurveInstrument> b = bench;
+        for (CurveInstrument& c : b) c.coupon += s ? 0.0005 : -0.0005;
+        shifted[s].bootstrap(b);
+    }
+    size_t n = 0;
+    t = Stopwatch();
+    for (size_t r = 0; r < rounds; ++r) n += book.setCurve(shifted[r % 2], false);
+    printBenchRow("BondPricer full pass (per bond)", n, t.seconds(), t.allocs());
+    t = Stopwatch();
+    for (size_t r = 0; r < rounds / 20; ++r) n += book.setCurve(shifted[r % 2], true);
+    size_t solved = bonds * (rounds / 20);
+    printBenchRow("full pass + YTM + duration (per bond)", solved, t.seconds(), t.allocs());
+
+    // a move at the long end: only bonds with flows past 15 years are repriced
+    vector<CurveInstrument> longEnd = bench;
+    longEnd.back().coupon += 0.001;
+    YieldCurve moved;
+    moved.bootstrap(longEnd);
+    book.setCurve(curve, true);
+    n = 0;
+    t = Stopwatch();
+    for (size_t r = 0; r < rounds; ++r) n += book.setCurve(r % 2 ? curve : moved, true);
+    double secs = t.seconds();
+    printBenchRow("30y move, incremental (per update)", rounds, secs, t.allocs());
+    ios::fmtflags f = cout.flags();
+    cout << "  " << n / rounds << " of " << bonds << " bonds repriced per 30y update; "
+         << fixed << setprecision(1) << secs * 1e9 / max<size_t>(1, n) << " ns per repriced bond\n";
+    cout.flags(f);
+    for (size_t b = 0; b < bonds; ++b) sink += book.analytics(b).ytm;
+    benchSink = sink;
+}
+
+// Whole-book valuation: per-account walks vs. the CSR matrix (ns per account)
+void benchBulkValuation(size_t accounts = 100000) {
+    const size_t universe = 500;
+    Market market;
+    vector<string> syms;
+    for (size_t i = 0; i < universe; ++i) {
+        syms.push_back("BV" + to_string(i));
+        if (i % 10 == 9) market.addFund(MutualFund("Valuation Fund " + to_string(i), syms.back(), 50.0, 1e12));
+        else market.addStock(Stock("Valuation Stock " + to_string(i), syms.back(), 100.0, 2000000000));
+    }
+    InvestorBook book;
+    mt19937 rng(23);
+    for (size_t a = 0; a < accounts; ++a) {
+        Investor& inv = book.open("INV" + to_string(a), 1e6);
+        size_t positions = 1 + rng() % 12; // uneven rows, for the load balancing
+        for (size_t k = 0; k < positions; ++k) {
+            size_t s = rng() % universe;
+            inv.tryBuy(market, syms[s], s % 10 == 9 ? 1.5 : (double)(1 + rng() % 20));
+        }
+    }
+    for (int i = 0; i < 5; ++i) market.simulatePriceMovement();
+
+    printBenchHeader("bulk valuation (" + to_string(accounts) + " accounts, per account)");
+    double bySymbol = 0.0, flat = 0.0;
+    Stopwatch t;
+    for (size_t a = 0; a < accounts; ++a) {
+        // what displayPortfolio does for its total
+        EpochGuard guard;
+        const InvestorState* st = book[a].view();
+        const MarketVersion* mv = market.view();
+        double total = st->cashBalance;
+        for (const Holding* h : st->holdings.bySymbol()) total += h->quantity * mv->priceOf(h->id);
+        bySymbol += total;
     }
+    double perAccountSecs = t.seconds();
+    printBenchRow("per account, displayPortfolio loop", accounts, perAccountSecs, t.allocs());
+    t = Stopwatch();
+    for (size_t a = 0; a < accounts; ++a) {
+        EpochGuard guard;
+        const InvestorState* st = book[a].view();
+        const MarketVersion* mv = market.view();
+        double total = st->cashBalance;
+        for (const Holding& h : st->holdings) total += h.quantity * mv->priceOf(h.id);
+        flat += total;
+    }
+    printBenchRow("per account, holdings in id order", accounts, t.seconds(), t.allocs());
+
+    HoldingMatrix matrix;
+    t = Stopwatch();
+    matrix.build(book);
+    printBenchRow("CSR build", accounts, t.seconds(), t.allocs());
+    unsigned threads = matrix.threadCount();
+    BulkValuation one, all;
+    matrix.setThreads(1);
+    matrix.valuate(market, one);
+    printBenchRow("CSR SpMV, 1 thread", accounts, one.seconds);
+    matrix.setThreads(threads);
+    matrix.valuate(market, all);
+    if (threads > 1) printBenchRow("CSR SpMV, " + to_string(threads) + " threads", accounts, all.seconds);
+
+    ios::fmtflags f = cout.flags();
+    streamsize prec = cout.precision();
+    double rel = fabs(all.totalNetWorth - bySymbol) / max(1.0, fabs(bySymbol));
+    cout << "  " << matrix.entries() << " positions in " << all.chunks << " chunks, "
+         << fixed << setprecision(1) << matrix.bytes() / (1024.0 * 1024.0) << " MB; SpMV "
+         << perAccountSecs / max(all.seconds, 1e-9) << "x the displayPortfolio loop; totals "
+         << (rel < 1e-9 && fabs(flat - bySymbol) / max(1.0, fabs(bySymbol)) < 1e-9 ? "agree" : "DIFFER") << "\n";
+    cout.flags(f);
+    cout.precision(prec);
+}
 
-    void addOrUpdateHolding(const string& sym, const string& nm, const string& type, double qty, double price) {
-        auto it = portfolio.find(sym);
-        if (it == portfolio.end()) {
-            portfolio[sym] = Holding(sym, nm, type, qty, price);
+// Scenario stress test: one SpMV per shocked price vector against the blocked
+// engine (ns per account x scenario), checked against direct revaluation
+void benchStressTest(size_t accounts = 100000, size_t scenarios = 100) {
+    const size_t universe = 500;
+    static const char* sectorNames[] = {"banks", "IT", "auto", "energy", "pharma", "metals", "FMCG", "telecom", "realty"};
+    Market market;
+    SectorMap sectors;
+    vector<string> syms;
+    for (size_t i = 0; i < universe; ++i) {
+        syms.push_back("ST" + to_string(i));
+        if (i % 10 == 9) {
+            market.addFund(MutualFund("Stress Fund " + to_string(i), syms.back(), 50.0, 1e12));
         } else {
-            Holding& h = it->second;
-            // update average price: newAvg = (oldQty*oldAvg + qty*price) / (oldQty+qty)
-            double newQty = h.quantity + qty;
-            if (newQty > 0.0) {
-                double newAvg = (h.quantity * h.avgPrice + qty * price) / newQty;
-                h.avgPrice = newAvg;
+            market.addStock(Stock("Stress Stock " + to_string(i), syms.back(), 100.0 + i % 50, 2000000000));
+            sectors.assign(syms.back(), sectorNames[i % 9]);
+        }
+    }
+    InvestorBook book;
+    mt19937 rng(41);
+    for (size_t a = 0; a < accounts; ++a) {
+        Investor& inv = book.open("INV" + to_string(a), 1e6);
+        size_t positions = 1 + rng() % 12;
+        for (size_t k = 0; k < positions; ++k) {
+            size_t s = rng() % universe;
+            inv.tryBuy(market, syms[s], s % 10 == 9 ? 1.5 : (double)(1 + rng() % 20));
+        }
+    }
+    // sector moves, sometimes with funds, one name or the whole market on top
+    vector<StressScenario> scen(scenarios);
+    for (size_t s = 0; s < scenarios; ++s) {
+        string text;
+        for (size_t t = 0, terms = 1 + rng() % 4; t < terms; ++t)
+            text += string(t ? ", " : "") + sectorNames[rng() % 9] + " " + to_string(-30 + (int)(rng() % 36)) + "%";
+        if (rng() % 10 < 3) text += ", funds " + to_string(-15 + (int)(rng() % 16)) + "%";
+        if (rng() % 10 < 2) text += ", " + syms[rng() % universe] + " -" + to_string(20 + rng() % 60) + "%";
+        if (rng() % 10 < 1) text += ", all -" + to_string(5 + rng() % 20) + "%";
+        string error;
+        if (!parseScenario(text, sectors, scen[s], error)) {
+            cout << "bad scenario " << text << ": " << error << "\n";
+            return;
+        }
+    }
+
+    printBenchHeader("stress test (" + to_string(accounts) + " accounts x " + to_string(scenarios) +
+                     " scenarios, per account x scenario)");
+    HoldingMatrix matrix;
+    matrix.build(book);
+    StressEngine engine(matrix);
+    Stopwatch t;
+    engine.prepare(market, scen, sectors);
+    printBenchRow("compile scenarios (per instrument)", matrix.width(), t.seconds(), t.allocs());
+
+    // the obvious way: a shocked price vector and a full revaluation per scenario
+    BulkValuation base, shocked;
+    matrix.valuate(market, base);
+    vector<double> basePrice(matrix.width()), price(matrix.width());
+    {
+        EpochGuard guard;
+        const MarketVersion* mv = market.view();
+        for (InstrumentId id = 0; id < matrix.width(); ++id) basePrice[id] = mv->priceOf(id);
+    }
+    size_t sample = min<size_t>(scenarios, 16);
+    vector<double> samplePnl(sample);
+    t = Stopwatch();
+    for (size_t s = 0; s < sample; ++s) {
+        for (InstrumentId id = 0; id < matrix.width(); ++id) price[id] = basePrice[id] + engine.move(id, s);
+        matrix.valuate(price.data(), shocked);
+        samplePnl[s] = shocked.totalNetWorth - base.totalNetWorth;
+    }
+    double naiveSecs = t.seconds();
+    printBenchRow("one SpMV per scenario", accounts * sample, naiveSecs, t.allocs());
+
+    unsigned threads = engine.threadCount();
+    StressResult r;
+    engine.setThreads(1);
+    engine.run(r);
+    printBenchRow("blocked scenarios x accounts, 1 thread", accounts * scenarios, r.seconds);
+    double oneSecs = r.seconds;
+    if (threads > 1) {
+        engine.setThreads(threads);
+        engine.run(r);
+        printBenchRow("blocked, " + to_string(threads) + " threads", accounts * scenarios, r.seconds);
+    }
+
+    // spot checks: book P/L of the sampled scenarios, and the worst case of a
+    // few accounts revalued position by position at shocked prices
+    bool agree = true;
+    for (size_t s = 0; s < sample; ++s)
+        if (fabs(samplePnl[s] - r.scenarioPnl[s]) > 1e-6 * max(1.0, base.totalNetWorth)) agree = false;
+    {
+        EpochGuard guard;
+        for (size_t i = 0; i < 200 && accounts; ++i) {
+            size_t a = rng() % accounts;
+            const InvestorState* st = book[a].view();
+            double worst = numeric_limits<double>::infinity();
+            for (size_t s = 0; s < scenarios; ++s) {
+                double pnl = 0.0;
+                for (const Holding& h : st->holdings)
+                    pnl += h.quantity * basePrice[h.id] * scen[s].moveOf(h.id, sectors);
+                worst = min(worst, pnl);
             }
-            h.quantity = newQty;
+            if (scenarios && fabs(worst - r.worstPnl[a]) > 1e-6 * max(1.0, fabs(worst))) agree = false;
+        }
+    }
+    ios::fmtflags f = cout.flags();
+    streamsize prec = cout.precision();
+    size_t w = r.worstScenarioOverall;
+    cout << "  " << fixed << setprecision(2) << oneSecs << " s for the whole run on 1 thread ("
+         << setprecision(1) << naiveSecs / max<size_t>(1, sample) * scenarios / max(oneSecs, 1e-9)
+         << "x one SpMV per scenario), " << r.tiles << " tiles; results "
+         << (agree ? "agree" : "DIFFER") << "\n";
+    if (scenarios)
+        cout << "  worst scenario \"" << scen[w].label << "\": book P/L " << setprecision(0) << r.scenarioPnl[w]
+             << ", worst account " << r.scenarioWorst[w] << "\n";
+    cout.flags(f);
+    cout.precision(prec);
+    benchSink = r.scenarioPnl.empty() ? 0.0 : r.scenarioPnl[0];
+}
+
+// Nightly rebalance of many accounts to a few models: the trade lists placed
+// one tryBuy / trySell at a time against the netted, batched execution
+void benchRebalance(size_t accounts = 20000) {
+    const size_t universe = 200, modelCount = 8;
+    vector<string> syms;
+    for (size_t i = 0; i < universe; ++i) syms.push_back("RB" + to_string(i));
+    auto setup = [&](Market& market, InvestorBook& book) {
+        for (size_t i = 0; i < universe; ++i) {
+            if (i % 10 == 9) market.addFund(MutualFund("Model Fund " + to_string(i), syms[i], 25.0 + i % 30, 1e12));
+            else market.addStock(Stock("Model Stock " + to_string(i), syms[i], 50.0 + i % 90, 2000000000));
+        }
+        mt19937 rng(53);
+        for (size_t a = 0; a < accounts; ++a) {
+            Investor& inv = book.open("RB" + to_string(a), 100000.0);
+            for (size_t k = 0, n = 1 + rng() % 10; k < n; ++k) {
+                size_t s = rng() % universe;
+                inv.tryBuy(market, syms[s], s % 10 == 9 ? 12.5 : (double)(1 + rng() % 100));
+            }
+        }
+    };
+    Market batched, oneByOne;
+    InvestorBook bookA, bookB;
+    setup(batched, bookA);
+    setup(oneByOne, bookB);
+    mt19937 rng(59);
+    vector<ModelPortfolio> models(modelCount);
+    for (size_t m = 0; m < modelCount; ++m) {
+        string text;
+        for (size_t k = 0; k < 10; ++k) text += string(k ? ", " : "") + syms[rng() % universe] + " 9.5%";
+        string error;
+        parseModel(text, models[m], error);
+    }
+
+    printBenchHeader("rebalance (" + to_string(accounts) + " accounts, " + to_string(modelCount) + " models)");
+    Rebalancer rebalancer(batched, bookA);
+    for (const ModelPortfolio& m : models) rebalancer.addModel(m);
+    for (size_t a = 0; a < accounts; ++a) rebalancer.assign((uint32_t)a, (uint32_t)(a % modelCount));
+    Stopwatch t;
+    size_t orders = rebalancer.plan();
+    printBenchRow("plan (per account)", accounts, t.seconds(), t.allocs());
+    vector<RebalanceOrder> list = rebalancer.trades();
+
+    t = Stopwatch();
+    size_t fills = 0;
+    for (const RebalanceOrder& o : list) {
+        Investor& inv = bookB[o.account];
+        const string& sym = instruments().symbol(o.id);
+        TradeStatus st = o.sell ? inv.trySell(oneByOne, sym, o.qty) : inv.tryBuy(oneByOne, sym, o.qty);
+        if (st == TradeStatus::Ok) ++fills;
+    }
+    printBenchRow("tryBuy / trySell one at a time", max<size_t>(1, orders), t.seconds(), t.allocs());
+    t = Stopwatch();
+    size_t batchFills = rebalancer.execute();
+    printBenchRow("netted batch execute (per order)", max<size_t>(1, orders), t.seconds(), t.allocs());
+
+    // the same fills either way, so the same cash and the same supply
+    bool agree = fills == batchFills;
+    for (size_t a = 0; a < accounts && agree; ++a)
+        if (fabs(bookA[a].getBalance() - bookB[a].getBalance()) > 1e-6) agree = false;
+    {
+        EpochGuard guard;
+        const MarketVersion* va = batched.view();
+        const MarketVersion* vb = oneByOne.view();
+        for (size_t i = 0; i < universe && agree; ++i) {
+            InstrumentId id = instruments().find(syms[i]);
+            if (fabs(va->available[id] - vb->available[id]) > 1e-6 * max(1.0, vb->available[id])) agree = false;
+        }
+    }
+    const RebalanceStats& st = rebalancer.getStats();
+    ios::fmtflags f = cout.flags();
+    streamsize prec = cout.precision();
+    double gross = 2.0 * st.crossed + st.marketUnits;
+    cout << "  " << orders << " orders on " << st.instruments << " instruments, " << fixed << setprecision(1)
+         << (gross > 0.0 ? 100.0 * 2.0 * st.crossed / gross : 0.0) << "% of units crossed between accounts; "
+         << st.partial + st.rejected << " cut or refused; books " << (agree ? "agree" : "DIFFER");
+    cout.flags(f);
+    cout.precision(prec);
+    cout << "; a second plan finds " << rebalancer.plan() << " orders\n";
+}
+
+void runBenchmarks() {
+    benchTradeDispatch();
+    benchMemoryPools();
+    benchHoldingLayout();
+    benchCheckpoint();
+    benchTriggers();
+    benchPriceModels();
+    benchTableRender();
+    benchScreener();
+    benchScheduler();
+    benchCorporateActions();
+    benchPriceTable();
+    benchBulkValuation();
+    benchBondPricing();
+    benchStressTest();
+    benchRebalance();
+    if (allocprof::enabled) printAllocReport();
+}
+
+// --------------------------- Self-test ---------------------------
+// ./sharemarket --selftest: fixed-seed round trips through the on-disk formats,
+// one PASS/FAIL line per check. Files are written as selftest* in the working
+// directory and removed.
+// Only rng() % n is used, so every platform builds the same data.
+
+struct SelfTest {
+    int failures;
+    SelfTest() : failures(0) {}
+    void check(const string& what, bool ok) {
+        cout << (ok ? "PASS  " : "FAIL  ") << what << "\n";
+        if (!ok) ++failures;
+    }
+};
+
+bool sameTx(const vector<TxEntry>& a, const vector<TxEntry>& b) {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); ++i) {
+        const TxEntry& x = a[i];
+        const TxEntry& y = b[i];
+        if (x.time != y.time || x.action != y.action || x.kind != y.kind || x.instrument != y.instrument ||
+            x.qty != y.qty || x.price != y.price || x.balanceAfter != y.balanceAfter || x.lot != y.lot)
+            return false;
+    }
+    return true;
+}
+
+// Values the 6-digit .txlog text keeps exactly: whole balances under 1e6,
+// quarter-share quantities and prices on a 5-cent grid. With 'stepBack' the
+// clock jumps back an hour now and then, so the log is out of time order.
+vector<TxEntry> selfTestEntries(size_t n, uint32_t seed, bool stepBack) {
+    static const char* syms[] = {"STA", "STB", "STC", "STD", "STF"};
+    vector<InstrumentId> ids;
+    for (int k = 0; k < 5; ++k)
+        ids.push_back(instruments().intern(syms[k], string("Selftest ") + syms[k],
+                                           k == 4 ? InstrumentKind::MutualFund : InstrumentKind::Stock));
+    mt19937 rng(seed);
+    vector<TxEntry> out(n);
+    double cash = 500000;
+    for (size_t i = 0; i < n; ++i) {
+        TxEntry& e = out[i];
+        e.time = 1700000000 * kNsPerSecond + (Timestamp)i * kNsPerSecond + (Timestamp)(rng() % 1000000);
+        if (stepBack && i % 97 == 96) e.time -= 3600 * kNsPerSecond;
+        e.lot = kAnyLot;
+        if (i % 10 == 0) {
+            e.action = TxAction::Deposit;
+            e.kind = InstrumentKind::None;
+            e.instrument = kNoInstrument;
+            e.qty = e.price = 0.0;
+            cash += 1000 + rng() % 1000;
+        } else {
+            size_t k = rng() % 5;
+            e.action = rng() % 3 ? TxAction::Buy : TxAction::Sell;
+            e.kind = k == 4 ? InstrumentKind::MutualFund : InstrumentKind::Stock;
+            e.instrument = ids[k];
+            e.qty = k == 4 ? 0.25 * (1 + rng() % 8) : (double)(1 + rng() % 9);
+            e.price = (2000 + rng() % 200) / 20.0;
+            if (e.action == TxAction::Sell && rng() % 4 == 0) e.lot = rng() % 5;
+            cash += e.action == TxAction::Buy ? -(double)(rng() % 500) : (double)(rng() % 500);
         }
+        e.balanceAfter = cash;
+    }
+    return out;
+}
+
+// The reference answer: a straight scan in log order
+vector<TxEntry> scanQuery(const vector<TxEntry>& all, const TxQuery& q) {
+    vector<TxEntry> out;
+    for (const TxEntry& e : all) {
+        if (!q.symbol.empty() && (e.instrument == kNoInstrument || instruments().symbol(e.instrument) != q.symbol))
+            continue;
+        if (e.time < q.from || e.time > q.to || (!q.anyAction && e.action != q.action)) continue;
+        out.push_back(e);
     }
+    return out;
+}
 
-    void displayPortfolio(const Market& market) const {
-        cout << "\n---- " << name << " PORTFOLIO ----\n";
-        cout << "Cash Balance: " << fixed << setprecision(2) << cashBalance << "\n";
-        if (portfolio.empty()) {
-            cout << "No holdings.\n";
-            return;
+// Every query answered from the file, through its index, as the scan answers it
+bool txLogFileAgrees(TxLogFile& file, const TransactionLog& log, const vector<TxEntry>& all) {
+    const Timestamp t0 = all.front().time;
+    vector<TxQuery> qs(6);
+    qs[1].symbol = "STB";
+    qs[2].symbol = "STF";
+    qs[2].anyAction = false;
+    qs[2].action = TxAction::Sell;
+    qs[3].from = t0 + 100 * kNsPerSecond;
+    qs[3].to = t0 + 400 * kNsPerSecond;
+    qs[4] = qs[3];
+    qs[4].symbol = "STC";
+    qs[5].anyAction = false;
+    qs[5].action = TxAction::Deposit;
+    bool ok = file.size() == all.size();
+    for (const TxQuery& q : qs) {
+        vector<TxEntry> want = scanQuery(all, q);
+        ok = ok && sameTx(file.query(q), want) && sameTx(log.query(q), want);
+    }
+    for (size_t i = 0; ok && i < all.size(); i += 37) {
+        double a = 0.0, b = 0.0;
+        bool fa = file.balanceAt(all[i].time, a), fb = log.balanceAt(all[i].time, b);
+        ok = fa == fb && a == b;
+    }
+    return ok;
+}
+
+void selfTestTxLog(SelfTest& t) {
+    const string fname = "selftest.txlog";
+    for (int pass = 0; pass < 2; ++pass) {
+        const string label = pass ? ".txlog out of time order: " : ".txlog in time order: ";
+        vector<TxEntry> all = selfTestEntries(1000, 11 + pass, pass == 1);
+        TransactionLog log;
+        for (const TxEntry& e : all) log.add(e);
+        t.check(label + "save", log.saveToFile(fname));
+
+        TxLogFile file;
+        t.check(label + "queries through the saved .idx", file.open(fname) && txLogFileAgrees(file, log, all));
+
+        remove((fname + ".idx").c_str());
+        TxLogFile rebuilt;
+        bool ok = rebuilt.open(fname) && txLogFileAgrees(rebuilt, log, all);
+        ifstream idx(fname + ".idx");
+        t.check(label + "missing .idx rebuilt", ok && idx.good());
+        idx.close();
+
+        TxEntry extra = all.back();
+        extra.time += kNsPerSecond;
+        {
+            ofstream ofs(fname, ios::app);
+            writeTxLine(ofs, extra);
         }
-        cout << left << setw(8) << "Sym" << setw(20) << "Name" << setw(8) << "Type"
-             << setw(10) << "Qty" << setw(12) << "AvgPrice" << setw(12) << "MktPrice"
-             << setw(12) << "MktValue" << setw(12) << "P/L\n";
-        cout << string(90, '-') << "\n";
-        double totalValue = cashBalance;
-        for (const auto& p : portfolio) {
-            const Holding& h = p.second;
-            double mprice = 0.0;
-            const Investment* inv = market.findInvestment(h.symbol);
-            if (inv) mprice = inv->currentPrice();
-            double mvalue = h.quantity * mprice;
-            double pl = (mprice - h.avgPrice) * h.quantity;
-            totalValue += mvalue;
-            cout << setw(8) << h.symbol << setw(20) << h.name << setw(8) << h.type
-                 << setw(10) << fixed << setprecision(2) << h.quantity << setw(12) << h.avgPrice
-                 << setw(12) << mprice << setw(12) << mvalue << setw(12) << pl << "\n";
-        }
-        cout << string(90, '-') << "\n";
-        cout << "Total Net Worth (cash + investments): " << fixed << setprecision(2) << totalValue << "\n";
+        all.push_back(extra);
+        log.add(extra);
+        TxLogFile grown;
+        t.check(label + "stale .idx ignored after an append", grown.open(fname) && txLogFileAgrees(grown, log, all));
+
+        TransactionLog loaded;
+        t.check(label + "loadFromFile", loaded.loadFromFile(fname) && sameTx(scanQuery(all, TxQuery()),
+                                                                            loaded.query(TxQuery())));
+        remove(fname.c_str());
+        remove((fname + ".idx").c_str());
     }
+}
 
-    void showTransactions() const {
-        cout << "\n--- Transaction History ---\n";
-        tlog.showAll();
+bool readFileBytes(const string& fname, string& out) {
+    ifstream ifs(fname, ios::binary);
+    if (!ifs) return false;
+    ostringstream ss;
+    ss << ifs.rdbuf();
+    out = ss.str();
+    return true;
+}
+
+void selfTestColumnar(SelfTest& t) {
+    // FNV-1a of the file this test writes; changes only with the .smcol format
+    const uint64_t kGolden = 11813940249316982401ULL;
+    const string fname = "selftest_tx.smcol";
+    vector<TransactionLog> logs(3);
+    for (size_t a = 0; a < logs.size(); ++a)
+        for (const TxEntry& e : selfTestEntries(700 + 300 * a, 21 + (uint32_t)a, a == 1)) logs[a].add(e);
+    vector<TransactionLog::Snapshot> snaps;
+    for (const TransactionLog& l : logs) snaps.push_back(l.snapshot());
+    TxColumnSource src(snaps);
+
+    string bytes[2];
+    for (int pass = 0; pass < 2; ++pass) {
+        WorkStealingPool pool(pass ? 3 : 1);
+        ColumnarExportStats st;
+        bool ok = exportColumnar(fname, "transactions", src, pool, st, 512) && st.groups == 6 &&
+                  readFileBytes(fname, bytes[pass]);
+        t.check(string(".smcol export on ") + (pass ? "3 threads" : "1 thread"), ok);
     }
+    t.check(".smcol bytes independent of thread count", bytes[0] == bytes[1]);
+    StateDigest d;
+    d.add(bytes[0]);
+    t.check(".smcol bytes match the golden digest", d.value() == kGolden);
+    if (d.value() != kGolden) cout << "      digest " << d.value() << "\n";
 
-    // Save investor data (portfolio + cash)
-    bool saveToFile(const string& fname) const {
-        ofstream ofs(fname);
-        if (!ofs) {
-            cout << "Error: Could not open file " << fname << " for writing.\n";
-            return false;
+    ColumnarFile f;
+    t.check(".smcol read back column by column", f.open(fname) && columnarMatches(f, src));
+    remove(fname.c_str());
+}
+
+void selfTestStore(SelfTest& t) {
+    const string fname = "selftest.smdb";
+    const size_t accounts = 300;
+    Market market;
+    vector<string> syms;
+    for (size_t i = 0; i < 6; ++i) {
+        syms.push_back("SS" + to_string(i));
+        if (i == 5) market.addFund(MutualFund("Selftest Store Fund", syms.back(), 50.0, 1e12));
+        else market.addStock(Stock("Selftest Store " + to_string(i), syms.back(), 100.0, 2000000000));
+    }
+    mt19937 rng(31);
+    auto trade = [&](InvestorStore& store, size_t orders) {
+        for (size_t i = 0; i < orders; ++i) {
+            Investor* inv = store.edit(rng() % accounts);
+            size_t k = rng() % syms.size();
+            if (rng() % 3) inv->tryBuy(market, syms[k], k == 5 ? 0.5 : (double)(1 + rng() % 4));
+            else inv->trySell(market, syms[k], 1);
+            if (i % 1000 == 999) market.simulatePriceMovement();
         }
-        ofs << name << '\n';
-        ofs << fixed << setprecision(2) << cashBalance << '\n';
-        // portfolio entries
-        for (const auto& p : portfolio) {
-            const Holding& h = p.second;
-            ofs << h.symbol << '|' << h.name << '|' << h.type << '|' << h.quantity << '|' << h.avgPrice << '\n';
+    };
+    auto digest = [&](InvestorStore& store) {
+        StateDigest d;
+        for (uint64_t id = 0; id < accounts; ++id) {
+            store.loadHistory(id);
+            store.peek(id)->addToDigest(d);
         }
-        ofs.close();
-        // save transaction log separately
-        tlog.saveToFile(fname + ".txlog");
-        return true;
+        return d.value();
+    };
+
+    remove(fname.c_str());
+    uint64_t before = 0;
+    {
+        // a 64-page cache and 8 live accounts: nearly every access reads and evicts
+        InvestorStore store;
+        bool ok = store.open(fname, 64, 8);
+        for (size_t i = 0; ok && i < accounts; ++i) ok = store.create("ST" + to_string(i), 1e6) == i;
+        t.check(".smdb create", ok);
+        if (!ok) return;
+        trade(store, 6000);
+        // one account with hundreds of lots, so its record spills into an overflow chain
+        for (size_t i = 0; i < 400; ++i) store.edit(7)->tryBuy(market, syms[i % 5], 1);
+        before = digest(store);
+        t.check(".smdb close", store.close());
     }
+    {
+        InvestorStore store;
+        t.check(".smdb reopen matches", store.open(fname, 64, 8) && digest(store) == before);
+        store.compactHistory();
+        t.check(".smdb compactHistory keeps every account", digest(store) == before);
+        trade(store, 2000);
+        before = digest(store);
+        t.check(".smdb close after compaction and more trading", store.close());
+    }
+    {
+        InvestorStore store;
+        t.check(".smdb reopen after compaction matches", store.open(fname, 64, 8) && digest(store) == before);
+        store.close();
+    }
+    remove(fname.c_str());
+}
 
-    bool loadFromFile(const string& fname) {
-        ifstream ifs(fname);
-        if (!ifs) {
-            cout << "Error: Could not open file " << fname << " for reading.\n";
-            return false;
+void selfTestJournal(SelfTest& t) {
+    const string prefix = "selftest";
+    const size_t accounts = 200;
+    vector<string> syms;
+    uint64_t before = 0;
+    string lastSegment;
+    {
+        Market market;
+        for (size_t i = 0; i < 6; ++i) {
+            syms.push_back("SJ" + to_string(i));
+            if (i == 5) market.addFund(MutualFund("Selftest Journal Fund", syms.back(), 50.0, 1e12));
+            else market.addStock(Stock("Selftest Journal " + to_string(i), syms.back(), 100.0, 2000000000));
         }
-        portfolio.clear();
-        string line;
-        getline(ifs, name);
-        if (name.empty()) return false;
-        string tmp;
-        getline(ifs, tmp);
-        try {
-            cashBalance = tmp.empty() ? 0.0 : stod(tmp);
-        } catch (const exception& e) {
-            cout << "Error parsing cash balance.\n";
-            return false;
+        InvestorBook book;
+        for (size_t i = 0; i < accounts; ++i) book.open("SJ" + to_string(i), 1e6);
+        Recovery rec(prefix, 2, false);
+        bool ok = rec.begin(market, book);
+        mt19937 rng(41);
+        for (size_t i = 0; ok && i < 4000; ++i) {
+            Investor& inv = book[rng() % accounts];
+            size_t k = rng() % syms.size();
+            if (rng() % 3) inv.tryBuy(market, syms[k], k == 5 ? 0.25 * (1 + rng() % 8) : (double)(1 + rng() % 5));
+            else inv.trySell(market, syms[k], 1);
+            if (i % 500 == 499) market.simulatePriceMovement();
+            if (i == 2000) ok = rec.checkpoint();
         }
-        while (getline(ifs, line)) {
-            if (line.empty()) continue;
-            stringstream ss(line);
-            string sym, nm, tp, qstr, avgstr;
-            getline(ss, sym, '|');
-            getline(ss, nm, '|');
-            getline(ss, tp, '|');
-            getline(ss, qstr, '|');
-            getline(ss, avgstr, '\n');
-            try {
-                Holding h(sym, nm, tp, stod(qstr), stod(avgstr));
-                portfolio[sym] = h;
-            } catch (const exception& e) {
-                cout << "Error parsing holding data.\n";
+        CorporateActionEngine actions(market, book, 1);
+        ok = ok && actions.apply(CorporateAction{instruments().find(syms[1]), CorporateActionKind::Dividend, 1.5},
+                                 clockNow()) &&
+             actions.apply(CorporateAction{instruments().find(syms[2]), CorporateActionKind::Split, 2.0}, clockNow()) &&
+             rec.log().commit();
+        t.check("journal: begin, trade, checkpoint, corporate actions", ok);
+        before = stateDigest(market, book);
+        lastSegment = Journal::segmentName(prefix, rec.log().segmentStart());
+        // crash: no shutdown record
+    }
+    const string torn = "T|999999|12|";
+    {
+        FILE* fp = fopen(lastSegment.c_str(), "ab");
+        t.check("journal: torn record appended", fp && fwrite(torn.data(), 1, torn.size(), fp) == torn.size());
+        if (fp) fclose(fp);
+    }
+    {
+        Market market;
+        InvestorBook book;
+        Recovery rec(prefix, 2, false);
+        RecoveryStats st;
+        bool ok = rec.recover(market, book, st);
+        t.check("journal: crash recovery matches pre-crash state", ok && stateDigest(market, book) == before);
+        t.check("journal: torn tail ignored", ok && st.tornBytes == torn.size() && !st.digestChecked);
+        t.check("journal: clean shutdown", ok && rec.shutdown());
+    }
+    {
+        Market market;
+        InvestorBook book;
+        Recovery rec(prefix, 2, false);
+        RecoveryStats st;
+        bool ok = rec.recover(market, book, st);
+        t.check("journal: shutdown digest verified on restart",
+                ok && st.digestChecked && st.digestOk && stateDigest(market, book) == before);
+        rec.removeFiles();
+    }
+}
+
+int runSelfTest() {
+    SelfTest t;
+    selfTestTxLog(t);
+    selfTestColumnar(t);
+    selfTestStore(t);
+    selfTestJournal(t);
+    cout << (t.failures ? "selftest: " + to_string(t.failures) + " FAILED\n" : string("selftest: all passed\n"));
+    return t.failures;
+}
+
+// --------------------------- Command line ---------------------------
+// Checked "--flag value" pairs for the run modes. Every flag must be one the
+// mode declared and must carry a value in range; otherwise parse() says what
+// was wrong, prints the usage line and returns false.
+class CliOptions {
+private:
+    struct Option {
+        string flag;
+        size_t* count;     // whole number in [1, max]
+        unsigned* small;   // same, for unsigned targets
+        double* number;    // positive real
+        uint64_t max;
+    };
+    string usage;
+    vector<Option> options;
+
+    bool set(const Option& o, const string& value) const {
+        const char* s = value.c_str();
+        char* end = nullptr;
+        if (o.number) {
+            double v = strtod(s, &end);
+            if (end == s || *end || !(v > 0) || v > numeric_limits<double>::max()) return false;
+            *o.number = v;
+            return true;
+        }
+        if (!isdigit((unsigned char)*s)) return false; // strtoull would take "-1" as a huge count
+        errno = 0;
+        unsigned long long v = strtoull(s, &end, 10);
+        if (*end || errno == ERANGE || v == 0 || v > o.max) return false;
+        if (o.count) *o.count = (size_t)v;
+        else *o.small = (unsigned)v;
+        return true;
+    }
+public:
+    explicit CliOptions(const string& usageLine) : usage(usageLine) {}
+
+    CliOptions& count(const string& flag, size_t& target, uint64_t max = numeric_limits<size_t>::max()) {
+        options.push_back(Option{flag, &target, nullptr, nullptr, max});
+        return *this;
+    }
+    CliOptions& count(const string& flag, unsigned& target, uint64_t max = numeric_limits<unsigned>::max()) {
+        options.push_back(Option{flag, nullptr, &target, nullptr, max});
+        return *this;
+    }
+    CliOptions& number(const string& flag, double& target) {
+        options.push_back(Option{flag, nullptr, nullptr, &target, 0});
+        return *this;
+    }
+
+    // argv[first..argc) as flag/value pairs
+    bool parse(int argc, char* argv[], int first) const {
+        for (int i = first; i < argc; i += 2) {
+            string flag = argv[i];
+            const Option* o = nullptr;
+            for (const Option& c : options)
+                if (c.flag == flag) o = &c;
+            bool ok = o && i + 1 < argc;
+            if (!o) cout << "Unknown option " << flag << ".\n";
+            else if (!ok) cout << flag << " needs a value.\n";
+            else if (!(ok = set(*o, argv[i + 1]))) {
+                cout << "Invalid value for " << flag << ": " << argv[i + 1] << " (expected "
+                     << (o->number ? string("a positive number")
+                         : o->max < numeric_limits<unsigned>::max() ? "a whole number from 1 to " + to_string(o->max)
+                                                                    : string("a positive whole number"))
+                     << ").\n";
+            }
+            if (!ok) {
+                cout << "usage: " << usage << "\n";
                 return false;
             }
         }
-        // load transactions if present
-        tlog.loadFromFile(fname + ".txlog");
-        ifs.close();
         return true;
     }
 };
 
-// --------------------------- UI & main ---------------------------
-void showMainMenu() {
-    cout << "\n===== STOCK MARKET SIMULATION (OOP Demo) =====\n";
-    cout << "1. Show Market\n";
-    cout << "2. Show My Portfolio\n";
-    cout << "3. Buy\n";
-    cout << "4. Sell\n";
-    cout << "5. Deposit Cash\n";
-    cout << "6. Withdraw Cash\n";
-    cout << "7. Show Transactions\n";
-    cout << "8. Simulate Market Movement\n";
-    cout << "9. Save Snapshot (Market & Investor)\n";
-    cout << "10. Load Snapshot (Market & Investor)\n";
-    cout << "11. Quick Demo Setup (populate sample market)\n";
-    cout << "0. Exit\n";
-    cout << "Enter choice: ";
-}
-
-void setupSampleMarket(Market& market) {
-    // Add a bunch of stocks and funds
-    market.addStock(Stock("Tata Motors Ltd", "TATAM", 490.50, 10000));
-    market.addStock(Stock("Infosys Ltd", "INFY", 1830.75, 8000));
-    market.addStock(Stock("Reliance Industries", "RELI", 2979.30, 9000));
-    market.addStock(Stock("HDFC Bank", "HDFCB", 1435.40, 7000));
-    market.addStock(Stock("ICICI Bank", "ICIC", 840.25, 6000));
-    market.addStock(Stock("Wipro Ltd", "WIPR", 420.10, 6500));
-    market.addFund(MutualFund("SBI Equity Fund", "SBI-EQ", 48.30, 50000.0));
-    market.addFund(MutualFund("Nippon India Largecap", "NIP-LC", 34.75, 40000.0));
-    market.addFund(MutualFund("HDFC Hybrid", "HDFC-HY", 20.50, 30000.0));
-    cout << "Sample market populated.\n";
-}
-
-int main() {
+int main(int argc, char* argv[]) {
     ios::sync_with_stdio(false);
     cin.tie(&cout);
 
+    if (argc > 1 && string(argv[1]) == "--bench") {
+        runBenchmarks();
+        return 0;
+    }
+    // ./sharemarket --selftest   (exit code is the number of failed checks)
+    if (argc > 1 && string(argv[1]) == "--selftest") return runSelfTest();
+    // ./sharemarket --rebuild-lots [--lifo] [--threads N] a.txlog b.txlog ...
+    if (argc > 1 && string(argv[1]) == "--rebuild-lots") {
+        LotMethod method = LotMethod::FIFO;
+        unsigned threads = 0;
+        vector<string> files;
+        for (int i = 2; i < argc; ++i) {
+            string a = argv[i];
+            if (a == "--lifo") method = LotMethod::LIFO;
+            else if (a == "--threads" && i + 1 < argc) threads = (unsigned)atoi(argv[++i]);
+            else files.push_back(a);
+        }
+        return runLotRebuild(files, method, threads);
+    }
+
+    // ./sharemarket --recover-bench [investors] [ops per investor]
+    if (argc > 1 && string(argv[1]) == "--recover-bench") {
+        size_t investors = argc > 2 ? strtoull(argv[2], nullptr, 10) : 1000000;
+        size_t ops = argc > 3 ? strtoull(argv[3], nullptr, 10) : 4;
+        return runRecoveryBench(investors, ops);
+    }
+    // ./sharemarket --loadgen [--agents N] [--rate ORDERS_PER_SEC] [--seconds S] [--threads T] [--symbols N]
+    // (no --rate: as fast as the engine allows; no --threads: one per core)
+    if (argc > 1 && string(argv[1]) == "--loadgen") {
+        LoadGenConfig cfg;
+        CliOptions opts("sharemarket --loadgen [--agents N] [--rate ORDERS_PER_SEC] [--seconds S] [--threads T] "
+                        "[--symbols N]");
+        opts.count("--agents", cfg.agents).number("--rate", cfg.rate).number("--seconds", cfg.seconds)
+            .count("--threads", cfg.threads, 4096).count("--symbols", cfg.instruments);
+        if (!opts.parse(argc, argv, 2)) return 1;
+        return runLoadGenerator(cfg);
+    }
+#ifndef _WIN32
+    // ./sharemarket --shards [--workers N] [--investors N] [--orders N] [--symbols N] [--batch N]
+    // (one worker process per hardware thread at most; the default is up to 4)
+    if (argc > 1 && string(argv[1]) == "--shards") {
+        ShardRunConfig cfg;
+        unsigned cores = workerThreads(0);
+        cfg.workers = min(cfg.workers, cores);
+        CliOptions opts("sharemarket --shards [--workers N] [--investors N] [--orders N] [--symbols N] [--batch N]");
+        opts.count("--workers", cfg.workers, cores).count("--investors", cfg.investors).count("--orders", cfg.orders)
+            .count("--symbols", cfg.instruments).count("--batch", cfg.batch);
+        if (!opts.parse(argc, argv, 2)) return 1;
+        return runShardedMarket(cfg);
+    }
+#else
+    // the shards are fork()ed workers sharing an anonymous mmap
+    if (argc > 1 && string(argv[1]) == "--shards") {
+        cout << "--shards is unsupported on this platform: it needs fork() and shared anonymous mmap.\n";
+        return 1;
+    }
+#endif
+    // ./sharemarket --read-prices SEGMENT [SYMBOL ...] : quotes from a running simulator (option 28)
+    if (argc > 2 && string(argv[1]) == "--read-prices") return runPriceReader(argv[2], vector<string>(argv + 3, argv + argc));
+    // ./sharemarket --export-bench [rows] [threads]
+    if (argc > 1 && string(argv[1]) == "--export-bench") {
+        size_t rows = argc > 2 ? strtoull(argv[2], nullptr, 10) : 4000000;
+        unsigned threads = argc > 3 ? (unsigned)atoi(argv[3]) : 0;
+        return runExportBench(rows, threads);
+    }
+    // ./sharemarket --store-bench [file] [accounts] [orders]
+    if (argc > 1 && string(argv[1]) == "--store-bench") {
+        string path = argc > 2 ? argv[2] : "store_bench.smdb";
+        size_t accounts = argc > 3 ? strtoull(argv[3], nullptr, 10) : 1000000;
+        size_t ops = argc > 4 ? strtoull(argv[4], nullptr, 10) : 1000000;
+        return runStoreBench(path, accounts, ops);
+    }
+    // ./sharemarket --valuation-bench [accounts]
+    if (argc > 1 && string(argv[1]) == "--valuation-bench") {
+        benchBulkValuation(argc > 2 ? strtoull(argv[2], nullptr, 10) : 1000000);
+        return 0;
+    }
+    // ./sharemarket --stress-bench [accounts] [scenarios]
+    if (argc > 1 && string(argv[1]) == "--stress-bench") {
+        size_t accounts = argc > 2 ? strtoull(argv[2], nullptr, 10) : 1000000;
+        size_t scenarios = argc > 3 ? strtoull(argv[3], nullptr, 10) : 500;
+        benchStressTest(accounts, scenarios);
+        return 0;
+    }
+    // ./sharemarket --rebalance-bench [accounts]
+    if (argc > 1 && string(argv[1]) == "--rebalance-bench") {
+        benchRebalance(argc > 2 ? strtoull(argv[2], nullptr, 10) : 20000);
+        return 0;
+    }
+    // ./sharemarket --journal PREFIX : durable session, recovered from PREFIX.* after a crash
+    unique_ptr<Recovery> durable;
+    if (argc > 2 && string(argv[1]) == "--journal") durable.reset(new Recovery(argv[2]));
 
     Market market;
-    Investor investor("Chaitanya", 10000.00); // default investor; user can load their own file
+    InvestorBook book;
+    if (durable && durable->exists()) {
+        RecoveryStats st;
+        if (!durable->recover(market, book, st) || book.size() == 0) {
+            cout << "Recovery from " << argv[2] << " failed.\n";
+            return 1;
+        }
+        printRecoveryStats(st);
+    }
+    bool fresh = book.size() == 0;
+    if (fresh) book.open("Chaitanya", 10000.00); // default investor; user can load their own file
+    Investor& investor = book[0];
     cout << "Program started successfully.\n";
     cout << "Welcome to the OOP Stock Market Simulation!\n";
     cout << "Default user created: " << investor.getName() << " with balance " << investor.getBalance() << "\n";
 
     // Optionally pre-populate market
-    setupSampleMarket(market);
+    if (fresh) setupSampleMarket(market);
+    if (fresh && durable && !durable->begin(market, book)) {
+        cout << "Could not start journal at " << argv[2] << ".\n";
+        return 1;
+    }
+
+    TickHistory tickHistory; // every tick's prices, for the columnar export
+    market.attachTickHistory(&tickHistory);
+    MarketIndicators indicators; // RSI / EMA / last move, for the screener
+    market.attachIndicators(&indicators);
+    SharedPriceTable priceTable; // prices for other processes, once option 28 starts it
+    vector<CurveInstrument> benchmarks = sampleBenchmarks(); // option 29 moves these
+    BondPricer bondBook;         // listed bonds, priced off the benchmarks' curve
+    SectorMap sectors = sampleSectors(); // for stress scenarios (option 30)
+    TriggerBook triggers;
+    Checkpointer checkpointer;
+    bool saveReported = true;
+    // Print the outcome of the last background save once; optionally wait for it
+    auto reportSave = [&](bool block) {
+        if (saveReported) return;
+        if (block) checkpointer.wait();
+        CheckpointProgress p = checkpointer.progress();
+        if (!p.done) return;
+        cout << (p.ok ? "Saved market and investor snapshot.\n" : "Error saving files.\n");
+        saveReported = true;
+    };
 
     bool running = true;
     while (running) {
+        if (durable) durable->log().commit(); // group commit: everything the last command did
+        reportSave(false);
         showMainMenu();
         int choice;
         while (!(cin >> choice)) {
@@ -780,16 +12618,19 @@ int main() {
                     cout << "Simulating market movement... (This will update prices randomly)\n";
                     market.simulatePriceMovement();
                     cout << "Simulation done.\n";
+                    printTriggerEvents(triggers.evaluate(market, book));
                     break;
                 }
                 case 9: {
                     cout << "Enter filename prefix to save snapshot (e.g. snapshot1): ";
                     string pref;
                     getline(cin, pref);
-                    if (market.saveSnapshot(pref + "_market.txt") && investor.saveToFile(pref + "_investor.txt")) {
-                        cout << "Saved market and investor snapshot.\n";
+                    reportSave(true);
+                    if (checkpointer.start(market, investor, pref)) {
+                        saveReported = false;
+                        cout << "Saving snapshot in background (option 17 shows progress).\n";
                     } else {
-                        cout << "Error saving files.\n";
+                        cout << "A snapshot save is already running.\n";
                     }
                     break;
                 }
@@ -797,11 +12638,14 @@ int main() {
                     cout << "Enter filename prefix to load snapshot (e.g. snapshot1): ";
                     string pref;
                     getline(cin, pref);
+                    reportSave(true);
                     if (market.loadSnapshot(pref + "_market.txt") && investor.loadFromFile(pref + "_investor.txt")) {
                         cout << "Loaded snapshots for market and investor.\n";
+                        printTriggerEvents(triggers.evaluate(market, book));
                     } else {
                         cout << "Error loading snapshots. Make sure files exist.\n";
                     }
+                    if (durable && !durable->rebase()) cout << "Error writing recovery checkpoint.\n";
                     break;
                 }
                 case 11: {
@@ -810,16 +12654,508 @@ int main() {
                     cin >> ch;
                     cin.ignore(numeric_limits<streamsize>::max(), '\n');
                     if (ch == 'y' || ch == 'Y') {
+                        reportSave(true);
                         market = Market();
+                        tickHistory.clear();
+                        market.attachTickHistory(&tickHistory);
+                        indicators.clear();
+                        market.attachIndicators(&indicators);
+                        if (priceTable.isOpen()) market.attachPriceTable(&priceTable);
                         setupSampleMarket(market);
+                        benchmarks = sampleBenchmarks();
+                        bondBook = BondPricer();
                         investor = Investor("Chaitanya", 10000.0);
+                        investor.attachHolderIndex(&book.holders());
+                        triggers = TriggerBook();
+                        if (durable && !durable->rebase()) cout << "Error writing recovery checkpoint.\n";
                         cout << "Demo setup complete.\n";
                     } else {
                         cout << "Aborted.\n";
                     }
                     break;
                 }
+                case 12: {
+                    TxQuery q;
+                    cout << "Symbol (blank for any): ";
+                    getline(cin, q.symbol);
+                    cout << "Action BUY/SELL/DEPOSIT/WITHDRAW/DIVIDEND/SPLIT (blank for any): ";
+                    string act;
+                    getline(cin, act);
+                    if (!act.empty()) {
+                        if (!parseAction(act, q.action)) { cout << "Unknown action.\n"; break; }
+                        q.anyAction = false;
+                    }
+                    string from, to;
+                    cout << "From time YYYY-MM-DD HH:MM:SS (blank for start): ";
+                    getline(cin, from);
+                    cout << "To time YYYY-MM-DD HH:MM:SS (blank for now): ";
+                    getline(cin, to);
+                    if ((!from.empty() && !parseTime(from, q.from)) || (!to.empty() && !parseTime(to, q.to, true))) {
+                        cout << "Invalid time.\n";
+                        break;
+                    }
+                    vector<TxEntry> rows = investor.transactions().query(q);
+                    if (rows.empty()) {
+                        cout << "No matching transactions.\n";
+                        break;
+                    }
+                    {
+                        TableWriter out(cout);
+                        TransactionLog::printHeader(out);
+                        for (const TxEntry& e : rows) TransactionLog::printRow(out, e);
+                    }
+                    keepTableFormat(cout, true);
+                    break;
+                }
+                case 13: {
+                    cout << "Time YYYY-MM-DD HH:MM:SS: ";
+                    string t;
+                    getline(cin, t);
+                    Timestamp at;
+                    if (!parseTime(t, at, true)) {
+                        cout << "Invalid time.\n";
+                        break;
+                    }
+                    double bal;
+                    if (investor.transactions().balanceAt(at, bal))
+                        cout << "Cash balance at " << t << ": " << fixed << setprecision(2) << bal << "\n";
+                    else
+                        cout << "No transactions at or before that time.\n";
+                    break;
+                }
+                case 14: {
+                    investor.showLots();
+                    break;
+                }
+                case 15: {
+                    cout << "Enter symbol to sell: ";
+                    string sym;
+                    getline(cin, sym);
+                    cout << "Enter lot number: ";
+                    unsigned lotId;
+                    while (!(cin >> lotId)) {
+                        cout << "Invalid lot. Enter a number: ";
+                        cin.clear();
+                        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+                    }
+                    cout << "Enter quantity to sell: ";
+                    double qty;
+                    while (!(cin >> qty)) {
+                        cout << "Invalid quantity. Enter a number: ";
+                        cin.clear();
+                        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+                    }
+                    cin.ignore(numeric_limits<streamsize>::max(), '\n');
+                    if (investor.sellLot(market, sym, lotId, qty)) cout << "Sell complete.\n";
+                    break;
+                }
+                case 16: {
+                    cout << "Lot method (FIFO/LIFO): ";
+                    string m;
+                    getline(cin, m);
+                    if (m == "FIFO" || m == "fifo") investor.setLotMethod(LotMethod::FIFO);
+                    else if (m == "LIFO" || m == "lifo") investor.setLotMethod(LotMethod::LIFO);
+                    else { cout << "Unknown method.\n"; break; }
+                    cout << "Lot method set.\n";
+                    break;
+                }
+                case 17: {
+                    CheckpointProgress p = checkpointer.progress();
+                    if (!p.running && !p.done) {
+                        cout << "No snapshot save has been started.\n";
+                        break;
+                    }
+                    cout << (p.running ? "Saving: " : "Last save: ") << p.rowsDone << "/" << p.rowsTotal
+                         << " rows, " << p.bytesWritten << " bytes, " << fixed << setprecision(3)
+                         << p.seconds << " s";
+                    if (!p.running) cout << (p.ok ? " (ok)" : " (failed)");
+                    cout << "\n";
+                    break;
+                }
+                case 18: {
+                    if (!durable) {
+                        cout << "Not journaling; start with --journal PREFIX.\n";
+                        break;
+                    }
+                    if (durable->checkpoint()) cout << "Checkpoint written at LSN " << durable->lastCheckpoint() << ".\n";
+                    else cout << "Error writing recovery checkpoint.\n";
+                    break;
+                }
+                case 19: {
+                    cout << "Type (STOP-LOSS, TAKE-PROFIT, BUY-BELOW, BUY-ABOVE, ALERT-ABOVE, ALERT-BELOW): ";
+                    string tp;
+                    getline(cin, tp);
+                    TriggerSpec s;
+                    if (!parseTriggerType(tp, s.type)) { cout << "Unknown trigger type.\n"; break; }
+                    cout << "Symbol: ";
+                    string sym;
+                    getline(cin, sym);
+                    if (!market.findInvestment(sym)) { cout << "Investment symbol not found in market.\n"; break; }
+                    cout << "Trigger price: ";
+                    while (!(cin >> s.level)) {
+                        cout << "Invalid price. Enter a number: ";
+                        cin.clear();
+                        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+                    }
+                    s.qty = 0.0;
+                    if (s.type != TriggerType::AlertAbove && s.type != TriggerType::AlertBelow) {
+                        // a buy needs a size; a sell may leave it at 0 to close the whole holding
+                        bool buy = s.type == TriggerType::BuyBelow || s.type == TriggerType::BuyAbove;
+                        cout << (buy ? "Quantity: " : "Quantity (0 = whole holding): ");
+                        while (!(cin >> s.qty) || (buy ? s.qty <= 0 : s.qty < 0)) {
+                            cout << (buy ? "Invalid quantity. Enter a positive number: "
+                                         : "Invalid quantity. Enter 0 or a positive number: ");
+                            cin.clear();
+                            cin.ignore(numeric_limits<streamsize>::max(), '\n');
+                        }
+                    }
+                    cin.ignore(numeric_limits<streamsize>::max(), '\n');
+                    s.account = 0; // the interactive investor is account 0
+                    s.instrument = instruments().find(sym);
+                    cout << "Trigger #" << triggers.add(s) << " placed.\n";
+                    break;
+                }
+                case 20: {
+                    vector<uint32_t> mine = triggers.restingFor(0);
+                    if (mine.empty()) {
+                        cout << "No resting triggers.\n";
+                        break;
+                    }
+                    cout << left << setw(6) << "Id" << setw(14) << "Type" << setw(8) << "Sym" << setw(12) << "Level" << "Qty\n";
+                    cout << string(46, '-') << "\n";
+                    for (uint32_t id : mine) {
+                        const TriggerSpec& s = triggers.spec(id);
+                        cout << setw(6) << id << setw(14) << triggerTypeName(s.type) << setw(8)
+                             << instruments().symbol(s.instrument) << setw(12) << fixed << setprecision(2)
+                             << s.level << s.qty << "\n";
+                    }
+                    break;
+                }
+                case 21: {
+                    cout << "Trigger id: ";
+                    unsigned id;
+                    while (!(cin >> id)) {
+                        cout << "Invalid id. Enter a number: ";
+                        cin.clear();
+                        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+                    }
+                    cin.ignore(numeric_limits<streamsize>::max(), '\n');
+                    if (triggers.isResting(id) && triggers.spec(id).account == 0 && triggers.cancel(id))
+                        cout << "Trigger cancelled.\n";
+                    else
+                        cout << "No resting trigger with that id.\n";
+                    break;
+                }
+                case 22: {
+                    size_t offset, limit;
+                    cout << "Skip how many rows: ";
+                    while (!(cin >> offset)) {
+                        cout << "Invalid number. Enter a number: ";
+                        cin.clear();
+                        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+                    }
+                    cout << "Show how many rows: ";
+                    while (!(cin >> limit)) {
+                        cout << "Invalid number. Enter a number: ";
+                        cin.clear();
+                        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+                    }
+                    cin.ignore(numeric_limits<streamsize>::max(), '\n');
+                    investor.showTransactions(offset, limit);
+                    break;
+                }
+                case 23: {
+                    cout << "Enter file prefix: ";
+                    string prefix;
+                    getline(cin, prefix);
+                    if (prefix.empty()) prefix = "analytics";
+                    exportAnalytics(prefix, book, tickHistory);
+                    break;
+                }
+                case 24: {
+                    cout << "Columns: price, available, rsi, change, ema (rsi needs "
+                         << MarketIndicators::kRsiPeriod + 1 << " simulated moves)\n";
+                    cout << "Enter filter: ";
+                    string expr, error;
+                    getline(cin, expr);
+                    Screener screener;
+                    if (!screener.compile(expr, error)) {
+                        cout << "Invalid filter: " << error << "\n";
+                        break;
+                    }
+                    EpochGuard g;
+                    const MarketVersion* v = market.view();
+                    vector<InstrumentId> hits = screener.matches(*v, &indicators);
+                    if (hits.empty()) {
+                        cout << "No instruments match.\n";
+                        break;
+                    }
+                    {
+                        TableWriter t(cout);
+                        t.cell("Sym", 8).cell("Kind", 12).cell("Price", 12).cell("Available", 14).cell("RSI", 8)
+                         .cell("Change%\n").repeat('-', 62).put('\n');
+                        for (InstrumentId id : hits) {
+                            t.cell(instruments().symbol(id), 8).cell(kindName(v->catalog->kind[id]), 12)
+                             .money(v->price[id], 12).money(v->available[id], 14);
+                            bool ticked = id < indicators.rsi.size();
+                            double rsi = ticked ? indicators.rsi[id] : NAN, chg = ticked ? indicators.change[id] : NAN;
+                            if (std::isnan(rsi)) t.cell("-", 8); else t.money(rsi, 8);
+                            if (std::isnan(chg)) t.cell("-"); else t.money(chg);
+                            t.put('\n');
+                        }
+                    }
+                    keepTableFormat(cout, true);
+                    cout << hits.size() << " of " << v->catalog->listed.size() << " instruments match.\n";
+                    break;
+                }
+                case 25: {
+                    printAllocReport();
+                    break;
+                }
+                case 26: {
+                    cout << "Trading sessions to simulate (252 is about a year): ";
+                    int sessions;
+                    while (!(cin >> sessions) || sessions <= 0) {
+                        cout << "Invalid number. Enter a positive whole number: ";
+                        cin.clear();
+                        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+                    }
+                    cin.ignore(numeric_limits<streamsize>::max(), '\n');
+                    SimConfig cfg;
+                    cout << "Seconds between ticks (blank for " << cfg.tickInterval / kNsPerSecond << "): ";
+                    string line;
+                    getline(cin, line);
+                    if (!line.empty()) {
+                        double secs = atof(line.c_str());
+                        if (secs <= 0) {
+                            cout << "Invalid interval.\n";
+                            break;
+                        }
+                        cfg.tickInterval = (Timestamp)(secs * kNsPerSecond);
+                    }
+                    MarketScheduler sim(market, cfg);
+                    CorporateActionEngine corporate(market, book);
+                    sim.attachCorporateActions(&corporate);
+                    cout << "Own rates, e.g. INFY=5 WIPR=300 (blank for none): ";
+                    getline(cin, line);
+                    stringstream rates(line);
+                    string rate;
+                    bool ok = true;
+                    while (rates >> rate) {
+                        size_t eq = rate.find('=');
+                        InstrumentId id = eq == string::npos ? kNoInstrument : instruments().find(rate.substr(0, eq));
+                        double secs = id == kNoInstrument ? 0.0 : atof(rate.c_str() + eq + 1);
+                        if (secs <= 0) {
+                            cout << "Invalid rate: " << rate << "\n";
+                            ok = false;
+                            break;
+                        }
+                        sim.setTickInterval(id, (Timestamp)(secs * kNsPerSecond));
+                    }
+                    if (!ok) break;
+                    vector<TriggerEvent> fired;
+                    sim.setBatchHandler([&](Timestamp) {
+                        vector<TriggerEvent> ev = triggers.evaluate(market, book);
+                        fired.insert(fired.end(), ev.begin(), ev.end());
+                    });
+                    Timestamp from = clockNow();
+                    sim.start(from);
+                    const SimStats& st = sim.runSessions((size_t)sessions);
+                    ios::fmtflags f = cout.flags();
+                    streamsize prec = cout.precision();
+                    cout << "Simulated " << st.sessions << " sessions, " << formatTime(from) << " to "
+                         << formatTime(sim.now()) << ", in " << fixed << setprecision(2) << st.seconds << " s.\n";
+                    cout << st.batches << " batched moves covering " << st.ticks << " ticks; " << st.earnings
+                         << " earnings, " << st.dividends << " dividends, " << st.splits << " splits.\n";
+                    cout.flags(f);
+                    cout.precision(prec);
+                    printTriggerEvents(fired);
+                    break;
+                }
+                case 27: {
+                    cout << "Enter symbol: ";
+                    string line, sym;
+                    getline(cin, line);
+                    stringstream(line) >> sym;
+                    InstrumentId id = instruments().find(sym);
+                    if (id == kNoInstrument) {
+                        cout << "Symbol not found in market.\n";
+                        break;
+                    }
+                    cout << "Action (SPLIT/DIVIDEND): ";
+                    string kindStr;
+                    getline(cin, line);
+                    stringstream(line) >> kindStr;
+                    for (char& c : kindStr) c = (char)toupper((unsigned char)c);
+                    CorporateAction a;
+                    a.instrument = id;
+                    if (!parseCorporateAction(kindStr, a.kind)) {
+                        cout << "Unknown action.\n";
+                        break;
+                    }
+                    cout << (a.kind == CorporateActionKind::Split ? "New units per unit held (e.g. 2 for 2-for-1): "
+                                                                 : "Dividend per unit: ");
+                    while (getline(cin, line)) {
+                        stringstream vs(line);
+                        string extra;
+                        if (vs >> a.value && !(vs >> extra) && a.value > 0) break;
+                        cout << "Invalid value. Enter a positive number: ";
+                    }
+                    if (!cin) break;
+                    CorporateActionEngine corporate(market, book);
+                    CorporateActionStats st;
+                    if (!corporate.apply(a, clockNow(), &st)) {
+                        cout << "Action could not be applied.\n";
+                        break;
+                    }
+                    ios::fmtflags f = cout.flags();
+                    streamsize prec = cout.precision();
+                    cout << corporateActionName(a.kind) << " applied to " << sym << ": " << st.adjusted << " positions adjusted ("
+                         << st.candidates << " indexed holders), " << fixed << setprecision(2) << st.cash
+                         << " paid in cash, " << setprecision(3) << st.seconds * 1e3 << " ms on " << st.threads
+                         << " thread(s).\n";
+                    cout.flags(f);
+                    cout.precision(prec);
+                    break;
+                }
+                case 28: {
+                    if (priceTable.isOpen()) {
+                        cout << "Publishing at " << priceTable.getName() << ": " << priceTable.size() << " rows, "
+                             << priceTable.rowWrites() << " row writes so far.\n";
+                        cout << "Stop publishing? (y/n): ";
+                        char ch;
+                        cin >> ch;
+                        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+                        if (ch == 'y' || ch == 'Y') {
+                            market.attachPriceTable(nullptr);
+                            priceTable.close();
+                            cout << "Stopped publishing prices.\n";
+                        }
+                        break;
+                    }
+                    cout << "Segment name (blank for /sharemarket-prices): ";
+                    string name;
+                    getline(cin, name);
+                    if (name.empty()) name = "/sharemarket-prices";
+                    if (name[0] != '/') name = "/" + name;
+                    bool created = priceTable.create(name);
+                    if (!created && errno == EEXIST) {
+                        cout << "Segment " << name << " already exists; another simulator may still be publishing "
+                             << "there. Take it over? (y/n): ";
+                        string answer;
+                        getline(cin, answer);
+                        if (answer.empty() || (answer[0] != 'y' && answer[0] != 'Y')) {
+                            cout << "Left " << name << " alone.\n";
+                            break;
+                        }
+                        created = priceTable.create(name, 65536, true);
+                    }
+                    if (!created) {
+                        cout << "Could not create shared memory segment " << name << ".\n";
+                        break;
+                    }
+                    market.attachPriceTable(&priceTable);
+                    cout << "Publishing " << priceTable.size() << " prices at " << name
+                         << "; read them with: sharemarket --read-prices " << name << "\n";
+                    break;
+                }
+                case 29: {
+                    bondBook.addListed(market);
+                    if (bondBook.getCurve().empty()) {
+                        YieldCurve curve;
+                        if (!curve.bootstrap(benchmarks)) {
+                            cout << "Could not build the yield curve from the benchmarks.\n";
+                            break;
+                        }
+                        bondBook.setCurve(curve);
+                    }
+                    showYieldCurve(benchmarks, bondBook.getCurve());
+                    cout << "Tenor to move (years, as listed): ";
+                    double tenor;
+                    while (!(cin >> tenor)) {
+                        cout << "Invalid tenor. Enter a number: ";
+                        cin.clear();
+                        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+                    }
+                    cin.ignore(numeric_limits<streamsize>::max(), '\n');
+                    size_t k = 0;
+                    while (k < benchmarks.size() && fabs(benchmarks[k].maturity - tenor) > 1e-6) ++k;
+                    if (k == benchmarks.size()) {
+                        cout << "No benchmark at that tenor.\n";
+                        break;
+                    }
+                    cout << "New yield (%): ";
+                    double pct;
+                    while (!(cin >> pct)) {
+                        cout << "Invalid yield. Enter a number: ";
+                        cin.clear();
+                        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+                    }
+                    cin.ignore(numeric_limits<streamsize>::max(), '\n');
+                    vector<CurveInstrument> moved = benchmarks;
+                    moved[k].coupon = pct / 100.0;
+                    YieldCurve curve;
+                    if (!curve.bootstrap(moved)) {
+                        cout << "That yield does not give a valid curve; nothing changed.\n";
+                        break;
+                    }
+                    benchmarks = moved;
+                    size_t n = bondBook.setCurve(curve);
+                    bondBook.publish(market);
+                    cout << "Repriced " << n << " of " << bondBook.size() << " bonds.\n";
+                    if (bondBook.unsolved())
+                        cout << bondBook.unsolved() << " of them have no yield that matches the price (shown as n/a).\n";
+                    if (n) showBondAnalytics(bondBook, &bondBook.lastRepriced());
+                    break;
+                }
+                case 30: {
+                    cout << "Scenarios, one per line, e.g. banks -15%, IT -8%, funds -5%\n";
+                    cout << "(targets: symbols, sectors, stocks/funds/bonds, all; blank line to run)\n";
+                    vector<StressScenario> scenarios;
+                    string line;
+                    while (getline(cin, line) && line.find_first_not_of(" \t") != string::npos) {
+                        StressScenario sc;
+                        string error;
+                        if (parseScenario(line, sectors, sc, error)) scenarios.push_back(sc);
+                        else cout << "Skipped: " << error << ".\n";
+                    }
+                    if (scenarios.empty()) {
+                        cout << "No scenarios given.\n";
+                        break;
+                    }
+                    HoldingMatrix matrix;
+                    matrix.build(book);
+                    StressEngine engine(matrix);
+                    engine.prepare(market, scenarios, sectors);
+                    StressResult result;
+                    engine.run(result);
+                    showStressResult(result, scenarios, book, sectors);
+                    break;
+                }
+                case 31: {
+                    cout << "Model weights, e.g. INFY 30%, HDFCB 20%, SBI-EQ 40% (the rest stays cash): ";
+                    string line;
+                    getline(cin, line);
+                    ModelPortfolio model;
+                    string error;
+                    if (!parseModel(line, model, error)) {
+                        cout << "Invalid model: " << error << ".\n";
+                        break;
+                    }
+                    Rebalancer rebalancer(market, book);
+                    uint32_t m = rebalancer.addModel(model);
+                    for (size_t a = 0; a < book.size(); ++a) rebalancer.assign((uint32_t)a, m);
+                    if (rebalancer.plan() == 0) {
+                        cout << "Already on target; nothing to trade.\n";
+                        break;
+                    }
+                    rebalancer.execute();
+                    showRebalance(rebalancer, book);
+                    break;
+                }
                 case 0: {
+                    reportSave(true);
+                    if (durable && !durable->shutdown()) cout << "Error sealing journal.\n";
                     cout << "Exiting... Goodbye!\n";
                     running = false;
                     break;